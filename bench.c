@@ -0,0 +1,530 @@
+#include "dat.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Beanstalkd-bench drives a running beanstalkd with producer and
+// consumer connections from one event loop, and prints the throughput
+// and the latency of put to INSERTED and of put to RESERVED as one line
+// of JSON, so runs can be compared across commits.
+//
+// Producers put jobs round-robin into the tubes, each keeping up to
+// depth puts in flight. Given a rate, they put on a fixed schedule
+// instead, however long the server takes to reply (open loop), and
+// latency counts from when a put was due rather than when it was sent.
+// Each body starts with that time in hex, which is how a consumer
+// knows the put to RESERVED latency. Consumers watch all the tubes and
+// reserve and delete one job at a time. The tubes are new to each run.
+
+enum {
+    Stampsize = 16, // hex digits of the time at the start of a body
+    Inbufmin = 4096,
+};
+
+typedef struct Client Client;
+
+struct Client {
+    int    fd;
+    int    consumer;
+    char   *out;      // bytes not yet written
+    size_t nout, outcap;
+    char   *in;       // bytes read but not yet handled
+    size_t nin, incap;
+    int64  *due;      // ring of the due times of puts awaiting a reply
+    int    head, ndue, duecap;
+    uint   tube;      // the tube a producer uses
+};
+
+static char  *addr = "127.0.0.1";
+static char  *port = Portdef;
+static int   nprod = 1, ncons = 1, ntube = 1, depth = 1, bodysize = 64;
+static uint  npri = 1, delay;
+static int64 njob = 100000;
+static int64 rate; // puts per second over all producers; 0 for closed loop
+
+static Client *clients;
+static int    nclient;
+static char   *body;
+static int    runid; // tubes are named bench<runid>-<n>
+static int64  start;
+static int64  nput, nputdone, nconsumed, nexpect, nerr;
+static Hist   putlat, reslat;
+
+static void
+usage(int code)
+{
+    fprintf(stderr, "Use: %s [OPTIONS]\n"
+            "\n"
+            "Puts jobs into a running beanstalkd and reserves and deletes\n"
+            "them, and prints throughput and latency as JSON.\n"
+            "\n"
+            "Options:\n"
+            " -l ADDR  server address (default is 127.0.0.1);\n"
+            "          unix:PATH for a UNIX socket\n"
+            " -p PORT  server port (default is " Portdef ")\n"
+            " -P N     producer connections (default is 1)\n"
+            " -c N     consumer connections (default is 1); -c0 only puts\n"
+            " -n N     number of jobs (default is 100000)\n"
+            " -s BYTES job body size, at least %d (default is 64)\n"
+            " -r N     spread jobs over priorities 0 to N-1 (default is 1)\n"
+            " -d SECS  put jobs with this delay (default is 0)\n"
+            " -t N     spread jobs over N tubes (default is 1)\n"
+            " -w N     puts in flight per producer (default is 1)\n"
+            " -R N     put N jobs a second on a fixed schedule, whatever\n"
+            "          the replies (default is 0, as fast as replies come)\n"
+            " -h       show this help\n",
+            progname, Stampsize);
+    exit(code);
+}
+
+static int64
+num(char *s, char *flag)
+{
+    char *end;
+    long long n;
+
+    if (!s) {
+        warnx("flag requires an argument: %s", flag);
+        usage(5);
+    }
+    errno = 0;
+    n = strtoll(s, &end, 10);
+    if (errno || end == s || *end || n < 0) {
+        warnx("invalid number for %s: %s", flag, s);
+        usage(5);
+    }
+    return n;
+}
+
+static void
+benchopts(char **argv)
+{
+    char *arg, *tmp;
+#   define EARG (*arg ? (tmp=arg,arg="",tmp) : *argv ? *argv++ : NULL)
+
+    while ((arg = *argv++) && *arg++ == '-' && *arg) {
+        char c;
+        while ((c = *arg++)) {
+            switch (c) {
+                case 'l':
+                    addr = EARG;
+                    if (!addr) usage(5);
+                    break;
+                case 'p':
+                    port = EARG;
+                    if (!port) usage(5);
+                    break;
+                case 'P':
+                    nprod = num(EARG, "-P");
+                    break;
+                case 'c':
+                    ncons = num(EARG, "-c");
+                    break;
+                case 'n':
+                    njob = num(EARG, "-n");
+                    break;
+                case 's':
+                    bodysize = num(EARG, "-s");
+                    break;
+                case 'r':
+                    npri = num(EARG, "-r");
+                    break;
+                case 'd':
+                    delay = num(EARG, "-d");
+                    break;
+                case 't':
+                    ntube = num(EARG, "-t");
+                    break;
+                case 'w':
+                    depth = num(EARG, "-w");
+                    break;
+                case 'R':
+                    rate = num(EARG, "-R");
+                    break;
+                case 'h':
+                    usage(0);
+                default:
+                    warnx("unknown flag: %s", arg-2);
+                    usage(5);
+            }
+        }
+    }
+    if (arg) {
+        warnx("unknown argument: %s", arg-1);
+        usage(5);
+    }
+    if (nprod < 1 || ntube < 1 || depth < 1 || npri < 1) {
+        warnx("-P, -t, -w and -r must be at least 1");
+        usage(5);
+    }
+    if (bodysize < Stampsize) {
+        warnx("-s must be at least %d", Stampsize);
+        usage(5);
+    }
+}
+
+// grow returns p, a buffer of *cap bytes, made to hold at least need.
+static char *
+grow(char *p, size_t *cap, size_t need)
+{
+    size_t n = *cap ? *cap : Inbufmin;
+
+    if (need <= *cap)
+        return p;
+    while (n < need)
+        n *= 2;
+    p = realloc(p, n);
+    if (!p) {
+        twarnx("OOM");
+        exit(1);
+    }
+    *cap = n;
+    return p;
+}
+
+static void
+sendq(Client *c, const char *p, size_t n)
+{
+    c->out = grow(c->out, &c->outcap, c->nout + n);
+    memcpy(c->out + c->nout, p, n);
+    c->nout += n;
+}
+
+static void
+flush(Client *c)
+{
+    ssize_t r;
+
+    while (c->nout) {
+        r = write(c->fd, c->out, c->nout);
+        if (r == -1 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (r == -1) {
+            twarn("write");
+            exit(1);
+        }
+        c->nout -= r;
+        memmove(c->out, c->out + r, c->nout);
+    }
+}
+
+static void
+pushdue(Client *c, int64 due)
+{
+    int64 *d;
+    int i, cap;
+
+    if (c->ndue == c->duecap) {
+        cap = c->duecap ? c->duecap * 2 : 64;
+        d = malloc(cap * sizeof *d);
+        if (!d) {
+            twarnx("OOM");
+            exit(1);
+        }
+        for (i = 0; i < c->ndue; i++)
+            d[i] = c->due[(c->head + i) % c->duecap];
+        free(c->due);
+        c->due = d;
+        c->head = 0;
+        c->duecap = cap;
+    }
+    c->due[(c->head + c->ndue) % c->duecap] = due;
+    c->ndue++;
+}
+
+static int64
+popdue(Client *c)
+{
+    int64 due = c->due[c->head];
+
+    c->head = (c->head + 1) % c->duecap;
+    c->ndue--;
+    return due;
+}
+
+// put has c put the next job, which was due at time due.
+static void
+put(Client *c, int64 due)
+{
+    char line[100];
+    uint t = nput % ntube;
+
+    if (t != c->tube) {
+        sendq(c, line, sprintf(line, "use bench%d-%u\r\n", runid, t));
+        c->tube = t;
+    }
+    sendq(c, line, sprintf(line, "put %u %u 120 %d\r\n",
+                          (uint)(nput % npri), delay, bodysize));
+    sprintf(line, "%016"PRIx64, (uint64)due);
+    memcpy(body, line, Stampsize);
+    sendq(c, body, bodysize + 2);
+    pushdue(c, due);
+    nput++;
+}
+
+// putdue returns when the next put is due in an open loop.
+static int64
+putdue(void)
+{
+    return start + (int64)((double)nput * 1000000000 / rate);
+}
+
+static void
+produce(int64 now)
+{
+    int i;
+
+    if (rate) {
+        while (nput < njob && putdue() <= now)
+            put(&clients[nput % nprod], putdue());
+        return;
+    }
+    for (i = 0; i < nprod; i++) {
+        while (nput < njob && clients[i].ndue < depth)
+            put(&clients[i], now);
+    }
+}
+
+static int
+prefix(const char *line, const char *word)
+{
+    return strncmp(line, word, strlen(word)) == 0;
+}
+
+// handle deals with the reply at the start of c->in, if it is all
+// there. It returns the number of bytes it took, or 0.
+static size_t
+handle(Client *c, int64 now)
+{
+    char *line = c->in, *nl, cmd[100];
+    uint64 id, stamp;
+    uint bytes;
+    size_t n;
+
+    nl = memchr(c->in, '\n', c->nin);
+    if (!nl)
+        return 0;
+    n = nl + 1 - c->in;
+
+    if (prefix(line, "USING ") || prefix(line, "WATCHING ") ||
+        prefix(line, "DELETED")) {
+        return n;
+    }
+    if (!c->consumer) {
+        if (!c->ndue) {
+            twarnx("reply to no put: %.*s", (int)n, line);
+            exit(1);
+        }
+        hist_record(&putlat, now - popdue(c));
+        nputdone++;
+        if (!prefix(line, "INSERTED ")) {
+            if (!nerr)
+                twarnx("put failed: %.*s", (int)n, line);
+            nerr++;
+            nexpect--; // no consumer will see it
+        }
+        return n;
+    }
+
+    if (prefix(line, "RESERVED ")) {
+        if (sscanf(line, "RESERVED %"SCNu64" %u", &id, &bytes) != 2) {
+            twarnx("bad reply: %.*s", (int)n, line);
+            exit(1);
+        }
+        if (c->nin < n + bytes + 2) {
+            c->in = grow(c->in, &c->incap, n + bytes + 2);
+            return 0;
+        }
+        memcpy(cmd, c->in + n, Stampsize);
+        cmd[Stampsize] = '\0';
+        stamp = strtoull(cmd, NULL, 16);
+        if (bytes >= Stampsize && stamp >= (uint64)start && stamp <= (uint64)now)
+            hist_record(&reslat, now - stamp);
+        nconsumed++;
+        sendq(c, cmd, sprintf(cmd, "delete %"PRIu64"\r\n"
+                             "reserve-with-timeout 1\r\n", id));
+        return n + bytes + 2;
+    }
+    if (prefix(line, "TIMED_OUT") || prefix(line, "DEADLINE_SOON")) {
+        sendq(c, "reserve-with-timeout 1\r\n", 24);
+        return n;
+    }
+    twarnx("unexpected reply: %.*s", (int)n, line);
+    exit(1);
+}
+
+static void
+receive(Client *c, int64 now)
+{
+    ssize_t r;
+    size_t n;
+
+    c->in = grow(c->in, &c->incap, c->nin + Inbufmin);
+    r = read(c->fd, c->in + c->nin, c->incap - c->nin);
+    if (r == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (r <= 0) {
+        if (r == -1)
+            twarn("read");
+        else
+            twarnx("server closed the connection");
+        exit(1);
+    }
+    c->nin += r;
+    while ((n = handle(c, now))) {
+        c->nin -= n;
+        memmove(c->in, c->in + n, c->nin);
+    }
+}
+
+static void
+printlat(const char *name, Hist *h)
+{
+    printf("\"%s\":{\"n\":%"PRIu64",\"p50\":%.1f,\"p99\":%.1f,"
+           "\"p999\":%.1f,\"max\":%.1f}", name, h->n,
+           hist_at(h, 500) / 1000.0, hist_at(h, 990) / 1000.0,
+           hist_at(h, 999) / 1000.0, h->max / 1000.0);
+}
+
+static void
+report(int64 dur)
+{
+    double secs = (double)dur / 1000000000;
+
+    printf("{\"addr\":\"%s\",\"port\":\"%s\",\"producers\":%d,"
+           "\"consumers\":%d,\"jobs\":%"PRId64",\"bytes\":%d,"
+           "\"priorities\":%u,\"delay\":%u,\"tubes\":%d,\"depth\":%d,"
+           "\"rate\":%"PRId64",\"seconds\":%.3f,\"puts_per_sec\":%.0f,"
+           "\"reserves_per_sec\":%.0f,\"errors\":%"PRId64",",
+           addr, port, nprod, ncons, njob, bodysize, npri, delay, ntube,
+           depth, rate, secs, nputdone / secs, nconsumed / secs, nerr);
+    printlat("put_inserted_us", &putlat);
+    putchar(',');
+    printlat("put_reserved_us", &reslat);
+    printf("}\n");
+}
+
+// connect_all dials the server for each client and sends the commands
+// that set up its tubes. It waits for the replies, so no setup work is
+// counted in the run.
+static void
+connect_all(void)
+{
+    char line[100], *nl;
+    int i, k;
+
+    nclient = nprod + ncons;
+    clients = calloc(nclient, sizeof *clients);
+    if (!clients) {
+        twarnx("OOM");
+        exit(1);
+    }
+    for (i = 0; i < nclient; i++) {
+        Client *c = &clients[i];
+
+        c->fd = dial_server(addr, port);
+        if (c->fd == -1)
+            exit(1);
+        if (i < nprod) {
+            sendq(c, line, sprintf(line, "use bench%d-0\r\n", runid));
+            continue;
+        }
+        c->consumer = 1;
+        for (k = 0; k < ntube; k++)
+            sendq(c, line, sprintf(line, "watch bench%d-%d\r\n", runid, k));
+        sendq(c, "ignore default\r\n", 16);
+    }
+
+    for (i = 0; i < nclient; i++) {
+        Client *c = &clients[i];
+        int want = c->consumer ? ntube + 1 : 1;
+
+        while (c->nout)
+            flush(c);
+        while (want > 0) {
+            struct pollfd p = {.fd = c->fd, .events = POLLIN};
+
+            poll(&p, 1, -1);
+            c->in = grow(c->in, &c->incap, c->nin + Inbufmin);
+            k = read(c->fd, c->in + c->nin, c->incap - c->nin);
+            if (k == 0) {
+                twarnx("server closed the connection");
+                exit(1);
+            }
+            if (k == -1 && errno != EAGAIN && errno != EINTR) {
+                twarn("read");
+                exit(1);
+            }
+            c->nin += k > 0 ? k : 0;
+            while (want > 0 && (nl = memchr(c->in, '\n', c->nin))) {
+                k = nl + 1 - c->in;
+                c->nin -= k;
+                memmove(c->in, c->in + k, c->nin);
+                want--;
+            }
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    struct pollfd *pfd;
+    int64 now, wait;
+    int i;
+
+    progname = argv[0];
+    runid = getpid(); // so no jobs are left from another run
+    benchopts(argv + 1);
+    signal(SIGPIPE, SIG_IGN);
+
+    body = malloc(bodysize + 2);
+    pfd = calloc(nprod + ncons, sizeof *pfd);
+    if (!body || !pfd) {
+        twarnx("OOM");
+        exit(1);
+    }
+    memset(body, 'x', bodysize);
+    memcpy(body + bodysize, "\r\n", 2);
+
+    connect_all();
+    nexpect = njob;
+    start = nanoseconds();
+    for (i = nprod; i < nclient; i++)
+        sendq(&clients[i], "reserve-with-timeout 1\r\n", 24);
+
+    for (;;) {
+        now = nanoseconds();
+        produce(now);
+        if (nputdone == njob && (!ncons || nconsumed >= nexpect))
+            break;
+
+        for (i = 0; i < nclient; i++) {
+            flush(&clients[i]);
+            pfd[i].fd = clients[i].fd;
+            pfd[i].events = POLLIN | (clients[i].nout ? POLLOUT : 0);
+            pfd[i].revents = 0;
+        }
+        wait = -1;
+        if (rate && nput < njob)
+            wait = putdue() > now ? (putdue() - now + 999999) / 1000000 : 0;
+        if (poll(pfd, nclient, wait) == -1 && errno != EINTR) {
+            twarn("poll");
+            exit(1);
+        }
+        now = nanoseconds();
+        for (i = 0; i < nclient; i++) {
+            if (pfd[i].revents & (POLLIN|POLLHUP|POLLERR))
+                receive(&clients[i], now);
+        }
+    }
+
+    report(nanoseconds() - start);
+    return 0;
+}
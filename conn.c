@@ -13,6 +13,32 @@ static int cur_conn_ct = 0, cur_worker_ct = 0, cur_producer_ct = 0;
 static uint tot_conn_ct = 0;
 int verbose = 0;
 
+// fd_conns has every open conn at the index of its fd, so they can be
+// listed, or found by fd, without a search. Fds are handed out lowest
+// first, so it is about as long as the number of conns.
+static Conn **fd_conns;
+static int fd_conns_cap;
+
+// fd_conns_grow makes room in fd_conns for fd.
+// It returns 1 on success, 0 if out of memory.
+static int
+fd_conns_grow(int fd)
+{
+    int cap = fd_conns_cap ? fd_conns_cap : 64;
+    Conn **a;
+
+    while (cap <= fd)
+        cap *= 2;
+    a = realloc(fd_conns, cap * sizeof(Conn *));
+    if (!a)
+        return 0;
+    mem_used[Memconn] += (cap - fd_conns_cap) * sizeof(Conn *);
+    memset(a + fd_conns_cap, 0, (cap - fd_conns_cap) * sizeof(Conn *));
+    fd_conns = a;
+    fd_conns_cap = cap;
+    return 1;
+}
+
 static void
 on_watch(Ms *a, Tube *t, size_t i)
 {
@@ -31,18 +57,43 @@ on_ignore(Ms *a, Tube *t, size_t i)
     tube_dref(t);
 }
 
+static void
+on_hold(Ms *a, Tube *t, size_t i)
+{
+    UNUSED_PARAMETER(a);
+    UNUSED_PARAMETER(i);
+    tube_iref(t);
+}
+
+static void
+on_let_go(Ms *a, Tube *t, size_t i)
+{
+    UNUSED_PARAMETER(a);
+    UNUSED_PARAMETER(i);
+    tube_dref(t);
+}
+
 Conn *
 make_conn(int fd, char start_state, Tube *use, Tube *watch)
 {
-    Conn *c = new(Conn);
+    Conn *c;
+
+    if (fd >= fd_conns_cap && !fd_conns_grow(fd)) {
+        twarn("OOM");
+        return NULL;
+    }
+    c = new(Conn);
     if (!c) {
         twarn("OOM");
         return NULL;
     }
+    mem_used[Memconn] += sizeof(Conn);
 
     ms_init(&c->watch, (ms_event_fn) on_watch, (ms_event_fn) on_ignore);
+    ms_init(&c->stats_tubes, (ms_event_fn) on_hold, (ms_event_fn) on_let_go);
     if (!ms_append(&c->watch, watch)) {
         free(c);
+        mem_used[Memconn] -= sizeof(Conn);
         twarn("OOM");
         return NULL;
     }
@@ -50,6 +101,9 @@ make_conn(int fd, char start_state, Tube *use, Tube *watch)
     TUBE_ASSIGN(c->use, use);
     use->using_ct++;
 
+    c->sock.fd = fd;
+    fd_conns[fd] = c;
+    c->since = curtime();
     c->state = start_state;
     c->pending_timeout = -1;
     c->tickpos = 0; // Does not mean anything if in_conns is set to 0.
@@ -81,6 +135,22 @@ connsetworker(Conn *c)
     cur_worker_ct++; /* stats */
 }
 
+// conn_by_fd returns the open conn on fd, or NULL.
+Conn *
+conn_by_fd(int fd)
+{
+    if (fd < 0 || fd >= fd_conns_cap)
+        return NULL;
+    return fd_conns[fd];
+}
+
+// conn_fd_limit returns a number greater than the fd of every open conn.
+int
+conn_fd_limit()
+{
+    return fd_conns_cap;
+}
+
 int
 count_cur_conns()
 {
@@ -119,21 +189,25 @@ conntickat(Conn *c)
     int margin = 0, should_timeout = 0;
     int64 t = INT64_MAX;
 
-    if (conn_waiting(c)) {
+    if (conn_blocked(c)) {
         margin = SAFETY_MARGIN;
     }
 
     if (has_reserved_job(c)) {
-        t = connsoonestjob(c)->r.deadline_at - nanoseconds() - margin;
+        t = connsoonestjob(c)->r.deadline_at - curtime() - margin;
         should_timeout = 1;
     }
     if (c->pending_timeout >= 0) {
         t = min(t, ((int64)c->pending_timeout) * 1000000000);
         should_timeout = 1;
     }
+    if (c->state == STATE_BULK) {
+        t = min(t, 0); // the next slice is due right away
+        should_timeout = 1;
+    }
 
     if (should_timeout) {
-        return nanoseconds() + t;
+        return curtime() + t;
     }
     return 0;
 }
@@ -182,12 +256,19 @@ connsoonestjob(Conn *c)
 
 void
 conn_reserve_job(Conn *c, Job *j) {
+    int64 now = curtime();
+
     j->tube->stat.reserved_ct++;
     j->r.reserve_ct++;
 
-    j->r.deadline_at = nanoseconds() + j->r.ttr;
+    // reserve-job can take a buried or delayed job; only ready ones waited
+    if (j->r.state == Ready)
+        hist_record(&c->srv->waitlat, now - j->since);
+    j->since = now;
+    j->r.deadline_at = now + j->r.ttr;
     j->r.state = Reserved;
     job_list_insert(&c->reserved_jobs, j);
+    c->reserved_n++;
     j->reserver = c;
     c->pending_timeout = -1;
     conn_set_soonestjob(c, j);
@@ -198,7 +279,7 @@ conn_reserve_job(Conn *c, Job *j) {
 int
 conndeadlinesoon(Conn *c)
 {
-    int64 t = nanoseconds();
+    int64 t = curtime();
     Job *j = connsoonestjob(c);
 
     return j && t >= j->r.deadline_at - SAFETY_MARGIN;
@@ -241,15 +322,19 @@ connclose(Conn *c)
     if (verbose) {
         printf("close %d\n", c->sock.fd);
     }
+    if (fd_conns[c->sock.fd] == c)
+        fd_conns[c->sock.fd] = NULL;
 
     job_free(c->in_job);
+    body_unref(c->out_body);
+    body_unref(c->stats_buf);
 
-    /* was this a peek or stats command? */
-    if (c->out_job && c->out_job->r.state == Copy)
-        job_free(c->out_job);
-
-    c->in_job = c->out_job = NULL;
+    c->in_job = NULL;
+    c->out_body = NULL;
+    c->stats_buf = NULL;
     c->in_job_read = 0;
+    c->in_op = 0;
+    c->in_batch = 0;
 
     if (c->type & CONN_TYPE_PRODUCER) cur_producer_ct--; /* stats */
     if (c->type & CONN_TYPE_WORKER) cur_worker_ct--; /* stats */
@@ -261,8 +346,10 @@ connclose(Conn *c)
         enqueue_reserved_jobs(c);
 
     ms_clear(&c->watch);
+    ms_clear(&c->stats_tubes);
     c->use->using_ct--;
     TUBE_ASSIGN(c->use, NULL);
+    TUBE_ASSIGN(c->bulk_tube, NULL);
 
     if (c->in_conns) {
         heapremove(&c->srv->conns, c->tickpos);
@@ -270,4 +357,5 @@ connclose(Conn *c)
     }
 
     free(c);
+    mem_used[Memconn] -= sizeof(Conn);
 }
@@ -0,0 +1,179 @@
+#include "dat.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// CRC-32C (Castagnoli), reflected polynomial.
+#define POLY 0x82f63b78
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_CRC32C_ARMV8 1
+#endif
+
+static uint32 table[8][256];
+static int    table_ready;
+
+static void
+maketable(void)
+{
+    uint32 n, c;
+    int i, k;
+
+    for (n = 0; n < 256; n++) {
+        c = n;
+        for (k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+        }
+        table[0][n] = c;
+    }
+    for (n = 0; n < 256; n++) {
+        c = table[0][n];
+        for (i = 1; i < 8; i++) {
+            c = table[0][c & 0xff] ^ (c >> 8);
+            table[i][n] = c;
+        }
+    }
+    table_ready = 1;
+}
+
+
+// crc32c_table is the portable slicing-by-8 implementation of crc32c.
+// It is exported so the tests can compare it against the
+// hardware-accelerated path.
+uint32
+crc32c_table(uint32 crc, const void *buf, size_t len)
+{
+    const byte *p = buf;
+    uint64 w;
+
+    if (!table_ready) maketable();
+
+    crc = ~crc;
+    while (len && ((uintptr_t)p & 7)) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        w ^= crc;
+        crc = table[7][w & 0xff] ^
+              table[6][(w >> 8) & 0xff] ^
+              table[5][(w >> 16) & 0xff] ^
+              table[4][(w >> 24) & 0xff] ^
+              table[3][(w >> 32) & 0xff] ^
+              table[2][(w >> 40) & 0xff] ^
+              table[1][(w >> 48) & 0xff] ^
+              table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+#if HAVE_CRC32C_SSE42
+
+__attribute__((target("sse4.2")))
+static uint32
+crc32c_hw(uint32 crc, const void *buf, size_t len)
+{
+    const byte *p = buf;
+
+    crc = ~crc;
+    while (len && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+#if defined(__x86_64__)
+    uint64 c = crc;
+    while (len >= 8) {
+        uint64 w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32)c;
+#endif
+    while (len >= 4) {
+        uint32 w;
+        memcpy(&w, p, 4);
+        crc = _mm_crc32_u32(crc, w);
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return ~crc;
+}
+
+static int
+havehw(void)
+{
+    static int have = -1;
+
+    if (have < 0) {
+        __builtin_cpu_init();
+        have = !!__builtin_cpu_supports("sse4.2");
+    }
+    return have;
+}
+
+#elif HAVE_CRC32C_ARMV8
+
+static uint32
+crc32c_hw(uint32 crc, const void *buf, size_t len)
+{
+    const byte *p = buf;
+
+    crc = ~crc;
+    while (len && ((uintptr_t)p & 7)) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64 w;
+        memcpy(&w, p, 8);
+        crc = __crc32cd(crc, w);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return ~crc;
+}
+
+static int
+havehw(void)
+{
+    return 1;
+}
+
+#endif
+
+
+// crc32c updates crc with len bytes from buf and returns the result.
+// Start with crc == 0. Uses the CPU's CRC32 instructions when
+// available, otherwise a slicing-by-8 table.
+uint32
+crc32c(uint32 crc, const void *buf, size_t len)
+{
+#if HAVE_CRC32C_SSE42 || HAVE_CRC32C_ARMV8
+    if (havehw()) {
+        return crc32c_hw(crc, buf, len);
+    }
+#endif
+    return crc32c_table(crc, buf, len);
+}
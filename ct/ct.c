@@ -15,9 +15,16 @@
 #include <sys/time.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <sys/mman.h>
 #include "internal.h"
 #include "ct.h"
 
+#ifdef __linux__
+#	include <linux/perf_event.h>
+#	include <sys/ioctl.h>
+#	include <sys/syscall.h>
+#endif
+
 
 static char *curdir;
 static int rjobfd = -1, wjobfd = -1;
@@ -25,6 +32,23 @@ int fail = 0; /* bool */
 static int64 bstart, bdur;
 static int btiming; /* bool */
 static int64 bbytes;
+static int bperf; /* bool; count hardware events (-c) */
+static int bjson; /* bool; print benchmark results as JSON (-j) */
+static int perffd[Nctr];
+static const char *ctrname[Nctr] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses",
+};
+
+/* Allocation counts of a benchmark. They live in shared memory, so a
+process it forks, such as a test server, counts into them too, and
+they count while the benchmark's timer runs. */
+typedef struct Alloccount Alloccount;
+struct Alloccount {
+    int   on;
+    int64 n;
+    int64 bytes;
+};
+static Alloccount *allocs;
 enum { Second = 1000 * 1000 * 1000 };
 enum { BenchTime = Second };
 enum { MaxN = 1000 * 1000 * 1000 };
@@ -88,11 +112,172 @@ ctdir(void)
 }
 
 
+#ifdef __linux__
+
+static void
+perfopen(void)
+{
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } ev[Nctr] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    };
+    struct perf_event_attr a;
+    int i;
+
+    for (i = 0; i < Nctr; i++) {
+        memset(&a, 0, sizeof a);
+        a.size = sizeof a;
+        a.type = ev[i].type;
+        a.config = ev[i].config;
+        a.disabled = 1;
+        a.inherit = 1; /* count forked servers too */
+        a.exclude_kernel = 1;
+        a.exclude_hv = 1;
+        a.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+            PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perffd[i] = syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+    }
+}
+
+
+static void
+perfctl(int on, int reset)
+{
+    int i;
+
+    for (i = 0; i < Nctr; i++) {
+        if (perffd[i] < 0) {
+            continue;
+        }
+        if (reset) {
+            ioctl(perffd[i], PERF_EVENT_IOC_RESET, 0);
+        } else if (on) {
+            ioctl(perffd[i], PERF_EVENT_IOC_ENABLE, 0);
+        } else {
+            ioctl(perffd[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+}
+
+
+/* perfread reads the counters into ctr, scaled up for any time the
+kernel had to share the hardware among them. */
+static void
+perfread(int64 *ctr)
+{
+    uint64_t v[3]; /* value, time enabled, time running */
+    int i;
+
+    for (i = 0; i < Nctr; i++) {
+        ctr[i] = -1;
+        if (perffd[i] >= 0 && read(perffd[i], v, sizeof v) == sizeof v && v[2]) {
+            ctr[i] = (int64)((double)v[0] * v[1] / v[2]);
+        }
+    }
+}
+
+#else
+
+static void
+perfopen(void)
+{
+    int i;
+
+    for (i = 0; i < Nctr; i++) {
+        perffd[i] = -1;
+    }
+}
+
+
+static void
+perfctl(int on, int reset)
+{
+}
+
+
+static void
+perfread(int64 *ctr)
+{
+    int i;
+
+    for (i = 0; i < Nctr; i++) {
+        ctr[i] = -1;
+    }
+}
+
+#endif
+
+
+#ifdef __GLIBC__
+
+/* Malloc, calloc and realloc stand in for the C library's own, to
+count allocations in benchmarks. Zalloc and every other allocation in
+the program under test come through here. */
+
+#define CTALLOC 1
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+
+static void
+countalloc(size_t n)
+{
+    if (allocs && allocs->on) {
+        __atomic_add_fetch(&allocs->n, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&allocs->bytes, (int64)n, __ATOMIC_RELAXED);
+    }
+}
+
+
+void *
+malloc(size_t n)
+{
+    countalloc(n);
+    return __libc_malloc(n);
+}
+
+
+void *
+calloc(size_t m, size_t n)
+{
+    countalloc(m * n);
+    return __libc_calloc(m, n);
+}
+
+
+void *
+realloc(void *p, size_t n)
+{
+    countalloc(n);
+    return __libc_realloc(p, n);
+}
+
+#else
+#define CTALLOC 0
+#endif
+
+
 void
 ctresettimer(void)
 {
     bdur = 0;
     bstart = nstime();
+    if (allocs) {
+        allocs->n = allocs->bytes = 0;
+    }
+    if (bperf) {
+        perfctl(0, 1);
+    }
 }
 
 
@@ -102,6 +287,12 @@ ctstarttimer(void)
     if (!btiming) {
         bstart = nstime();
         btiming = 1;
+        if (allocs) {
+            allocs->on = 1;
+        }
+        if (bperf) {
+            perfctl(1, 0);
+        }
     }
 }
 
@@ -112,6 +303,12 @@ ctstoptimer(void)
     if (btiming) {
         bdur += nstime() - bstart;
         btiming = 0;
+        if (allocs) {
+            allocs->on = 0;
+        }
+        if (bperf) {
+            perfctl(0, 0);
+        }
     }
 }
 
@@ -320,13 +517,18 @@ runbenchn(Benchmark *b, int n)
             die(3, errno, "dup2");
         }
         curdir = b->dir;
+        if (bperf) {
+            perfopen();
+        }
         ctstarttimer();
         b->f(n);
         ctstoptimer();
-        if (write(durfd, &bdur, sizeof bdur) != sizeof bdur) {
-            die(3, errno, "write");
-        }
-        if (write(durfd, &bbytes, sizeof bbytes) != sizeof bbytes) {
+        perfread(b->ctr);
+        b->dur = bdur;
+        b->bytes = bbytes;
+        b->nalloc = allocs ? allocs->n : 0;
+        b->allocbytes = allocs ? allocs->bytes : 0;
+        if (write(durfd, b, sizeof *b) != sizeof *b) {
             die(3, errno, "write");
         }
         exit(0);
@@ -340,23 +542,26 @@ runbenchn(Benchmark *b, int n)
     killpg(pid, SIGKILL);
     rmtree(b->dir);
     if (b->status != 0) {
-        putchar('\n');
+        if (!bjson) {
+            putchar('\n');
+        }
         lseek(outfd, 0, SEEK_SET);
-        copyfd(stdout, outfd);
+        copyfd(bjson ? stderr : stdout, outfd);
         return;
     }
 
     lseek(durfd, 0, SEEK_SET);
-    int r = read(durfd, &b->dur, sizeof b->dur);
-    if (r != sizeof b->dur) {
-        perror("read");
-        b->status = 1;
-    }
-    r = read(durfd, &b->bytes, sizeof b->bytes);
-    if (r != sizeof b->bytes) {
+    Benchmark r;
+    if (read(durfd, &r, sizeof r) != sizeof r) {
         perror("read");
         b->status = 1;
+        return;
     }
+    b->dur = r.dur;
+    b->bytes = r.bytes;
+    b->nalloc = r.nalloc;
+    b->allocbytes = r.allocbytes;
+    memcpy(b->ctr, r.ctr, sizeof b->ctr);
 }
 
 
@@ -416,11 +621,59 @@ max(int a, int b)
 }
 
 
+static void
+printbench(Benchmark *b, int n)
+{
+    double sec = (double)b->dur / Second;
+    int i;
+
+    if (bjson) {
+        printf("{\"name\":\"%s\",\"n\":%d,\"ns_per_op\":%" PRId64
+               ",\"ops_per_sec\":%.0f",
+               b->name, n, b->dur/n, sec > 0 ? n / sec : 0);
+        if (b->bytes > 0) {
+            printf(",\"mb_per_sec\":%.2f", sec > 0 ? b->bytes * (n / sec) / 1000000 : 0);
+        }
+        if (CTALLOC) {
+            printf(",\"allocs_per_op\":%.2f,\"alloc_bytes_per_op\":%.1f",
+                   (double)b->nalloc / n, (double)b->allocbytes / n);
+        }
+        for (i = 0; i < Nctr; i++) {
+            if (b->ctr[i] >= 0) {
+                printf(",\"%s_per_op\":%.2f", ctrname[i], (double)b->ctr[i] / n);
+            }
+        }
+        printf("}\n");
+        return;
+    }
+
+    printf("%8d\t%10" PRId64 " ns/op", n, b->dur/n);
+    if (sec > 0) {
+        printf("\t%10.0f ops/s", n / sec);
+    }
+    if (b->bytes > 0 && sec > 0) {
+        printf("\t%7.2f MB/s", b->bytes * (n / sec) / 1000000);
+    }
+    if (CTALLOC) {
+        printf("\t%7.2f allocs/op\t%8.1f B/op",
+               (double)b->nalloc / n, (double)b->allocbytes / n);
+    }
+    for (i = 0; i < Nctr; i++) {
+        if (b->ctr[i] >= 0) {
+            printf("\t%10.1f %s/op", (double)b->ctr[i] / n, ctrname[i]);
+        }
+    }
+    putchar('\n');
+}
+
+
 static void
 runbench(Benchmark *b)
 {
-    printf("%s\t", b->name);
-    fflush(stdout);
+    if (!bjson) {
+        printf("%s\t", b->name);
+        fflush(stdout);
+    }
     int n = 1;
     runbenchn(b, n);
     while (b->status == 0 && b->dur < BenchTime && n < MaxN) {
@@ -441,40 +694,42 @@ runbench(Benchmark *b)
         runbenchn(b, n);
     }
     if (b->status == 0) {
-        printf("%8d\t%10" PRId64 " ns/op", n, b->dur/n);
-        if (b->bytes > 0) {
-            double mbs = 0;
-            if (b->dur > 0) {
-                int64 sec = b->dur / 1000L / 1000L / 1000L;
-                int64 nsec = b->dur % 1000000000L;
-                double dur = (double)sec + (double)nsec*.0000000001;
-                mbs = ((double)b->bytes * (double)n / 1000000) / dur;
-            }
-            printf("\t%7.2f MB/s", mbs);
+        printbench(b, n);
+        return;
+    }
+
+    const char *what = failed(b->status) ? "failure" : "error";
+    if (bjson) {
+        printf("{\"name\":\"%s\",\"%s\":%d}\n", b->name, what, b->status);
+        return;
+    }
+    printf("%s", what);
+    if (!failed(b->status)) {
+        if (WIFEXITED(b->status)) {
+            printf(" (exit status %d)", WEXITSTATUS(b->status));
         }
-        putchar('\n');
-    } else {
-        if (failed(b->status)) {
-            printf("failure");
-        } else {
-            printf("error");
-            if (WIFEXITED(b->status)) {
-                printf(" (exit status %d)", WEXITSTATUS(b->status));
-            }
-            if (WIFSIGNALED(b->status)) {
-                printf(" (signal %d)", WTERMSIG(b->status));
-            }
+        if (WIFSIGNALED(b->status)) {
+            printf(" (signal %d)", WTERMSIG(b->status));
         }
-        putchar('\n');
     }
+    putchar('\n');
 }
 
 
 static void
 runallbench(Benchmark *b)
 {
+    allocs = mmap(NULL, sizeof *allocs, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (allocs == MAP_FAILED) {
+        die(1, errno, "mmap");
+    }
     for (; b->f; b++) {
         runbench(b);
+        if (bperf && b->status == 0 && b->ctr[0] < 0 && b->ctr[1] < 0) {
+            fputs("ct: hardware counters are not available\n", stderr);
+            bperf = 0;
+        }
     }
 }
 
@@ -557,9 +812,31 @@ writetokens(int n)
 }
 
 
+/*
+Usage: _ctcheck [-b [-c] [-j]]
+
+Runs the tests, then with -b the benchmarks. With -c, benchmarks also
+count CPU cycles, instructions, cache and branch misses, where the
+system allows it; with -j, each benchmark's results are printed as a
+line of JSON.
+*/
 int
 main(int argc, char **argv)
 {
+    int i, bench = 0;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            bperf = 1;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            bjson = 1;
+        } else {
+            fprintf(stderr, "usage: %s [-b [-c] [-j]]\n", argv[0]);
+            return 2;
+        }
+    }
+
     int n = readtokens();
     runalltest(ctmaintest, n);
     writetokens(n);
@@ -567,7 +844,7 @@ main(int argc, char **argv)
     if (code != 0) {
         return code;
     }
-    if (argc == 2 && strcmp(argv[1], "-b") == 0) {
+    if (bench) {
         runallbench(ctmainbench);
     }
     return 0;
@@ -15,6 +15,8 @@ struct Test {
     char dir[sizeof TmpDirPat];
 };
 
+enum { Nctr = 5 }; /* hardware counters; see ctrname */
+
 struct Benchmark {
     void  (*f)(int);
     const char  *name;
@@ -22,6 +24,9 @@ struct Benchmark {
     int64 dur;
     int64 bytes;
     char  dir[sizeof TmpDirPat];
+    int64 nalloc;      /* allocations in the timed region */
+    int64 allocbytes;  /* bytes they asked for */
+    int64 ctr[Nctr];   /* counts, or -1 if not counted */
 };
 
 extern Test ctmaintest[];
@@ -11,14 +11,22 @@ typedef uint64_t      uint64;
 
 typedef struct Ms     Ms;
 typedef struct Job    Job;
+typedef struct Body   Body;
 typedef struct Tube   Tube;
 typedef struct Conn   Conn;
 typedef struct Heap   Heap;
+typedef struct Hist   Hist;
 typedef struct Jobrec Jobrec;
+typedef struct Tombrec Tombrec;
+typedef struct Keyrec Keyrec;
 typedef struct File   File;
 typedef struct Socket Socket;
 typedef struct Server Server;
 typedef struct Wal    Wal;
+typedef struct Spill  Spill;
+typedef struct Spillseg Spillseg;
+typedef struct Zstat  Zstat;
+typedef struct Dkey   Dkey;
 
 typedef void(*Handle)(void*, int rw);
 typedef int(FAlloc)(int, int);
@@ -44,10 +52,13 @@ typedef int(FAlloc)(int, int);
 // The name of a tube cannot be longer than MAX_TUBE_NAME_LEN-1
 #define MAX_TUBE_NAME_LEN 201
 
+// The size of a binary protocol request header; see dispatch_frame.
+#define BIN_REQ_SIZE 32
+
 // A command can be at most LINE_BUF_SIZE chars, including "\r\n". This value
-// MUST be enough to hold the longest possible command ("pause-tube a{200} 4294967295\r\n")
-// or reply line ("USING a{200}\r\n").
-#define LINE_BUF_SIZE (11 + MAX_TUBE_NAME_LEN + 12)
+// MUST be enough to hold the longest possible command ("pause-tube a{200} 4294967295\r\n"),
+// reply line ("USING a{200}\r\n") or binary request (a header and a{200}).
+#define LINE_BUF_SIZE (BIN_REQ_SIZE + MAX_TUBE_NAME_LEN)
 
 #define min(a,b) ((a)<(b)?(a):(b))
 
@@ -62,9 +73,25 @@ typedef int(FAlloc)(int, int);
 // The width is restricted by Jobrec.body_size that is int32.
 #define JOB_DATA_SIZE_LIMIT_MAX 1073741824
 
+// The maximum number of jobs in one put-batch command.
+#define PUT_BATCH_MAX 1000
+
+// The maximum number of jobs one reserve-batch command may ask for.
+#define RESERVE_BATCH_MAX 1000
+
+// The maximum number of ids in one delete-many, release-many or
+// bury-many command.
+#define ID_LIST_MAX 1000
+
 // The default value for the fsync (-f) parameter, milliseconds.
 #define DEFAULT_FSYNC_MS 50
 
+// A deduplication key of a put can be at most MAX_DEDUP_KEY_LEN chars.
+#define MAX_DEDUP_KEY_LEN 128
+
+// The default value for the key retention (-k) parameter, seconds.
+#define DEFAULT_DEDUP_SECS 600
+
 // Use this macro to designate unused parameters in functions.
 #define UNUSED_PARAMETER(x) (void)(x)
 
@@ -110,6 +137,26 @@ int   heapinsert(Heap *h, void *x);
 void* heapremove(Heap *h, size_t k);
 
 
+// A Hist is a log-linear histogram of durations in nanoseconds. Each
+// power of two is split into Histsub buckets, so a recorded value is
+// known to within 1/Histsub of itself. Values of 2^Histbits ns (about
+// 19 hours) or more all go into the last bucket.
+enum {
+    Histsubbits = 3,
+    Histsub = 1 << Histsubbits,
+    Histbits = 46,
+    Histbuckets = (Histbits - Histsubbits + 1) * Histsub,
+};
+
+struct Hist {
+    uint64 n;
+    uint64 max;
+    uint64 ct[Histbuckets];
+};
+void   hist_record(Hist *h, int64 ns);
+uint64 hist_at(Hist *h, uint permille);
+
+
 struct Socket {
     // Descriptor for the socket.
     int    fd;
@@ -170,13 +217,12 @@ enum // Jobrec.state
     Ready,
     Reserved,
     Buried,
-    Delayed,
-    Copy
+    Delayed
 };
 
 enum
 {
-    Walver = 7
+    Walver = 13
 };
 
 // If you modify Jobrec struct, you must increment Walver above.
@@ -202,9 +248,18 @@ enum
 struct Jobrec {
     uint64 id;
     uint32 pri;
+
+    // crc is the CRC32C of the whole record as written to the wal,
+    // computed with this field set to 0. It is only meaningful on disk.
+    uint32 crc;
+
     int64  delay;
     int64  ttr;
     int32  body_size;
+
+    // zsize is the size of the body as stored, if it is compressed;
+    // otherwise 0. See job_compress.
+    int32  zsize;
     int64  created_at;
 
     // deadline_at is a timestamp, in nsec, that points to:
@@ -219,6 +274,42 @@ struct Jobrec {
     uint32 bury_ct;
     uint32 kick_ct;
     byte   state;
+
+    // keylen is the length of the job's deduplication key, which follows
+    // the body in a full record; 0 if there is none. See dedup.c.
+    byte   keylen;
+};
+
+// A Tombrec records the deletion of up to Tombmax jobs at once. It is
+// written after a namelen of Tombname, in place of a Jobrec and in the
+// same space, so one tombstone costs no more than a single delete.
+enum
+{
+    Tombname = -1,
+    Tombmax = (sizeof(Jobrec) - 2*sizeof(uint32)) / sizeof(uint64)
+};
+
+struct Tombrec {
+    uint32 crc; // as in Jobrec
+    uint32 n;
+    uint64 ids[Tombmax];
+};
+
+// A Keyrec records a deduplication key on its own, for when the file
+// holding its job's full record is compacted away (see moveone). It is
+// written after a namelen of Keyname, and is followed by the tube name
+// and the key.
+enum
+{
+    Keyname = -2
+};
+
+struct Keyrec {
+    uint64 id;
+    int64  expire_at; // as deadline_at
+    uint32 crc;       // as in Jobrec
+    byte   namelen;
+    byte   keylen;
 };
 
 struct Job {
@@ -237,8 +328,28 @@ struct Job {
     void *reserver;
     int walresv;
     int walused;
+    int64 since;                // when it last became ready or reserved
+    uint64 bury_seq;            // its place in the buried list of its tube
+
+    Body *bodybuf;              // holds the body; shared with senders
+    char *body;                 // bodybuf->data; written separately to the wal
 
-    char *body;                 // written separately to the wal
+    // A job whose body was moved to disk has no bodybuf and no body;
+    // spill is the spill file holding it, at spilloff. See spill.c.
+    Spillseg *spill;
+    int64 spilloff;
+
+    Dkey *dkey;                 // the deduplication key it was put with, if any
+};
+
+// A Body holds the data of a job or of a reply. It is reference
+// counted so a conn can finish sending it after the job is freed.
+struct Body {
+    int  refs;
+    int  size;
+    int  cap;                   // bytes allocated for data
+    byte mem;                   // the Mem* category it is counted in
+    char data[];
 };
 
 struct Tube {
@@ -257,7 +368,34 @@ struct Tube {
     // unpause_at is a timestamp when to unpause the tube, in nsec.
     int64 unpause_at;
 
+    // ephemeral is set if the tube's name matches a -e prefix.
+    // Jobs put into an ephemeral tube are not written to the wal.
+    byte ephemeral;
+
+    // proclat holds the reserve-to-delete times of the tube's jobs.
+    // It is allocated when the first reserved job is deleted.
+    Hist *proclat;
+
+    uint64 mem;                 // bytes used by the tube's jobs; see job_mem
+
+    // keys is a hash table of the tube's deduplication keys,
+    // with keycap chains; see dedup.c.
+    Dkey **keys;
+    uint keycap;
+    uint nkeys;
+
     Job buried;                 // linked list header
+
+    // bury_seq numbers the jobs buried in the tube, in order. marks
+    // holds, for each block of Burymark numbers from mark0 on, the
+    // first job still buried in it, or NULL; see buried_after.
+    // marksoff is set while the marks are incomplete for lack of memory.
+    uint64 bury_seq;
+    Job    **marks;
+    uint64 mark0;
+    size_t nmark;
+    size_t markcap;
+    byte   marksoff;
 };
 
 
@@ -284,13 +422,44 @@ void warnx(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 char* fmtalloc(char *fmt, ...) __attribute__((format(printf, 1, 2)));
 void* zalloc(int n);
 #define new(T) zalloc(sizeof(T))
+
+// Categories of memory use. Each allocation of these kinds adds its
+// size to mem_used, and its release takes it away.
+enum {
+    Membody,    // job bodies
+    Memjob,     // job headers
+    Memheap,    // heap arrays of ready and delayed jobs, and timed conns
+    Memhash,    // the job id hash table, beyond its static part
+    Memtube,    // tubes
+    Memconn,    // connections
+    Memreply,   // reply buffers
+    Memkey,     // deduplication keys
+    Memcats
+};
+extern uint64 mem_used[Memcats];
+extern uint64 mem_limit;
+uint64 mem_total(void);
+int    mem_over(uint64 n);
 void optparse(Server*, char**);
 
 extern const char *progname;
 
+// coarseclock is set if deadlines may use a cheaper, coarser clock.
+extern int coarseclock;
+
 int64 nanoseconds(void);
+int64 walltime(void);
+int64 clockoffset(void);
+int64 clockupdate(void);
+int64 curtime(void);
 int   rawfalloc(int fd, int len);
 
+uint32 crc32c(uint32 crc, const void *buf, size_t len);
+
+int lzcompress(const void *src, int n, void *dst, int cap);
+int lzdecompress(const void *src, int n, void *dst, int cap);
+uint32 crc32c_table(uint32 crc, const void *buf, size_t len);
+
 // Take ID for a jobs from next_id and allocate and store the job.
 #define make_job(pri,delay,ttr,body_size,tube) \
     make_job_with_id(pri,delay,ttr,body_size,tube,0)
@@ -300,6 +469,25 @@ Job *make_job_with_id(uint pri, int64 delay, int64 ttr,
                       int body_size, Tube *tube, uint64 id);
 void job_free(Job *j);
 
+Body *body_new(int size, int mem);
+
+// job_stored_size is the size of the body of j as kept in memory,
+// in a spill file and in the wal.
+#define job_stored_size(j) ((j)->r.zsize ? (j)->r.zsize : (j)->r.body_size)
+
+// job_keylen is the length of the deduplication key of j, if any.
+#define job_keylen(j) ((j)->dkey ? (j)->dkey->len : 0)
+
+void  job_compress(Job *j);
+Body *job_body(Job *j);
+
+// job_mem is the memory used by j: its header and body,
+// unless the body was spilled.
+#define job_mem(j) (sizeof(Job) + \
+    ((j)->bodybuf ? sizeof(Body) + (j)->bodybuf->cap : 0))
+Body *body_ref(Body *b);
+void  body_unref(Body *b);
+
 /* Lookup a job by job ID */
 Job *job_find(uint64 job_id);
 
@@ -308,8 +496,6 @@ void job_setpos(void *j, size_t pos);
 int job_pri_less(void *ja, void *jb);
 int job_delay_less(void *ja, void *jb);
 
-Job *job_copy(Job *j);
-
 const char * job_state(Job *j);
 
 void job_list_reset(Job *head);
@@ -322,6 +508,7 @@ size_t get_all_jobs_used(void);
 
 
 extern struct Ms tubes;
+extern struct Ms ephemeral_prefixes;
 
 Tube *make_tube(const char *name);
 void  tube_dref(Tube *t);
@@ -357,7 +544,88 @@ int  prot_replay(Server *s, Job *list);
 
 
 int make_server_socket(char *host, char *port);
+int dial_server(char *host, char *port);
+
+
+// A Spillseg is one spill file.
+struct Spillseg {
+    int   seq;
+    int   fd;
+    int   refs;                 // jobs with a body in this file
+    int64 size;                 // bytes written so far
+};
+
+// Spill is the state of tiered storage (-t).
+struct Spill {
+    char     *dir;              // where spill files go; NULL if not tiered
+    Spillseg *cur;              // the file being appended to
+    int       seq;              // of the last file opened
+    int       nseg;             // open files
+    uint64    njob;             // jobs with a spilled body
+    uint64    nbyte;            // bytes of spilled bodies
+    uint64    nwrite;           // bodies spilled, in total
+    uint64    nread;            // spilled bodies read back, in total
+};
+
+extern Spill spill;
+
+
+// Zstat counts the work of body compression (-Z).
+struct Zstat {
+    int    min;                 // compress bodies of at least this size; 0 is off
+    uint64 njob;                // jobs with a compressed body
+    uint64 nbyte;               // bytes of compressed bodies, as stored
+    uint64 nraw;                // bytes of those bodies, uncompressed
+    uint64 hits;                // sends served from the cache of bodies
+    uint64 misses;              // sends that decompressed a body
+};
 
+extern Zstat zstat;
+
+
+// A Dkey remembers the job put with a deduplication key, in the
+// tube's keys, until expire_at.
+struct Dkey {
+    Dkey   *next;               // in the tube's hash chain
+    Dkey   *bnext;              // in the expiry bucket
+    Tube   *tube;               // NULL until the key is added
+    File   *file;               // holds the record with the key, if any
+    Dkey   *fnext;              // in the keys of file
+    Dkey   *fprev;
+    uint64 id;
+    int64  expire_at;
+    byte   len;
+    char   key[];
+};
+
+extern int64  dedup_window;     // how long keys are kept, in nsec; 0 is off
+extern uint64 dedup_keys;       // keys kept in all tubes
+extern uint64 dedup_hits;       // puts answered with the id of an earlier job
+
+Dkey *dedupfind(Tube *t, const char *key, int len);
+Dkey *dedupnew(const char *key, int len);
+void  dedupadd(Dkey *k, Tube *t, uint64 id, int64 expire_at, File *f);
+void  dedupfree(Dkey *k);
+int64 deduptick(int64 now);
+
+int   spillinit(void);
+int   spillout(Job *j);
+int   spillload(Job *j, char *buf);
+Body *spillread(Job *j);
+void  spillprefetch(Job *j);
+void  spilldrop(Job *j);
+
+
+// Connection can be in one of these states:
+#define STATE_WANT_COMMAND  0  // conn expects a command from the client
+#define STATE_WANT_DATA     1  // conn expects a job data
+#define STATE_SEND_JOB      2  // conn sends job to the client
+#define STATE_SEND_WORD     3  // conn sends a line reply
+#define STATE_WAIT          4  // client awaits for the job reservation
+#define STATE_BITBUCKET     5  // conn discards content
+#define STATE_CLOSE         6  // conn should be closed
+#define STATE_WANT_ENDLINE  7  // skip until the end of a line
+#define STATE_BULK          8  // client awaits the end of a kick or flush-tube
 
 // CONN_TYPE_* are bit masks used to track the type of connection.
 // A put command adds the PRODUCER type, "reserve*" adds the WORKER type.
@@ -382,9 +650,28 @@ struct Conn {
     // How long client should "wait" for the next job; -1 means forever.
     int    pending_timeout;
 
+    // While waiting for reserve-batch, the number of jobs asked for;
+    // otherwise 0.
+    uint   batch_n;
+
+    // The reserve-stream window: the server pushes jobs to c while it
+    // holds fewer than this many reservations. 0 if not streaming.
+    uint   stream_window;
+    uint   reserved_n;  // number of jobs in reserved_jobs
+
+    // A kick or flush-tube that runs in slices; see bulk_slice in prot.c.
+    byte   bulk_op;
+    byte   bulk_state;  // the job state flush-tube removes, or 0 for all
+    uint   bulk_left;   // the most jobs still to kick
+    uint   bulk_ct;     // jobs kicked or flushed so far
+    Tube   *bulk_tube;
+
     // Used to inform state machine that client no longer waits for the data.
     char   halfclosed;
 
+    // Set once the client has switched to the binary protocol.
+    char   binary;
+
     char   cmd[LINE_BUF_SIZE];     // this string is NOT NUL-terminated
     size_t cmd_len;
     int    cmd_read;
@@ -401,11 +688,29 @@ struct Conn {
     int64 in_job_read;
     Job   *in_job;              // a job to be read from the client
 
-    Job *out_job;               // a job to be sent to the client
-    int out_job_sent;           // how many bytes of *out_job were sent already
+    // If nonzero, in_job is not a job but the payload of a command of
+    // this type (put-batch, delete-many, ...); see read_payload.
+    byte  in_op;
+    uint  in_batch;             // number of jobs in a put-batch payload
+
+    Body *out_body;             // data to be sent to the client
+    int out_body_sent;          // how many bytes of *out_body were sent already
+    Body *stats_buf;            // kept between stats replies; see reply_stats
+    Ms    stats_tubes;          // tubes of a stats-tubes reply in progress
+    size_t tubes_sent;          // how many of stats_tubes were sent already
+    byte  listing;              // a list-conns reply is in progress
+    int   list_fd;              // the next fd it lists; see list_conns_next
 
     Ms  watch;                  // the set of watched tubes by the connection
     Job reserved_jobs;          // linked list header
+
+    // For list-conns and stats-conn.
+    char   addr[64];            // the peer's numeric address
+    int64  since;               // when the conn was accepted
+    uint64 bytes_in;
+    uint64 bytes_out;
+    uint64 cmd_ct;              // commands received
+    uint64 reply_ct;            // replies sent
 };
 int  conn_less(void *ca, void *cb);
 void conn_setpos(void *c, size_t i);
@@ -417,14 +722,27 @@ Job *connsoonestjob(Conn *c);
 int  conndeadlinesoon(Conn *c);
 int conn_ready(Conn *c);
 void conn_reserve_job(Conn *c, Job *j);
+Conn *conn_by_fd(int fd);
+int  conn_fd_limit(void);
 #define conn_waiting(c) ((c)->type & CONN_TYPE_WAITING)
 
+// conn_blocked is true while c waits for the reply to a reserve command,
+// as opposed to a streaming connection waiting for its next job.
+#define conn_blocked(c) (conn_waiting(c) && (c)->state == STATE_WAIT)
+
 
 
 
 enum
 {
-    Filesizedef = (10 << 20)
+    Filesizedef = (10 << 20),
+
+    // Compaction work done by one call to walcompact is bounded by
+    // min(ratio, Compactmaxratio) * Compactstep bytes of migrated
+    // records and by Compactslice nanoseconds.
+    Compactstep = (64 << 10),
+    Compactmaxratio = 16,
+    Compactslice = 1000000,
 };
 
 struct Wal {
@@ -440,6 +758,8 @@ struct Wal {
     int64  alive; // bytes in use
     int64  nmig;  // migrations
     int64  nrec;  // records written ever
+    Hist   writelat; // time taken by writes
+    Hist   synclat;  // time taken by fsyncs
     int    wantsync; // do we sync to disk?
     int64  syncrate; // how often we sync to disk, in nanoseconds
     int64  lastsync;
@@ -447,9 +767,15 @@ struct Wal {
 int  waldirlock(Wal*);
 void walinit(Wal*, Job *list);
 int  walwrite(Wal*, Job*);
+int  walwritebatch(Wal*, Job**, int);
 void walmaint(Wal*);
+int  walcompact(Wal*);
 int  walresvput(Wal*, Job*);
-int  walresvupdate(Wal*);
+int  walresvputbatch(Wal*, Job**, int);
+int  walbatchfits(Wal*, Tube*, int, int64);
+int  walresvupdate(Wal*, Job*);
+int  walresvupdatebatch(Wal*, Job**, int);
+int  walwritetomb(Wal*, Job**, int);
 void walgc(Wal*);
 
 
@@ -464,7 +790,13 @@ struct File {
     char *path;
     Wal  *w;
 
+    // clockadj is added to the deadlines read from the file to turn
+    // them into monotonic times of this process. See fileread.
+    int64 clockadj;
+    int   ver;    // the format version of the file, when read
+
     Job jlist;    // jobs written in this file
+    Dkey *keys;   // deduplication keys whose records are in this file
 };
 int  fileinit(File*, Wal*, int);
 Wal* fileadd(File*, Wal*);
@@ -472,15 +804,30 @@ void fileincref(File*);
 void filedecref(File*);
 void fileaddjob(File*, Job*);
 void filermjob(File*, Job*);
+void fileaddkey(File*, Dkey*);
+void filermkey(File*, Dkey*);
 int  fileread(File*, Job *list);
 void filewopen(File*);
 void filewclose(File*);
-int  filewrjobshort(File*, Job*);
-int  filewrjobfull(File*, Job*);
+int  filewrjobs(File*, Job**, int);
+int  filewrtomb(File*, uint64*, int);
+int  filewrkey(File*, Dkey*);
 
 
 #define Portdef "11300"
 
+// Causes of event loop stalls, counted in Server.stall_ct.
+enum {
+    Stallcmd,       // running a command
+    Stallaccept,    // accepting a connection
+    Stalldelay,     // moving due delayed jobs, unpausing tubes
+    Stalltimeout,   // connection timeouts and expired reservations
+    Stallcompact,   // a binlog compaction slice
+    Stallcauses
+};
+
+#define DEFAULT_SLOW_MS 100
+
 struct Server {
     char *port;
     char *addr;
@@ -491,7 +838,17 @@ struct Server {
 
     // Connections that must produce deadline or timeout, ordered by the time.
     Heap   conns;
+
+    Hist   looplat; // time spent working in an event loop iteration
+    Hist   waitlat; // time jobs spend ready before they are reserved
+    Hist   proclat; // time from reserve to delete, over all tubes
+
+    // Work in the event loop taking slowop nanoseconds or more is
+    // counted in stall_ct by cause and logged. 0 turns this off.
+    int64  slowop;
+    uint64 stall_ct[Stallcauses];
 };
 void srv_acquire_wal(Server *s);
 void srvserve(Server *s);
 void srvaccept(Server *s, int ev);
+int  srvstall(Server *s, int cause, int64 d);
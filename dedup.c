@@ -0,0 +1,198 @@
+#include "dat.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Deduplication keys. A put may carry a key. The key is kept in its
+// tube for dedup_window (-k), and a put with the same key in that time
+// gets the id of the first job instead of making another one, so a
+// producer can safely retry a put whose reply it did not see.
+//
+// Keys expire in bulk rather than each on a timer of its own: a key
+// goes in the bucket of the time slice it expires in, and the whole
+// bucket is freed once that slice is over. There are Dbuckets slices
+// in a window, so a key is kept at most one slice past its time.
+//
+// A key is written to the wal in the full record of its job. It pins
+// the file holding that record until it expires, so it is read back
+// after a restart, even if its job has been deleted since. The key
+// moves on with its job when the job is migrated, and on its own, as a
+// key record, when compaction finds no jobs left in its file.
+
+int64  dedup_window = (int64)DEFAULT_DEDUP_SECS * 1000000000;
+uint64 dedup_keys;
+uint64 dedup_hits;
+
+enum {
+    Dbuckets = 64,
+    Dmincap = 16,
+};
+
+static Dkey *buckets[Dbuckets];
+
+// swept is the number of the first time slice not yet expired.
+static int64 swept = -1;
+
+static int64
+slotwidth(void)
+{
+    return dedup_window / (Dbuckets - 1) + 1;
+}
+
+static uint
+hashkey(const char *key, int len)
+{
+    uint32 h = 2166136261u; // FNV-1a
+    int i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (byte)key[i];
+        h *= 16777619;
+    }
+    return h;
+}
+
+// Dedupfind returns the key of t equal to the len bytes
+// at key, or NULL if there is none.
+Dkey *
+dedupfind(Tube *t, const char *key, int len)
+{
+    Dkey *k;
+
+    if (!t->keycap)
+        return NULL;
+    k = t->keys[hashkey(key, len) % t->keycap];
+    for (; k; k = k->next) {
+        if (k->len == len && memcmp(k->key, key, len) == 0)
+            return k;
+    }
+    return NULL;
+}
+
+// Dedupnew returns a new key, not yet in any tube,
+// or NULL if out of memory.
+Dkey *
+dedupnew(const char *key, int len)
+{
+    Dkey *k = zalloc(sizeof(Dkey) + len);
+
+    if (!k)
+        return NULL;
+    memcpy(k->key, key, len);
+    k->len = len;
+    mem_used[Memkey] += sizeof(Dkey) + len;
+    return k;
+}
+
+// Dedupfree frees k, which must not be in a tube.
+void
+dedupfree(Dkey *k)
+{
+    if (!k)
+        return;
+    mem_used[Memkey] -= sizeof(Dkey) + k->len;
+    free(k);
+}
+
+static void
+rehash(Tube *t)
+{
+    uint i, cap = t->keycap ? t->keycap * 2 : Dmincap;
+    Dkey **keys, *k, *next;
+
+    keys = calloc(cap, sizeof *keys);
+    if (!keys)
+        return; // the chains just get longer
+    for (i = 0; i < t->keycap; i++) {
+        for (k = t->keys[i]; k; k = next) {
+            next = k->next;
+            k->next = keys[hashkey(k->key, k->len) % cap];
+            keys[hashkey(k->key, k->len) % cap] = k;
+        }
+    }
+    free(t->keys);
+    mem_used[Memkey] += (cap - t->keycap) * sizeof *keys;
+    t->keys = keys;
+    t->keycap = cap;
+}
+
+// Dedupadd adds k to t, for job id, until expire_at. If f is not
+// NULL, it is the file holding the record with k, and it is kept
+// until k expires or moves on (see fileaddkey).
+void
+dedupadd(Dkey *k, Tube *t, uint64 id, int64 expire_at, File *f)
+{
+    uint i;
+
+    deduptick(curtime());
+    if (expire_at < curtime())
+        expire_at = curtime();
+    if (t->nkeys >= t->keycap)
+        rehash(t);
+    if (!t->keycap) {
+        twarnx("OOM");
+        dedupfree(k);
+        return;
+    }
+
+    i = hashkey(k->key, k->len) % t->keycap;
+    k->next = t->keys[i];
+    t->keys[i] = k;
+    t->nkeys++;
+    dedup_keys++;
+    TUBE_ASSIGN(k->tube, t);
+    k->id = id;
+    k->expire_at = expire_at;
+    fileaddkey(f, k);
+
+    i = (expire_at / slotwidth()) % Dbuckets;
+    k->bnext = buckets[i];
+    buckets[i] = k;
+}
+
+static void
+expire(Dkey *k)
+{
+    Tube *t = k->tube;
+    Dkey **p;
+    Job *j;
+
+    p = &t->keys[hashkey(k->key, k->len) % t->keycap];
+    while (*p != k)
+        p = &(*p)->next;
+    *p = k->next;
+    t->nkeys--;
+    dedup_keys--;
+
+    j = job_find(k->id);
+    if (j && j->dkey == k)
+        j->dkey = NULL;
+    filermkey(k->file, k);
+    TUBE_ASSIGN(k->tube, NULL);
+    dedupfree(k);
+}
+
+// Deduptick expires the keys whose time is up as of now. It returns
+// how long until it may have more to do.
+int64
+deduptick(int64 now)
+{
+    int64 w = slotwidth(), s = now / w;
+    Dkey *k, *next;
+
+    if (swept < 0)
+        swept = s;
+    else if (s - swept > Dbuckets)
+        swept = s - Dbuckets; // all of them
+    for (; swept < s; swept++) {
+        k = buckets[swept % Dbuckets];
+        buckets[swept % Dbuckets] = NULL;
+        for (; k; k = next) {
+            next = k->bnext;
+            expire(k);
+        }
+    }
+    if (!dedup_keys)
+        return 0x34630B8A000LL; // 1 hour; nothing will expire
+    return (s + 1) * w - now;
+}
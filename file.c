@@ -11,10 +11,16 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/uio.h>
 
 static int  readrec(File*, Job *, int*);
+static int  readtomb(File*, int*);
+static int  readkey(File*, int*);
+static void restorekey(File*, Job*, char*, int);
+static int  readrec7(File*, Job *, int*);
 static int  readrec5(File*, Job *, int*);
 static int  readfull(File*, void*, int, int*, char*);
+static void cuttail(File*, int);
 static void warnpos(File*, int, char*, ...)
 __attribute__((format(printf, 3, 4)));
 
@@ -22,7 +28,18 @@ FAlloc *falloc = &rawfalloc;
 
 enum
 {
-    Walver5 = 5
+    Walver5 = 5,
+    Walver7 = 7,
+    Walver8 = 8,
+    Walver9 = 9,
+    Walver10 = 10,
+    Walver11 = 11,
+    Walver12 = 12
+};
+
+enum
+{
+    Wrbatch = 256 // records per writev in filewrjobs; up to 5 iovecs each
 };
 
 typedef struct Jobrec5 Jobrec5;
@@ -122,22 +139,74 @@ filermjob(File *f, Job *j)
 }
 
 
+// Fileaddkey records that the latest record with k is in f,
+// which is kept until k expires or moves on.
+void
+fileaddkey(File *f, Dkey *k)
+{
+    if (!f) return;
+    k->file = f;
+    k->fprev = NULL;
+    k->fnext = f->keys;
+    if (f->keys) f->keys->fprev = k;
+    f->keys = k;
+    fileincref(f);
+}
+
+
+void
+filermkey(File *f, Dkey *k)
+{
+    if (!f) return;
+    if (f != k->file) return;
+    if (k->fprev) k->fprev->fnext = k->fnext;
+    else f->keys = k->fnext;
+    if (k->fnext) k->fnext->fprev = k->fprev;
+    k->fnext = NULL;
+    k->fprev = NULL;
+    k->file = NULL;
+    filedecref(f);
+}
+
+
 // Fileread reads jobs from f->path into list.
 // It returns 0 on success, or 1 if any errors occurred.
+//
+// Deadlines in the log are monotonic times of the process that wrote
+// it, and the file header has the offset from those to the wall clock
+// at the time. Before Walver 10, deadlines were wall clock times.
+// Either way, they are turned into monotonic times of this process,
+// so a delayed job is due at the same wall clock time as before.
 int
 fileread(File *f, Job *list)
 {
     int err = 0, v;
+    int64 off = 0;
 
     if (!readfull(f, &v, sizeof(v), &err, "version")) {
         return err;
     }
+    if (v >= Walver10 && !readfull(f, &off, sizeof(off), &err, "clock offset")) {
+        return err;
+    }
+    f->ver = v;
+    f->clockadj = off - clockoffset();
     switch (v) {
     case Walver:
+    case Walver12: // like Walver, without key records
+    case Walver11: // like Walver12, without deduplication keys
+    case Walver10: // like Walver11, without compressed bodies
+    case Walver9: // like Walver10, with wall clock deadlines
+    case Walver8: // like Walver9, without tombstones
         fileincref(f);
         while (readrec(f, list, &err));
         filedecref(f);
         return err;
+    case Walver7:
+        fileincref(f);
+        while (readrec7(f, list, &err));
+        filedecref(f);
+        return err;
     case Walver5:
         fileincref(f);
         while (readrec5(f, list, &err));
@@ -152,16 +221,23 @@ fileread(File *f, Job *list)
 
 // Readrec reads a record from f->fd into linked list l.
 // If an error occurs, it sets *err to 1.
+// A record whose checksum does not match ends the file. In the
+// last file of the log this is expected after a crash (a torn
+// write), so it is not treated as an error there, and the file is
+// cut off before the record; see cuttail.
 // Readrec returns the number of records read, either 1 or 0.
 static int
 readrec(File *f, Job *l, int *err)
 {
-    int r, sz = 0;
+    int r, sz = 0, bs = 0;
     int namelen;
+    uint32 crc;
     Jobrec jr;
     Job *j;
     Tube *t;
     char tubename[MAX_TUBE_NAME_LEN];
+    char key[MAX_DEDUP_KEY_LEN];
+    char *body = NULL;
 
     r = read(f->fd, &namelen, sizeof(int));
     if (r == -1) {
@@ -180,6 +256,14 @@ readrec(File *f, Job *l, int *err)
         return 0;
     }
 
+    if (namelen == Tombname) {
+        return readtomb(f, err);
+    }
+
+    if (namelen == Keyname) {
+        return readkey(f, err);
+    }
+
     if (namelen < 0) {
         warnpos(f, -r, "namelen %d is negative", namelen);
         *err = 1;
@@ -204,6 +288,373 @@ readrec(File *f, Job *l, int *err)
     // are we reading trailing zeroes?
     if (!jr.id) return 0;
 
+    crc = jr.crc;
+    jr.crc = 0;
+    jr.crc = crc32c(crc32c(crc32c(0, &namelen, sizeof(int)),
+                           tubename, namelen),
+                    &jr, sizeof(Jobrec));
+    if (f->ver < Walver11) {
+        jr.zsize = 0; // it was padding
+    }
+    if (f->ver < Walver12) {
+        jr.keylen = 0; // so was this
+    }
+
+    // full record; read the job body so the checksum
+    // can be verified before anything is changed
+    if (namelen) {
+        if (jr.body_size < 0 || (size_t)jr.body_size > job_data_size_limit) {
+            warnpos(f, -r, "job %"PRIu64" is too big (%"PRId32" > %zu)",
+                    jr.id,
+                    jr.body_size,
+                    job_data_size_limit);
+            *err = 1;
+            return 0;
+        }
+        if (jr.zsize < 0 || jr.zsize > jr.body_size) {
+            warnpos(f, -r, "job %"PRIu64" has bad compressed size %"PRId32,
+                    jr.id, jr.zsize);
+            *err = 1;
+            return 0;
+        }
+        bs = jr.zsize ? jr.zsize : jr.body_size;
+        body = malloc(bs + 1);
+        if (!body) {
+            twarnx("OOM");
+            *err = 1;
+            return 0;
+        }
+        r = readfull(f, body, bs, err, "job body");
+        if (!r && bs) {
+            free(body);
+            return 0;
+        }
+        sz += r;
+        jr.crc = crc32c(jr.crc, body, bs);
+
+        if (jr.keylen > MAX_DEDUP_KEY_LEN) {
+            warnpos(f, -sz, "job %"PRIu64" key is too long (%d)",
+                    jr.id, jr.keylen);
+            *err = 1;
+            free(body);
+            return 0;
+        }
+        if (jr.keylen) {
+            r = readfull(f, key, jr.keylen, err, "job key");
+            if (!r) {
+                free(body);
+                return 0;
+            }
+            sz += r;
+            jr.crc = crc32c(jr.crc, key, jr.keylen);
+        }
+    }
+
+    if (jr.crc != crc) {
+        if (f->seq == f->w->next - 1) {
+            warnpos(f, -sz, "bad checksum; ignoring the rest of the file");
+            cuttail(f, sz);
+        } else {
+            warnpos(f, -sz, "bad checksum");
+            *err = 1;
+        }
+        free(body);
+        return 0;
+    }
+    jr.crc = 0;
+    jr.deadline_at += f->clockadj;
+
+    j = job_find(jr.id);
+    if (!(j || namelen)) {
+        // We read a short record without having seen a
+        // full record for this job, so the full record
+        // was in an earlier file that has been deleted.
+        // Therefore the job itself has either been
+        // deleted or migrated; either way, this record
+        // should be ignored.
+        return 1;
+    }
+
+    switch (jr.state) {
+    case Reserved:
+        jr.state = Ready;
+        /* Falls through */
+    case Ready:
+    case Buried:
+    case Delayed:
+        if (!j) {
+            t = tube_find_or_make(tubename);
+            j = make_job_with_id(jr.pri, jr.delay, jr.ttr, bs, t, jr.id);
+            job_list_reset(j);
+            j->r.created_at = jr.created_at;
+        }
+        if (namelen && bs != job_stored_size(j)) {
+            warnpos(f, -sz, "job %"PRIu64" size changed", j->r.id);
+            warnpos(f, -sz, "was %d, now %d", job_stored_size(j), bs);
+            goto Error;
+        }
+        if (jr.zsize && !j->r.zsize) {
+            zstat.njob++;
+            zstat.nbyte += jr.zsize;
+            zstat.nraw += jr.body_size;
+        }
+        j->r = jr;
+        j->r.keylen = 0;
+        job_list_insert(l, j);
+
+        // full record; take the job body
+        if (namelen) {
+            if (jr.keylen && !j->dkey) {
+                restorekey(f, j, key, jr.keylen);
+            } else if (jr.keylen && j->dkey->file != f) {
+                // the job was migrated, and its key with it
+                filermkey(j->dkey->file, j->dkey);
+                fileaddkey(f, j->dkey);
+            }
+            memcpy(j->body, body, bs);
+            free(body);
+            body = NULL;
+
+            // since this is a full record, we can move
+            // the file pointer and decref the old
+            // file, if any
+            filermjob(j->file, j);
+            fileaddjob(f, j);
+        }
+        j->walused += sz;
+        f->w->alive += sz;
+
+        return 1;
+    case Invalid:
+        free(body);
+        if (j) {
+            job_list_remove(j);
+            filermjob(j->file, j);
+            job_free(j);
+        }
+        return 1;
+    }
+
+Error:
+    *err = 1;
+    free(body);
+    if (j) {
+        job_list_remove(j);
+        filermjob(j->file, j);
+        job_free(j);
+    }
+    return 0;
+}
+
+
+// Restorekey gives j back the deduplication key read with its full
+// record from f, unless the key has run out since the job was put,
+// or its tube has it already.
+static void
+restorekey(File *f, Job *j, char *key, int len)
+{
+    int64 left = j->r.created_at + dedup_window - walltime();
+    Dkey *k;
+
+    if (left <= 0 || dedupfind(j->tube, key, len))
+        return;
+    k = dedupnew(key, len);
+    if (!k) {
+        twarnx("OOM");
+        return;
+    }
+    dedupadd(k, j->tube, j->r.id, curtime() + left, f);
+    j->dkey = k;
+}
+
+
+// Readtomb reads the rest of a tombstone record, whose namelen has
+// been read already, and deletes the jobs it names. Its checksum is
+// handled as in readrec. It returns the number of records read,
+// either 1 or 0.
+static int
+readtomb(File *f, int *err)
+{
+    int namelen = Tombname;
+    uint32 crc, i;
+    union {
+        Jobrec  jr;
+        Tombrec tr;
+    } u;
+    Job *j;
+
+    if (!readfull(f, &u, sizeof(Jobrec), err, "tombstone")) {
+        return 0;
+    }
+    crc = u.tr.crc;
+    u.tr.crc = 0;
+    if (crc32c(crc32c(0, &namelen, sizeof(int)), &u, sizeof(Jobrec)) != crc) {
+        if (f->seq == f->w->next - 1) {
+            warnpos(f, -(int)sizeof(Jobrec), "bad checksum; ignoring the rest of the file");
+            cuttail(f, sizeof(int) + sizeof(Jobrec));
+        } else {
+            warnpos(f, -(int)sizeof(Jobrec), "bad checksum");
+            *err = 1;
+        }
+        return 0;
+    }
+    if (u.tr.n > Tombmax) {
+        warnpos(f, -(int)sizeof(Jobrec), "tombstone holds %u ids", u.tr.n);
+        *err = 1;
+        return 0;
+    }
+
+    for (i = 0; i < u.tr.n; i++) {
+        j = job_find(u.tr.ids[i]);
+        if (j) {
+            job_list_remove(j);
+            filermjob(j->file, j);
+            job_free(j);
+        }
+    }
+    return 1;
+}
+
+
+// Readkey reads the rest of a key record, whose namelen has been read
+// already, and gives the key back to its tube, unless it has run out.
+// If the tube has the key already, from the full record of its job in
+// an earlier file, the key is moved to f. Its checksum is handled as in
+// readrec. It returns the number of records read, either 1 or 0.
+static int
+readkey(File *f, int *err)
+{
+    int namelen = Keyname, sz;
+    uint32 crc;
+    Keyrec kr;
+    char tubename[MAX_TUBE_NAME_LEN];
+    char key[MAX_DEDUP_KEY_LEN];
+    int64 now = curtime();
+    Tube *t;
+    Dkey *k;
+
+    if (!readfull(f, &kr, sizeof kr, err, "key record")) {
+        return 0;
+    }
+    sz = sizeof(int) + sizeof kr;
+    if (kr.namelen >= MAX_TUBE_NAME_LEN || !kr.keylen ||
+        kr.keylen > MAX_DEDUP_KEY_LEN) {
+        warnpos(f, -(int)sizeof kr, "key record has bad lengths (%d, %d)",
+                kr.namelen, kr.keylen);
+        *err = 1;
+        return 0;
+    }
+    if (!readfull(f, tubename, kr.namelen, err, "tube name")) {
+        return 0;
+    }
+    tubename[kr.namelen] = '\0';
+    if (!readfull(f, key, kr.keylen, err, "key")) {
+        return 0;
+    }
+    sz += kr.namelen + kr.keylen;
+
+    crc = kr.crc;
+    kr.crc = 0;
+    kr.crc = crc32c(crc32c(crc32c(crc32c(0, &namelen, sizeof(int)),
+                                  &kr, sizeof kr),
+                           tubename, kr.namelen),
+                    key, kr.keylen);
+    if (kr.crc != crc) {
+        if (f->seq == f->w->next - 1) {
+            warnpos(f, -sz, "bad checksum; ignoring the rest of the file");
+            cuttail(f, sz);
+        } else {
+            warnpos(f, -sz, "bad checksum");
+            *err = 1;
+        }
+        return 0;
+    }
+
+    kr.expire_at = min(kr.expire_at + f->clockadj, now + dedup_window);
+    if (kr.expire_at <= now) {
+        return 1;
+    }
+    t = tube_find_or_make(tubename);
+    if (!t) {
+        twarnx("OOM");
+        return 1;
+    }
+    k = dedupfind(t, key, kr.keylen);
+    if (k) {
+        if (k->id == kr.id) {
+            filermkey(k->file, k);
+            fileaddkey(f, k);
+        }
+        return 1;
+    }
+    k = dedupnew(key, kr.keylen);
+    if (!k) {
+        twarnx("OOM");
+        return 1;
+    }
+    dedupadd(k, t, kr.id, kr.expire_at, f);
+    return 1;
+}
+
+
+// Readrec7 is like readrec, but it reads a record in "version 7"
+// of the log format. Version 7 records have no checksum; the bytes
+// that hold Jobrec.crc, Jobrec.zsize and Jobrec.keylen in the current
+// format were padding.
+static int
+readrec7(File *f, Job *l, int *err)
+{
+    int r, sz = 0;
+    int namelen;
+    Jobrec jr;
+    Job *j;
+    Tube *t;
+    char tubename[MAX_TUBE_NAME_LEN];
+
+    r = read(f->fd, &namelen, sizeof(int));
+    if (r == -1) {
+        twarn("read");
+        warnpos(f, 0, "error");
+        *err = 1;
+        return 0;
+    }
+    if (r != sizeof(int)) {
+        return 0;
+    }
+    sz += r;
+    if (namelen >= MAX_TUBE_NAME_LEN) {
+        warnpos(f, -r, "namelen %d exceeds maximum of %d", namelen, MAX_TUBE_NAME_LEN - 1);
+        *err = 1;
+        return 0;
+    }
+
+    if (namelen < 0) {
+        warnpos(f, -r, "namelen %d is negative", namelen);
+        *err = 1;
+        return 0;
+    }
+
+    if (namelen) {
+        r = readfull(f, tubename, namelen, err, "v7 tube name");
+        if (!r) {
+            return 0;
+        }
+        sz += r;
+    }
+    tubename[namelen] = '\0';
+
+    r = readfull(f, &jr, sizeof(Jobrec), err, "v7 job struct");
+    if (!r) {
+        return 0;
+    }
+    sz += r;
+    jr.crc = 0;
+    jr.zsize = 0;
+    jr.keylen = 0;
+
+    // are we reading trailing zeroes?
+    if (!jr.id) return 0;
+
     j = job_find(jr.id);
     if (!(j || namelen)) {
         // We read a short record without having seen a
@@ -237,6 +688,7 @@ readrec(File *f, Job *l, int *err)
             j->r.created_at = jr.created_at;
         }
         j->r = jr;
+        j->r.deadline_at += f->clockadj;
         job_list_insert(l, j);
 
         // full record; read the job body
@@ -246,7 +698,7 @@ readrec(File *f, Job *l, int *err)
                 warnpos(f, -r, "was %d, now %d", j->r.body_size, jr.body_size);
                 goto Error;
             }
-            r = readfull(f, j->body, j->r.body_size, err, "job body");
+            r = readfull(f, j->body, j->r.body_size, err, "v7 job body");
             if (!r) {
                 goto Error;
             }
@@ -366,7 +818,7 @@ readrec5(File *f, Job *l, int *err)
         j->r.ttr = jr.ttr * 1000; // us => ns
         j->r.body_size = jr.body_size;
         j->r.created_at = jr.created_at * 1000; // us => ns
-        j->r.deadline_at = jr.deadline_at * 1000; // us => ns
+        j->r.deadline_at = jr.deadline_at * 1000 + f->clockadj; // us => ns
         j->r.reserve_ct = jr.reserve_ct;
         j->r.timeout_ct = jr.timeout_ct;
         j->r.release_ct = jr.release_ct;
@@ -438,6 +890,24 @@ readfull(File *f, void *c, int n, int *err, char *desc)
     return r;
 }
 
+// Cuttail truncates f at the torn record that ends sz bytes before
+// the read position. Once the server writes a new file, f is no
+// longer the last one, and the next restart must find it whole.
+static void
+cuttail(File *f, int sz)
+{
+    off_t off;
+
+    off = lseek(f->fd, 0, SEEK_CUR);
+    if (off == -1) {
+        twarn("lseek %s", f->path);
+        return;
+    }
+    if (truncate(f->path, off - sz) == -1) {
+        twarn("truncate %s", f->path);
+    }
+}
+
 static void
 warnpos(File *f, int adj, char *fmt, ...)
 {
@@ -462,6 +932,8 @@ filewopen(File *f)
     int fd, r;
     int n;
     int ver = Walver;
+    int64 off = clockoffset();
+    char hdr[sizeof(ver) + sizeof(off)];
 
     fd = open(f->path, O_WRONLY|O_CREAT, 0400);
     if (fd < 0) {
@@ -482,8 +954,11 @@ filewopen(File *f)
         return;
     }
 
-    n = write(fd, &ver, sizeof(int));
-    if (n < 0 || (size_t)n < sizeof(int)) {
+    // the version, then the offset from monotonic to wall clock time
+    memcpy(hdr, &ver, sizeof(ver));
+    memcpy(hdr + sizeof(ver), &off, sizeof(off));
+    n = write(fd, hdr, sizeof(hdr));
+    if (n < 0 || (size_t)n < sizeof(hdr)) {
         twarn("write %s", f->path);
         if (close(fd) == -1)
             twarn("close");
@@ -498,56 +973,170 @@ filewopen(File *f)
 }
 
 
+// Fillrec prepares the log record for j in *nl and *jr and points
+// iov at its pieces. A job that is not yet in the log gets a full
+// record, with its tube name and body, and is added to f; otherwise
+// it gets a short record. A full record also holds the job's
+// deduplication key, if any. Fillrec returns the number of iovecs
+// used, at most 5.
 static int
-filewrite(File *f, Job *j, void *buf, int len)
+fillrec(File *f, Job *j, int *nl, Jobrec *jr, struct iovec *iov)
 {
-    int r;
-
-    r = write(f->fd, buf, len);
-    if (r != len) {
-        twarn("write");
-        return 0;
+    uint32 crc;
+
+    memcpy(jr, &j->r, sizeof *jr);
+    jr->crc = 0;
+    jr->keylen = 0;
+    if (j->file) {
+        *nl = 0; // name len 0 indicates short record
+        jr->crc = crc32c(crc32c(0, nl, sizeof *nl), jr, sizeof *jr);
+        iov[0] = (struct iovec){nl, sizeof *nl};
+        iov[1] = (struct iovec){jr, sizeof *jr};
+        return 2;
     }
 
-    f->w->resv -= r;
-    f->resv -= r;
-    j->walresv -= r;
-    j->walused += r;
-    f->w->alive += r;
-    return 1;
+    fileaddjob(f, j);
+    jr->keylen = job_keylen(j);
+    if (j->dkey && j->dkey->tube) {
+        // the key goes along, so its old record is no longer needed
+        filermkey(j->dkey->file, j->dkey);
+        fileaddkey(f, j->dkey);
+    }
+    *nl = strlen(j->tube->name);
+    crc = crc32c(0, nl, sizeof *nl);
+    crc = crc32c(crc, j->tube->name, *nl);
+    crc = crc32c(crc, jr, sizeof *jr);
+    crc = crc32c(crc, j->body, job_stored_size(j));
+    iov[0] = (struct iovec){nl, sizeof *nl};
+    iov[1] = (struct iovec){j->tube->name, *nl};
+    iov[2] = (struct iovec){jr, sizeof *jr};
+    iov[3] = (struct iovec){j->body, job_stored_size(j)};
+    if (!jr->keylen) {
+        jr->crc = crc;
+        return 4;
+    }
+    jr->crc = crc32c(crc, j->dkey->key, jr->keylen);
+    iov[4] = (struct iovec){j->dkey->key, jr->keylen};
+    return 5;
 }
 
 
+// Filewrjobs writes a record for each of the n jobs in js to f,
+// gathering up to Wrbatch records into a single writev.
+// Returns 1 on success, 0 on error.
 int
-filewrjobshort(File *f, Job *j)
+filewrjobs(File *f, Job **js, int n)
 {
-    int r, nl;
+    struct iovec iov[Wrbatch * 5];
+    Jobrec jr[Wrbatch];
+    int nl[Wrbatch], sz[Wrbatch];
+    int i, k, m, niov;
+    ssize_t want, r;
+    Job *j;
 
-    nl = 0; // name len 0 indicates short record
-    r = filewrite(f, j, &nl, sizeof nl) &&
-        filewrite(f, j, &j->r, sizeof j->r);
-    if (!r) return 0;
+    for (i = 0; i < n; i += m) {
+        m = min(n - i, Wrbatch);
+        niov = 0;
+        want = 0;
+        for (k = 0; k < m; k++) {
+            int c = fillrec(f, js[i+k], &nl[k], &jr[k], iov+niov);
+            sz[k] = 0;
+            while (c--) {
+                sz[k] += iov[niov++].iov_len;
+            }
+            want += sz[k];
+        }
 
-    if (j->r.state == Invalid) {
-        filermjob(j->file, j);
-    }
+        r = writev(f->fd, iov, niov);
+        if (r != want) {
+            twarn("writev");
+            return 0;
+        }
 
-    return r;
+        for (k = 0; k < m; k++) {
+            j = js[i+k];
+            f->w->resv -= sz[k];
+            f->resv -= sz[k];
+            j->walresv -= sz[k];
+            j->walused += sz[k];
+            f->w->alive += sz[k];
+            if (j->r.state == Invalid) {
+                filermjob(j->file, j);
+            }
+        }
+    }
+    return 1;
 }
 
 
+// Filewrtomb writes tombstone records for the n job ids in ids to f,
+// Tombmax ids per record, in a single writev. The records use space
+// already reserved in f, one delete record's worth each.
+// Returns 1 on success, 0 on error.
 int
-filewrjobfull(File *f, Job *j)
+filewrtomb(File *f, uint64 *ids, int n)
 {
-    int nl;
+    int k = (n + Tombmax - 1) / Tombmax, i, namelen = Tombname;
+    union {
+        Jobrec  jr;
+        Tombrec tr;
+    } u[k];
+    struct iovec iov[k * 2];
+    uint32 crc0 = crc32c(0, &namelen, sizeof(int));
+    ssize_t want = k * (sizeof(int) + sizeof(Jobrec));
+
+    memset(u, 0, sizeof u);
+    for (i = 0; i < k; i++) {
+        u[i].tr.n = min(n - i * Tombmax, Tombmax);
+        memcpy(u[i].tr.ids, ids + i * Tombmax, u[i].tr.n * sizeof(uint64));
+        u[i].tr.crc = crc32c(crc0, &u[i], sizeof(Jobrec));
+        iov[i*2] = (struct iovec){&namelen, sizeof(int)};
+        iov[i*2+1] = (struct iovec){&u[i], sizeof(Jobrec)};
+    }
+    if (writev(f->fd, iov, k * 2) != want) {
+        twarn("writev");
+        return 0;
+    }
+    f->w->resv -= want;
+    f->resv -= want;
+    return 1;
+}
 
-    fileaddjob(f, j);
-    nl = strlen(j->tube->name);
-    return
-        filewrite(f, j, &nl, sizeof nl) &&
-        filewrite(f, j, j->tube->name, nl) &&
-        filewrite(f, j, &j->r, sizeof j->r) &&
-        filewrite(f, j, j->body, j->r.body_size);
+
+// Filewrkey writes a key record for k to f, in space already
+// reserved in f, and moves k to f.
+// Returns 1 on success, 0 on error.
+int
+filewrkey(File *f, Dkey *k)
+{
+    int namelen = Keyname;
+    Keyrec kr;
+    struct iovec iov[4];
+    ssize_t want;
+
+    memset(&kr, 0, sizeof kr);
+    kr.id = k->id;
+    kr.expire_at = k->expire_at;
+    kr.namelen = strlen(k->tube->name);
+    kr.keylen = k->len;
+    kr.crc = crc32c(crc32c(crc32c(crc32c(0, &namelen, sizeof(int)),
+                                  &kr, sizeof kr),
+                           k->tube->name, kr.namelen),
+                    k->key, k->len);
+    iov[0] = (struct iovec){&namelen, sizeof(int)};
+    iov[1] = (struct iovec){&kr, sizeof kr};
+    iov[2] = (struct iovec){k->tube->name, kr.namelen};
+    iov[3] = (struct iovec){k->key, k->len};
+    want = sizeof(int) + sizeof kr + kr.namelen + k->len;
+    if (writev(f->fd, iov, 4) != want) {
+        twarn("writev");
+        return 0;
+    }
+    f->w->resv -= want;
+    f->resv -= want;
+    filermkey(k->file, k);
+    fileaddkey(f, k);
+    return 1;
 }
 
 
@@ -84,6 +84,7 @@ heapinsert(Heap *h, void *x)
 
         memcpy(ndata, h->data, sizeof(void*) * h->len);
         free(h->data);
+        mem_used[Memheap] += sizeof(void*) * (ncap - h->cap);
         h->data = ndata;
         h->cap = ncap;
     }
@@ -0,0 +1,67 @@
+#include "dat.h"
+#include <stdint.h>
+
+// bucket returns the index of the bucket that holds v. Below Histsub
+// each value has its own bucket; above that a value's bucket is given
+// by its top bit and the Histsubbits bits that follow it.
+static size_t
+bucket(uint64 v)
+{
+    int e;
+
+    if (v < Histsub)
+        return v;
+    e = 63 - __builtin_clzll(v);
+    if (e >= Histbits)
+        return Histbuckets - 1;
+    return (e - Histsubbits + 1) * Histsub + ((v >> (e - Histsubbits)) & (Histsub - 1));
+}
+
+// bucketmax returns the largest value that goes into bucket i.
+static uint64
+bucketmax(size_t i)
+{
+    int shift;
+
+    if (i < Histsub)
+        return i;
+    shift = i / Histsub - 1;
+    return ((uint64)(Histsub + i % Histsub + 1) << shift) - 1;
+}
+
+// hist_record adds a duration of ns nanoseconds to h.
+// Negative durations, from a clock that went back, count as 0.
+void
+hist_record(Hist *h, int64 ns)
+{
+    uint64 v = ns > 0 ? ns : 0;
+
+    h->ct[bucket(v)]++;
+    h->n++;
+    if (v > h->max)
+        h->max = v;
+}
+
+// hist_at returns the value below which permille thousandths of the
+// values recorded in h fall, rounded up to the top of its bucket but
+// no more than the largest value seen. It returns 0 if h is empty.
+uint64
+hist_at(Hist *h, uint permille)
+{
+    uint64 rank, sum = 0;
+    size_t i;
+
+    if (!h->n)
+        return 0;
+    rank = (h->n * permille + 999) / 1000;
+    if (!rank)
+        rank = 1;
+    for (i = 0; i < Histbuckets; i++) {
+        sum += h->ct[i];
+        if (sum >= rank)
+            break;
+    }
+    if (i >= Histbuckets - 1)
+        return h->max;
+    return min(bucketmax(i), h->max);
+}
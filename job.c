@@ -1,8 +1,11 @@
 #include "dat.h"
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+Zstat zstat;
+
 static uint64 next_id = 1;
 
 static int cur_prime = 0;
@@ -62,6 +65,7 @@ rehash(int is_upscaling)
         all_jobs_used = old_used;
         return;
     }
+    mem_used[Memhash] += all_jobs_cap * sizeof(Job *);
     all_jobs_used = 0;
     hash_table_was_oom = 0;
 
@@ -75,6 +79,7 @@ rehash(int is_upscaling)
     }
     if (old != all_jobs_init) {
         free(old);
+        mem_used[Memhash] -= old_cap * sizeof(Job *);
     }
 }
 
@@ -95,16 +100,23 @@ allocate_job(int body_size)
 {
     Job *j;
 
-    j = malloc(sizeof(Job) + body_size);
+    j = malloc(sizeof(Job));
     if (!j) {
         twarnx("OOM");
         return (Job *) 0;
     }
 
     memset(j, 0, sizeof(Job));
-    j->r.created_at = nanoseconds();
+    j->bodybuf = body_new(body_size, Membody);
+    if (!j->bodybuf) {
+        twarnx("OOM");
+        free(j);
+        return (Job *) 0;
+    }
+    mem_used[Memjob] += sizeof(Job);
+    j->r.created_at = walltime();
     j->r.body_size = body_size;
-    j->body = (char *)j + sizeof(Job);
+    j->body = j->bodybuf->data;
     job_list_reset(j);
     return j;
 }
@@ -134,6 +146,8 @@ make_job_with_id(uint32 pri, int64 delay, int64 ttr,
     store_job(j);
 
     TUBE_ASSIGN(j->tube, tube);
+    if (tube)
+        tube->mem += job_mem(j);
 
     return j;
 }
@@ -154,15 +168,113 @@ job_hash_free(Job *j)
     if (all_jobs_used < (all_jobs_cap >> 4)) rehash(0);
 }
 
+enum { Zcachesize = 16 };
+
+// zcache holds the bodies decompressed last, most recent first, so a
+// job that is peeked over and over is decompressed only once.
+static struct {
+    uint64 id;
+    Body   *b;
+} zcache[Zcachesize];
+
+// zcache_touch moves entry i of zcache to the front.
+static void
+zcache_touch(int i)
+{
+    uint64 id = zcache[i].id;
+    Body *b = zcache[i].b;
+
+    memmove(&zcache[1], &zcache[0], i * sizeof zcache[0]);
+    zcache[0].id = id;
+    zcache[0].b = b;
+}
+
+static void
+zcache_drop(uint64 id)
+{
+    int i;
+
+    for (i = 0; i < Zcachesize && zcache[i].b; i++) {
+        if (zcache[i].id == id) {
+            body_unref(zcache[i].b);
+            memmove(&zcache[i], &zcache[i+1],
+                    (Zcachesize - 1 - i) * sizeof zcache[0]);
+            zcache[Zcachesize-1].b = NULL;
+            return;
+        }
+    }
+}
+
 void
 job_free(Job *j)
 {
-    if (j) {
-        TUBE_ASSIGN(j->tube, NULL);
-        if (j->r.state != Copy) job_hash_free(j);
-    }
+    if (!j)
+        return;
 
+    if (j->tube)
+        j->tube->mem -= job_mem(j);
+    TUBE_ASSIGN(j->tube, NULL);
+    if (j->r.id) job_hash_free(j); /* bare buffers have no id */
+    if (j->r.zsize) {
+        zstat.njob--;
+        zstat.nbyte -= j->r.zsize;
+        zstat.nraw -= j->r.body_size;
+        zcache_drop(j->r.id);
+    }
+    if (j->dkey && !j->dkey->tube)
+        dedupfree(j->dkey); // it was never added
+    spilldrop(j);
+    body_unref(j->bodybuf);
     free(j);
+    mem_used[Memjob] -= sizeof(Job);
+}
+
+// body_new returns a Body with room for size bytes and one reference,
+// counted in memory category mem, or NULL if out of memory.
+Body *
+body_new(int size, int mem)
+{
+    Body *b = malloc(sizeof(Body) + size);
+
+    if (!b)
+        return NULL;
+    b->refs = 1;
+    b->size = size;
+    b->cap = size;
+    b->mem = mem;
+    mem_used[mem] += sizeof(Body) + size;
+    return b;
+}
+
+// body_trim gives back the room in b beyond size bytes, and returns
+// b, which may have moved. The caller must hold the only reference.
+static Body *
+body_trim(Body *b, int size)
+{
+    Body *t = realloc(b, sizeof(Body) + size);
+
+    if (!t)
+        return b;
+    mem_used[t->mem] -= t->cap - size;
+    t->size = t->cap = size;
+    return t;
+}
+
+Body *
+body_ref(Body *b)
+{
+    b->refs++;
+    return b;
+}
+
+// body_unref drops a reference to b, freeing it with the last one.
+void
+body_unref(Body *b)
+{
+    if (b && --b->refs == 0) {
+        mem_used[b->mem] -= sizeof(Body) + b->cap;
+        free(b);
+    }
 }
 
 void
@@ -191,32 +303,6 @@ job_delay_less(void *ja, void *jb)
     return a->r.id < b->r.id;
 }
 
-Job *
-job_copy(Job *j)
-{
-    if (!j)
-        return NULL;
-
-    Job *n = malloc(sizeof(Job) + j->r.body_size);
-    if (!n) {
-        twarnx("OOM");
-        return (Job *) 0;
-    }
-
-    memcpy(n, j, sizeof(Job) + j->r.body_size);
-    job_list_reset(n);
-
-    n->file = NULL; /* copies do not have refcnt on the wal */
-
-    n->tube = 0; /* Don't use memcpy for the tube, which we must refcount. */
-    TUBE_ASSIGN(n->tube, j->tube);
-
-    /* Mark this job as a copy so it can be appropriately freed later on */
-    n->r.state = Copy;
-
-    return n;
-}
-
 const char *
 job_state(Job *j)
 {
@@ -273,3 +359,85 @@ get_all_jobs_used()
 {
     return all_jobs_used;
 }
+
+// job_compress replaces the body of j with its compressed form if
+// compression is on (-Z), the body has at least zstat.min bytes, and
+// it shrinks by an eighth or more. Otherwise it leaves j as it is.
+void
+job_compress(Job *j)
+{
+    int n = j->r.body_size, z;
+    Body *b;
+
+    if (!zstat.min || n < zstat.min || j->r.zsize || !j->bodybuf)
+        return;
+
+    b = body_new(n - n/8, Membody);
+    if (!b)
+        return;
+    z = lzcompress(j->body, n, b->data, b->cap);
+    if (!z) {
+        body_unref(b);
+        return;
+    }
+
+    if (j->tube)
+        j->tube->mem -= job_mem(j);
+    body_unref(j->bodybuf);
+    j->bodybuf = body_trim(b, z);
+    j->body = j->bodybuf->data;
+    j->r.zsize = z;
+    if (j->tube)
+        j->tube->mem += job_mem(j);
+    zstat.njob++;
+    zstat.nbyte += z;
+    zstat.nraw += n;
+}
+
+// job_body returns a new reference to a Body holding the body of j
+// as it was put, or NULL on error. A spilled body is read back, and
+// a compressed one decompressed, to make it.
+Body *
+job_body(Job *j)
+{
+    Body *b, *z;
+    int i;
+
+    if (!j->r.zsize) {
+        if (j->spill)
+            return spillread(j);
+        return body_ref(j->bodybuf);
+    }
+
+    for (i = 0; i < Zcachesize && zcache[i].b; i++) {
+        if (zcache[i].id == j->r.id) {
+            zstat.hits++;
+            zcache_touch(i);
+            return body_ref(zcache[0].b);
+        }
+    }
+
+    zstat.misses++;
+    z = j->spill ? spillread(j) : body_ref(j->bodybuf);
+    if (!z)
+        return NULL;
+    b = body_new(j->r.body_size, Membody);
+    if (!b) {
+        twarnx("OOM");
+        body_unref(z);
+        return NULL;
+    }
+    i = lzdecompress(z->data, j->r.zsize, b->data, b->cap);
+    body_unref(z);
+    if (i != j->r.body_size) {
+        twarnx("job %"PRIu64" has a bad compressed body", j->r.id);
+        body_unref(b);
+        return NULL;
+    }
+
+    body_unref(zcache[Zcachesize-1].b);
+    zcache[Zcachesize-1].id = j->r.id;
+    zcache[Zcachesize-1].b = body_ref(b);
+    zcache_touch(Zcachesize-1);
+    return b;
+}
@@ -0,0 +1,173 @@
+#include "dat.h"
+#include <stdint.h>
+#include <string.h>
+
+// A small, fast LZ77 codec for job bodies, in the manner of LZ4.
+//
+// Compressed data is a sequence of runs. Each run starts with a token
+// byte: its high four bits are a count of literal bytes and its low
+// four bits a match length less Minmatch. A count of 15 is followed by
+// more bytes of it, each added in, ending with one that is not 255.
+// Then come the literal bytes, then, unless it is the last run, a
+// two-byte little-endian offset back into the output to copy the match
+// from, and the rest of the match length. The last run has literals
+// only; the data ends right after them.
+
+enum {
+    Hbits = 12,
+    Minmatch = 4,
+    Maxoff = 65535,
+};
+
+static uint32
+rd32(const byte *p)
+{
+    uint32 v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint
+hash(uint32 v)
+{
+    return (v * 2654435761u) >> (32 - Hbits);
+}
+
+static byte *
+putlen(byte *op, int n)
+{
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+// emit writes a run of nlit literals from lit followed by a match of
+// mlen bytes at off, or no match if off is 0. It returns the new end
+// of the output, or NULL if the run would not fit before oend.
+static byte *
+emit(byte *op, byte *oend, const byte *lit, int nlit, int off, int mlen)
+{
+    int ml = off ? mlen - Minmatch : 0;
+    int64 need = 1 + nlit + nlit/255 + 1 + (off ? 2 + ml/255 + 1 : 0);
+
+    if (oend - op < need)
+        return NULL;
+    *op++ = (min(nlit, 15) << 4) | min(ml, 15);
+    if (nlit >= 15)
+        op = putlen(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (off) {
+        *op++ = off;
+        *op++ = off >> 8;
+        if (ml >= 15)
+            op = putlen(op, ml - 15);
+    }
+    return op;
+}
+
+// Lzcompress compresses the n bytes at src into dst, which has room
+// for cap bytes. It returns the compressed size, or 0 if it would
+// not fit in cap.
+int
+lzcompress(const void *src, int n, void *dst, int cap)
+{
+    static int ht[1 << Hbits]; // position+1 of the last 4 bytes with a hash
+    const byte *in = src, *ip = in, *anchor = in, *end = in + n;
+    byte *op = dst, *oend = op + cap;
+    int ref, mlen;
+
+    memset(ht, 0, sizeof ht);
+    while (end - ip >= Minmatch) {
+        uint32 v = rd32(ip);
+        uint h = hash(v);
+
+        ref = ht[h] - 1;
+        ht[h] = ip - in + 1;
+        if (ref < 0 || ip - in - ref > Maxoff || rd32(in + ref) != v) {
+            ip++;
+            continue;
+        }
+
+        mlen = Minmatch;
+        while (ip + mlen < end && ip[mlen] == in[ref + mlen])
+            mlen++;
+        op = emit(op, oend, anchor, ip - anchor, ip - in - ref, mlen);
+        if (!op)
+            return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+
+    op = emit(op, oend, anchor, end - anchor, 0, 0);
+    if (!op)
+        return 0;
+    return op - (byte *)dst;
+}
+
+// getlen adds the extra bytes of a count to *n.
+// It returns 0 if they run past iend or the count past max.
+static int
+getlen(const byte **ip, const byte *iend, int *n, int max)
+{
+    byte b;
+
+    do {
+        if (*ip >= iend)
+            return 0;
+        b = *(*ip)++;
+        *n += b;
+        if (*n > max)
+            return 0;
+    } while (b == 255);
+    return 1;
+}
+
+// Lzdecompress decompresses the n bytes at src into dst, which has
+// room for cap bytes. It returns the decompressed size, or -1 if
+// src is not valid compressed data or does not fit in cap.
+int
+lzdecompress(const void *src, int n, void *dst, int cap)
+{
+    const byte *ip = src, *iend = ip + n;
+    byte *out = dst, *op = out, *oend = out + cap;
+    int nlit, mlen, off;
+
+    while (ip < iend) {
+        byte tok = *ip++;
+
+        nlit = tok >> 4;
+        if (nlit == 15 && !getlen(&ip, iend, &nlit, cap))
+            return -1;
+        if (nlit > iend - ip || nlit > oend - op)
+            return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend)
+            break; // the last run
+
+        if (iend - ip < 2)
+            return -1;
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        mlen = tok & 15;
+        if (mlen == 15 && !getlen(&ip, iend, &mlen, cap))
+            return -1;
+        mlen += Minmatch;
+        if (off == 0 || off > op - out || mlen > oend - op)
+            return -1;
+
+        if (off >= mlen) {
+            memcpy(op, op - off, mlen);
+            op += mlen;
+        } else {
+            // byte by byte, as the match overlaps what it writes
+            for (; mlen; mlen--, op++)
+                *op = op[-off];
+        }
+    }
+    return op - out;
+}
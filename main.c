@@ -108,6 +108,10 @@ main(int argc, char **argv)
         su(srv.user);
     set_sig_handlers();
 
+    if (spill.dir && !spillinit()) {
+        twarnx("failed to use spill dir %s", spill.dir);
+        exit(10);
+    }
     srv_acquire_wal(&srv);
     srvserve(&srv);
     exit(0);
@@ -259,3 +259,73 @@ make_server_socket(char *host, char *port)
         return make_inet_socket(host, port);
     }
 }
+
+// dial_server connects to a server listening on host and port, given
+// as to make_server_socket, so "unix:PATH" names a UNIX socket. It
+// returns a non-blocking socket, or -1 on error.
+int
+dial_server(char *host, char *port)
+{
+    int fd = -1, flags = 1, r;
+    struct addrinfo *airoot, *ai, hints;
+    struct sockaddr_un addr;
+
+    if (host && !strncmp(host, "unix:", 5)) {
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        if (strlen(host + 5) >= sizeof addr.sun_path) {
+            twarnx("socket path %s is too long", host + 5);
+            return -1;
+        }
+        strcpy(addr.sun_path, host + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+            twarn("socket()");
+            return -1;
+        }
+        r = connect(fd, (struct sockaddr *) &addr, sizeof addr);
+        if (r == -1) {
+            twarn("connect(%s)", host + 5);
+            close(fd);
+            return -1;
+        }
+    } else {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        r = getaddrinfo(host, port, &hints, &airoot);
+        if (r != 0) {
+            twarnx("getaddrinfo(): %s", gai_strerror(r));
+            return -1;
+        }
+        for (ai = airoot; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd == -1) {
+                twarn("socket()");
+                continue;
+            }
+            r = connect(fd, ai->ai_addr, ai->ai_addrlen);
+            if (r == -1) {
+                close(fd);
+                fd = -1;
+                continue;
+            }
+            r = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof flags);
+            if (r == -1) {
+                twarn("setting TCP_NODELAY on fd %d", fd);
+            }
+            break;
+        }
+        freeaddrinfo(airoot);
+        if (fd == -1) {
+            twarnx("connect(%s:%s) failed", host, port);
+            return -1;
+        }
+    }
+
+    if (set_nonblocking(fd) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
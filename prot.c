@@ -16,6 +16,9 @@
 #include <stdarg.h>
 #include <signal.h>
 #include <limits.h>
+#include <fnmatch.h>
+#include <netdb.h>
+#include <netinet/in.h>
 
 /* job body cannot be greater than this many bytes long */
 size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
@@ -26,6 +29,7 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
     "0123456789-+/;.$_()"
 
 #define CMD_PUT "put "
+#define CMD_PUT_BATCH "put-batch "
 #define CMD_PEEKJOB "peek "
 #define CMD_PEEK_READY "peek-ready"
 #define CMD_PEEK_DELAYED "peek-delayed"
@@ -33,9 +37,17 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define CMD_RESERVE "reserve"
 #define CMD_RESERVE_TIMEOUT "reserve-with-timeout "
 #define CMD_RESERVE_JOB "reserve-job "
+#define CMD_RESERVE_BATCH "reserve-batch "
+#define CMD_RESERVE_STREAM "reserve-stream "
+#define CMD_BINARY "binary "
 #define CMD_DELETE "delete "
+#define CMD_DELETE_MANY "delete-many "
+#define CMD_DELETE_RESERVE "delete-reserve "
 #define CMD_RELEASE "release "
+#define CMD_RELEASE_MANY "release-many "
+#define CMD_RELEASE_RESERVE "release-reserve "
 #define CMD_BURY "bury "
+#define CMD_BURY_MANY "bury-many "
 #define CMD_KICK "kick "
 #define CMD_KICKJOB "kick-job "
 #define CMD_TOUCH "touch "
@@ -47,12 +59,19 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define CMD_LIST_TUBES "list-tubes"
 #define CMD_LIST_TUBE_USED "list-tube-used"
 #define CMD_LIST_TUBES_WATCHED "list-tubes-watched"
+#define CMD_LIST_JOBS "list-jobs "
 #define CMD_STATS_TUBE "stats-tube "
+#define CMD_STATS_TUBES "stats-tubes"
+#define CMD_STATS_LATENCY "stats-latency"
+#define CMD_STATS_CONN "stats-conn"
+#define CMD_LIST_CONNS "list-conns"
 #define CMD_QUIT "quit"
 #define CMD_PAUSE_TUBE "pause-tube"
+#define CMD_FLUSH_TUBE "flush-tube "
 
 #define CONSTSTRLEN(m) (sizeof(m) - 1)
 
+#define CMD_PUT_BATCH_LEN CONSTSTRLEN(CMD_PUT_BATCH)
 #define CMD_PEEK_READY_LEN CONSTSTRLEN(CMD_PEEK_READY)
 #define CMD_PEEK_DELAYED_LEN CONSTSTRLEN(CMD_PEEK_DELAYED)
 #define CMD_PEEK_BURIED_LEN CONSTSTRLEN(CMD_PEEK_BURIED)
@@ -60,9 +79,17 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define CMD_RESERVE_LEN CONSTSTRLEN(CMD_RESERVE)
 #define CMD_RESERVE_TIMEOUT_LEN CONSTSTRLEN(CMD_RESERVE_TIMEOUT)
 #define CMD_RESERVE_JOB_LEN CONSTSTRLEN(CMD_RESERVE_JOB)
+#define CMD_RESERVE_BATCH_LEN CONSTSTRLEN(CMD_RESERVE_BATCH)
+#define CMD_RESERVE_STREAM_LEN CONSTSTRLEN(CMD_RESERVE_STREAM)
+#define CMD_BINARY_LEN CONSTSTRLEN(CMD_BINARY)
 #define CMD_DELETE_LEN CONSTSTRLEN(CMD_DELETE)
+#define CMD_DELETE_MANY_LEN CONSTSTRLEN(CMD_DELETE_MANY)
+#define CMD_DELETE_RESERVE_LEN CONSTSTRLEN(CMD_DELETE_RESERVE)
 #define CMD_RELEASE_LEN CONSTSTRLEN(CMD_RELEASE)
+#define CMD_RELEASE_MANY_LEN CONSTSTRLEN(CMD_RELEASE_MANY)
+#define CMD_RELEASE_RESERVE_LEN CONSTSTRLEN(CMD_RELEASE_RESERVE)
 #define CMD_BURY_LEN CONSTSTRLEN(CMD_BURY)
+#define CMD_BURY_MANY_LEN CONSTSTRLEN(CMD_BURY_MANY)
 #define CMD_KICK_LEN CONSTSTRLEN(CMD_KICK)
 #define CMD_KICKJOB_LEN CONSTSTRLEN(CMD_KICKJOB)
 #define CMD_TOUCH_LEN CONSTSTRLEN(CMD_TOUCH)
@@ -74,12 +101,22 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define CMD_LIST_TUBES_LEN CONSTSTRLEN(CMD_LIST_TUBES)
 #define CMD_LIST_TUBE_USED_LEN CONSTSTRLEN(CMD_LIST_TUBE_USED)
 #define CMD_LIST_TUBES_WATCHED_LEN CONSTSTRLEN(CMD_LIST_TUBES_WATCHED)
+#define CMD_LIST_JOBS_LEN CONSTSTRLEN(CMD_LIST_JOBS)
 #define CMD_STATS_TUBE_LEN CONSTSTRLEN(CMD_STATS_TUBE)
+#define CMD_STATS_TUBES_LEN CONSTSTRLEN(CMD_STATS_TUBES)
+#define CMD_STATS_LATENCY_LEN CONSTSTRLEN(CMD_STATS_LATENCY)
+#define CMD_STATS_CONN_LEN CONSTSTRLEN(CMD_STATS_CONN)
+#define CMD_LIST_CONNS_LEN CONSTSTRLEN(CMD_LIST_CONNS)
 #define CMD_PAUSE_TUBE_LEN CONSTSTRLEN(CMD_PAUSE_TUBE)
+#define CMD_FLUSH_TUBE_LEN CONSTSTRLEN(CMD_FLUSH_TUBE)
 
 #define MSG_FOUND "FOUND"
 #define MSG_NOTFOUND "NOT_FOUND\r\n"
 #define MSG_RESERVED "RESERVED"
+#define MSG_RESERVED_BATCH_FMT "RESERVED_BATCH %u\r\n"
+#define MSG_STREAMING_FMT "STREAMING %u\r\n"
+#define MSG_TUBES "TUBES"
+#define MSG_CONNS "CONNS\r\n"
 #define MSG_DEADLINE_SOON "DEADLINE_SOON\r\n"
 #define MSG_TIMED_OUT "TIMED_OUT\r\n"
 #define MSG_DELETED "DELETED\r\n"
@@ -87,11 +124,13 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define MSG_BURIED "BURIED\r\n"
 #define MSG_KICKED "KICKED\r\n"
 #define MSG_TOUCHED "TOUCHED\r\n"
-#define MSG_BURIED_FMT "BURIED %"PRIu64"\r\n"
-#define MSG_INSERTED_FMT "INSERTED %"PRIu64"\r\n"
+#define MSG_INSERTED "INSERTED"
+#define MSG_BINARY_FMT "BINARY %u\r\n"
+#define MSG_INSERTED_BATCH_FMT "INSERTED_BATCH %"PRIu64" %"PRIu64"\r\n"
 #define MSG_NOT_IGNORED "NOT_IGNORED\r\n"
 
 #define MSG_OUT_OF_MEMORY "OUT_OF_MEMORY\r\n"
+#define MSG_OUT_OF_CAPACITY "OUT_OF_CAPACITY\r\n"
 #define MSG_INTERNAL_ERROR "INTERNAL_ERROR\r\n"
 #define MSG_DRAINING "DRAINING\r\n"
 #define MSG_BAD_FORMAT "BAD_FORMAT\r\n"
@@ -99,16 +138,6 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define MSG_EXPECTED_CRLF "EXPECTED_CRLF\r\n"
 #define MSG_JOB_TOO_BIG "JOB_TOO_BIG\r\n"
 
-// Connection can be in one of these states:
-#define STATE_WANT_COMMAND  0  // conn expects a command from the client
-#define STATE_WANT_DATA     1  // conn expects a job data
-#define STATE_SEND_JOB      2  // conn sends job to the client
-#define STATE_SEND_WORD     3  // conn sends a line reply
-#define STATE_WAIT          4  // client awaits for the job reservation
-#define STATE_BITBUCKET     5  // conn discards content
-#define STATE_CLOSE         6  // conn should be closed
-#define STATE_WANT_ENDLINE  7  // skip until the end of a line
-
 #define OP_UNKNOWN 0
 #define OP_PUT 1
 #define OP_PEEKJOB 2
@@ -135,102 +164,54 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define OP_PAUSE_TUBE 23
 #define OP_KICKJOB 24
 #define OP_RESERVE_JOB 25
-#define TOTAL_OPS 26
-
-#define STATS_FMT "---\n" \
-    "current-jobs-urgent: %" PRIu64 "\n" \
-    "current-jobs-ready: %" PRIu64 "\n" \
-    "current-jobs-reserved: %" PRIu64 "\n" \
-    "current-jobs-delayed: %u\n" \
-    "current-jobs-buried: %" PRIu64 "\n" \
-    "cmd-put: %" PRIu64 "\n" \
-    "cmd-peek: %" PRIu64 "\n" \
-    "cmd-peek-ready: %" PRIu64 "\n" \
-    "cmd-peek-delayed: %" PRIu64 "\n" \
-    "cmd-peek-buried: %" PRIu64 "\n" \
-    "cmd-reserve: %" PRIu64 "\n" \
-    "cmd-reserve-with-timeout: %" PRIu64 "\n" \
-    "cmd-delete: %" PRIu64 "\n" \
-    "cmd-release: %" PRIu64 "\n" \
-    "cmd-use: %" PRIu64 "\n" \
-    "cmd-watch: %" PRIu64 "\n" \
-    "cmd-ignore: %" PRIu64 "\n" \
-    "cmd-bury: %" PRIu64 "\n" \
-    "cmd-kick: %" PRIu64 "\n" \
-    "cmd-touch: %" PRIu64 "\n" \
-    "cmd-stats: %" PRIu64 "\n" \
-    "cmd-stats-job: %" PRIu64 "\n" \
-    "cmd-stats-tube: %" PRIu64 "\n" \
-    "cmd-list-tubes: %" PRIu64 "\n" \
-    "cmd-list-tube-used: %" PRIu64 "\n" \
-    "cmd-list-tubes-watched: %" PRIu64 "\n" \
-    "cmd-pause-tube: %" PRIu64 "\n" \
-    "job-timeouts: %" PRIu64 "\n" \
-    "total-jobs: %" PRIu64 "\n" \
-    "max-job-size: %zu\n" \
-    "current-tubes: %zu\n" \
-    "current-connections: %u\n" \
-    "current-producers: %u\n" \
-    "current-workers: %u\n" \
-    "current-waiting: %" PRIu64 "\n" \
-    "total-connections: %u\n" \
-    "pid: %ld\n" \
-    "version: \"%s\"\n" \
-    "rusage-utime: %d.%06d\n" \
-    "rusage-stime: %d.%06d\n" \
-    "uptime: %u\n" \
-    "binlog-oldest-index: %d\n" \
-    "binlog-current-index: %d\n" \
-    "binlog-records-migrated: %" PRId64 "\n" \
-    "binlog-records-written: %" PRId64 "\n" \
-    "binlog-max-size: %d\n" \
-    "draining: %s\n" \
-    "id: %s\n" \
-    "hostname: \"%s\"\n" \
-    "os: \"%s\"\n" \
-    "platform: \"%s\"\n" \
-    "\r\n"
-
-#define STATS_TUBE_FMT "---\n" \
-    "name: \"%s\"\n" \
-    "current-jobs-urgent: %" PRIu64 "\n" \
-    "current-jobs-ready: %zu\n" \
-    "current-jobs-reserved: %" PRIu64 "\n" \
-    "current-jobs-delayed: %zu\n" \
-    "current-jobs-buried: %" PRIu64 "\n" \
-    "total-jobs: %" PRIu64 "\n" \
-    "current-using: %u\n" \
-    "current-watching: %u\n" \
-    "current-waiting: %" PRIu64 "\n" \
-    "cmd-delete: %" PRIu64 "\n" \
-    "cmd-pause-tube: %" PRIu64 "\n" \
-    "pause: %" PRIu64 "\n" \
-    "pause-time-left: %" PRId64 "\n" \
-    "\r\n"
-
-#define STATS_JOB_FMT "---\n" \
-    "id: %" PRIu64 "\n" \
-    "tube: \"%s\"\n" \
-    "state: %s\n" \
-    "pri: %u\n" \
-    "age: %" PRId64 "\n" \
-    "delay: %" PRId64 "\n" \
-    "ttr: %" PRId64 "\n" \
-    "time-left: %" PRId64 "\n" \
-    "file: %d\n" \
-    "reserves: %u\n" \
-    "timeouts: %u\n" \
-    "releases: %u\n" \
-    "buries: %u\n" \
-    "kicks: %u\n" \
-    "\r\n"
+#define OP_PUT_BATCH 26
+#define OP_RESERVE_BATCH 27
+#define OP_DELETE_MANY 28
+#define OP_RELEASE_MANY 29
+#define OP_BURY_MANY 30
+#define OP_DELETE_RESERVE 31
+#define OP_RELEASE_RESERVE 32
+#define OP_RESERVE_STREAM 33
+#define OP_BINARY 34
+#define OP_LIST_JOBS 35
+#define OP_FLUSH_TUBE 36
+#define OP_STATS_TUBES 37
+#define OP_STATS_LATENCY 38
+#define OP_LIST_CONNS 39
+#define OP_STATS_CONN 40
+#define TOTAL_OPS 41
+
+// The stats, stats-tube and stats-job documents are bounded: a few
+// dozen numeric fields plus strings of at most a tube name or a uname
+// field each. They are written in one pass into a buffer of this size
+// that each connection keeps for reuse; see reply_stats. The biggest
+// is stats-latency, with a line per command; its bound is checked
+// below, at fmt_stats_latency.
+#define STATS_BUF_SIZE 16384
 
 // The size of the throw-away (BITBUCKET) buffer. Arbitrary.
 #define BUCKET_BUF_SIZE 1024
 
+// In tiered mode, bodies smaller than SPILL_MIN bytes stay in memory,
+// as do those of jobs delayed for less than SPILL_DELAY nsec or within
+// SPILL_DEPTH of the top of their ready heap. See spill_cold.
+#define SPILL_MIN 256
+#define SPILL_DELAY ((int64)60 * 1000000000) /* 1 minute */
+#define SPILL_DEPTH 1024
+
 static uint64 ready_ct = 0;
+static uint64 delayed_ct = 0;
+
+// No delayed job or tube pause is due before tubes_tick_at, so prottick
+// need not look at every tube until then. Anything that sets an earlier
+// deadline lowers it.
+static int64 tubes_tick_at = 0;
 static uint64 timeout_ct = 0;
 static uint64 op_ct[TOTAL_OPS] = {0};
+static Hist op_lat[TOTAL_OPS];
+
+// cur_op is the op of the command being dispatched, for op_lat.
+static byte cur_op;
 static struct stats global_stat = {0};
 
 static Tube *default_tube;
@@ -277,10 +258,31 @@ static const char * op_names[] = {
     CMD_PAUSE_TUBE,
     CMD_KICKJOB,
     CMD_RESERVE_JOB,
+    CMD_PUT_BATCH,
+    CMD_RESERVE_BATCH,
+    CMD_DELETE_MANY,
+    CMD_RELEASE_MANY,
+    CMD_BURY_MANY,
+    CMD_DELETE_RESERVE,
+    CMD_RELEASE_RESERVE,
+    CMD_RESERVE_STREAM,
+    CMD_BINARY,
+    CMD_LIST_JOBS,
+    CMD_FLUSH_TUBE,
+    CMD_STATS_TUBES,
+    CMD_STATS_LATENCY,
+    CMD_LIST_CONNS,
+    CMD_STATS_CONN,
 };
 
 static Job *remove_ready_job(Job *j);
 static Job *remove_buried_job(Job *j);
+static Job *remove_delayed_job(Job *j);
+static void reserve_batch(Conn *c, Job *j, uint n);
+static void apply_id_list(Conn *c);
+static void conn_stream(Conn *c);
+static void start_bulk(Conn *c, byte op, Tube *t, int state, uint n);
+static void unreserve_job(Conn *c, Job *j);
 
 // epollq_add schedules connection c in the s->conns heap, adds c
 // to the epollq list to change expected operation in event notifications.
@@ -334,7 +336,7 @@ epollq_apply()
 }
 
 #define reply_msg(c, m) \
-    reply((c), (m), CONSTSTRLEN(m), STATE_SEND_WORD)
+    reply_word((c), (m), CONSTSTRLEN(m))
 
 #define reply_serr(c, e) \
     (twarnx("server error: %s", (e)), reply_msg((c), (e)))
@@ -351,23 +353,285 @@ reply(Conn *c, char *line, int len, int state)
     c->reply_len = len;
     c->reply_sent = 0;
     c->state = state;
-    if (verbose >= 2) {
+    c->reply_ct++;
+    if (verbose >= 2 && !c->binary) {
         printf(">%d reply %.*s\n", c->sock.fd, len-2, line);
     }
 }
 
+// Binary protocol replies are a BIN_REPLY_SIZE header, little-endian:
+//
+//     0   u8   status, the index of the reply word in bin_words
+//     4   u32  the size of the data that follows
+//     8   u64  the job id or count that the text reply would carry
+//
+// The data is a job body or a stats document, without the "\r\n".
+#define BIN_REPLY_SIZE 16
+
+static const char *const bin_words[] = {
+    NULL,
+    "INSERTED",
+    "BURIED",
+    "RESERVED",
+    "DELETED",
+    "RELEASED",
+    "TOUCHED",
+    "USING",
+    "WATCHING",
+    "FOUND",
+    "KICKED",
+    "OK",
+    "NOT_FOUND",
+    "DEADLINE_SOON",
+    "TIMED_OUT",
+    "NOT_IGNORED",
+    "JOB_TOO_BIG",
+    "DRAINING",
+    "OUT_OF_MEMORY",
+    "INTERNAL_ERROR",
+    "BAD_FORMAT",
+    "UNKNOWN_COMMAND",
+    "OUT_OF_CAPACITY",
+};
+
+static void
+put_le32(byte *p, uint32 v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void
+put_le64(byte *p, uint64 v)
+{
+    put_le32(p, (uint32)v);
+    put_le32(p + 4, (uint32)(v >> 32));
+}
+
+static uint32
+get_le32(const byte *p)
+{
+    return p[0] | (uint32)p[1] << 8 | (uint32)p[2] << 16 | (uint32)p[3] << 24;
+}
+
+static uint64
+get_le64(const byte *p)
+{
+    return get_le32(p) | (uint64)get_le32(p + 4) << 32;
+}
+
+// bin_status returns the binary status code for the reply word at the
+// start of s, which may be a whole text reply.
+static byte
+bin_status(const char *s)
+{
+    size_t i, n = strcspn(s, " \r");
+
+    for (i = 1; i < sizeof(bin_words) / sizeof(bin_words[0]); i++) {
+        if (strlen(bin_words[i]) == n && memcmp(s, bin_words[i], n) == 0)
+            return i;
+    }
+    return bin_status(MSG_INTERNAL_ERROR);
+}
+
+// reply_frame replies to a binary conn with the reply word and number n.
+// In STATE_SEND_JOB the header also carries the size of c->out_body.
+static void
+reply_frame(Conn *c, int state, const char *word, uint64 n)
+{
+    byte *p = (byte *)c->reply_buf;
+    uint32 bytes = 0;
+
+    if (state == STATE_SEND_JOB)
+        bytes = c->out_body->size - 2;
+    memset(p, 0, BIN_REPLY_SIZE);
+    p[0] = bin_status(word);
+    put_le32(p + 4, bytes);
+    put_le64(p + 8, n);
+    if (verbose >= 2) {
+        printf(">%d reply %.*s %"PRIu64" %u\n", c->sock.fd,
+               (int)strcspn(word, " \r"), word, n, bytes);
+    }
+    reply(c, c->reply_buf, BIN_REPLY_SIZE, state);
+}
+
+// reply_word replies with the constant line m, or its binary equivalent.
+static void
+reply_word(Conn *c, char *m, int len)
+{
+    if (c->binary) {
+        reply_frame(c, STATE_SEND_WORD, m, 0);
+        return;
+    }
+    reply(c, m, len, STATE_SEND_WORD);
+}
+
+// fmt_u64 writes n in decimal to buf and returns the number of
+// bytes written, without a terminating NUL.
+static int
+fmt_u64(char *buf, uint64 n)
+{
+    char tmp[20];
+    int i = 0, k;
+
+    do {
+        tmp[i++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    for (k = 0; k < i; k++)
+        buf[k] = tmp[i - k - 1];
+    return i;
+}
+
+// The put_* functions append one "key: value\n" line of a stats
+// document at p and return the position after it. key includes the
+// ": " and has length n; the macros below pass both from a literal.
+static char *
+put_u64(char *p, const char *key, size_t n, uint64 v)
+{
+    memcpy(p, key, n);
+    p += n;
+    p += fmt_u64(p, v);
+    *p++ = '\n';
+    return p;
+}
+
+static char *
+put_i64(char *p, const char *key, size_t n, int64 v)
+{
+    memcpy(p, key, n);
+    p += n;
+    if (v < 0) {
+        *p++ = '-';
+        p += fmt_u64(p, -(uint64)v);
+    } else {
+        p += fmt_u64(p, v);
+    }
+    *p++ = '\n';
+    return p;
+}
+
+// put_str appends s as is, or in double quotes if quote is set.
+static char *
+put_str(char *p, const char *key, size_t n, const char *s, int quote)
+{
+    size_t len = strlen(s);
+
+    memcpy(p, key, n);
+    p += n;
+    if (quote)
+        *p++ = '"';
+    memcpy(p, s, len);
+    p += len;
+    if (quote)
+        *p++ = '"';
+    *p++ = '\n';
+    return p;
+}
+
+// put_tv appends tv as seconds with six decimal places.
+static char *
+put_tv(char *p, const char *key, size_t n, struct timeval tv)
+{
+    char digits[20];
+    int i, k;
+
+    memcpy(p, key, n);
+    p += n;
+    p += fmt_u64(p, tv.tv_sec);
+    *p++ = '.';
+    k = fmt_u64(digits, tv.tv_usec);
+    for (i = k; i < 6; i++)
+        *p++ = '0';
+    memcpy(p, digits, k);
+    p += k;
+    *p++ = '\n';
+    return p;
+}
+
+// put_hist appends the count, percentiles and maximum of h,
+// in nanoseconds, as a YAML flow mapping.
+static char *
+put_hist(char *p, const char *key, size_t n, Hist *h)
+{
+    static const struct {
+        const char *key;
+        uint       permille;
+    } pcts[] = {
+        {", p50: ", 500},
+        {", p90: ", 900},
+        {", p99: ", 990},
+        {", p999: ", 999},
+    };
+    size_t i;
+
+    memcpy(p, key, n);
+    p += n;
+    memcpy(p, "{count: ", 8);
+    p += 8;
+    p += fmt_u64(p, h->n);
+    for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+        n = strlen(pcts[i].key);
+        memcpy(p, pcts[i].key, n);
+        p += n;
+        p += fmt_u64(p, hist_at(h, pcts[i].permille));
+    }
+    memcpy(p, ", max: ", 7);
+    p += 7;
+    p += fmt_u64(p, h->max);
+    *p++ = '}';
+    *p++ = '\n';
+    return p;
+}
+
+#define stat_u64(p, k, v) ((p) = put_u64((p), k ": ", CONSTSTRLEN(k ": "), (v)))
+#define stat_i64(p, k, v) ((p) = put_i64((p), k ": ", CONSTSTRLEN(k ": "), (v)))
+#define stat_str(p, k, v) ((p) = put_str((p), k ": ", CONSTSTRLEN(k ": "), (v), 0))
+#define stat_qstr(p, k, v) ((p) = put_str((p), k ": ", CONSTSTRLEN(k ": "), (v), 1))
+#define stat_tv(p, k, v) ((p) = put_tv((p), k ": ", CONSTSTRLEN(k ": "), (v)))
+#define stat_hist(p, k, h) ((p) = put_hist((p), k ": ", CONSTSTRLEN(k ": "), (h)))
+
+// reply_num replies with "<word> <n>\r\n", without going through printf.
+static void
+reply_num(Conn *c, int state, const char *word, uint64 n)
+{
+    char *p = c->reply_buf;
+    size_t len = strlen(word);
+
+    if (c->binary) {
+        reply_frame(c, state, word, n);
+        return;
+    }
+    memcpy(p, word, len);
+    p += len;
+    *p++ = ' ';
+    p += fmt_u64(p, n);
+    *p++ = '\r';
+    *p++ = '\n';
+    *p = '\0';
+    reply(c, c->reply_buf, p - c->reply_buf, state);
+}
+
 static void
 reply_line(Conn*, int, const char*, ...)
 __attribute__((format(printf, 3, 4)));
 
 // reply_line prints *fmt into c->reply_buffer and
 // calls reply() for the string and state.
+// A binary conn gets only the reply word of fmt.
 static void
 reply_line(Conn *c, int state, const char *fmt, ...)
 {
     int r;
     va_list ap;
 
+    if (c->binary) {
+        reply_frame(c, state, fmt, 0);
+        return;
+    }
+
     va_start(ap, fmt);
     r = vsnprintf(c->reply_buf, LINE_BUF_SIZE, fmt, ap);
     va_end(ap);
@@ -386,10 +650,31 @@ reply_line(Conn *c, int state, const char *fmt, ...)
 static void
 reply_job(Conn *c, Job *j, const char *msg)
 {
-    c->out_job = j;
-    c->out_job_sent = 0;
-    reply_line(c, STATE_SEND_JOB, "%s %"PRIu64" %u\r\n",
-               msg, j->r.id, j->r.body_size - 2);
+    char *p = c->reply_buf;
+    size_t len = strlen(msg);
+
+    c->out_body = job_body(j);
+    if (!c->out_body) {
+        if (j->reserver == c && strcmp(msg, MSG_RESERVED) == 0)
+            unreserve_job(c, j);
+        reply_serr(c, MSG_INTERNAL_ERROR);
+        return;
+    }
+    c->out_body_sent = 0;
+    if (c->binary) {
+        reply_frame(c, STATE_SEND_JOB, msg, j->r.id);
+        return;
+    }
+    memcpy(p, msg, len);
+    p += len;
+    *p++ = ' ';
+    p += fmt_u64(p, j->r.id);
+    *p++ = ' ';
+    p += fmt_u64(p, j->r.body_size - 2);
+    *p++ = '\r';
+    *p++ = '\n';
+    *p = '\0';
+    reply(c, c->reply_buf, p - c->reply_buf, STATE_SEND_JOB);
 }
 
 // remove_waiting_conn unsets CONN_TYPE_WAITING for the connection,
@@ -401,27 +686,32 @@ remove_waiting_conn(Conn *c)
     if (!conn_waiting(c))
         return;
 
+    // only a conn blocked in a reserve was counted; see enqueue_waiting_conn
+    int blocked = conn_blocked(c);
     c->type &= ~CONN_TYPE_WAITING;
-    global_stat.waiting_ct--;
+    global_stat.waiting_ct -= blocked;
     size_t i;
     for (i = 0; i < c->watch.len; i++) {
         Tube *t = c->watch.items[i];
-        t->stat.waiting_ct--;
+        t->stat.waiting_ct -= blocked;
         ms_remove(&t->waiting_conns, c);
     }
 }
 
 // enqueue_waiting_conn sets CONN_TYPE_WAITING for the connection,
 // adds it to the waiting_conns set of every tube it's watching.
+// The waiting_ct stats count it only if it is blocked in a reserve,
+// not if it is a streaming conn waiting for its next push.
 static void
 enqueue_waiting_conn(Conn *c)
 {
+    int blocked = c->state == STATE_WAIT;
     c->type |= CONN_TYPE_WAITING;
-    global_stat.waiting_ct++;
+    global_stat.waiting_ct += blocked;
     size_t i;
     for (i = 0; i < c->watch.len; i++) {
         Tube *t = c->watch.items[i];
-        t->stat.waiting_ct++;
+        t->stat.waiting_ct += blocked;
         ms_append(&t->waiting_conns, c);
     }
 }
@@ -458,7 +748,7 @@ static void
 process_queue()
 {
     Job *j = NULL;
-    int64 now = nanoseconds();
+    int64 now = curtime();
 
     while ((j = next_awaited_job(now))) {
         j = remove_ready_job(j);
@@ -475,10 +765,30 @@ process_queue()
 
         remove_waiting_conn(c);
         conn_reserve_job(c, j);
-        reply_job(c, j, MSG_RESERVED);
+        if (c->batch_n) {
+            reserve_batch(c, j, c->batch_n);
+        } else {
+            reply_job(c, j, MSG_RESERVED);
+        }
     }
 }
 
+// conn_stream puts a streaming connection that is idle and below its
+// window in the waiting set of every tube it watches, so process_queue
+// pushes it the next ready job as it would answer a reserve. The conn
+// leaves the waiting sets when it gets a job or sends a command, and
+// comes back here once it is idle again.
+static void
+conn_stream(Conn *c)
+{
+    if (!c->stream_window || c->state != STATE_WANT_COMMAND)
+        return;
+    if (conn_waiting(c) || c->reserved_n >= c->stream_window)
+        return;
+    enqueue_waiting_conn(c);
+    process_queue();
+}
+
 // soonest_delayed_job returns the delayed job
 // with the smallest deadline_at among all tubes.
 static Job *
@@ -499,33 +809,79 @@ soonest_delayed_job()
     return j;
 }
 
-// enqueue_job inserts job j in the tube, returns 1 on success, otherwise 0.
-// If update_store then it writes an entry to WAL.
-// On success it processes the queue.
-// BUG: If maintenance of WAL has failed, it is not reported as error.
+// insert_job puts job j in the ready or the delay heap of its tube.
+// Returns 1 on success, otherwise 0.
 static int
-enqueue_job(Server *s, Job *j, int64 delay, char update_store)
+insert_job(Job *j, int64 delay)
 {
     int r;
 
     j->reserver = NULL;
     if (delay) {
-        j->r.deadline_at = nanoseconds() + delay;
+        j->r.deadline_at = curtime() + delay;
+        tubes_tick_at = min(tubes_tick_at, j->r.deadline_at);
         r = heapinsert(&j->tube->delay, j);
         if (!r)
             return 0;
         j->r.state = Delayed;
+        delayed_ct++;
     } else {
         r = heapinsert(&j->tube->ready, j);
         if (!r)
             return 0;
         j->r.state = Ready;
+        j->since = curtime();
         ready_ct++;
         if (j->r.pri < URGENT_THRESHOLD) {
             global_stat.urgent_ct++;
             j->tube->stat.urgent_ct++;
         }
+        if (j->spill && j->heap_index < SPILL_DEPTH)
+            spillprefetch(j);
+    }
+
+    return 1;
+}
+
+// spill_cold moves the body of j to disk in tiered mode (-t) if it
+// will not be needed soon: if j is buried, delayed for longer than
+// SPILL_DELAY, or deep down the ready heap of a big tube. A job that
+// is still to be written to the wal in full keeps its body, as do
+// small jobs.
+static void
+spill_cold(Server *s, Job *j)
+{
+    if (!spill.dir || !j->bodybuf || job_stored_size(j) < SPILL_MIN)
+        return;
+    if (s->wal.use && !j->file && !j->tube->ephemeral)
+        return;
+
+    switch (j->r.state) {
+    case Ready:
+        if (j->heap_index < SPILL_DEPTH)
+            return;
+        break;
+    case Delayed:
+        if (j->r.deadline_at - curtime() < SPILL_DELAY)
+            return;
+        break;
+    case Buried:
+        break;
+    default:
+        return;
     }
+    spillout(j);
+}
+
+// enqueue_job inserts job j in the tube, returns 1 on success, otherwise 0.
+// If update_store then it writes an entry to WAL.
+// On success it processes the queue.
+// BUG: If maintenance of WAL has failed, it is not reported as error.
+static int
+enqueue_job(Server *s, Job *j, int64 delay, char update_store)
+{
+    if (!insert_job(j, delay))
+        return 0;
 
     if (update_store) {
         if (!walwrite(&s->wal, j)) {
@@ -537,20 +893,114 @@ enqueue_job(Server *s, Job *j, int64 delay, char update_store)
     // The call below makes this function do too much.
     // TODO: refactor this call outside so the call is explicit (not hidden)?
     process_queue();
+    spill_cold(s, j);
     return 1;
 }
 
+// Burymark is the number of bury sequence numbers per mark
+// in a tube's marks.
+enum { Burymark = 256 };
+
+// mark_buried numbers j, just buried in t, and marks it if it is the
+// first job in its block. If the marks cannot grow, they are turned
+// off until t has no buried jobs, and buried_after does without them.
+static void
+mark_buried(Tube *t, Job *j)
+{
+    uint64 b;
+    size_t cap;
+    Job **marks;
+
+    j->bury_seq = ++t->bury_seq;
+    if (t->marksoff)
+        return;
+    b = j->bury_seq / Burymark;
+    if (!t->nmark)
+        t->mark0 = b;
+    if (b - t->mark0 >= t->markcap) {
+        cap = t->markcap ? t->markcap * 2 : 16;
+        while (cap <= b - t->mark0)
+            cap *= 2;
+        marks = realloc(t->marks, cap * sizeof *marks);
+        if (!marks) {
+            twarnx("OOM");
+            t->marksoff = 1;
+            return;
+        }
+        mem_used[Memtube] += (cap - t->markcap) * sizeof *marks;
+        t->marks = marks;
+        t->markcap = cap;
+    }
+    while (t->nmark <= b - t->mark0)
+        t->marks[t->nmark++] = NULL;
+    if (!t->marks[b - t->mark0])
+        t->marks[b - t->mark0] = j;
+}
+
+// unmark_buried passes j's mark, if it has one, to the next job of
+// its block, and drops the empty blocks at the front of t's marks.
+// It must be called before j leaves the buried list.
+static void
+unmark_buried(Tube *t, Job *j)
+{
+    uint64 b = j->bury_seq / Burymark;
+    Job *n = j->next;
+    size_t i;
+
+    if (j->prev == &t->buried && n == &t->buried) {
+        // the last one
+        t->nmark = 0;
+        t->marksoff = 0;
+        return;
+    }
+    if (t->marksoff || b < t->mark0 || b - t->mark0 >= t->nmark)
+        return;
+    if (t->marks[b - t->mark0] == j) {
+        if (n == &t->buried || n->bury_seq / Burymark != b)
+            n = NULL;
+        t->marks[b - t->mark0] = n;
+    }
+    for (i = 0; i < t->nmark && !t->marks[i]; i++);
+    if (i) {
+        t->nmark -= i;
+        t->mark0 += i;
+        memmove(t->marks, t->marks + i, t->nmark * sizeof *t->marks);
+    }
+}
+
+// buried_after returns the first job buried in t after the one
+// numbered seq, whether or not that one is still buried, or &t->buried
+// if there is none. It looks at no more than a block of jobs, and one
+// mark per block of numbers in between.
+static Job *
+buried_after(Tube *t, uint64 seq)
+{
+    uint64 b = (seq + 1) / Burymark;
+    size_t i;
+    Job *j = t->buried.next;
+
+    if (!t->marksoff && t->nmark) {
+        i = b < t->mark0 ? 0 : b - t->mark0;
+        for (; i < t->nmark && !t->marks[i]; i++);
+        j = i < t->nmark ? t->marks[i] : &t->buried;
+    }
+    while (j != &t->buried && j->bury_seq <= seq)
+        j = j->next;
+    return j;
+}
+
 static int
 bury_job(Server *s, Job *j, char update_store)
 {
     if (update_store) {
-        int z = walresvupdate(&s->wal);
+        int z = walresvupdate(&s->wal, j);
         if (!z)
             return 0;
         j->walresv += z;
     }
 
     job_list_insert(&j->tube->buried, j);
+    mark_buried(j->tube, j);
     global_stat.buried_ct++;
     j->tube->stat.buried_ct++;
     j->r.state = Buried;
@@ -564,6 +1014,7 @@ bury_job(Server *s, Job *j, char update_store)
         walmaint(&s->wal);
     }
 
+    spill_cold(s, j);
     return 1;
 }
 
@@ -579,6 +1030,7 @@ enqueue_reserved_jobs(Conn *c)
         j->tube->stat.reserved_ct--;
         c->soonest_job = NULL;
     }
+    c->reserved_n = 0;
 }
 
 static int
@@ -587,7 +1039,7 @@ kick_buried_job(Server *s, Job *j)
     int r;
     int z;
 
-    z = walresvupdate(&s->wal);
+    z = walresvupdate(&s->wal, j);
     if (!z)
         return 0;
     j->walresv += z;
@@ -604,31 +1056,18 @@ kick_buried_job(Server *s, Job *j)
     return 0;
 }
 
-static uint
-get_delayed_job_ct()
-{
-    size_t i;
-    uint count = 0;
-
-    for (i = 0; i < tubes.len; i++) {
-        Tube *t = tubes.items[i];
-        count += t->delay.len;
-    }
-    return count;
-}
-
 static int
 kick_delayed_job(Server *s, Job *j)
 {
     int r;
     int z;
 
-    z = walresvupdate(&s->wal);
+    z = walresvupdate(&s->wal, j);
     if (!z)
         return 0;
     j->walresv += z;
 
-    heapremove(&j->tube->delay, j->heap_index);
+    remove_delayed_job(j);
 
     j->r.kick_ct++;
     r = enqueue_job(s, j, 0, 1);
@@ -652,34 +1091,96 @@ buried_job_p(Tube *t)
     return !job_list_is_empty(&t->buried);
 }
 
-/* return the number of jobs successfully kicked */
-static uint
-kick_buried_jobs(Server *s, Tube *t, uint n)
+// Kick and flush-tube work in batches of at most Bulkbatch jobs, and
+// give the event loop back every Bulkslice nanoseconds; see bulk_slice.
+enum { Bulkbatch = 256, Bulkslice = 1000000 };
+
+// kick_batch kicks up to n jobs of t, and at most Bulkbatch: buried
+// ones if there are any, otherwise delayed ones. The jobs share one
+// binlog reservation and write, and the queue is processed once.
+// Returns the number of jobs kicked, or -1 if the binlog write failed.
+static int
+kick_batch(Server *s, Tube *t, uint n)
 {
-    uint i;
-    for (i = 0; (i < n) && buried_job_p(t); ++i) {
-        kick_buried_job(s, t->buried.next);
+    Job *js[Bulkbatch], *j;
+    uint i, k = 0, m = 0;
+    int buried = buried_job_p(t), r;
+
+    n = min(n, Bulkbatch);
+    if (buried) {
+        for (j = t->buried.next; k < n && j != &t->buried; j = j->next)
+            js[k++] = j;
+    } else {
+        while (k < n && t->delay.len)
+            js[k++] = remove_delayed_job(t->delay.data[0]);
     }
-    return i;
-}
+    if (!k)
+        return 0;
 
-/* return the number of jobs successfully kicked */
-static uint
-kick_delayed_jobs(Server *s, Tube *t, uint n)
-{
-    uint i;
-    for (i = 0; (i < n) && (t->delay.len > 0); ++i) {
-        kick_delayed_job(s, (Job *)t->delay.data[0]);
+    if (!walresvupdatebatch(&s->wal, js, k)) {
+        for (i = 0; !buried && i < k; i++)
+            if (heapinsert(&t->delay, js[i]))
+                delayed_ct++;
+        return 0;
     }
-    return i;
+
+    for (i = 0; i < k; i++) {
+        j = js[i];
+        if (buried)
+            remove_buried_job(j);
+        j->r.kick_ct++;
+        if (insert_job(j, 0)) {
+            js[m++] = j;
+            continue;
+        }
+
+        /* ready queue is full, so put it back */
+        if (buried || !insert_job(j, j->r.delay))
+            bury_job(s, j, 0);
+    }
+    r = walwritebatch(&s->wal, js, m);
+    walmaint(&s->wal);
+    process_queue();
+    if (!r)
+        return -1;
+    return m;
 }
 
-static uint
-kick_jobs(Server *s, Tube *t, uint n)
+// flush_batch deletes up to Bulkbatch jobs of t in the given state, or
+// in any state but reserved if state is 0, logging them with
+// tombstones. Returns the number of jobs deleted, or -1 if the binlog
+// write failed; the jobs are gone from memory either way.
+static int
+flush_batch(Server *s, Tube *t, int state)
 {
-    if (buried_job_p(t))
-        return kick_buried_jobs(s, t, n);
-    return kick_delayed_jobs(s, t, n);
+    Job *js[Bulkbatch], *j;
+    uint i, k = 0;
+    int r;
+
+    while (k < Bulkbatch) {
+        if ((!state || state == Buried) && buried_job_p(t)) {
+            j = remove_buried_job(t->buried.next);
+        } else if ((!state || state == Delayed) && t->delay.len) {
+            j = remove_delayed_job(t->delay.data[t->delay.len - 1]);
+        } else if ((!state || state == Ready) && t->ready.len) {
+            j = remove_ready_job(t->ready.data[t->ready.len - 1]);
+        } else {
+            break;
+        }
+        t->stat.total_delete_ct++;
+        j->r.state = Invalid;
+        js[k++] = j;
+    }
+    if (!k)
+        return 0;
+
+    r = walwritetomb(&s->wal, js, k);
+    walmaint(&s->wal);
+    for (i = 0; i < k; i++)
+        job_free(js[i]);
+    if (!r)
+        return -1;
+    return k;
 }
 
 // remove_buried_job returns non-NULL value if job j was in the buried state.
@@ -689,6 +1190,7 @@ remove_buried_job(Job *j)
 {
     if (!j || j->r.state != Buried)
         return NULL;
+    unmark_buried(j->tube, j);
     j = job_list_remove(j);
     if (j) {
         global_stat.buried_ct--;
@@ -705,6 +1207,7 @@ remove_delayed_job(Job *j)
     if (!j || j->r.state != Delayed)
         return NULL;
     heapremove(&j->tube->delay, j->heap_index);
+    delayed_ct--;
 
     return j;
 }
@@ -718,6 +1221,11 @@ remove_ready_job(Job *j)
         return NULL;
     heapremove(&j->tube->ready, j->heap_index);
     ready_ct--;
+    if (j->tube->ready.len) {
+        Job *next = j->tube->ready.data[0];
+        if (next->spill)
+            spillprefetch(next);
+    }
     if (j->r.pri < URGENT_THRESHOLD) {
         global_stat.urgent_ct--;
         j->tube->stat.urgent_ct--;
@@ -735,7 +1243,7 @@ static bool
 touch_job(Conn *c, Job *j)
 {
     if (is_job_reserved_by_conn(c, j)) {
-        j->r.deadline_at = nanoseconds() + j->r.ttr;
+        j->r.deadline_at = curtime() + j->r.ttr;
         c->soonest_job = NULL;
         return true;
     }
@@ -774,11 +1282,34 @@ scan_line_end(const char *s, int size)
     return 0;
 }
 
+// scan_frame_end returns the size of the binary request at the start
+// of c->cmd, or 0 if it has not all arrived. A request is a header and
+// its data; the body of a put, or data too long to be a tube name,
+// is read separately.
+static int
+scan_frame_end(Conn *c)
+{
+    uint32 bytes;
+
+    if (c->cmd_read < BIN_REQ_SIZE)
+        return 0;
+    bytes = get_le32((byte *)c->cmd + 4);
+    if (c->cmd[0] == OP_PUT || bytes >= MAX_TUBE_NAME_LEN)
+        return BIN_REQ_SIZE;
+    if ((uint32)c->cmd_read < BIN_REQ_SIZE + bytes)
+        return 0;
+    return BIN_REQ_SIZE + bytes;
+}
+
+#define scan_cmd_end(c) ((c)->binary ? scan_frame_end(c) : \
+                         scan_line_end((c)->cmd, (c)->cmd_read))
+
 /* parse the command line */
 static int
 which_cmd(Conn *c)
 {
 #define TEST_CMD(s,c,o) if (strncmp((s), (c), CONSTSTRLEN(c)) == 0) return (o);
+    TEST_CMD(c->cmd, CMD_PUT_BATCH, OP_PUT_BATCH);
     TEST_CMD(c->cmd, CMD_PUT, OP_PUT);
     TEST_CMD(c->cmd, CMD_PEEKJOB, OP_PEEKJOB);
     TEST_CMD(c->cmd, CMD_PEEK_READY, OP_PEEK_READY);
@@ -786,27 +1317,45 @@ which_cmd(Conn *c)
     TEST_CMD(c->cmd, CMD_PEEK_BURIED, OP_PEEK_BURIED);
     TEST_CMD(c->cmd, CMD_RESERVE_TIMEOUT, OP_RESERVE_TIMEOUT);
     TEST_CMD(c->cmd, CMD_RESERVE_JOB, OP_RESERVE_JOB);
+    TEST_CMD(c->cmd, CMD_RESERVE_BATCH, OP_RESERVE_BATCH);
+    TEST_CMD(c->cmd, CMD_RESERVE_STREAM, OP_RESERVE_STREAM);
+    TEST_CMD(c->cmd, CMD_BINARY, OP_BINARY);
     TEST_CMD(c->cmd, CMD_RESERVE, OP_RESERVE);
+    TEST_CMD(c->cmd, CMD_DELETE_MANY, OP_DELETE_MANY);
+    TEST_CMD(c->cmd, CMD_DELETE_RESERVE, OP_DELETE_RESERVE);
     TEST_CMD(c->cmd, CMD_DELETE, OP_DELETE);
+    TEST_CMD(c->cmd, CMD_RELEASE_MANY, OP_RELEASE_MANY);
+    TEST_CMD(c->cmd, CMD_RELEASE_RESERVE, OP_RELEASE_RESERVE);
     TEST_CMD(c->cmd, CMD_RELEASE, OP_RELEASE);
+    TEST_CMD(c->cmd, CMD_BURY_MANY, OP_BURY_MANY);
     TEST_CMD(c->cmd, CMD_BURY, OP_BURY);
     TEST_CMD(c->cmd, CMD_KICK, OP_KICK);
     TEST_CMD(c->cmd, CMD_KICKJOB, OP_KICKJOB);
     TEST_CMD(c->cmd, CMD_TOUCH, OP_TOUCH);
     TEST_CMD(c->cmd, CMD_STATSJOB, OP_STATSJOB);
+    TEST_CMD(c->cmd, CMD_STATS_TUBES, OP_STATS_TUBES);
+    TEST_CMD(c->cmd, CMD_STATS_LATENCY, OP_STATS_LATENCY);
+    TEST_CMD(c->cmd, CMD_STATS_CONN, OP_STATS_CONN);
     TEST_CMD(c->cmd, CMD_STATS_TUBE, OP_STATS_TUBE);
     TEST_CMD(c->cmd, CMD_STATS, OP_STATS);
     TEST_CMD(c->cmd, CMD_USE, OP_USE);
     TEST_CMD(c->cmd, CMD_WATCH, OP_WATCH);
     TEST_CMD(c->cmd, CMD_IGNORE, OP_IGNORE);
     TEST_CMD(c->cmd, CMD_LIST_TUBES_WATCHED, OP_LIST_TUBES_WATCHED);
+    TEST_CMD(c->cmd, CMD_LIST_JOBS, OP_LIST_JOBS);
+    TEST_CMD(c->cmd, CMD_LIST_CONNS, OP_LIST_CONNS);
     TEST_CMD(c->cmd, CMD_LIST_TUBE_USED, OP_LIST_TUBE_USED);
     TEST_CMD(c->cmd, CMD_LIST_TUBES, OP_LIST_TUBES);
     TEST_CMD(c->cmd, CMD_QUIT, OP_QUIT);
     TEST_CMD(c->cmd, CMD_PAUSE_TUBE, OP_PAUSE_TUBE);
+    TEST_CMD(c->cmd, CMD_FLUSH_TUBE, OP_FLUSH_TUBE);
     return OP_UNKNOWN;
 }
 
+// wire_size is the number of bytes of j's body that travel over c.
+// Binary frames leave out the trailing "\r\n".
+#define wire_size(c, j) ((j)->r.body_size - ((c)->binary ? 2 : 0))
+
 /* Copy up to body_size trailing bytes into the job, then the rest into the cmd
  * buffer. If c->in_job exists, this assumes that c->in_job->body is empty.
  * This function is idempotent(). */
@@ -824,7 +1373,7 @@ fill_extra_data(Conn *c)
     int64 job_data_bytes = 0;
     /* how many bytes should we put into the job body? */
     if (c->in_job) {
-        job_data_bytes = min(extra_bytes, c->in_job->r.body_size);
+        job_data_bytes = min(extra_bytes, wire_size(c, c->in_job));
         memcpy(c->in_job->body, c->cmd + c->cmd_len, job_data_bytes);
         c->in_job_read = job_data_bytes;
     } else if (c->in_job_read) {
@@ -852,7 +1401,7 @@ _skip(Conn *c, int64 n, char *msg, int msglen)
     fill_extra_data(c);
 
     if (c->in_job_read == 0) {
-        reply(c, msg, msglen, STATE_SEND_WORD);
+        reply_word(c, msg, msglen);
         return;
     }
 
@@ -888,10 +1437,22 @@ enqueue_incoming_job(Conn *c)
         return;
     }
 
+    // a retry of a put we have already done gets the same reply
+    if (j->dkey && dedup_window) {
+        Dkey *k = dedupfind(j->tube, j->dkey->key, j->dkey->len);
+        if (k) {
+            dedup_hits++;
+            job_free(j);
+            reply_num(c, STATE_SEND_WORD, MSG_INSERTED, k->id);
+            return;
+        }
+    }
+
     if (j->walresv) {
         reply_serr(c, MSG_INTERNAL_ERROR);
         return;
     }
+    job_compress(j);
     j->walresv = walresvput(&c->srv->wal, j);
     if (!j->walresv) {
         reply_serr(c, MSG_OUT_OF_MEMORY);
@@ -909,15 +1470,18 @@ enqueue_incoming_job(Conn *c)
 
     global_stat.total_jobs_ct++;
     j->tube->stat.total_jobs_ct++;
+    if (j->dkey) {
+        dedupadd(j->dkey, j->tube, j->r.id, curtime() + dedup_window, j->file);
+    }
 
     if (r == 1) {
-        reply_line(c, STATE_SEND_WORD, MSG_INSERTED_FMT, j->r.id);
+        reply_num(c, STATE_SEND_WORD, MSG_INSERTED, j->r.id);
         return;
     }
 
     /* out of memory trying to grow the queue, so it gets buried */
     bury_job(c->srv, j, 0);
-    reply_line(c, STATE_SEND_WORD, MSG_BURIED_FMT, j->r.id);
+    reply_num(c, STATE_SEND_WORD, "BURIED", j->r.id);
 }
 
 static uint
@@ -926,14 +1490,63 @@ uptime()
     return (nanoseconds() - started_at) / 1000000000;
 }
 
-static int
-fmt_stats(char *buf, size_t size, void *x)
+// stats_cmds lists the command counters of the stats document, in order.
+static const struct {
+    const char *key;
+    size_t     len;
+    int        op;
+} stats_cmds[] = {
+#define STAT_CMD(k, op) {k ": ", CONSTSTRLEN(k ": "), op}
+    STAT_CMD("cmd-put", OP_PUT),
+    STAT_CMD("cmd-put-batch", OP_PUT_BATCH),
+    STAT_CMD("cmd-peek", OP_PEEKJOB),
+    STAT_CMD("cmd-peek-ready", OP_PEEK_READY),
+    STAT_CMD("cmd-peek-delayed", OP_PEEK_DELAYED),
+    STAT_CMD("cmd-peek-buried", OP_PEEK_BURIED),
+    STAT_CMD("cmd-reserve", OP_RESERVE),
+    STAT_CMD("cmd-reserve-with-timeout", OP_RESERVE_TIMEOUT),
+    STAT_CMD("cmd-reserve-batch", OP_RESERVE_BATCH),
+    STAT_CMD("cmd-reserve-stream", OP_RESERVE_STREAM),
+    STAT_CMD("cmd-delete", OP_DELETE),
+    STAT_CMD("cmd-delete-many", OP_DELETE_MANY),
+    STAT_CMD("cmd-delete-reserve", OP_DELETE_RESERVE),
+    STAT_CMD("cmd-release", OP_RELEASE),
+    STAT_CMD("cmd-release-many", OP_RELEASE_MANY),
+    STAT_CMD("cmd-release-reserve", OP_RELEASE_RESERVE),
+    STAT_CMD("cmd-use", OP_USE),
+    STAT_CMD("cmd-watch", OP_WATCH),
+    STAT_CMD("cmd-ignore", OP_IGNORE),
+    STAT_CMD("cmd-bury", OP_BURY),
+    STAT_CMD("cmd-bury-many", OP_BURY_MANY),
+    STAT_CMD("cmd-kick", OP_KICK),
+    STAT_CMD("cmd-touch", OP_TOUCH),
+    STAT_CMD("cmd-stats", OP_STATS),
+    STAT_CMD("cmd-stats-job", OP_STATSJOB),
+    STAT_CMD("cmd-stats-tube", OP_STATS_TUBE),
+    STAT_CMD("cmd-stats-tubes", OP_STATS_TUBES),
+    STAT_CMD("cmd-stats-latency", OP_STATS_LATENCY),
+    STAT_CMD("cmd-stats-conn", OP_STATS_CONN),
+    STAT_CMD("cmd-list-tubes", OP_LIST_TUBES),
+    STAT_CMD("cmd-list-tube-used", OP_LIST_TUBE_USED),
+    STAT_CMD("cmd-list-tubes-watched", OP_LIST_TUBES_WATCHED),
+    STAT_CMD("cmd-list-jobs", OP_LIST_JOBS),
+    STAT_CMD("cmd-list-conns", OP_LIST_CONNS),
+    STAT_CMD("cmd-pause-tube", OP_PAUSE_TUBE),
+    STAT_CMD("cmd-flush-tube", OP_FLUSH_TUBE),
+    STAT_CMD("cmd-binary", OP_BINARY),
+#undef STAT_CMD
+};
+
+// fmt_stats writes the stats document at p and returns its end.
+// Every value is a counter kept up to date as jobs and connections
+// change, so this does not depend on the number of tubes or jobs.
+static char *
+fmt_stats(char *p, void *x)
 {
     int whead = 0, wcur = 0;
     Server *s = x;
     struct rusage ru;
-
-    s = x;
+    size_t i;
 
     if (s->wal.head) {
         whead = s->wal.head->seq;
@@ -944,58 +1557,73 @@ fmt_stats(char *buf, size_t size, void *x)
     }
 
     getrusage(RUSAGE_SELF, &ru); /* don't care if it fails */
-    return snprintf(buf, size, STATS_FMT,
-                    global_stat.urgent_ct,
-                    ready_ct,
-                    global_stat.reserved_ct,
-                    get_delayed_job_ct(),
-                    global_stat.buried_ct,
-                    op_ct[OP_PUT],
-                    op_ct[OP_PEEKJOB],
-                    op_ct[OP_PEEK_READY],
-                    op_ct[OP_PEEK_DELAYED],
-                    op_ct[OP_PEEK_BURIED],
-                    op_ct[OP_RESERVE],
-                    op_ct[OP_RESERVE_TIMEOUT],
-                    op_ct[OP_DELETE],
-                    op_ct[OP_RELEASE],
-                    op_ct[OP_USE],
-                    op_ct[OP_WATCH],
-                    op_ct[OP_IGNORE],
-                    op_ct[OP_BURY],
-                    op_ct[OP_KICK],
-                    op_ct[OP_TOUCH],
-                    op_ct[OP_STATS],
-                    op_ct[OP_STATSJOB],
-                    op_ct[OP_STATS_TUBE],
-                    op_ct[OP_LIST_TUBES],
-                    op_ct[OP_LIST_TUBE_USED],
-                    op_ct[OP_LIST_TUBES_WATCHED],
-                    op_ct[OP_PAUSE_TUBE],
-                    timeout_ct,
-                    global_stat.total_jobs_ct,
-                    job_data_size_limit,
-                    tubes.len,
-                    count_cur_conns(),
-                    count_cur_producers(),
-                    count_cur_workers(),
-                    global_stat.waiting_ct,
-                    count_tot_conns(),
-                    (long) getpid(),
-                    version,
-                    (int) ru.ru_utime.tv_sec, (int) ru.ru_utime.tv_usec,
-                    (int) ru.ru_stime.tv_sec, (int) ru.ru_stime.tv_usec,
-                    uptime(),
-                    whead,
-                    wcur,
-                    s->wal.nmig,
-                    s->wal.nrec,
-                    s->wal.filesize,
-                    drain_mode ? "true" : "false",
-                    instance_hex,
-                    node_info.nodename,
-                    node_info.version,
-                    node_info.machine);
+    memcpy(p, "---\n", 4);
+    p += 4;
+    stat_u64(p, "current-jobs-urgent", global_stat.urgent_ct);
+    stat_u64(p, "current-jobs-ready", ready_ct);
+    stat_u64(p, "current-jobs-reserved", global_stat.reserved_ct);
+    stat_u64(p, "current-jobs-delayed", delayed_ct);
+    stat_u64(p, "current-jobs-buried", global_stat.buried_ct);
+    for (i = 0; i < sizeof(stats_cmds) / sizeof(stats_cmds[0]); i++) {
+        p = put_u64(p, stats_cmds[i].key, stats_cmds[i].len,
+                    op_ct[stats_cmds[i].op]);
+    }
+    stat_u64(p, "job-timeouts", timeout_ct);
+    stat_u64(p, "total-jobs", global_stat.total_jobs_ct);
+    stat_u64(p, "max-job-size", job_data_size_limit);
+    stat_u64(p, "current-tubes", tubes.len);
+    stat_u64(p, "current-connections", count_cur_conns());
+    stat_u64(p, "current-producers", count_cur_producers());
+    stat_u64(p, "current-workers", count_cur_workers());
+    stat_u64(p, "current-waiting", global_stat.waiting_ct);
+    stat_u64(p, "total-connections", count_tot_conns());
+    stat_i64(p, "pid", getpid());
+    stat_qstr(p, "version", version);
+    stat_tv(p, "rusage-utime", ru.ru_utime);
+    stat_tv(p, "rusage-stime", ru.ru_stime);
+    stat_u64(p, "uptime", uptime());
+    stat_i64(p, "binlog-oldest-index", whead);
+    stat_i64(p, "binlog-current-index", wcur);
+    stat_i64(p, "binlog-records-migrated", s->wal.nmig);
+    stat_i64(p, "binlog-records-written", s->wal.nrec);
+    stat_i64(p, "binlog-max-size", s->wal.filesize);
+    stat_u64(p, "mem-bodies", mem_used[Membody]);
+    stat_u64(p, "mem-jobs", mem_used[Memjob]);
+    stat_u64(p, "mem-heaps", mem_used[Memheap]);
+    stat_u64(p, "mem-hash", mem_used[Memhash]);
+    stat_u64(p, "mem-tubes", mem_used[Memtube]);
+    stat_u64(p, "mem-conns", mem_used[Memconn]);
+    stat_u64(p, "mem-replies", mem_used[Memreply]);
+    stat_u64(p, "mem-keys", mem_used[Memkey]);
+    stat_u64(p, "mem-total", mem_total());
+    stat_u64(p, "mem-limit", mem_limit);
+    stat_u64(p, "spill-jobs", spill.njob);
+    stat_u64(p, "spill-bytes", spill.nbyte);
+    stat_u64(p, "spill-files", spill.nseg);
+    stat_u64(p, "spill-writes", spill.nwrite);
+    stat_u64(p, "spill-reads", spill.nread);
+    stat_u64(p, "compressed-jobs", zstat.njob);
+    stat_u64(p, "compressed-bytes", zstat.nbyte);
+    stat_u64(p, "compressed-raw-bytes", zstat.nraw);
+    stat_u64(p, "decompress-cache-hits", zstat.hits);
+    stat_u64(p, "decompress-cache-misses", zstat.misses);
+    stat_u64(p, "dedup-keys", dedup_keys);
+    stat_u64(p, "dedup-hits", dedup_hits);
+    stat_u64(p, "loop-lag-p99", hist_at(&s->looplat, 990) / 1000);
+    stat_u64(p, "loop-lag-max", s->looplat.max / 1000);
+    stat_u64(p, "stalls-command", s->stall_ct[Stallcmd]);
+    stat_u64(p, "stalls-accept", s->stall_ct[Stallaccept]);
+    stat_u64(p, "stalls-delay", s->stall_ct[Stalldelay]);
+    stat_u64(p, "stalls-timeout", s->stall_ct[Stalltimeout]);
+    stat_u64(p, "stalls-compact", s->stall_ct[Stallcompact]);
+    stat_str(p, "draining", drain_mode ? "true" : "false");
+    stat_str(p, "id", instance_hex);
+    stat_qstr(p, "hostname", node_info.nodename);
+    stat_qstr(p, "os", node_info.version);
+    stat_qstr(p, "platform", node_info.machine);
+    *p++ = '\r';
+    *p++ = '\n';
+    return p;
 }
 
 /* Read an integer from the given buffer and place it in num.
@@ -1095,6 +1723,23 @@ read_tube_name(char **tubename, char *buf, char **end)
     return 0;
 }
 
+/* Read an optional trailing reserve timeout in seconds. An empty
+   buffer leaves *timeout unchanged. */
+static int
+read_timeout(int *timeout, const char *buf)
+{
+    uint32 t;
+
+    while (buf[0] == ' ')
+        buf++;
+    if (buf[0] == '\0')
+        return 0;
+    if (read_u32(&t, buf, NULL) || t > INT_MAX)
+        return -1;
+    *timeout = (int)t;
+    return 0;
+}
+
 static void
 wait_for_job(Conn *c, int timeout)
 {
@@ -1118,26 +1763,60 @@ do_stats(Conn *c, fmt_fn fmt, void *data)
     /* first, measure how big a buffer we will need */
     stats_len = fmt(NULL, 0, data) + 16;
 
-    c->out_job = allocate_job(stats_len); /* fake job to hold stats data */
-    if (!c->out_job) {
+    c->out_body = body_new(stats_len, Memreply);
+    if (!c->out_body) {
         reply_serr(c, MSG_OUT_OF_MEMORY);
         return;
     }
 
-    /* Mark this job as a copy so it can be appropriately freed later on */
-    c->out_job->r.state = Copy;
-
     /* now actually format the stats data */
-    r = fmt(c->out_job->body, stats_len, data);
+    r = fmt(c->out_body->data, stats_len, data);
     /* and set the actual body size */
-    c->out_job->r.body_size = r;
+    c->out_body->size = r;
     if (r > stats_len) {
         reply_serr(c, MSG_INTERNAL_ERROR);
         return;
     }
 
-    c->out_job_sent = 0;
-    reply_line(c, STATE_SEND_JOB, "OK %d\r\n", r - 2);
+    c->out_body_sent = 0;
+    reply_num(c, STATE_SEND_JOB, "OK", r - 2);
+}
+
+typedef char *(*put_fn)(char *, void *);
+
+// stats_buf returns c's buffer of STATS_BUF_SIZE bytes for stats
+// replies, or NULL if out of memory. The buffer is kept for the next
+// stats command unless something else still holds a reference to it.
+static Body *
+stats_buf(Conn *c)
+{
+    if (c->stats_buf && c->stats_buf->refs > 1) {
+        body_unref(c->stats_buf);
+        c->stats_buf = NULL;
+    }
+    if (!c->stats_buf)
+        c->stats_buf = body_new(STATS_BUF_SIZE, Memreply);
+    return c->stats_buf;
+}
+
+// reply_stats sends one of the bounded stats documents, written by fn
+// into the connection's stats buffer.
+static void
+reply_stats(Conn *c, put_fn fn, void *data)
+{
+    Body *b = stats_buf(c);
+    char *end;
+
+    if (!b) {
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+
+    end = fn(b->data, data);
+    b->size = end - b->data;
+    c->out_body = body_ref(b);
+    c->out_body_sent = 0;
+    reply_num(c, STATE_SEND_JOB, "OK", b->size - 2);
 }
 
 static void
@@ -1154,17 +1833,14 @@ do_list_tubes(Conn *c, Ms *l)
         resp_z += 3 + strlen(t->name); /* including "- " and "\n" */
     }
 
-    c->out_job = allocate_job(resp_z); /* fake job to hold response data */
-    if (!c->out_job) {
+    c->out_body = body_new(resp_z, Memreply);
+    if (!c->out_body) {
         reply_serr(c, MSG_OUT_OF_MEMORY);
         return;
     }
 
-    /* Mark this job as a copy so it can be appropriately freed later on */
-    c->out_job->r.state = Copy;
-
     /* now actually format the response */
-    buf = c->out_job->body;
+    buf = c->out_body->data;
     buf += snprintf(buf, 5, "---\n");
     for (i = 0; i < l->len; i++) {
         t = l->items[i];
@@ -1173,18 +1849,19 @@ do_list_tubes(Conn *c, Ms *l)
     buf[0] = '\r';
     buf[1] = '\n';
 
-    c->out_job_sent = 0;
-    reply_line(c, STATE_SEND_JOB, "OK %zu\r\n", resp_z - 2);
+    c->out_body_sent = 0;
+    reply_num(c, STATE_SEND_JOB, "OK", resp_z - 2);
 }
 
-static int
-fmt_job_stats(char *buf, size_t size, Job *j)
+static char *
+fmt_job_stats(char *p, void *x)
 {
+    Job *j = x;
     int64 t;
     int64 time_left;
     int file = 0;
 
-    t = nanoseconds();
+    t = curtime();
     if (j->r.state == Reserved || j->r.state == Delayed) {
         time_left = (j->r.deadline_at - t) / 1000000000;
     } else {
@@ -1193,110 +1870,1351 @@ fmt_job_stats(char *buf, size_t size, Job *j)
     if (j->file) {
         file = j->file->seq;
     }
-    return snprintf(buf, size, STATS_JOB_FMT,
-            j->r.id,
-            j->tube->name,
-            job_state(j),
-            j->r.pri,
-            (t - j->r.created_at) / 1000000000,
-            j->r.delay / 1000000000,
-            j->r.ttr / 1000000000,
-            time_left,
-            file,
-            j->r.reserve_ct,
-            j->r.timeout_ct,
-            j->r.release_ct,
-            j->r.bury_ct,
-            j->r.kick_ct);
+    memcpy(p, "---\n", 4);
+    p += 4;
+    stat_u64(p, "id", j->r.id);
+    stat_qstr(p, "tube", j->tube->name);
+    stat_str(p, "state", job_state(j));
+    stat_u64(p, "pri", j->r.pri);
+    stat_i64(p, "age", (walltime() - j->r.created_at) / 1000000000);
+    stat_i64(p, "delay", j->r.delay / 1000000000);
+    stat_i64(p, "ttr", j->r.ttr / 1000000000);
+    stat_i64(p, "time-left", time_left);
+    stat_i64(p, "file", file);
+    stat_u64(p, "reserves", j->r.reserve_ct);
+    stat_u64(p, "timeouts", j->r.timeout_ct);
+    stat_u64(p, "releases", j->r.release_ct);
+    stat_u64(p, "buries", j->r.bury_ct);
+    stat_u64(p, "kicks", j->r.kick_ct);
+    *p++ = '\r';
+    *p++ = '\n';
+    return p;
 }
 
-static int
-fmt_stats_tube(char *buf, size_t size, Tube *t)
+static char *
+fmt_stats_tube(char *p, void *x)
 {
-    uint64 time_left;
+    Tube *t = x;
+    int64 time_left;
 
     if (t->pause > 0) {
-        time_left = (t->unpause_at - nanoseconds()) / 1000000000;
+        time_left = (t->unpause_at - curtime()) / 1000000000;
     } else {
         time_left = 0;
     }
-    return snprintf(buf, size, STATS_TUBE_FMT,
-            t->name,
-            t->stat.urgent_ct,
-            t->ready.len,
-            t->stat.reserved_ct,
-            t->delay.len,
-            t->stat.buried_ct,
-            t->stat.total_jobs_ct,
-            t->using_ct,
-            t->watching_ct,
-            t->stat.waiting_ct,
-            t->stat.total_delete_ct,
-            t->stat.pause_ct,
-            t->pause / 1000000000,
-            time_left);
+    memcpy(p, "---\n", 4);
+    p += 4;
+    stat_qstr(p, "name", t->name);
+    stat_u64(p, "current-jobs-urgent", t->stat.urgent_ct);
+    stat_u64(p, "current-jobs-ready", t->ready.len);
+    stat_u64(p, "current-jobs-reserved", t->stat.reserved_ct);
+    stat_u64(p, "current-jobs-delayed", t->delay.len);
+    stat_u64(p, "current-jobs-buried", t->stat.buried_ct);
+    stat_u64(p, "total-jobs", t->stat.total_jobs_ct);
+    stat_u64(p, "current-using", t->using_ct);
+    stat_u64(p, "current-watching", t->watching_ct);
+    stat_u64(p, "current-waiting", t->stat.waiting_ct);
+    stat_u64(p, "cmd-delete", t->stat.total_delete_ct);
+    stat_u64(p, "cmd-pause-tube", t->stat.pause_ct);
+    stat_u64(p, "pause", t->pause / 1000000000);
+    stat_i64(p, "pause-time-left", time_left);
+    stat_str(p, "durable", t->ephemeral ? "false" : "true");
+    stat_u64(p, "dedup-keys", t->nkeys);
+    stat_u64(p, "mem", t->mem +
+             sizeof(void*) * (t->ready.cap + t->delay.cap));
+    *p++ = '\r';
+    *p++ = '\n';
+    return p;
 }
 
-static void
-maybe_enqueue_incoming_job(Conn *c)
-{
-    Job *j = c->in_job;
+#define LIST_JOBS_MAX 1000
 
-    /* do we have a complete job? */
-    if (c->in_job_read == j->r.body_size) {
-        enqueue_incoming_job(c);
-        return;
-    }
+// A JobPage is one page of a list-jobs reply.
+typedef struct JobPage {
+    Job    *js[LIST_JOBS_MAX];
+    uint   n;
+    uint64 next;                // cursor for the next page, or 0 at the end
+    int64  now;                 // wall clock, the same for both passes of fmt_job_page
+} JobPage;
 
-    /* otherwise we have incomplete data, so just keep waiting */
-    c->state = STATE_WANT_DATA;
+static int
+fmt_job_page(char *buf, size_t size, void *x)
+{
+    JobPage *p = x;
+    uint i;
+    int r, n;
+
+    n = snprintf(buf, size, "---\nnext: %"PRIu64"\njobs:%s\n",
+                 p->next, p->n ? "" : " []");
+    for (i = 0; i < p->n; i++) {
+        Job *j = p->js[i];
+        r = snprintf(buf ? buf + n : NULL, buf ? size - n : 0,
+                     "- {id: %"PRIu64", pri: %u, age: %"PRId64", bytes: %d, "
+                     "reserves: %u, timeouts: %u, releases: %u, buries: %u, "
+                     "kicks: %u}\n",
+                     j->r.id, j->r.pri, (p->now - j->r.created_at) / 1000000000,
+                     j->r.body_size - 2, j->r.reserve_ct, j->r.timeout_ct,
+                     j->r.release_ct, j->r.bury_ct, j->r.kick_ct);
+        n += r;
+    }
+    r = snprintf(buf ? buf + n : NULL, buf ? size - n : 0, "\r\n");
+    return n + r;
+}
+
+// list_jobs replies with up to limit jobs of t in the given state,
+// without touching their bodies. Ready and delayed jobs are listed in
+// heap order and the cursor is a position in the heap. Buried jobs are
+// listed in the order they were buried and the cursor is the bury_seq
+// of the last job of the previous page, which stays good when that job
+// leaves.
+static void
+list_jobs(Conn *c, Tube *t, int state, uint64 cursor, uint limit)
+{
+    static JobPage p;
+    Heap *h;
+    Job *j;
+    size_t i;
+
+    p.n = 0;
+    p.next = 0;
+    p.now = walltime();
+    if (state == Buried) {
+        j = buried_after(t, cursor);
+        while (p.n < limit && j != &t->buried) {
+            p.js[p.n++] = j;
+            j = j->next;
+        }
+        if (j != &t->buried)
+            p.next = p.js[p.n - 1]->bury_seq;
+    } else {
+        h = state == Ready ? &t->ready : &t->delay;
+        for (i = cursor; p.n < limit && i < h->len; i++)
+            p.js[p.n++] = h->data[i];
+        if (i < h->len)
+            p.next = i;
+    }
+    do_stats(c, fmt_job_page, &p);
+}
+
+static const char *const state_names[] = {
+    "want-command",
+    "want-data",
+    "send-job",
+    "send-word",
+    "wait",
+    "bitbucket",
+    "close",
+    "want-endline",
+    "bulk",
+};
+
+// type_names lists the CONN_TYPE_* bits set in each conn type,
+// as one word for a list-conns line.
+static const char *const type_names[] = {
+    "-",
+    "producer",
+    "worker",
+    "producer,worker",
+    "waiting",
+    "producer,waiting",
+    "worker,waiting",
+    "producer,worker,waiting",
+};
+
+// conn_time_left returns the seconds until the soonest of c's
+// reservations expires, or 0 if it has none.
+static int64
+conn_time_left(Conn *c, int64 now)
+{
+    Job *j = connsoonestjob(c);
+
+    if (!j || j->r.deadline_at <= now)
+        return 0;
+    return (j->r.deadline_at - now) / 1000000000;
+}
+
+// fmt_stats_conn writes the stats-conn document of conn x at p
+// and returns its end.
+static char *
+fmt_stats_conn(char *p, void *x)
+{
+    Conn *c = x;
+    int64 now = curtime();
+
+    memcpy(p, "---\n", 4);
+    p += 4;
+    stat_i64(p, "fd", c->sock.fd);
+    stat_qstr(p, "addr", c->addr);
+    stat_str(p, "state", state_names[(int)c->state]);
+    stat_str(p, "producer", c->type & CONN_TYPE_PRODUCER ? "true" : "false");
+    stat_str(p, "worker", c->type & CONN_TYPE_WORKER ? "true" : "false");
+    stat_str(p, "waiting", c->type & CONN_TYPE_WAITING ? "true" : "false");
+    stat_str(p, "binary", c->binary ? "true" : "false");
+    stat_qstr(p, "use", c->use->name);
+    stat_u64(p, "watching", c->watch.len);
+    stat_u64(p, "reserved", c->reserved_n);
+    stat_i64(p, "time-left", conn_time_left(c, now));
+    stat_u64(p, "bytes-in", c->bytes_in);
+    stat_u64(p, "bytes-out", c->bytes_out);
+    stat_u64(p, "cmds", c->cmd_ct);
+    stat_u64(p, "replies", c->reply_ct);
+    stat_i64(p, "age", (now - c->since) / 1000000000);
+    *p++ = '\r';
+    *p++ = '\n';
+    return p;
+}
+
+// read_job_state reads "ready", "delayed" or "buried" from buf.
+// The interface and behavior are analogous to read_u32().
+static int
+read_job_state(int *state, char *buf, char **end)
+{
+    size_t len;
+
+    while (buf[0] == ' ')
+        buf++;
+    len = strcspn(buf, " ");
+    if (len == 5 && strncmp(buf, "ready", len) == 0)
+        *state = Ready;
+    else if (len == 7 && strncmp(buf, "delayed", len) == 0)
+        *state = Delayed;
+    else if (len == 6 && strncmp(buf, "buried", len) == 0)
+        *state = Buried;
+    else
+        return -1;
+    if (end)
+        *end = buf + len;
+    return 0;
+}
+
+// read_batch_entry parses one "<pri> <delay> <ttr> <bytes>\r\n<data>\r\n"
+// entry of a put-batch payload at *p, not reading past end. On success it
+// fills in the fields, points *body at the data (including its "\r\n"),
+// advances *p past the entry and returns NULL. Otherwise it returns
+// the reply to send.
+static char *
+read_batch_entry(char **p, char *end, uint32 *pri, int64 *delay,
+                 int64 *ttr, uint32 *body_size, char **body)
+{
+    char line[LINE_BUF_SIZE];
+    char *delay_buf, *ttr_buf, *size_buf, *end_buf;
+    size_t len;
+
+    if (end - *p < 2)
+        return MSG_BAD_FORMAT;
+    len = scan_line_end(*p, min(end - *p, LINE_BUF_SIZE));
+    if (!len)
+        return MSG_BAD_FORMAT;
+    memcpy(line, *p, len - 2);
+    line[len - 2] = '\0';
+    if (strlen(line) != len - 2)
+        return MSG_BAD_FORMAT;
+
+    if (read_u32(pri, line, &delay_buf) ||
+        read_duration(delay, delay_buf, &ttr_buf) ||
+        read_duration(ttr, ttr_buf, &size_buf) ||
+        read_u32(body_size, size_buf, &end_buf) ||
+        end_buf[0] != '\0')
+        return MSG_BAD_FORMAT;
+
+    if (*body_size > job_data_size_limit)
+        return MSG_JOB_TOO_BIG;
+    if ((size_t)(end - *p) - len < (size_t)*body_size + 2)
+        return MSG_BAD_FORMAT;
+
+    *body = *p + len;
+    if (memcmp(*body + *body_size, "\r\n", 2))
+        return MSG_EXPECTED_CRLF;
+    *p = *body + *body_size + 2;
+    if (*ttr < 1000000000) {
+        *ttr = 1000000000;
+    }
+    return NULL;
+}
+
+static void
+free_jobs(Job **js, uint n)
+{
+    uint i;
+
+    for (i = 0; i < n; i++)
+        job_free(js[i]);
+    free(js);
+}
+
+// enqueue_incoming_batch makes and enqueues the jobs of a complete
+// put-batch payload. It is all or nothing: if any entry is bad or
+// there is no room for all of them, none is inserted.
+static void
+enqueue_incoming_batch(Conn *c)
+{
+    Job *b = c->in_job, **js;
+    uint i, n = c->in_batch;
+    char *p, *end, *body, *msg;
+    uint32 pri, body_size;
+    int64 delay, ttr, nbody = 0;
+    uint64 first, last;
+    int r;
+
+    c->in_job = NULL;
+    c->in_job_read = 0;
+    c->in_op = 0;
+    c->in_batch = 0;
+
+    if (memcmp(b->body + b->r.body_size - 2, "\r\n", 2)) {
+        job_free(b);
+        reply_msg(c, MSG_EXPECTED_CRLF);
+        return;
+    }
+
+    // validate every entry before making any job
+    p = b->body;
+    end = b->body + b->r.body_size - 2;
+    for (i = 0; i < n; i++) {
+        msg = read_batch_entry(&p, end, &pri, &delay, &ttr, &body_size, &body);
+        if (msg) {
+            job_free(b);
+            reply_word(c, msg, strlen(msg));
+            return;
+        }
+        nbody += body_size + 2;
+    }
+    if (p != end) {
+        job_free(b);
+        reply_msg(c, MSG_BAD_FORMAT);
+        return;
+    }
+
+    if (drain_mode) {
+        job_free(b);
+        reply_serr(c, MSG_DRAINING);
+        return;
+    }
+
+    // refuse a batch too big for the binlog before it takes any ids
+    if (!walbatchfits(&c->srv->wal, c->use, n, nbody)) {
+        job_free(b);
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+
+    js = calloc(n, sizeof *js);
+    if (!js) {
+        job_free(b);
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+    p = b->body;
+    for (i = 0; i < n; i++) {
+        read_batch_entry(&p, end, &pri, &delay, &ttr, &body_size, &body);
+        js[i] = make_job(pri, delay, ttr, body_size + 2, c->use);
+        if (!js[i]) {
+            free_jobs(js, i);
+            job_free(b);
+            reply_serr(c, MSG_OUT_OF_MEMORY);
+            return;
+        }
+        memcpy(js[i]->body, body, body_size + 2);
+        job_compress(js[i]);
+    }
+    job_free(b);
+
+    if (!walresvputbatch(&c->srv->wal, js, n)) {
+        free_jobs(js, n);
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!insert_job(js[i], js[i]->r.delay)) {
+            /* out of memory trying to grow the queue, so it gets buried */
+            bury_job(c->srv, js[i], 0);
+        }
+    }
+    global_stat.total_jobs_ct += n;
+    c->use->stat.total_jobs_ct += n;
+
+    r = walwritebatch(&c->srv->wal, js, n);
+    walmaint(&c->srv->wal);
+
+    first = js[0]->r.id;
+    last = js[n-1]->r.id;
+    free(js);
+
+    process_queue();
+    if (!r) {
+        reply_serr(c, MSG_INTERNAL_ERROR);
+        return;
+    }
+    reply_line(c, STATE_SEND_WORD, MSG_INSERTED_BATCH_FMT, first, last);
+}
+
+static void
+maybe_enqueue_incoming_job(Conn *c)
+{
+    Job *j = c->in_job;
+
+    /* do we have a complete job? */
+    if (c->in_job_read == wire_size(c, j)) {
+        if (c->binary) {
+            memcpy(j->body + c->in_job_read, "\r\n", 2);
+            c->in_job_read += 2;
+        }
+        switch (c->in_op) {
+        case 0:
+            enqueue_incoming_job(c);
+            break;
+        case OP_PUT_BATCH:
+            enqueue_incoming_batch(c);
+            break;
+        default:
+            apply_id_list(c);
+        }
+        return;
+    }
+
+    /* otherwise we have incomplete data, so just keep waiting */
+    c->state = STATE_WANT_DATA;
+}
+
+// read_payload has the next bytes+2 bytes from c read into a bare job
+// buffer as the payload of a command of type op, with the command's
+// pri and delay arguments kept in the buffer's Jobrec. The command
+// runs once the payload is complete; see maybe_enqueue_incoming_job.
+static void
+read_payload(Conn *c, byte op, uint32 bytes, uint32 pri, int64 delay)
+{
+    c->in_job = allocate_job(bytes + 2);
+    if (!c->in_job) {
+        /* throw away the payload and respond with OUT_OF_MEMORY */
+        twarnx("server error: " MSG_OUT_OF_MEMORY);
+        skip(c, (int64)bytes + 2, MSG_OUT_OF_MEMORY);
+        return;
+    }
+    c->in_job->r.pri = pri;
+    c->in_job->r.delay = delay;
+    c->in_op = op;
+
+    fill_extra_data(c);
+    maybe_enqueue_incoming_job(c);
+}
+
+/* j can be NULL */
+static Job *
+remove_this_reserved_job(Conn *c, Job *j)
+{
+    j = job_list_remove(j);
+    if (j) {
+        global_stat.reserved_ct--;
+        j->tube->stat.reserved_ct--;
+        j->reserver = NULL;
+        c->reserved_n--;
+    }
+    c->soonest_job = NULL;
+    return j;
+}
+
+static Job *
+remove_reserved_job(Conn *c, Job *j)
+{
+    if (!is_job_reserved_by_conn(c, j))
+        return NULL;
+    return remove_this_reserved_job(c, j);
+}
+
+// unreserve_job gives j, which c has just reserved but could not be
+// sent, back to its tube.
+static void
+unreserve_job(Conn *c, Job *j)
+{
+    j = remove_this_reserved_job(c, j);
+    if (!insert_job(j, 0))
+        bury_job(c->srv, j, 0);
+}
+
+// next_watched_job returns the ready job with the smallest priority
+// among the unpaused tubes that c watches, picking it the same way
+// next_awaited_job does.
+static Job *
+next_watched_job(Conn *c, int64 now)
+{
+    size_t i;
+    Job *j = NULL;
+
+    for (i = 0; i < c->watch.len; i++) {
+        Tube *t = c->watch.items[i];
+        if (t->pause) {
+            if (t->unpause_at > now)
+                continue;
+            t->pause = 0;
+        }
+        if (t->ready.len) {
+            Job *candidate = t->ready.data[0];
+            if (!j || job_pri_less(candidate, j)) {
+                j = candidate;
+            }
+        }
+    }
+    return j;
+}
+
+// reserve_or_wait gives c the next ready job from its watched tubes, or
+// if there is none, puts c in the waiting state for up to timeout
+// seconds. Any connections already waiting on c's tubes have no ready
+// jobs (see process_queue), so taking a job here is just what
+// process_queue would do, without the trip through the waiting sets.
+static void
+reserve_or_wait(Conn *c, int timeout)
+{
+    Job *j;
+
+    connsetworker(c);
+    j = next_watched_job(c, curtime());
+    if (j) {
+        remove_ready_job(j);
+        global_stat.reserved_ct++;
+        conn_reserve_job(c, j);
+        reply_job(c, j, MSG_RESERVED);
+        return;
+    }
+
+    if (conndeadlinesoon(c)) {
+        reply_msg(c, MSG_DEADLINE_SOON);
+        return;
+    }
+
+    wait_for_job(c, timeout);
+}
+
+// reserve_batch reserves for c up to n ready jobs from its watched tubes,
+// counting j if it is not NULL (j must already be reserved by c), and
+// replies with all of them in a single RESERVED_BATCH response.
+static void
+reserve_batch(Conn *c, Job *j, uint n)
+{
+    Job *js[n];
+    uint i, k = 0;
+    int64 now = curtime(), size = 0;
+    Body *b, *jb;
+    char *p;
+
+    enum { line_max = 48 }; // "RESERVED <id> <bytes>\r\n"
+
+    if (j) {
+        js[k++] = j;
+        size += line_max + j->r.body_size;
+    }
+    while (k < n && (j = next_watched_job(c, now))) {
+        if (size + line_max + j->r.body_size > JOB_DATA_SIZE_LIMIT_MAX)
+            break;
+        j = remove_ready_job(j);
+        global_stat.reserved_ct++;
+        conn_reserve_job(c, j);
+        js[k++] = j;
+        size += line_max + j->r.body_size;
+    }
+
+    if (!k) {
+        reply_line(c, STATE_SEND_WORD, MSG_RESERVED_BATCH_FMT, 0);
+        return;
+    }
+
+    b = body_new(size, Memreply);
+    if (!b) {
+        for (i = 0; i < k; i++)
+            unreserve_job(c, js[i]);
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+    p = b->data;
+    for (i = 0; i < k; i++) {
+        p += sprintf(p, MSG_RESERVED " %"PRIu64" %u\r\n",
+                     js[i]->r.id, js[i]->r.body_size - 2);
+        jb = job_body(js[i]);
+        if (!jb) {
+            for (i = 0; i < k; i++)
+                unreserve_job(c, js[i]);
+            body_unref(b);
+            reply_serr(c, MSG_INTERNAL_ERROR);
+            return;
+        }
+        memcpy(p, jb->data, js[i]->r.body_size);
+        body_unref(jb);
+        p += js[i]->r.body_size;
+    }
+    b->size = p - b->data;
+
+    c->out_body = b;
+    c->out_body_sent = 0;
+    reply_line(c, STATE_SEND_JOB, MSG_RESERVED_BATCH_FMT, k);
+}
+
+// record_proclat records how long reserved job j took to be deleted,
+// for the server and for j's tube.
+static void
+record_proclat(Server *s, Job *j)
+{
+    int64 d = curtime() - j->since;
+    Tube *t = j->tube;
+
+    hist_record(&s->proclat, d);
+    if (!t->proclat && (t->proclat = calloc(1, sizeof(Hist))))
+        mem_used[Memtube] += sizeof(Hist);
+    if (t->proclat)
+        hist_record(t->proclat, d);
+}
+
+// take_deletable_job removes job id from wherever it is, if c may delete
+// it: it is reserved by c, or is ready, buried or delayed.
+// Returns the job, or NULL if there is no such job.
+static Job *
+take_deletable_job(Conn *c, uint64 id)
+{
+    Job *jf, *j;
+
+    jf = job_find(id);
+    j = remove_reserved_job(c, jf);
+    if (j)
+        record_proclat(c->srv, j);
+    if (!j)
+        j = remove_ready_job(jf);
+    if (!j)
+        j = remove_buried_job(jf);
+    if (!j)
+        j = remove_delayed_job(jf);
+    return j;
+}
+
+typedef struct {
+    uint n;
+    uint64 ids[ID_LIST_MAX];
+    const char *status[ID_LIST_MAX];
+} IdStatus;
+
+static int
+fmt_id_statuses(char *buf, size_t size, void *x)
+{
+    IdStatus *s = x;
+    size_t off = 0;
+    uint i;
+
+#define FMT_AT(...) \
+    (off += snprintf(buf ? buf + off : NULL, off < size ? size - off : 0, __VA_ARGS__))
+
+    FMT_AT("---\n");
+    for (i = 0; i < s->n; i++) {
+        FMT_AT("- %" PRIu64 ": %s\n", s->ids[i], s->status[i]);
+    }
+    FMT_AT("\r\n");
+#undef FMT_AT
+    return off;
+}
+
+// apply_id_list runs a complete delete-many, release-many or bury-many
+// payload: a list of job ids separated by spaces. It handles each id as
+// the single-id command would, except that the log records are written
+// together and the queue is processed once, at the end. The reply is
+// a YAML list with the outcome for each id, in order.
+static void
+apply_id_list(Conn *c)
+{
+    Job *b = c->in_job, *j;
+    byte op = c->in_op;
+    uint32 pri = b->r.pri;
+    int64 delay = b->r.delay;
+    IdStatus s;
+    uint i, k = 0;
+    char *p;
+    int r, z;
+
+    c->in_job = NULL;
+    c->in_job_read = 0;
+    c->in_op = 0;
+
+    if (memcmp(b->body + b->r.body_size - 2, "\r\n", 2)) {
+        job_free(b);
+        reply_msg(c, MSG_EXPECTED_CRLF);
+        return;
+    }
+    b->body[b->r.body_size - 2] = '\0';
+
+    s.n = 0;
+    p = b->body;
+    r = strlen(p) != (size_t)b->r.body_size - 2;
+    for (;;) {
+        while (*p == ' ')
+            p++;
+        if (r || !*p)
+            break;
+        r = s.n == ID_LIST_MAX ||
+            read_u64(&s.ids[s.n++], p, &p) ||
+            (*p != ' ' && *p != '\0');
+    }
+    job_free(b);
+    if (r || !s.n) {
+        reply_msg(c, MSG_BAD_FORMAT);
+        return;
+    }
+
+    Job *js[s.n];
+    for (i = 0; i < s.n; i++) {
+        switch (op) {
+        case OP_DELETE_MANY:
+            j = take_deletable_job(c, s.ids[i]);
+            if (!j) {
+                s.status[i] = "NOT_FOUND";
+                continue;
+            }
+            j->tube->stat.total_delete_ct++;
+            j->r.state = Invalid;
+            js[k++] = j;
+            s.status[i] = "DELETED";
+            continue;
+
+        case OP_RELEASE_MANY:
+            j = job_find(s.ids[i]);
+            if (!is_job_reserved_by_conn(c, j)) {
+                s.status[i] = "NOT_FOUND";
+                continue;
+            }
+            if (delay) {
+                z = walresvupdate(&c->srv->wal, j);
+                if (!z) {
+                    s.status[i] = "OUT_OF_MEMORY";
+                    continue;
+                }
+                j->walresv += z;
+            }
+            remove_this_reserved_job(c, j);
+            j->r.pri = pri;
+            j->r.delay = delay;
+            j->r.release_ct++;
+            if (!insert_job(j, delay)) {
+                /* out of memory trying to grow the queue, so it gets buried */
+                bury_job(c->srv, j, 0);
+                s.status[i] = "BURIED";
+                continue;
+            }
+            if (delay)
+                js[k++] = j;
+            s.status[i] = "RELEASED";
+            continue;
+
+        case OP_BURY_MANY:
+            j = job_find(s.ids[i]);
+            if (!is_job_reserved_by_conn(c, j)) {
+                s.status[i] = "NOT_FOUND";
+                continue;
+            }
+            z = walresvupdate(&c->srv->wal, j);
+            if (!z) {
+                s.status[i] = "OUT_OF_MEMORY";
+                continue;
+            }
+            j->walresv += z;
+            remove_this_reserved_job(c, j);
+            j->r.pri = pri;
+            bury_job(c->srv, j, 0);
+            js[k++] = j;
+            s.status[i] = "BURIED";
+            continue;
+        }
+    }
+
+    r = walwritebatch(&c->srv->wal, js, k);
+    walmaint(&c->srv->wal);
+    if (op == OP_DELETE_MANY) {
+        for (i = 0; i < k; i++)
+            job_free(js[i]);
+    }
+    if (op == OP_RELEASE_MANY) {
+        process_queue();
+    }
+
+    if (!r) {
+        reply_serr(c, MSG_INTERNAL_ERROR);
+        return;
+    }
+    do_stats(c, fmt_id_statuses, &s);
+}
+
+static bool
+is_valid_tube(const char *name, size_t max)
+{
+    size_t len = strlen(name);
+    return 0 < len && len <= max &&
+        strspn(name, NAME_CHARS) == len &&
+        name[0] != '-';
+}
+
+// The handlers below carry out commands shared by the text and binary
+// protocols, once the arguments have been parsed; they send the reply.
+
+// put_job starts reading the body of a new job of body_size bytes
+// into c->in_job. If key is not NULL, it is the job's deduplication
+// key, of keylen bytes.
+static void
+put_job(Conn *c, uint32 pri, int64 delay, int64 ttr, uint32 body_size,
+        const char *key, int keylen)
+{
+    connsetproducer(c);
+
+    if (ttr < 1000000000) {
+        ttr = 1000000000;
+    }
+
+    // A retry of a put we have already done gets the same reply,
+    // without reading the body into a job. The skipped body is
+    // answered with a text line; a binary conn gets its frame from
+    // the same check in enqueue_incoming_job.
+    if (key && dedup_window && !c->binary) {
+        Dkey *k = dedupfind(c->use, key, keylen);
+        if (k) {
+            int n = snprintf(c->reply_buf, sizeof c->reply_buf,
+                             MSG_INSERTED " %"PRIu64"\r\n", k->id);
+            dedup_hits++;
+            _skip(c, (int64)body_size + (c->binary ? 0 : 2), c->reply_buf, n);
+            return;
+        }
+    }
+
+    if (mem_over(sizeof(Job) + sizeof(Body) + body_size + 2)) {
+        /* throw away the job body and respond with OUT_OF_CAPACITY */
+        skip(c, (int64)body_size + (c->binary ? 0 : 2), MSG_OUT_OF_CAPACITY);
+        return;
+    }
+
+    c->in_job = make_job(pri, delay, ttr, body_size + 2, c->use);
+
+    /* OOM? */
+    if (!c->in_job) {
+        /* throw away the job body and respond with OUT_OF_MEMORY */
+        twarnx("server error: " MSG_OUT_OF_MEMORY);
+        skip(c, (int64)body_size + (c->binary ? 0 : 2), MSG_OUT_OF_MEMORY);
+        return;
+    }
+    if (key && dedup_window) {
+        c->in_job->dkey = dedupnew(key, keylen);
+        if (!c->in_job->dkey) {
+            job_free(c->in_job);
+            twarnx("server error: " MSG_OUT_OF_MEMORY);
+            skip(c, (int64)body_size + (c->binary ? 0 : 2), MSG_OUT_OF_MEMORY);
+            return;
+        }
+    }
+
+    fill_extra_data(c);
+
+    /* it's possible we already have a complete job */
+    maybe_enqueue_incoming_job(c);
+}
+
+static void
+peek_job(Conn *c, uint64 id)
+{
+    /* reply_job takes a reference to the body, so another connection
+     * may free the job while we are still writing it out. */
+    Job *j = job_find(id);
+
+    if (!j) {
+        reply_msg(c, MSG_NOTFOUND);
+        return;
+    }
+    reply_job(c, j, MSG_FOUND);
+}
+
+// delete_job deletes job id for c. It returns 1 on success, otherwise
+// it has sent the error reply and returns 0.
+static int
+delete_job(Conn *c, uint64 id)
+{
+    Job *j;
+    int r;
+
+    j = take_deletable_job(c, id);
+    if (!j) {
+        reply_msg(c, MSG_NOTFOUND);
+        return 0;
+    }
+
+    j->tube->stat.total_delete_ct++;
+
+    j->r.state = Invalid;
+    r = walwrite(&c->srv->wal, j);
+    walmaint(&c->srv->wal);
+    job_free(j);
+
+    if (!r) {
+        reply_serr(c, MSG_INTERNAL_ERROR);
+        return 0;
+    }
+    return 1;
+}
+
+// release_job releases job id, reserved by c. It returns 1 on success,
+// otherwise it has sent the reply and returns 0.
+static int
+release_job(Conn *c, uint64 id, uint32 pri, int64 delay)
+{
+    Job *j;
+    int r;
+
+    j = remove_reserved_job(c, job_find(id));
+
+    if (!j) {
+        reply_msg(c, MSG_NOTFOUND);
+        return 0;
+    }
+
+    /* We want to update the delay deadline on disk, so reserve space for
+     * that. */
+    if (delay) {
+        int z = walresvupdate(&c->srv->wal, j);
+        if (!z) {
+            reply_serr(c, MSG_OUT_OF_MEMORY);
+            return 0;
+        }
+        j->walresv += z;
+    }
+
+    j->r.pri = pri;
+    j->r.delay = delay;
+    j->r.release_ct++;
+
+    r = enqueue_job(c->srv, j, delay, !!delay);
+    if (r < 0) {
+        reply_serr(c, MSG_INTERNAL_ERROR);
+        return 0;
+    }
+    if (r == 1)
+        return 1;
+
+    /* out of memory trying to grow the queue, so it gets buried */
+    bury_job(c->srv, j, 0);
+    reply_msg(c, MSG_BURIED);
+    return 0;
+}
+
+static void
+bury_reserved_job(Conn *c, uint64 id, uint32 pri)
+{
+    Job *j;
+
+    j = remove_reserved_job(c, job_find(id));
+
+    if (!j) {
+        reply_msg(c, MSG_NOTFOUND);
+        return;
+    }
+
+    j->r.pri = pri;
+    if (!bury_job(c->srv, j, 1)) {
+        reply_serr(c, MSG_INTERNAL_ERROR);
+        return;
+    }
+    reply_msg(c, MSG_BURIED);
+}
+
+static void
+kick_job_by_id(Conn *c, uint64 id)
+{
+    Job *j = job_find(id);
+
+    if (!j) {
+        reply_msg(c, MSG_NOTFOUND);
+        return;
+    }
+
+    if ((j->r.state == Buried && kick_buried_job(c->srv, j)) ||
+        (j->r.state == Delayed && kick_delayed_job(c->srv, j))) {
+        reply_msg(c, MSG_KICKED);
+    } else {
+        reply_msg(c, MSG_NOTFOUND);
+    }
+}
+
+static void
+touch_job_by_id(Conn *c, uint64 id)
+{
+    if (touch_job(c, job_find(id))) {
+        reply_msg(c, MSG_TOUCHED);
+    } else {
+        reply_msg(c, MSG_NOTFOUND);
+    }
+}
+
+static void
+stats_job(Conn *c, uint64 id)
+{
+    Job *j = job_find(id);
+
+    if (!j) {
+        reply_msg(c, MSG_NOTFOUND);
+        return;
+    }
+
+    if (!j->tube) {
+        reply_serr(c, MSG_INTERNAL_ERROR);
+        return;
+    }
+    reply_stats(c, fmt_job_stats, j);
+}
+
+static void
+stats_tube(Conn *c, const char *name)
+{
+    Tube *t = tube_find(&tubes, name);
+
+    if (!t) {
+        reply_msg(c, MSG_NOTFOUND);
+        return;
+    }
+    reply_stats(c, fmt_stats_tube, t);
+}
+
+// The longest key of a stats-latency line, with its ": ", and the
+// longest line: the key, six numbers of up to 20 digits, their keys
+// and the braces. There is a line for each command and 5 more.
+#define LATENCY_KEY_MAX 40
+#define LATENCY_LINE_MAX (LATENCY_KEY_MAX + 6 * 20 + 44 + 2)
+_Static_assert(4 + (TOTAL_OPS + 5) * LATENCY_LINE_MAX + 2 <= STATS_BUF_SIZE,
+               "stats-latency may not fit in STATS_BUF_SIZE");
+
+// fmt_stats_latency writes the stats-latency document of the server
+// at p and returns its end. Each command is listed as "cmd-<name>".
+static char *
+fmt_stats_latency(char *p, void *x)
+{
+    Server *s = x;
+    char key[LATENCY_KEY_MAX];
+    size_t i, n;
+
+    memcpy(p, "---\n", 4);
+    p += 4;
+    for (i = 1; i < TOTAL_OPS; i++) {
+        n = strcspn(op_names[i], " ");
+        memcpy(key, "cmd-", 4);
+        memcpy(key + 4, op_names[i], n);
+        memcpy(key + 4 + n, ": ", 2);
+        p = put_hist(p, key, n + 6, &op_lat[i]);
+    }
+    stat_hist(p, "queue-wait", &s->waitlat);
+    stat_hist(p, "process", &s->proclat);
+    stat_hist(p, "binlog-write", &s->wal.writelat);
+    stat_hist(p, "binlog-fsync", &s->wal.synclat);
+    stat_hist(p, "loop", &s->looplat);
+    *p++ = '\r';
+    *p++ = '\n';
+    return p;
+}
+
+static char *
+fmt_stats_latency_tube(char *p, void *x)
+{
+    static Hist empty;
+    Tube *t = x;
+
+    memcpy(p, "---\n", 4);
+    p += 4;
+    stat_qstr(p, "name", t->name);
+    stat_hist(p, "process", t->proclat ? t->proclat : &empty);
+    *p++ = '\r';
+    *p++ = '\n';
+    return p;
+}
+
+// The longest line of a stats-tubes reply: a name and 14 numbers.
+#define TUBES_ROW_MAX (MAX_TUBE_NAME_LEN + 14 * 21 + 2)
+
+static char *
+put_col(char *p, uint64 v)
+{
+    *p++ = ' ';
+    return p + fmt_u64(p, v);
+}
+
+// fmt_tubes_row writes the stats-tubes line of t at p and returns
+// its end. The columns are those of stats-tube, in the same order.
+static char *
+fmt_tubes_row(char *p, Tube *t, int64 now)
+{
+    int64 time_left = 0;
+    size_t len = strlen(t->name);
+
+    if (t->pause > 0) {
+        time_left = (t->unpause_at - now) / 1000000000;
+    }
+    memcpy(p, t->name, len);
+    p += len;
+    p = put_col(p, t->stat.urgent_ct);
+    p = put_col(p, t->ready.len);
+    p = put_col(p, t->stat.reserved_ct);
+    p = put_col(p, t->delay.len);
+    p = put_col(p, t->stat.buried_ct);
+    p = put_col(p, t->stat.total_jobs_ct);
+    p = put_col(p, t->using_ct);
+    p = put_col(p, t->watching_ct);
+    p = put_col(p, t->stat.waiting_ct);
+    p = put_col(p, t->stat.total_delete_ct);
+    p = put_col(p, t->stat.pause_ct);
+    p = put_col(p, t->pause / 1000000000);
+    p = put_col(p, time_left > 0 ? time_left : 0);
+    p = put_col(p, !t->ephemeral);
+    *p++ = '\r';
+    *p++ = '\n';
+    return p;
+}
+
+// stats_tubes_next makes the next rows of c's stats-tubes reply, as
+// many as fit in the stats buffer, the body to send. It returns 0 once
+// all rows are sent, and lets go of the tubes. Rows are made as the
+// client reads them, so a reply is never held in memory at once, and
+// each row shows its tube as of the moment it is sent.
+static int
+stats_tubes_next(Conn *c)
+{
+    Body *b;
+    char *p, *end;
+    int64 now;
+
+    if (c->tubes_sent == c->stats_tubes.len) {
+        ms_clear(&c->stats_tubes);
+        c->tubes_sent = 0;
+        return 0;
+    }
+
+    body_unref(c->out_body);
+    c->out_body = NULL;
+    b = stats_buf(c);
+    if (!b) {
+        twarnx("OOM in the middle of stats-tubes");
+        c->state = STATE_CLOSE;
+        return 1;
+    }
+
+    now = curtime();
+    p = b->data;
+    end = b->data + STATS_BUF_SIZE - TUBES_ROW_MAX;
+    while (c->tubes_sent < c->stats_tubes.len && p <= end) {
+        p = fmt_tubes_row(p, c->stats_tubes.items[c->tubes_sent++], now);
+    }
+    b->size = p - b->data;
+    c->out_body = body_ref(b);
+    c->out_body_sent = 0;
+    return 1;
 }
 
-/* j can be NULL */
-static Job *
-remove_this_reserved_job(Conn *c, Job *j)
+// stats_tubes replies to stats-tubes with a line for each tube whose
+// name matches pattern, or for every tube if pattern is NULL. The set
+// of tubes is fixed here, so the count in the first line is exact,
+// and the tubes are held until their lines are sent.
+static void
+stats_tubes(Conn *c, const char *pattern)
 {
-    j = job_list_remove(j);
-    if (j) {
-        global_stat.reserved_ct--;
-        j->tube->stat.reserved_ct--;
-        j->reserver = NULL;
+    size_t i, n;
+    Tube *t;
+
+    for (i = 0; i < tubes.len; i++) {
+        t = tubes.items[i];
+        if (pattern && fnmatch(pattern, t->name, 0) != 0)
+            continue;
+        if (!ms_append(&c->stats_tubes, t)) {
+            ms_clear(&c->stats_tubes);
+            reply_serr(c, MSG_OUT_OF_MEMORY);
+            return;
+        }
     }
-    c->soonest_job = NULL;
-    return j;
+
+    n = c->stats_tubes.len;
+    c->tubes_sent = 0;
+    if (!n) {
+        reply_num(c, STATE_SEND_WORD, MSG_TUBES, 0);
+        return;
+    }
+    if (!stats_buf(c)) {
+        ms_clear(&c->stats_tubes);
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+    stats_tubes_next(c);
+    reply_num(c, STATE_SEND_JOB, MSG_TUBES, n);
 }
 
-static Job *
-remove_reserved_job(Conn *c, Job *j)
+// The longest line of a list-conns reply: an address, a tube name,
+// a state and a type of at most 64 bytes between them, and 10 numbers.
+#define CONNS_ROW_MAX (sizeof(((Conn *)0)->addr) + MAX_TUBE_NAME_LEN + \
+                       64 + 10 * 21 + 2)
+
+static char *
+put_word(char *p, const char *s)
 {
-    if (!is_job_reserved_by_conn(c, j))
-        return NULL;
-    return remove_this_reserved_job(c, j);
+    size_t len = strlen(s);
+
+    *p++ = ' ';
+    memcpy(p, s, len);
+    return p + len;
 }
 
-static bool
-is_valid_tube(const char *name, size_t max)
+// fmt_conns_row writes the list-conns line of c at p and returns its
+// end. The columns are those of stats-conn, with type in place of
+// producer, worker and waiting, and without binary.
+static char *
+fmt_conns_row(char *p, Conn *c, int64 now)
 {
-    size_t len = strlen(name);
-    return 0 < len && len <= max &&
-        strspn(name, NAME_CHARS) == len &&
-        name[0] != '-';
+    p += fmt_u64(p, c->sock.fd);
+    p = put_word(p, c->addr);
+    p = put_word(p, state_names[(int)c->state]);
+    p = put_word(p, type_names[c->type & 7]);
+    p = put_word(p, c->use->name);
+    p = put_col(p, c->watch.len);
+    p = put_col(p, c->reserved_n);
+    p = put_col(p, conn_time_left(c, now));
+    p = put_col(p, c->bytes_in);
+    p = put_col(p, c->bytes_out);
+    p = put_col(p, c->cmd_ct);
+    p = put_col(p, c->reply_ct);
+    p = put_col(p, (now - c->since) / 1000000000);
+    *p++ = '\r';
+    *p++ = '\n';
+    return p;
+}
+
+// list_conns_next makes the next lines of c's list-conns reply, as
+// many as fit in the stats buffer, the body to send, going through the
+// conns by fd from c->list_fd on. The last body ends with an empty
+// line, after which list_fd is -1. It returns 0 once that is sent,
+// and 1 otherwise.
+static int
+list_conns_next(Conn *c)
+{
+    int lim = conn_fd_limit();
+    Conn *o;
+    Body *b;
+    char *p, *end;
+    int64 now;
+
+    if (!c->listing)
+        return 0;
+    if (c->list_fd < 0) {
+        c->listing = 0;
+        return 0;
+    }
+
+    body_unref(c->out_body);
+    c->out_body = NULL;
+    b = stats_buf(c);
+    if (!b) {
+        twarnx("OOM in the middle of list-conns");
+        c->state = STATE_CLOSE;
+        return 1;
+    }
+
+    now = curtime();
+    p = b->data;
+    end = b->data + STATS_BUF_SIZE - CONNS_ROW_MAX;
+    while (c->list_fd < lim && p <= end) {
+        if ((o = conn_by_fd(c->list_fd++)))
+            p = fmt_conns_row(p, o, now);
+    }
+    if (c->list_fd == lim) {
+        *p++ = '\r';
+        *p++ = '\n';
+        c->list_fd = -1;
+    }
+    b->size = p - b->data;
+    c->out_body = body_ref(b);
+    c->out_body_sent = 0;
+    return 1;
+}
+
+// list_conns replies to list-conns with a line for each open conn.
+// The lines are made as the client reads them, a buffer at a time, so
+// each shows its conn as of the moment it is sent.
+static void
+list_conns(Conn *c)
+{
+    if (!stats_buf(c)) {
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+    c->listing = 1;
+    c->list_fd = 0;
+    list_conns_next(c);
+    reply(c, MSG_CONNS, CONSTSTRLEN(MSG_CONNS), STATE_SEND_JOB);
+}
+
+static void
+use_tube(Conn *c, const char *name)
+{
+    Tube *t = NULL;
+
+    TUBE_ASSIGN(t, tube_find_or_make(name));
+    if (!t) {
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+
+    c->use->using_ct--;
+    TUBE_ASSIGN(c->use, t);
+    TUBE_ASSIGN(t, NULL);
+    c->use->using_ct++;
+
+    reply_line(c, STATE_SEND_WORD, "USING %s\r\n", c->use->name);
+}
+
+static void
+watch_tube(Conn *c, const char *name)
+{
+    Tube *t = NULL;
+    int r;
+
+    TUBE_ASSIGN(t, tube_find_or_make(name));
+    if (!t) {
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+
+    r = 1;
+    if (!ms_contains(&c->watch, t))
+        r = ms_append(&c->watch, t);
+    TUBE_ASSIGN(t, NULL);
+    if (!r) {
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+    reply_num(c, STATE_SEND_WORD, "WATCHING", c->watch.len);
+}
+
+static void
+ignore_tube(Conn *c, const char *name)
+{
+    Tube *t = tube_find(&c->watch, name);
+
+    if (t && c->watch.len < 2) {
+        reply_msg(c, MSG_NOT_IGNORED);
+        return;
+    }
+
+    if (t)
+        ms_remove(&c->watch, t); /* may free t if refcount => 0 */
+    reply_num(c, STATE_SEND_WORD, "WATCHING", c->watch.len);
 }
 
 static void
 dispatch_cmd(Conn *c)
 {
-    int r, timeout = -1;
-    uint i;
+    int timeout = -1, state;
     uint count;
     Job *j = 0;
     byte type;
-    char *size_buf, *delay_buf, *ttr_buf, *pri_buf, *end_buf, *name;
+    char *size_buf, *delay_buf, *ttr_buf, *pri_buf, *end_buf, *name, *key;
+    int keylen;
     uint32 pri;
     uint32 body_size;
     int64 delay, ttr;
     uint64 id;
     Tube *t = NULL;
+    Conn *other;
 
     /* NUL-terminate this string so we can use strtol and friends */
     c->cmd[c->cmd_len - 2] = '\0';
@@ -1307,7 +3225,10 @@ dispatch_cmd(Conn *c)
         return;
     }
 
-    type = which_cmd(c);
+    /* a streaming conn gets no pushes while it runs a command */
+    remove_waiting_conn(c);
+
+    type = cur_op = which_cmd(c);
     if (verbose >= 2) {
         printf("<%d command %s\n", c->sock.fd, op_names[type]);
     }
@@ -1329,32 +3250,55 @@ dispatch_cmd(Conn *c)
             return;
         }
 
-        /* don't allow trailing garbage */
+        // an optional deduplication key; nothing else may follow
+        key = NULL;
+        keylen = 0;
+        if (end_buf[0] == ' ') {
+            key = end_buf + 1;
+            keylen = strspn(key, NAME_CHARS);
+            end_buf = key + keylen;
+            if (keylen < 1 || keylen > MAX_DEDUP_KEY_LEN) {
+                reply_msg(c, MSG_BAD_FORMAT);
+                return;
+            }
+        }
         if (end_buf[0] != '\0') {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
 
-        connsetproducer(c);
+        put_job(c, pri, delay, ttr, body_size, key, keylen);
+        return;
 
-        if (ttr < 1000000000) {
-            ttr = 1000000000;
+    case OP_PUT_BATCH:
+        if (read_u32(&count, c->cmd + CMD_PUT_BATCH_LEN, &size_buf) ||
+            read_u32(&body_size, size_buf, &end_buf)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
         }
+        op_ct[type]++;
 
-        c->in_job = make_job(pri, delay, ttr, body_size + 2, c->use);
-
-        /* OOM? */
-        if (!c->in_job) {
-            /* throw away the job body and respond with OUT_OF_MEMORY */
-            twarnx("server error: " MSG_OUT_OF_MEMORY);
-            skip(c, body_size + 2, MSG_OUT_OF_MEMORY);
+        /* don't allow trailing garbage */
+        if (end_buf[0] != '\0' || count == 0 || count > PUT_BATCH_MAX) {
+            skip(c, (int64)body_size + 2, MSG_BAD_FORMAT);
             return;
         }
 
-        fill_extra_data(c);
+        if ((uint64)body_size + 2 > JOB_DATA_SIZE_LIMIT_MAX ||
+            body_size > (uint64)count * (job_data_size_limit + LINE_BUF_SIZE + 2)) {
+            /* throw away the payload and respond with JOB_TOO_BIG */
+            skip(c, (int64)body_size + 2, MSG_JOB_TOO_BIG);
+            return;
+        }
 
-        /* it's possible we already have a complete job */
-        maybe_enqueue_incoming_job(c);
+        connsetproducer(c);
+        if (mem_over((uint64)count * (sizeof(Job) + sizeof(Body)) +
+                     body_size + 2)) {
+            skip(c, (int64)body_size + 2, MSG_OUT_OF_CAPACITY);
+            return;
+        }
+        c->in_batch = count;
+        read_payload(c, type, body_size, 0, 0);
         return;
 
     case OP_PEEK_READY:
@@ -1366,7 +3310,7 @@ dispatch_cmd(Conn *c)
         op_ct[type]++;
 
         if (c->use->ready.len) {
-            j = job_copy(c->use->ready.data[0]);
+            j = c->use->ready.data[0];
         }
 
         if (!j) {
@@ -1385,7 +3329,7 @@ dispatch_cmd(Conn *c)
         op_ct[type]++;
 
         if (c->use->delay.len) {
-            j = job_copy(c->use->delay.data[0]);
+            j = c->use->delay.data[0];
         }
 
         if (!j) {
@@ -1404,7 +3348,7 @@ dispatch_cmd(Conn *c)
         op_ct[type]++;
 
         if (buried_job_p(c->use))
-            j = job_copy(c->use->buried.next);
+            j = c->use->buried.next;
         else
             j = NULL;
 
@@ -1421,17 +3365,7 @@ dispatch_cmd(Conn *c)
             return;
         }
         op_ct[type]++;
-
-        /* So, peek is annoying, because some other connection might free the
-         * job while we are still trying to write it out. So we copy it and
-         * free the copy when it's done sending, in the "conn_want_command" function. */
-        j = job_copy(job_find(id));
-
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
-            return;
-        }
-        reply_job(c, j, MSG_FOUND);
+        peek_job(c, id);
         return;
 
     case OP_RESERVE_TIMEOUT:
@@ -1463,6 +3397,60 @@ dispatch_cmd(Conn *c)
         process_queue();
         return;
 
+    case OP_RESERVE_BATCH:
+        if (read_u32(&count, c->cmd + CMD_RESERVE_BATCH_LEN, &end_buf) ||
+            count == 0 || count > RESERVE_BATCH_MAX) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        if (read_timeout(&timeout, end_buf)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+        connsetworker(c);
+
+        // Without a timeout, or if any job is ready, never block.
+        if (timeout < 0 || next_watched_job(c, curtime())) {
+            reserve_batch(c, NULL, count);
+            return;
+        }
+
+        if (conndeadlinesoon(c)) {
+            reply_msg(c, MSG_DEADLINE_SOON);
+            return;
+        }
+
+        c->batch_n = count;
+        wait_for_job(c, timeout);
+        process_queue();
+        return;
+
+    case OP_RESERVE_STREAM:
+        if (read_u32(&count, c->cmd + CMD_RESERVE_STREAM_LEN, NULL)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+        connsetworker(c);
+
+        // Pushes start once the reply has been sent; see conn_stream.
+        c->stream_window = count;
+        reply_line(c, STATE_SEND_WORD, MSG_STREAMING_FMT, count);
+        return;
+
+    case OP_BINARY:
+        if (read_u32(&count, c->cmd + CMD_BINARY_LEN, NULL) || count != 1) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+
+        // The reply is the last text this conn sees.
+        reply_line(c, STATE_SEND_WORD, MSG_BINARY_FMT, count);
+        c->binary = 1;
+        return;
+
     case OP_RESERVE_JOB:
         if (read_u64(&id, c->cmd + CMD_RESERVE_JOB_LEN, NULL)) {
             reply_msg(c, MSG_BAD_FORMAT);
@@ -1505,87 +3493,60 @@ dispatch_cmd(Conn *c)
         reply_job(c, j, MSG_RESERVED);
         return;
 
-    case OP_DELETE:
-        if (read_u64(&id, c->cmd + CMD_DELETE_LEN, NULL)) {
+    case OP_DELETE_RESERVE:
+        if (read_u64(&id, c->cmd + CMD_DELETE_RESERVE_LEN, &end_buf) ||
+            read_timeout(&timeout, end_buf)) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
-        op_ct[type]++;
-
-        {
-            Job *jf = job_find(id);
-            j = remove_reserved_job(c, jf);
-            if (!j)
-                j = remove_ready_job(jf);
-            if (!j)
-                j = remove_buried_job(jf);
-            if (!j)
-                j = remove_delayed_job(jf);
-        }
+        goto delete;
 
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
+    case OP_DELETE:
+        if (read_u64(&id, c->cmd + CMD_DELETE_LEN, NULL)) {
+            reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
 
-        j->tube->stat.total_delete_ct++;
-
-        j->r.state = Invalid;
-        r = walwrite(&c->srv->wal, j);
-        walmaint(&c->srv->wal);
-        job_free(j);
+    delete:
+        op_ct[type]++;
 
-        if (!r) {
-            reply_serr(c, MSG_INTERNAL_ERROR);
+        if (!delete_job(c, id))
+            return;
+        if (type == OP_DELETE_RESERVE) {
+            reserve_or_wait(c, timeout);
             return;
         }
         reply_msg(c, MSG_DELETED);
         return;
 
-    case OP_RELEASE:
-        if (read_u64(&id, c->cmd + CMD_RELEASE_LEN, &pri_buf) ||
+    case OP_RELEASE_RESERVE:
+        if (read_u64(&id, c->cmd + CMD_RELEASE_RESERVE_LEN, &pri_buf) ||
             read_u32(&pri, pri_buf, &delay_buf) ||
-            read_duration(&delay, delay_buf, NULL)) {
+            read_duration(&delay, delay_buf, &end_buf) ||
+            read_timeout(&timeout, end_buf)) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
-        op_ct[type]++;
-
-        j = remove_reserved_job(c, job_find(id));
+        goto release;
 
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
+    case OP_RELEASE:
+        if (read_u64(&id, c->cmd + CMD_RELEASE_LEN, &pri_buf) ||
+            read_u32(&pri, pri_buf, &delay_buf) ||
+            read_duration(&delay, delay_buf, NULL)) {
+            reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
 
-        /* We want to update the delay deadline on disk, so reserve space for
-         * that. */
-        if (delay) {
-            int z = walresvupdate(&c->srv->wal);
-            if (!z) {
-                reply_serr(c, MSG_OUT_OF_MEMORY);
-                return;
-            }
-            j->walresv += z;
-        }
-
-        j->r.pri = pri;
-        j->r.delay = delay;
-        j->r.release_ct++;
+    release:
+        op_ct[type]++;
 
-        r = enqueue_job(c->srv, j, delay, !!delay);
-        if (r < 0) {
-            reply_serr(c, MSG_INTERNAL_ERROR);
+        if (!release_job(c, id, pri, delay))
             return;
-        }
-        if (r == 1) {
-            reply_msg(c, MSG_RELEASED);
+        if (type == OP_RELEASE_RESERVE) {
+            reserve_or_wait(c, timeout);
             return;
         }
-
-        /* out of memory trying to grow the queue, so it gets buried */
-        bury_job(c->srv, j, 0);
-        reply_msg(c, MSG_BURIED);
+        reply_msg(c, MSG_RELEASED);
         return;
 
     case OP_BURY:
@@ -1596,21 +3557,42 @@ dispatch_cmd(Conn *c)
         }
 
         op_ct[type]++;
+        bury_reserved_job(c, id, pri);
+        return;
 
-        j = remove_reserved_job(c, job_find(id));
+    case OP_DELETE_MANY:
+        if (read_u32(&body_size, c->cmd + CMD_DELETE_MANY_LEN, NULL)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        pri = 0;
+        delay = 0;
+        goto id_list;
+
+    case OP_RELEASE_MANY:
+        if (read_u32(&pri, c->cmd + CMD_RELEASE_MANY_LEN, &delay_buf) ||
+            read_duration(&delay, delay_buf, &size_buf) ||
+            read_u32(&body_size, size_buf, NULL)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        goto id_list;
 
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
+    case OP_BURY_MANY:
+        if (read_u32(&pri, c->cmd + CMD_BURY_MANY_LEN, &size_buf) ||
+            read_u32(&body_size, size_buf, NULL)) {
+            reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
+        delay = 0;
 
-        j->r.pri = pri;
-        r = bury_job(c->srv, j, 1);
-        if (!r) {
-            reply_serr(c, MSG_INTERNAL_ERROR);
+    id_list:
+        op_ct[type]++;
+        if (body_size > ID_LIST_MAX * 21) {
+            skip(c, (int64)body_size + 2, MSG_BAD_FORMAT);
             return;
         }
-        reply_msg(c, MSG_BURIED);
+        read_payload(c, type, body_size, pri, delay);
         return;
 
     case OP_KICK:
@@ -1622,9 +3604,7 @@ dispatch_cmd(Conn *c)
         }
 
         op_ct[type]++;
-
-        i = kick_jobs(c->srv, c->use, count);
-        reply_line(c, STATE_SEND_WORD, "KICKED %u\r\n", i);
+        start_bulk(c, OP_KICK, c->use, 0, count);
         return;
 
     case OP_KICKJOB:
@@ -1634,91 +3614,148 @@ dispatch_cmd(Conn *c)
         }
 
         op_ct[type]++;
+        kick_job_by_id(c, id);
+        return;
 
-        j = job_find(id);
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
+    case OP_TOUCH:
+        if (read_u64(&id, c->cmd + CMD_TOUCH_LEN, NULL)) {
+            reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
+        op_ct[type]++;
+        touch_job_by_id(c, id);
+        return;
 
-        if ((j->r.state == Buried && kick_buried_job(c->srv, j)) ||
-            (j->r.state == Delayed && kick_delayed_job(c->srv, j))) {
-            reply_msg(c, MSG_KICKED);
-        } else {
-            reply_msg(c, MSG_NOTFOUND);
+    case OP_STATS:
+        /* don't allow trailing garbage */
+        if (c->cmd_len != CMD_STATS_LEN + 2) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
         }
+        op_ct[type]++;
+
+        reply_stats(c, fmt_stats, c->srv);
         return;
 
-    case OP_TOUCH:
-        if (read_u64(&id, c->cmd + CMD_TOUCH_LEN, NULL)) {
+    case OP_STATSJOB:
+        if (read_u64(&id, c->cmd + CMD_STATSJOB_LEN, NULL)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+        stats_job(c, id);
+        return;
+
+    case OP_STATS_TUBE:
+        name = c->cmd + CMD_STATS_TUBE_LEN;
+        if (!is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
         op_ct[type]++;
-
-        if (touch_job(c, job_find(id))) {
-            reply_msg(c, MSG_TOUCHED);
-        } else {
-            reply_msg(c, MSG_NOTFOUND);
-        }
+        stats_tube(c, name);
         return;
 
-    case OP_STATS:
-        /* don't allow trailing garbage */
-        if (c->cmd_len != CMD_STATS_LEN + 2) {
+    case OP_STATS_TUBES:
+        name = NULL;
+        if (c->cmd[CMD_STATS_TUBES_LEN] == ' ') {
+            name = c->cmd + CMD_STATS_TUBES_LEN + 1;
+            if (!*name || strlen(name) > MAX_TUBE_NAME_LEN - 1 ||
+                strchr(name, ' ')) {
+                reply_msg(c, MSG_BAD_FORMAT);
+                return;
+            }
+        } else if (c->cmd[CMD_STATS_TUBES_LEN] != '\0') {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
         op_ct[type]++;
-
-        do_stats(c, fmt_stats, c->srv);
+        stats_tubes(c, name);
         return;
 
-    case OP_STATSJOB:
-        if (read_u64(&id, c->cmd + CMD_STATSJOB_LEN, NULL)) {
+    case OP_STATS_LATENCY:
+        if (c->cmd[CMD_STATS_LATENCY_LEN] == '\0') {
+            op_ct[type]++;
+            reply_stats(c, fmt_stats_latency, c->srv);
+            return;
+        }
+        name = c->cmd + CMD_STATS_LATENCY_LEN + 1;
+        if (c->cmd[CMD_STATS_LATENCY_LEN] != ' ' ||
+            !is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
         op_ct[type]++;
-
-        j = job_find(id);
-        if (!j) {
+        t = tube_find(&tubes, name);
+        if (!t) {
             reply_msg(c, MSG_NOTFOUND);
             return;
         }
+        reply_stats(c, fmt_stats_latency_tube, t);
+        return;
 
-        if (!j->tube) {
-            reply_serr(c, MSG_INTERNAL_ERROR);
+    case OP_LIST_TUBES:
+        /* don't allow trailing garbage */
+        if (c->cmd_len != CMD_LIST_TUBES_LEN + 2) {
+            reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
-        do_stats(c, (fmt_fn) fmt_job_stats, j);
+        op_ct[type]++;
+        do_list_tubes(c, &tubes);
         return;
 
-    case OP_STATS_TUBE:
-        name = c->cmd + CMD_STATS_TUBE_LEN;
-        if (!is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
+    case OP_LIST_JOBS:
+        if (read_tube_name(&name, c->cmd + CMD_LIST_JOBS_LEN, &delay_buf) ||
+            read_job_state(&state, delay_buf, &end_buf) ||
+            read_u64(&id, end_buf, &end_buf) ||
+            read_u32(&count, end_buf, NULL) ||
+            count == 0 || count > LIST_JOBS_MAX) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
         op_ct[type]++;
 
+        *delay_buf = '\0';
+        if (!is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
         t = tube_find(&tubes, name);
         if (!t) {
             reply_msg(c, MSG_NOTFOUND);
             return;
         }
-        do_stats(c, (fmt_fn) fmt_stats_tube, t);
-        t = NULL;
+        list_jobs(c, t, state, id, count);
         return;
 
-    case OP_LIST_TUBES:
+    case OP_LIST_CONNS:
         /* don't allow trailing garbage */
-        if (c->cmd_len != CMD_LIST_TUBES_LEN + 2) {
+        if (c->cmd_len != CMD_LIST_CONNS_LEN + 2) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
         op_ct[type]++;
-        do_list_tubes(c, &tubes);
+        list_conns(c);
+        return;
+
+    case OP_STATS_CONN:
+        other = c;
+        if (c->cmd[CMD_STATS_CONN_LEN] == ' ') {
+            if (read_u32(&count, c->cmd + CMD_STATS_CONN_LEN, NULL)) {
+                reply_msg(c, MSG_BAD_FORMAT);
+                return;
+            }
+            other = conn_by_fd(count);
+        } else if (c->cmd[CMD_STATS_CONN_LEN] != '\0') {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+        if (!other) {
+            reply_msg(c, MSG_NOTFOUND);
+            return;
+        }
+        reply_stats(c, fmt_stats_conn, other);
         return;
 
     case OP_LIST_TUBE_USED:
@@ -1748,19 +3785,7 @@ dispatch_cmd(Conn *c)
             return;
         }
         op_ct[type]++;
-
-        TUBE_ASSIGN(t, tube_find_or_make(name));
-        if (!t) {
-            reply_serr(c, MSG_OUT_OF_MEMORY);
-            return;
-        }
-
-        c->use->using_ct--;
-        TUBE_ASSIGN(c->use, t);
-        TUBE_ASSIGN(t, NULL);
-        c->use->using_ct++;
-
-        reply_line(c, STATE_SEND_WORD, "USING %s\r\n", c->use->name);
+        use_tube(c, name);
         return;
 
     case OP_WATCH:
@@ -1770,22 +3795,7 @@ dispatch_cmd(Conn *c)
             return;
         }
         op_ct[type]++;
-
-        TUBE_ASSIGN(t, tube_find_or_make(name));
-        if (!t) {
-            reply_serr(c, MSG_OUT_OF_MEMORY);
-            return;
-        }
-
-        r = 1;
-        if (!ms_contains(&c->watch, t))
-            r = ms_append(&c->watch, t);
-        TUBE_ASSIGN(t, NULL);
-        if (!r) {
-            reply_serr(c, MSG_OUT_OF_MEMORY);
-            return;
-        }
-        reply_line(c, STATE_SEND_WORD, "WATCHING %zu\r\n", c->watch.len);
+        watch_tube(c, name);
         return;
 
     case OP_IGNORE:
@@ -1795,17 +3805,7 @@ dispatch_cmd(Conn *c)
             return;
         }
         op_ct[type]++;
-
-        t = tube_find(&c->watch, name);
-        if (t && c->watch.len < 2) {
-            reply_msg(c, MSG_NOT_IGNORED);
-            return;
-        }
-
-        if (t)
-            ms_remove(&c->watch, t); /* may free t if refcount => 0 */
-        t = NULL;
-        reply_line(c, STATE_SEND_WORD, "WATCHING %zu\r\n", c->watch.len);
+        ignore_tube(c, name);
         return;
 
     case OP_QUIT:
@@ -1837,18 +3837,253 @@ dispatch_cmd(Conn *c)
             delay = 1;
         }
 
-        t->unpause_at = nanoseconds() + delay;
+        t->unpause_at = curtime() + delay;
+        tubes_tick_at = min(tubes_tick_at, t->unpause_at);
         t->pause = delay;
         t->stat.pause_ct++;
 
         reply_line(c, STATE_SEND_WORD, "PAUSED\r\n");
         return;
 
+    case OP_FLUSH_TUBE:
+        state = 0;
+        end_buf = NULL;
+        if (read_tube_name(&name, c->cmd + CMD_FLUSH_TUBE_LEN, &delay_buf) ||
+            (delay_buf[strspn(delay_buf, " ")] &&
+             read_job_state(&state, delay_buf, &end_buf)) ||
+            (end_buf && end_buf[strspn(end_buf, " ")])) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+
+        *delay_buf = '\0';
+        if (!is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        t = tube_find(&tubes, name);
+        if (!t) {
+            reply_msg(c, MSG_NOTFOUND);
+            return;
+        }
+        start_bulk(c, OP_FLUSH_TUBE, t, state, 0);
+        return;
+
+    default:
+        reply_msg(c, MSG_UNKNOWN_COMMAND);
+    }
+}
+
+// dispatch_frame runs the binary request in c->cmd. Its header is
+// BIN_REQ_SIZE bytes, little-endian:
+//
+//     0   u8   op, the same OP_* code as the text command
+//     4   u32  the size of the data following the header
+//     8   u64  job id
+//     16  u32  priority, or the bound for kick
+//     20  u32  delay, or the timeout for reserve-with-timeout, in seconds
+//     24  u32  ttr in seconds
+//
+// Other bytes are zero. The data is the job body for put and the tube
+// name for use, watch, ignore and stats-tube. Each op has the same
+// semantics as its text command; see reply_frame for the replies.
+static void
+dispatch_frame(Conn *c)
+{
+    byte *p = (byte *)c->cmd;
+    byte type = p[0];
+    uint32 bytes = get_le32(p + 4);
+    uint64 id = get_le64(p + 8);
+    uint32 pri = get_le32(p + 16);
+    uint32 delay = get_le32(p + 20);
+    uint32 ttr = get_le32(p + 24);
+    char name[MAX_TUBE_NAME_LEN];
+
+    /* a streaming conn gets no pushes while it runs a command */
+    remove_waiting_conn(c);
+
+    if (type >= TOTAL_OPS)
+        type = OP_UNKNOWN;
+    cur_op = type;
+    if (verbose >= 2) {
+        printf("<%d frame %s\n", c->sock.fd, op_names[type]);
+    }
+
+    if (type == OP_PUT) {
+        op_ct[type]++;
+        if (bytes > job_data_size_limit) {
+            /* throw away the job body and respond with JOB_TOO_BIG */
+            skip(c, bytes, MSG_JOB_TOO_BIG);
+            return;
+        }
+        put_job(c, pri, (int64)delay * 1000000000, (int64)ttr * 1000000000, bytes,
+                NULL, 0);
+        return;
+    }
+
+    if (c->cmd_len == BIN_REQ_SIZE && bytes) {
+        /* data too long for any request but put */
+        skip(c, bytes, MSG_BAD_FORMAT);
+        return;
+    }
+    memcpy(name, c->cmd + BIN_REQ_SIZE, bytes);
+    name[bytes] = '\0';
+
+    switch (type) {
+    case OP_USE:
+    case OP_WATCH:
+    case OP_IGNORE:
+    case OP_STATS_TUBE:
+        if (strlen(name) != bytes || !is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+    }
+
+    switch (type) {
+    case OP_PEEKJOB:
+        op_ct[type]++;
+        peek_job(c, id);
+        return;
+
+    case OP_RESERVE_TIMEOUT:
+        if (delay > INT_MAX) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+        reserve_or_wait(c, delay);
+        return;
+
+    case OP_RESERVE:
+        op_ct[type]++;
+        reserve_or_wait(c, -1);
+        return;
+
+    case OP_DELETE:
+        op_ct[type]++;
+        if (delete_job(c, id))
+            reply_msg(c, MSG_DELETED);
+        return;
+
+    case OP_RELEASE:
+        op_ct[type]++;
+        if (release_job(c, id, pri, (int64)delay * 1000000000))
+            reply_msg(c, MSG_RELEASED);
+        return;
+
+    case OP_BURY:
+        op_ct[type]++;
+        bury_reserved_job(c, id, pri);
+        return;
+
+    case OP_KICK:
+        op_ct[type]++;
+        start_bulk(c, OP_KICK, c->use, 0, pri);
+        return;
+
+    case OP_KICKJOB:
+        op_ct[type]++;
+        kick_job_by_id(c, id);
+        return;
+
+    case OP_TOUCH:
+        op_ct[type]++;
+        touch_job_by_id(c, id);
+        return;
+
+    case OP_STATS:
+        op_ct[type]++;
+        reply_stats(c, fmt_stats, c->srv);
+        return;
+
+    case OP_STATSJOB:
+        op_ct[type]++;
+        stats_job(c, id);
+        return;
+
+    case OP_STATS_TUBE:
+        op_ct[type]++;
+        stats_tube(c, name);
+        return;
+
+    case OP_USE:
+        op_ct[type]++;
+        use_tube(c, name);
+        return;
+
+    case OP_WATCH:
+        op_ct[type]++;
+        watch_tube(c, name);
+        return;
+
+    case OP_IGNORE:
+        op_ct[type]++;
+        ignore_tube(c, name);
+        return;
+
+    case OP_QUIT:
+        c->state = STATE_CLOSE;
+        return;
+
     default:
         reply_msg(c, MSG_UNKNOWN_COMMAND);
     }
 }
 
+// bulk_slice runs c's kick or flush-tube for up to Bulkslice
+// nanoseconds. If there is more to do, c waits in STATE_BULK and
+// prottick comes back to it right away through conn_timeout;
+// otherwise c gets its reply.
+static void
+bulk_slice(Conn *c)
+{
+    int64 deadline = nanoseconds() + Bulkslice;
+    int n, more;
+
+    do {
+        if (c->bulk_op == OP_KICK) {
+            n = kick_batch(c->srv, c->bulk_tube, c->bulk_left);
+        } else {
+            n = flush_batch(c->srv, c->bulk_tube, c->bulk_state);
+        }
+        if (n < 0)
+            break;
+        if (c->bulk_op == OP_KICK)
+            c->bulk_left -= n;
+        c->bulk_ct += n;
+        more = n && (c->bulk_op != OP_KICK || c->bulk_left);
+    } while (more && nanoseconds() < deadline);
+
+    if (n < 0) {
+        // the binlog failed, as in delete_job
+        TUBE_ASSIGN(c->bulk_tube, NULL);
+        reply_serr(c, MSG_INTERNAL_ERROR);
+    } else if (more) {
+        c->state = STATE_BULK;
+        epollq_add(c, 'h');
+    } else {
+        TUBE_ASSIGN(c->bulk_tube, NULL);
+        reply_num(c, STATE_SEND_WORD,
+                  c->bulk_op == OP_KICK ? "KICKED" : "FLUSHED", c->bulk_ct);
+    }
+    connsched(c);
+}
+
+// start_bulk starts a kick of up to n jobs, or a flush-tube, of tube t
+// for c; see bulk_slice.
+static void
+start_bulk(Conn *c, byte op, Tube *t, int state, uint n)
+{
+    c->bulk_op = op;
+    c->bulk_state = state;
+    c->bulk_left = n;
+    c->bulk_ct = 0;
+    TUBE_ASSIGN(c->bulk_tube, t);
+    bulk_slice(c);
+}
+
 /* There are three reasons this function may be called. We need to check for
  * all of them.
  *
@@ -1863,24 +4098,22 @@ conn_timeout(Conn *c)
     int should_timeout = 0;
     Job *j;
 
+    if (c->state == STATE_BULK)
+        bulk_slice(c);
+
     /* Check if the client was trying to reserve a job. */
-    if (conn_waiting(c) && conndeadlinesoon(c))
+    if (conn_blocked(c) && conndeadlinesoon(c))
         should_timeout = 1;
 
     /* Check if any reserved jobs have run out of time. We should do this
      * whether or not the client is waiting for a new reservation. */
     while ((j = connsoonestjob(c))) {
-        if (j->r.deadline_at >= nanoseconds())
+        if (j->r.deadline_at >= curtime())
             break;
 
-        /* This job is in the middle of being written out. If we return it to
-         * the ready queue, someone might free it before we finish writing it
-         * out to the socket. So we'll copy it here and free the copy when it's
-         * done sending. */
-        if (j == c->out_job) {
-            c->out_job = job_copy(c->out_job);
-        }
-
+        /* The job may be in the middle of being written out; c holds a
+         * reference to its body, so it is fine for someone else to take
+         * and free it now. */
         timeout_ct++; /* stats */
         j->r.timeout_ct++;
         int r = enqueue_job(c->srv, remove_this_reserved_job(c, j), 0, 0);
@@ -1892,11 +4125,14 @@ conn_timeout(Conn *c)
     if (should_timeout) {
         remove_waiting_conn(c);
         reply_msg(c, MSG_DEADLINE_SOON);
-    } else if (conn_waiting(c) && c->pending_timeout >= 0) {
+    } else if (conn_blocked(c) && c->pending_timeout >= 0) {
         c->pending_timeout = -1;
         remove_waiting_conn(c);
         reply_msg(c, MSG_TIMED_OUT);
     }
+
+    /* expired reservations give a streaming conn room for more */
+    conn_stream(c);
 }
 
 void
@@ -1911,21 +4147,23 @@ conn_want_command(Conn *c)
 {
     epollq_add(c, 'r');
 
-    /* was this a peek or stats command? */
-    if (c->out_job && c->out_job->r.state == Copy)
-        job_free(c->out_job);
-    c->out_job = NULL;
+    body_unref(c->out_body);
+    c->out_body = NULL;
 
     c->reply_sent = 0; /* now that we're done, reset this */
+    c->batch_n = 0;
     c->state = STATE_WANT_COMMAND;
+
+    conn_stream(c);
 }
 
 static void
 conn_process_io(Conn *c)
 {
-    int r;
+    int r, n;
     int64 to_read;
     Job *j;
+    Body *b;
     struct iovec iov[2];
 
     switch (c->state) {
@@ -1940,8 +4178,9 @@ conn_process_io(Conn *c)
             return;
         }
 
+        c->bytes_in += r;
         c->cmd_read += r;
-        c->cmd_len = scan_line_end(c->cmd, c->cmd_read);
+        c->cmd_len = scan_cmd_end(c);
         if (c->cmd_len) {
             // We found complete command line. Bail out to h_conn.
             return;
@@ -1970,6 +4209,7 @@ conn_process_io(Conn *c)
             return;
         }
 
+        c->bytes_in += r;
         c->cmd_read += r;
         c->cmd_len = scan_line_end(c->cmd, c->cmd_read);
         if (c->cmd_len) {
@@ -2002,19 +4242,20 @@ conn_process_io(Conn *c)
             return;
         }
 
+        c->bytes_in += r;
         c->in_job_read -= r; /* we got some bytes */
 
         /* (c->in_job_read < 0) can't happen */
 
         if (c->in_job_read == 0) {
-            reply(c, c->reply, c->reply_len, STATE_SEND_WORD);
+            reply_word(c, c->reply, c->reply_len);
         }
         return;
     }
     case STATE_WANT_DATA:
         j = c->in_job;
 
-        r = read(c->sock.fd, j->body + c->in_job_read, j->r.body_size -c->in_job_read);
+        r = read(c->sock.fd, j->body + c->in_job_read, wire_size(c, j) - c->in_job_read);
         if (r == -1) {
             check_err(c, "read()");
             return;
@@ -2024,6 +4265,7 @@ conn_process_io(Conn *c)
             return;
         }
 
+        c->bytes_in += r;
         c->in_job_read += r; /* we got some bytes */
 
         /* (j->in_job_read > j->r.body_size) can't happen */
@@ -2041,6 +4283,7 @@ conn_process_io(Conn *c)
             return;
         }
 
+        c->bytes_out += r;
         c->reply_sent += r; /* we got some bytes */
 
         /* (c->reply_sent > c->reply_len) can't happen */
@@ -2053,12 +4296,13 @@ conn_process_io(Conn *c)
         /* otherwise we sent an incomplete reply, so just keep waiting */
         break;
     case STATE_SEND_JOB:
-        j = c->out_job;
+        b = c->out_body;
+        n = b->size - (c->binary ? 2 : 0);
 
         iov[0].iov_base = (void *)(c->reply + c->reply_sent);
         iov[0].iov_len = c->reply_len - c->reply_sent; /* maybe 0 */
-        iov[1].iov_base = j->body + c->out_job_sent;
-        iov[1].iov_len = j->r.body_size - c->out_job_sent;
+        iov[1].iov_base = b->data + c->out_body_sent;
+        iov[1].iov_len = n - c->out_body_sent;
 
         r = writev(c->sock.fd, iov, 2);
         if (r == -1) {
@@ -2071,19 +4315,22 @@ conn_process_io(Conn *c)
         }
 
         /* update the sent values */
+        c->bytes_out += r;
         c->reply_sent += r;
         if (c->reply_sent >= c->reply_len) {
-            c->out_job_sent += c->reply_sent - c->reply_len;
+            c->out_body_sent += c->reply_sent - c->reply_len;
             c->reply_sent = c->reply_len;
         }
 
-        /* (c->out_job_sent > j->r.body_size) can't happen */
+        /* (c->out_body_sent > n) can't happen */
 
         /* are we done? */
-        if (c->out_job_sent == j->r.body_size) {
+        if (c->out_body_sent == n) {
             if (verbose >= 2) {
-                printf(">%d job %"PRIu64"\n", c->sock.fd, j->r.id);
+                printf(">%d data %d\n", c->sock.fd, n);
             }
+            if (stats_tubes_next(c) || list_conns_next(c))
+                break;
             conn_want_command(c);
             return;
         }
@@ -2101,6 +4348,21 @@ conn_process_io(Conn *c)
     }
 }
 
+// log_slow_cmd logs a command that held up the event loop for d
+// nanoseconds, with the sizes that could explain it.
+static void
+log_slow_cmd(Conn *c, int64 d)
+{
+    const char *name = op_names[cur_op];
+    Tube *t = c->use;
+
+    twarnx("slow %.*s: %"PRId64"us on fd %d; tube %s has %zu ready,"
+           " %zu delayed, %"PRIu64" buried; %zu jobs in %zu tubes",
+           (int)strcspn(name, " "), name, d / 1000, c->sock.fd, t->name,
+           t->ready.len, t->delay.len, t->stat.buried_ct,
+           get_all_jobs_used(), tubes.len);
+}
+
 #define want_command(c) ((c)->sock.fd && ((c)->state == STATE_WANT_COMMAND))
 #define cmd_data_ready(c) (want_command(c) && (c)->cmd_read)
 
@@ -2120,9 +4382,20 @@ h_conn(const int fd, const short which, Conn *c)
     }
 
     conn_process_io(c);
-    while (cmd_data_ready(c) && (c->cmd_len = scan_line_end(c->cmd, c->cmd_read))) {
-        dispatch_cmd(c);
+    while (cmd_data_ready(c) && (c->cmd_len = scan_cmd_end(c))) {
+        int64 t = nanoseconds();
+
+        cur_op = OP_UNKNOWN;
+        c->cmd_ct++;
+        if (c->binary)
+            dispatch_frame(c);
+        else
+            dispatch_cmd(c);
         fill_extra_data(c);
+        t = nanoseconds() - t;
+        hist_record(&op_lat[cur_op], t);
+        if (srvstall(c->srv, Stallcmd, t))
+            log_slow_cmd(c, t);
     }
     if (c->state == STATE_CLOSE) {
         epollq_rmconn(c);
@@ -2145,41 +4418,57 @@ prottick(Server *s)
     int64 now;
     Tube *t;
     int64 period = 0x34630B8A000LL; /* 1 hour in nanoseconds */
-    int64 d;
-
-    now = nanoseconds();
-
-    // Enqueue all jobs that are no longer delayed.
-    // Capture the smallest period from the soonest delayed job.
-    while ((j = soonest_delayed_job())) {
-        d = j->r.deadline_at - now;
-        if (d > 0) {
-            period = min(period, d);
-            break;
+    int64 d, t0;
+    size_t i, n;
+
+    now = curtime();
+
+    if (now >= tubes_tick_at) {
+        n = 0;
+        t0 = nanoseconds();
+        tubes_tick_at = now + period;
+        // Enqueue all jobs that are no longer delayed.
+        // Capture the smallest period from the soonest delayed job.
+        while ((j = soonest_delayed_job())) {
+            d = j->r.deadline_at - now;
+            if (d > 0) {
+                period = min(period, d);
+                break;
+            }
+            remove_delayed_job(j);
+            int r = enqueue_job(s, j, 0, 0);
+            if (r < 1)
+                bury_job(s, j, 0);  /* out of memory */
+            n++;
         }
-        heapremove(&j->tube->delay, j->heap_index);
-        int r = enqueue_job(s, j, 0, 0);
-        if (r < 1)
-            bury_job(s, j, 0);  /* out of memory */
-    }
 
-    // Unpause every possible tube and process the queue.
-    // Capture the smallest period from the soonest pause deadline.
-    size_t i;
-    for (i = 0; i < tubes.len; i++) {
-        t = tubes.items[i];
-        d = t->unpause_at - now;
-        if (t->pause && d <= 0) {
-            t->pause = 0;
-            process_queue();
+        // Unpause every possible tube and process the queue.
+        // Capture the smallest period from the soonest pause deadline.
+        for (i = 0; i < tubes.len; i++) {
+            t = tubes.items[i];
+            d = t->unpause_at - now;
+            if (t->pause && d <= 0) {
+                t->pause = 0;
+                process_queue();
+            }
+            else if (d > 0) {
+                period = min(period, d);
+            }
         }
-        else if (d > 0) {
-            period = min(period, d);
+        tubes_tick_at = min(tubes_tick_at, now + period);
+        d = nanoseconds() - t0;
+        if (srvstall(s, Stalldelay, d)) {
+            twarnx("slow delay tick: %"PRId64"us; %zu jobs due, %zu tubes",
+                   d / 1000, n, tubes.len);
         }
     }
+    period = min(period, tubes_tick_at - now);
+    period = min(period, deduptick(now));
 
     // Process connections with pending timeouts. Release jobs with expired ttr.
     // Capture the smallest period from the soonest connection.
+    n = 0;
+    t0 = nanoseconds();
     while (s->conns.len) {
         Conn *c = s->conns.data[0];
         d = c->tickat - now;
@@ -2190,6 +4479,29 @@ prottick(Server *s)
         heapremove(&s->conns, 0);
         c->in_conns = 0;
         conn_timeout(c);
+        n++;
+    }
+    if (n) {
+        d = nanoseconds() - t0;
+        if (srvstall(s, Stalltimeout, d)) {
+            twarnx("slow timeouts: %"PRId64"us; %zu conns timed out", d / 1000, n);
+        }
+    }
+
+    // Migrate a slice of live records out of old binlog files.
+    // Come back right away if there is more to do.
+    if (s->wal.use) {
+        int64 nmig = s->wal.nmig;
+
+        t0 = nanoseconds();
+        if (walcompact(&s->wal)) {
+            period = 0;
+        }
+        d = nanoseconds() - t0;
+        if (srvstall(s, Stallcompact, d)) {
+            twarnx("slow binlog compaction: %"PRId64"us; %"PRId64" records moved",
+                   d / 1000, s->wal.nmig - nmig);
+        }
     }
 
     epollq_apply();
@@ -2197,6 +4509,28 @@ prottick(Server *s)
     return period;
 }
 
+// fmt_addr writes the numeric form of a peer's address into buf.
+static void
+fmt_addr(char *buf, size_t size, struct sockaddr *sa, socklen_t len)
+{
+    char host[INET6_ADDRSTRLEN], serv[8];
+    int r;
+
+    if (sa->sa_family != AF_INET && sa->sa_family != AF_INET6) {
+        snprintf(buf, size, "unix");
+        return;
+    }
+    r = getnameinfo(sa, len, host, sizeof host, serv, sizeof serv,
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+    if (r != 0) {
+        snprintf(buf, size, "?");
+    } else if (sa->sa_family == AF_INET6) {
+        snprintf(buf, size, "[%s]:%s", host, serv);
+    } else {
+        snprintf(buf, size, "%s:%s", host, serv);
+    }
+}
+
 void
 h_accept(const int fd, const short which, Server *s)
 {
@@ -2250,14 +4584,12 @@ h_accept(const int fd, const short which, Server *s)
     c->sock.x = c;
     c->sock.f = (Handle)prothandle;
     c->sock.fd = cfd;
+    fmt_addr(c->addr, sizeof c->addr, (struct sockaddr *)&addr, addrlen);
 
     r = sockwant(&c->sock, 'r');
     if (r == -1) {
         twarn("sockwant");
-        close(cfd);
-        if (verbose) {
-            printf("close %d\n", cfd);
-        }
+        connclose(c);
     }
     epollq_apply();
 }
@@ -2312,7 +4644,7 @@ prot_replay(Server *s, Job *list)
     for (j = list->next ; j != list ; j = nj) {
         nj = j->next;
         job_list_remove(j);
-        int z = walresvupdate(&s->wal);
+        int z = walresvupdate(&s->wal, j);
         if (!z) {
             twarnx("failed to reserve space");
             return 0;
@@ -1,10 +1,12 @@
 #include "dat.h"
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 
 struct Server srv = {
     .port = Portdef,
+    .slowop = DEFAULT_SLOW_MS * 1000000,
     .wal = {
         .filesize = Filesizedef,
         .wantsync = 1,
@@ -57,8 +59,13 @@ srvserve(Server *s)
     }
 
 
+    // curtime reads the clock clockupdate sets, which -C makes coarse;
+    // the busy time is measured with the precise one
     for (;;) {
+        clockupdate();
+        int64 t0 = nanoseconds();
         int64 period = prottick(s);
+        int64 busy = nanoseconds() - t0;
 
         int rw = socknext(&sock, period);
         if (rw == -1) {
@@ -67,8 +74,12 @@ srvserve(Server *s)
         }
 
         if (rw) {
+            clockupdate();
+            t0 = nanoseconds();
             sock->f(sock->x, rw);
+            busy += nanoseconds() - t0;
         }
+        hist_record(&s->looplat, busy);
     }
 }
 
@@ -76,5 +87,24 @@ srvserve(Server *s)
 void
 srvaccept(Server *s, int ev)
 {
+    int64 t0 = nanoseconds();
+
     h_accept(s->sock.fd, ev, s);
+    t0 = nanoseconds() - t0;
+    if (srvstall(s, Stallaccept, t0)) {
+        twarnx("slow accept: %"PRId64"us", t0 / 1000);
+    }
+}
+
+
+// srvstall reports whether d nanoseconds of work are long enough to
+// count as a stall of the event loop, and if so counts it under cause.
+// The caller logs what was going on.
+int
+srvstall(Server *s, int cause, int64 d)
+{
+    if (!s->slowop || d < s->slowop)
+        return 0;
+    s->stall_ct[cause]++;
+    return 1;
 }
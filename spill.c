@@ -0,0 +1,207 @@
+#define _GNU_SOURCE // for fallocate
+
+#include "dat.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Tiered storage. In tiered mode (-t), the bodies of jobs that will not
+// be needed for a while are moved out of memory into spill files, and
+// read back when they are sent. See spill_cold in prot.c for which jobs.
+//
+// Bodies are appended to the current spill file until it reaches
+// Spillsize, then a new one is started. A file is removed once none of
+// its bodies are in use. The space of a body that is no longer needed
+// is given back to the file system right away where that is possible.
+//
+// Spill files are not a log: the binlog keeps jobs across restarts, and
+// the spill files of a previous process are removed on startup.
+
+Spill spill;
+
+enum {
+    Spillsize = 64 << 20,
+};
+
+static Spillseg *
+segopen(void)
+{
+    Spillseg *g = new(Spillseg);
+    char *path;
+
+    if (!g) {
+        twarnx("OOM");
+        return NULL;
+    }
+    g->seq = ++spill.seq;
+    path = fmtalloc("%s/spill.%d", spill.dir, g->seq);
+    if (!path) {
+        twarnx("OOM");
+        free(g);
+        return NULL;
+    }
+    g->fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0400);
+    if (g->fd < 0) {
+        twarn("open %s", path);
+        free(path);
+        free(g);
+        return NULL;
+    }
+    // Nobody else needs the file, and it need not outlive the process.
+    unlink(path);
+    free(path);
+    spill.nseg++;
+    return g;
+}
+
+static void
+segclose(Spillseg *g)
+{
+    close(g->fd);
+    free(g);
+    spill.nseg--;
+}
+
+// Spillinit removes the spill files left by a previous process in
+// spill.dir. It returns 1 on success, 0 if the directory can't be used.
+int
+spillinit()
+{
+    DIR *d;
+    struct dirent *e;
+    char *path;
+
+    d = opendir(spill.dir);
+    if (!d) {
+        twarn("opendir %s", spill.dir);
+        return 0;
+    }
+    while ((e = readdir(d))) {
+        if (strncmp(e->d_name, "spill.", 6) != 0)
+            continue;
+        path = fmtalloc("%s/%s", spill.dir, e->d_name);
+        if (path && unlink(path) == -1)
+            twarn("unlink %s", path);
+        free(path);
+    }
+    closedir(d);
+    return 1;
+}
+
+// Spillout writes the body of j to the current spill file and lets go
+// of it in memory. It returns 1 on success, 0 if the body stays put.
+int
+spillout(Job *j)
+{
+    Spillseg *g = spill.cur;
+    int n = job_stored_size(j);
+    ssize_t r;
+
+    if (j->spill || !j->bodybuf)
+        return 0;
+    if (!g || g->size + n > Spillsize) {
+        g = segopen();
+        if (!g)
+            return 0;
+        if (spill.cur && !spill.cur->refs)
+            segclose(spill.cur);
+        spill.cur = g;
+    }
+
+    r = pwrite(g->fd, j->body, n, g->size);
+    if (r != n) {
+        if (r < 0)
+            twarn("spill write");
+        return 0;
+    }
+
+    j->spill = g;
+    j->spilloff = g->size;
+    g->size += n;
+    g->refs++;
+    if (j->tube)
+        j->tube->mem -= sizeof(Body) + j->bodybuf->cap;
+    body_unref(j->bodybuf);
+    j->bodybuf = NULL;
+    j->body = NULL;
+    spill.njob++;
+    spill.nbyte += n;
+    spill.nwrite++;
+    return 1;
+}
+
+// Spillload reads the spilled body of j into buf, which must have
+// room for job_stored_size(j) bytes. It returns 1 on success, 0 on error.
+int
+spillload(Job *j, char *buf)
+{
+    int n = job_stored_size(j);
+    ssize_t r;
+
+    r = pread(j->spill->fd, buf, n, j->spilloff);
+    if (r != n) {
+        if (r < 0)
+            twarn("spill read");
+        else
+            twarnx("spill read: short read");
+        return 0;
+    }
+    spill.nread++;
+    return 1;
+}
+
+// Spillread returns a new Body holding the spilled body of j,
+// or NULL on error. The job itself stays spilled.
+Body *
+spillread(Job *j)
+{
+    Body *b;
+
+    b = body_new(job_stored_size(j), Membody);
+    if (!b) {
+        twarnx("OOM");
+        return NULL;
+    }
+    if (!spillload(j, b->data)) {
+        body_unref(b);
+        return NULL;
+    }
+    return b;
+}
+
+// Spillprefetch asks the kernel to start reading the spilled body of
+// j into the page cache, so that the read that sends it does not wait
+// for the disk.
+void
+spillprefetch(Job *j)
+{
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(j->spill->fd, j->spilloff, job_stored_size(j),
+                  POSIX_FADV_WILLNEED);
+#endif
+}
+
+// Spilldrop forgets the spilled body of j, as j is freed.
+void
+spilldrop(Job *j)
+{
+    Spillseg *g = j->spill;
+
+    if (!g)
+        return;
+    j->spill = NULL;
+    spill.njob--;
+    spill.nbyte -= job_stored_size(j);
+    g->refs--;
+    if (!g->refs && g != spill.cur) {
+        segclose(g);
+        return;
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    fallocate(g->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+              j->spilloff, job_stored_size(j));
+#endif
+}
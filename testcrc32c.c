@@ -0,0 +1,119 @@
+#include "ct/ct.h"
+#include "dat.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char check[] = "123456789";
+
+void
+cttest_crc32c_check_value()
+{
+    uint32 got;
+
+    got = crc32c(0, check, strlen(check));
+    assertf(got == 0xe3069283, "got %08x", got);
+    got = crc32c_table(0, check, strlen(check));
+    assertf(got == 0xe3069283, "got %08x", got);
+}
+
+void
+cttest_crc32c_empty()
+{
+    assert(crc32c(0, "", 0) == 0);
+    assert(crc32c(0x1234, "", 0) == 0x1234);
+}
+
+void
+cttest_crc32c_zeros()
+{
+    char buf[32] = {0};
+    uint32 got;
+
+    // from RFC 3720, section B.4
+    got = crc32c(0, buf, sizeof buf);
+    assertf(got == 0x8a9136aa, "got %08x", got);
+}
+
+void
+cttest_crc32c_incremental()
+{
+    uint32 whole, crc;
+    size_t i, n = strlen(check);
+
+    whole = crc32c(0, check, n);
+    for (i = 0; i <= n; i++) {
+        crc = crc32c(crc32c(0, check, i), check+i, n-i);
+        assertf(crc == whole, "split at %zu: got %08x", i, crc);
+    }
+}
+
+// The hardware path must agree with the table for every
+// length and alignment, including the unaligned head and tail.
+void
+cttest_crc32c_table_agrees()
+{
+    byte buf[300];
+    size_t off, n;
+    uint32 a, b;
+
+    for (n = 0; n < sizeof buf; n++) {
+        buf[n] = (byte)(n * 131 + 7);
+    }
+    for (off = 0; off < 8; off++) {
+        for (n = 0; n + off <= sizeof buf; n++) {
+            a = crc32c(0, buf+off, n);
+            b = crc32c_table(0, buf+off, n);
+            assertf(a == b, "off %zu len %zu: %08x != %08x", off, n, a, b);
+        }
+    }
+}
+
+
+static void
+benchcrc(int n, int size, uint32 (*f)(uint32, const void*, size_t))
+{
+    int i;
+    uint32 crc = 0;
+    char *buf;
+
+    buf = malloc(size);
+    memset(buf, 'a', size);
+    ctsetbytes(size);
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        crc = f(crc, buf, size);
+    }
+    ctstoptimer();
+    free(buf);
+}
+
+void
+ctbench_crc32c_64(int n)
+{
+    benchcrc(n, 64, crc32c);
+}
+
+void
+ctbench_crc32c_1k(int n)
+{
+    benchcrc(n, 1024, crc32c);
+}
+
+void
+ctbench_crc32c_64k(int n)
+{
+    benchcrc(n, 64*1024, crc32c);
+}
+
+void
+ctbench_crc32c_table_1k(int n)
+{
+    benchcrc(n, 1024, crc32c_table);
+}
+
+void
+ctbench_crc32c_table_64k(int n)
+{
+    benchcrc(n, 64*1024, crc32c_table);
+}
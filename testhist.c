@@ -0,0 +1,89 @@
+#include "ct/ct.h"
+#include "dat.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+void
+cttest_hist_empty()
+{
+    Hist h = {0};
+
+    assert(hist_at(&h, 500) == 0);
+    assert(hist_at(&h, 999) == 0);
+}
+
+void
+cttest_hist_small_values_exact()
+{
+    Hist h = {0};
+    int i;
+
+    for (i = 0; i < Histsub * 2; i++)
+        hist_record(&h, i);
+    assert(h.n == Histsub * 2);
+    assert(h.max == Histsub * 2 - 1);
+    assertf(hist_at(&h, 500) == Histsub - 1, "got %llu",
+            (unsigned long long) hist_at(&h, 500));
+    assert(hist_at(&h, 1000) == Histsub * 2 - 1);
+}
+
+void
+cttest_hist_relative_error()
+{
+    uint64 v;
+
+    for (v = 1; v < (1ULL << Histbits); v = v * 3 + 1) {
+        Hist h = {0};
+        uint64 got;
+
+        hist_record(&h, v);
+        hist_record(&h, v * 2);
+        got = hist_at(&h, 500);
+        assertf(got >= v && got - v <= v / Histsub,
+                "v %llu got %llu", (unsigned long long) v,
+                (unsigned long long) got);
+    }
+}
+
+void
+cttest_hist_percentiles()
+{
+    Hist h = {0};
+    int i;
+
+    for (i = 1; i <= 1000; i++)
+        hist_record(&h, i * 1000);
+    assert(h.n == 1000);
+    assert(hist_at(&h, 1000) == 1000000);
+    assert(hist_at(&h, 500) >= 500000 && hist_at(&h, 500) <= 500000 * 9 / 8);
+    assert(hist_at(&h, 990) >= 990000 && hist_at(&h, 990) <= 1000000);
+    assert(hist_at(&h, 0) >= 1000 && hist_at(&h, 0) <= 1000 * 9 / 8);
+}
+
+void
+cttest_hist_out_of_range()
+{
+    Hist h = {0};
+
+    hist_record(&h, -5);
+    assert(h.ct[0] == 1);
+    hist_record(&h, INT64_MAX);
+    assert(h.ct[Histbuckets - 1] == 1);
+    assert(hist_at(&h, 1000) == INT64_MAX);
+}
+
+void
+ctbench_hist_record(int n)
+{
+    Hist *h = calloc(1, sizeof *h);
+    int i;
+
+    assert(h);
+    ctresettimer();
+    for (i = 0; i < n; i++)
+        hist_record(h, i * 7919);
+    ctstoptimer();
+    assert(h->n == (uint64) n);
+    free(h);
+}
@@ -109,6 +109,25 @@ cttest_job_all_jobs_used()
     assertf(get_all_jobs_used() == 0, "should match");
 }
 
+void
+cttest_job_body_outlives_job()
+{
+    Job *j;
+    Body *b;
+
+    TUBE_ASSIGN(default_tube, make_tube("default"));
+    j = make_job(0, 0, 1, 4, default_tube);
+    memcpy(j->body, "abcd", 4);
+    b = body_ref(j->bodybuf);
+    assertf(b->refs == 2, "refs is %d", b->refs);
+
+    job_free(j);
+    assertf(b->refs == 1, "refs is %d", b->refs);
+    assertf(b->size == 4, "size is %d", b->size);
+    assert(memcmp(b->data, "abcd", 4) == 0);
+    body_unref(b);
+}
+
 void
 cttest_job_100_000_jobs()
 {
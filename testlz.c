@@ -0,0 +1,179 @@
+#include "ct/ct.h"
+#include "dat.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// jsonish fills buf with n bytes of something like a JSON document,
+// which is what job bodies often are.
+static void
+jsonish(char *buf, int n)
+{
+    int i = 0, k = 0;
+    char rec[96];
+
+    while (i < n) {
+        int r = snprintf(rec, sizeof rec,
+                         "{\"id\":%d,\"name\":\"item-%d\",\"tags\":[\"a\",\"b\"],"
+                         "\"score\":%d},", k, k * 7, (k * 131) % 997);
+        k++;
+        r = min(r, n - i);
+        memcpy(buf + i, rec, r);
+        i += r;
+    }
+}
+
+// noise fills buf with n bytes that do not compress.
+static void
+noise(char *buf, int n)
+{
+    uint32 x = 2463534242u;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = (char)x;
+    }
+}
+
+static void
+roundtrip(const char *src, int n)
+{
+    int cap = n + n/255 + 16, z, got;
+    char *c = malloc(cap), *d = malloc(n + 1);
+
+    z = lzcompress(src, n, c, cap);
+    assertf(z > 0, "len %d: compress failed", n);
+    got = lzdecompress(c, z, d, n);
+    assertf(got == n, "len %d: got %d", n, got);
+    assertf(memcmp(src, d, n) == 0, "len %d: data differs", n);
+    free(c);
+    free(d);
+}
+
+void
+cttest_lz_roundtrip()
+{
+    char buf[70000];
+    int n;
+
+    jsonish(buf, sizeof buf);
+    for (n = 0; n < 300; n++) {
+        roundtrip(buf, n);
+    }
+    roundtrip(buf, 4096);
+    roundtrip(buf, sizeof buf);
+}
+
+void
+cttest_lz_runs()
+{
+    char buf[5000];
+
+    // long literal runs and long, overlapping matches
+    memset(buf, 'x', sizeof buf);
+    roundtrip(buf, sizeof buf);
+    noise(buf, sizeof buf);
+    roundtrip(buf, sizeof buf);
+    memcpy(buf + 3000, buf, 2000);
+    roundtrip(buf, sizeof buf);
+}
+
+void
+cttest_lz_ratio()
+{
+    char buf[16384], c[16384];
+    int z;
+
+    jsonish(buf, sizeof buf);
+    z = lzcompress(buf, sizeof buf, c, sizeof c);
+    assertf(z > 0 && z < (int)sizeof buf / 3, "compressed to %d", z);
+}
+
+void
+cttest_lz_no_room()
+{
+    char buf[1000], c[1000];
+
+    noise(buf, sizeof buf);
+    assert(lzcompress(buf, sizeof buf, c, sizeof buf - sizeof buf/8) == 0);
+}
+
+void
+cttest_lz_bad_input()
+{
+    char buf[4096], c[64000], d[4096];
+    int z, i;
+
+    jsonish(buf, sizeof buf);
+    z = lzcompress(buf, sizeof buf, c, sizeof c);
+    assert(z > 0);
+
+    // too small a buffer, or cut short
+    assert(lzdecompress(c, z, d, sizeof buf - 1) == -1);
+    assert(lzdecompress(c, z/2, d, sizeof d) != (int)sizeof buf);
+
+    // a match before the start of the output
+    memcpy(d, "\x10" "a" "\x05\x00", 4);
+    assert(lzdecompress(d, 4, buf, sizeof buf) == -1);
+
+    // garbage must not run past either buffer
+    noise(c, 64000);
+    for (i = 0; i < 1000; i++) {
+        z = lzdecompress(c + i*64, 64, d, 100);
+        assert(z >= -1 && z <= 100);
+    }
+}
+
+
+static void
+benchlz(int n, int size, int decompress)
+{
+    int i, z;
+    char *buf, *c, *d;
+
+    buf = malloc(size);
+    c = malloc(size);
+    d = malloc(size);
+    jsonish(buf, size);
+    z = lzcompress(buf, size, c, size);
+    ctsetbytes(size);
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        if (decompress)
+            lzdecompress(c, z, d, size);
+        else
+            lzcompress(buf, size, c, size);
+    }
+    ctstoptimer();
+    free(buf);
+    free(c);
+    free(d);
+}
+
+void
+ctbench_lzcompress_4k(int n)
+{
+    benchlz(n, 4096, 0);
+}
+
+void
+ctbench_lzcompress_64k(int n)
+{
+    benchlz(n, 64*1024, 0);
+}
+
+void
+ctbench_lzdecompress_4k(int n)
+{
+    benchlz(n, 4096, 1);
+}
+
+void
+ctbench_lzdecompress_64k(int n)
+{
+    benchlz(n, 64*1024, 1);
+}
@@ -265,7 +265,7 @@ static char *
 readline(int fd)
 {
     char c = 0, p = 0;
-    static char buf[1024];
+    static char buf[4096];
     fd_set rfd;
     struct timeval tv;
 
@@ -344,6 +344,103 @@ writefull(int fd, char *s, int n)
     }
 }
 
+// readfull reads exactly n bytes from fd into buf.
+static void
+readfull(int fd, char *buf, int n)
+{
+    fd_set rfd;
+    struct timeval tv;
+    int r;
+
+    while (n) {
+        FD_ZERO(&rfd);
+        FD_SET(fd, &rfd);
+        tv.tv_sec = timeout / 1000000000;
+        tv.tv_usec = (timeout/1000) % 1000000;
+        if (select(fd+1, &rfd, NULL, NULL, &tv) != 1) {
+            fputs("timeout", stderr);
+            exit(8);
+        }
+        r = read(fd, buf, n);
+        if (r <= 0) {
+            perror("read");
+            exit(1);
+        }
+        buf += r;
+        n -= r;
+    }
+}
+
+#define Anynum ((uint64)-1)
+
+static void
+put_le(byte *p, uint64 v, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        p[i] = v >> (8*i);
+    }
+}
+
+static uint64
+get_le(byte *p, int n)
+{
+    uint64 v = 0;
+    int i;
+    for (i = n - 1; i >= 0; i--) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+// mkframe writes a binary protocol request into buf and returns its
+// size. See dispatch_frame in prot.c for the layout.
+static int
+mkframe(char *buf, int op, uint64 id, uint32 pri, uint32 delay, uint32 ttr,
+        char *data, int n)
+{
+    byte *p = (byte *)buf;
+
+    memset(p, 0, BIN_REQ_SIZE);
+    p[0] = op;
+    put_le(p + 4, n, 4);
+    put_le(p + 8, id, 8);
+    put_le(p + 16, pri, 4);
+    put_le(p + 20, delay, 4);
+    put_le(p + 24, ttr, 4);
+    memcpy(buf + BIN_REQ_SIZE, data, n);
+    return BIN_REQ_SIZE + n;
+}
+
+static void
+sendframe(int fd, int op, uint64 id, uint32 pri, uint32 delay, uint32 ttr,
+          char *data)
+{
+    char buf[BIN_REQ_SIZE + 1024];
+    int n = mkframe(buf, op, id, pri, delay, ttr, data, strlen(data));
+    writefull(fd, buf, n);
+}
+
+// ckframe reads a binary reply and checks its status code and number,
+// unless num is Anynum. It returns the data that follows, NUL-terminated.
+static char *
+ckframe(int fd, int status, uint64 num)
+{
+    static char buf[4096];
+    byte h[16];
+    uint32 n;
+
+    readfull(fd, (char *)h, sizeof h);
+    n = get_le(h + 4, 4);
+    assertf(h[0] == status, "status %d != %d", h[0], status);
+    assertf(num == Anynum || get_le(h + 8, 8) == num, "num %llu != %llu",
+            (unsigned long long)get_le(h + 8, 8), (unsigned long long)num);
+    assertf(n < sizeof buf, "data too big: %u", n);
+    readfull(fd, buf, n);
+    buf[n] = '\0';
+    return buf;
+}
+
 static void
 mustsend(int fd, char *s)
 {
@@ -641,1004 +738,3236 @@ cttest_kickjob_delayed()
     ckresp(fd, "NOT_FOUND\r\n");
 }
 
+// A kick bigger than one batch goes on in slices and still reports
+// every job it kicked.
 void
-cttest_pause()
+cttest_kick_many()
 {
-    int64 s;
-
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 1\r\n");
-    mustsend(fd, "x\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
-    s = nanoseconds();
-    mustsend(fd, "pause-tube default 1\r\n");
-    ckresp(fd, "PAUSED\r\n");
-    mustsend(fd, "reserve\r\n");
-    ckresp(fd, "RESERVED 1 1\r\n");
-    ckresp(fd, "x\r\n");
-    assert(nanoseconds() - s >= 1000000000); // 1s
+    int fd2 = mustdiallocal(port);
+    int i;
+
+    for (i = 0; i < 600; i++) {
+        mustsend(fd, "put 0 100 100 1\r\na\r\n");
+        ckrespsub(fd, "INSERTED ");
+    }
+    mustsend(fd, "kick 1000\r\n");
+    mustsend(fd, "kick 1\r\n");
+    mustsend(fd2, "reserve-with-timeout 1\r\n");
+    ckresp(fd, "KICKED 600\r\n");
+    ckresp(fd, "KICKED 0\r\n");
+    ckresp(fd2, "RESERVED 1 1\r\n");
+    ckresp(fd2, "a\r\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 599\n");
 }
 
 void
-cttest_underscore()
+cttest_flush_tube()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "use x_y\r\n");
-    ckresp(fd, "USING x_y\r\n");
+    int i;
+
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+    mustsend(fd, "watch foo\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    for (i = 0; i < 4; i++) {
+        mustsend(fd, "put 0 0 100 1\r\na\r\n");
+        ckrespsub(fd, "INSERTED ");
+    }
+    mustsend(fd, "put 0 100 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED 5\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "bury 2 0\r\n");
+    ckresp(fd, "BURIED\r\n");
+
+    mustsend(fd, "flush-tube foo buried\r\n");
+    ckresp(fd, "FLUSHED 1\r\n");
+    mustsend(fd, "flush-tube foo delayed\r\n");
+    ckresp(fd, "FLUSHED 1\r\n");
+    mustsend(fd, "flush-tube foo\r\n");
+    ckresp(fd, "FLUSHED 2\r\n");
+    mustsend(fd, "flush-tube foo ready\r\n");
+    ckresp(fd, "FLUSHED 0\r\n");
+
+    // reserved jobs stay
+    mustsend(fd, "stats-tube foo\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-reserved: 1\n");
+    mustsend(fd, "stats-tube foo\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntotal-jobs: 5\n");
+    mustsend(fd, "stats-tube foo\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-delete: 4\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
 }
 
 void
-cttest_2cmdpacket()
+cttest_flush_tube_bad_format()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "use a\r\nuse b\r\n");
-    ckresp(fd, "USING a\r\n");
-    ckresp(fd, "USING b\r\n");
+    mustsend(fd, "flush-tube default reserved\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "flush-tube default ready x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "flush-tube -foo\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "flush-tube nosuchtube\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
 }
 
 void
-cttest_too_big()
+cttest_stats_delayed_count()
 {
-    job_data_size_limit = 10;
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 11\r\n");
-    mustsend(fd, "delete 9999\r\n");
-    mustsend(fd, "put 0 0 0 1\r\n");
-    mustsend(fd, "x\r\n");
-    ckresp(fd, "JOB_TOO_BIG\r\n");
+
+    mustsend(fd, "use a\r\n");
+    ckresp(fd, "USING a\r\n");
+    mustsend(fd, "put 0 100 100 1\r\na\r\n");
     ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "use b\r\n");
+    ckresp(fd, "USING b\r\n");
+    mustsend(fd, "put 0 100 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 100 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 3\n");
+
+    mustsend(fd, "kick 1\r\n");
+    ckresp(fd, "KICKED 1\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 1\n");
+
+    mustsend(fd, "flush-tube b\r\n");
+    ckresp(fd, "FLUSHED 2\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 0\n");
+
+    // a job whose delay runs out leaves the count too
+    mustsend(fd, "put 0 1 100 1\r\nc\r\n");
+    ckresp(fd, "INSERTED 4\r\n");
+    mustsend(fd, "watch b\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "reserve-with-timeout 5\r\n");
+    ckresp(fd, "RESERVED 4 1\r\n");
+    ckresp(fd, "c\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 0\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-reserved: 1\n");
 }
 
 void
-cttest_job_size_invalid()
+cttest_stats_tubes()
 {
-    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 4294967296\r\n");
-    mustsend(fd, "put 0 0 0 10b\r\n");
-    mustsend(fd, "put 0 0 0 --!@#$%^&&**()0b\r\n");
-    mustsend(fd, "put 0 0 0 1\r\n");
-    mustsend(fd, "x\r\n");
+
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+    mustsend(fd, "put 0 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    mustsend(fd, "stats-tubes\r\n");
+    ckresp(fd, "TUBES 2\r\n");
+    ckresp(fd, "default 0 0 0 0 0 0 0 1 0 0 0 0 0 1\r\n");
+    ckresp(fd, "foo 1 1 0 0 0 1 1 0 0 0 0 0 0 1\r\n");
+    mustsend(fd, "stats-tubes f*\r\n");
+    ckresp(fd, "TUBES 1\r\n");
+    ckresp(fd, "foo 1 1 0 0 0 1 1 0 0 0 0 0 0 1\r\n");
+    mustsend(fd, "stats-tubes [a-e]?fault\r\n");
+    ckresp(fd, "TUBES 1\r\n");
+    ckresp(fd, "default 0 0 0 0 0 0 0 1 0 0 0 0 0 1\r\n");
+    mustsend(fd, "stats-tubes bar\r\n");
+    ckresp(fd, "TUBES 0\r\n");
+
+    mustsend(fd, "stats-tubes \r\n");
     ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "stats-tubesfoo\r\n");
     ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "stats-tubes foo bar\r\n");
     ckresp(fd, "BAD_FORMAT\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-stats-tubes: 4\n");
 }
 
+// A reply larger than the stats buffer is sent in several pieces,
+// and a tube stays until its line is sent even if nothing else uses it.
+// Whether "last" shows as used depends on how far the reply got.
 void
-cttest_job_size_max_plus_1()
+cttest_stats_tubes_many()
 {
-    /* verify that server reject the job larger than maximum allowed. */
-    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 1073741825\r\n");
+    int fd2 = mustdiallocal(port);
+    char buf[50];
+    int i;
 
-    const int len = 1024*1024;
-    char body[len+1];
-    memset(body, 'a', len);
-    body[len] = 0;
+    for (i = 0; i < 1000; i++) {
+        sprintf(buf, "use tube%04d\r\n", i);
+        mustsend(fd, buf);
+        ckrespsub(fd, "USING ");
+        mustsend(fd, "put 0 0 100 1\r\na\r\n");
+        ckrespsub(fd, "INSERTED ");
+    }
+    mustsend(fd2, "use last\r\n");
+    ckresp(fd2, "USING last\r\n");
 
-    int i;
-    for (i=0; i<JOB_DATA_SIZE_LIMIT_MAX; i+=len) {
-        mustsend(fd, body);
+    mustsend(fd, "stats-tubes *\r\n");
+    ckresp(fd, "TUBES 1002\r\n");
+    ckresp(fd, "default 0 0 0 0 0 0 0 2 0 0 0 0 0 1\r\n");
+
+    // the tube "last" goes away unless the reply holds it
+    mustsend(fd2, "use default\r\n");
+    ckresp(fd2, "USING default\r\n");
+
+    for (i = 0; i < 999; i++) {
+        sprintf(buf, "tube%04d 1 1 0 0 0 1 0 0 0 0 0 0 0 1\r\n", i);
+        ckresp(fd, buf);
     }
-    mustsend(fd, "x");
-    mustsend(fd, "\r\n");
-    ckresp(fd, "JOB_TOO_BIG\r\n");
+    ckresp(fd, "tube0999 1 1 0 0 0 1 1 0 0 0 0 0 0 1\r\n");
+    ckrespsub(fd, "last 0 0 0 0 0 0 ");
+
+    mustsend(fd, "stats-tubes last\r\n");
+    ckresp(fd, "TUBES 0\r\n");
 }
 
+// With a threshold of 1ns every command is a stall.
 void
-cttest_delete_ready()
+cttest_stats_stalls()
 {
+    srv.slowop = 1;
+
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 0\r\n");
-    mustsend(fd, "\r\n");
+
+    mustsend(fd, "put 0 0 100 1\r\na\r\n");
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "delete 1\r\n");
-    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    char *body = readline(fd);
+    char *s = strstr(body, "\nstalls-command: ");
+    assert(s);
+    assertf(atoi(s + 17) >= 1, "stalls-command %d", atoi(s + 17));
+    assert(strstr(body, "\nstalls-accept: 1\n"));
+    assert(strstr(body, "\nloop-lag-max: "));
 }
 
 void
-cttest_delete_reserved_by_other()
+cttest_stats_latency()
 {
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 1 1\r\n");
-    mustsend(fd, "a\r\n");
+
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+    mustsend(fd, "watch foo\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "put 0 0 100 1\r\na\r\n");
     ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
 
-    int o = mustdiallocal(port);
-    mustsend(o, "reserve\r\n");
-    ckresp(o, "RESERVED 1 1\r\n");
-    ckresp(o, "a\r\n");
+    mustsend(fd, "stats-latency\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-put: {count: 1, p50: ");
+    mustsend(fd, "stats-latency\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-peek: {count: 0, p50: 0, p90: 0, p99: 0, p999: 0, max: 0}\n");
+    mustsend(fd, "stats-latency\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nqueue-wait: {count: 1, ");
+    mustsend(fd, "stats-latency\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nprocess: {count: 1, ");
+    mustsend(fd, "stats-latency\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbinlog-write: {count: 2, ");
+    mustsend(fd, "stats-latency\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbinlog-fsync: {count: 2, ");
 
-    mustsend(fd, "delete 1\r\n");
+    mustsend(fd, "stats-latency foo\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "---\nname: \"foo\"\nprocess: {count: 1, ");
+    mustsend(fd, "stats-latency default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nprocess: {count: 0, p50: 0, ");
+    mustsend(fd, "stats-latency bar\r\n");
     ckresp(fd, "NOT_FOUND\r\n");
-}
-
-void
-cttest_delete_bad_format()
-{
-    int port = SERVER();
-    int fd = mustdiallocal(port);
-    mustsend(fd, "delete 18446744073709551616\r\n"); // UINT64_MAX+1
+    mustsend(fd, "stats-latency \r\n");
     ckresp(fd, "BAD_FORMAT\r\n");
-    mustsend(fd, "delete 184467440737095516160000000000000000000000000000\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
-    mustsend(fd, "delete foo111\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
-    mustsend(fd, "delete 111foo\r\n");
+    mustsend(fd, "stats-latencyfoo\r\n");
     ckresp(fd, "BAD_FORMAT\r\n");
 }
 
 void
-cttest_multi_tube()
+cttest_pause()
 {
+    int64 s;
+
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "use abc\r\n");
-    ckresp(fd, "USING abc\r\n");
-    mustsend(fd, "put 999999 0 0 0\r\n");
-    mustsend(fd, "\r\n");
+    mustsend(fd, "put 0 0 0 1\r\n");
+    mustsend(fd, "x\r\n");
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "use def\r\n");
-    ckresp(fd, "USING def\r\n");
-    mustsend(fd, "put 99 0 0 0\r\n");
-    mustsend(fd, "\r\n");
-    ckresp(fd, "INSERTED 2\r\n");
-    mustsend(fd, "watch abc\r\n");
-    ckresp(fd, "WATCHING 2\r\n");
-    mustsend(fd, "watch def\r\n");
-    ckresp(fd, "WATCHING 3\r\n");
+    s = nanoseconds();
+    mustsend(fd, "pause-tube default 1\r\n");
+    ckresp(fd, "PAUSED\r\n");
     mustsend(fd, "reserve\r\n");
-    ckresp(fd, "RESERVED 2 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "x\r\n");
+    assert(nanoseconds() - s >= 1000000000); // 1s
 }
 
 void
-cttest_negative_delay()
+cttest_underscore()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 512 -1 100 0\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "use x_y\r\n");
+    ckresp(fd, "USING x_y\r\n");
 }
 
-/* TODO: add more edge cases tests for delay and ttr */
-
 void
-cttest_garbage_priority()
+cttest_2cmdpacket()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put -1kkdj9djjkd9 0 100 1\r\n");
-    mustsend(fd, "a\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "use a\r\nuse b\r\n");
+    ckresp(fd, "USING a\r\n");
+    ckresp(fd, "USING b\r\n");
 }
 
 void
-cttest_negative_priority()
+cttest_too_big()
 {
+    job_data_size_limit = 10;
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put -1 0 100 1\r\n");
-    mustsend(fd, "a\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
-}
-
-void
-cttest_max_priority()
+    mustsend(fd, "put 0 0 0 11\r\n");
+    mustsend(fd, "delete 9999\r\n");
+    mustsend(fd, "put 0 0 0 1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "JOB_TOO_BIG\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+}
+
+// Under -m, puts are refused once the jobs would not fit, and
+// accepted again once there is room.
+void
+cttest_mem_limit()
 {
+    enum { size = 60000 };
+    static char buf[size + 100];
+    int i, n = 0;
+
+    mem_limit = 1 << 20;
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 4294967295 0 100 1\r\n");
-    mustsend(fd, "a\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
+
+    sprintf(buf, "put 0 0 100 %d\r\n", size);
+    i = strlen(buf);
+    memset(buf + i, 'a', size);
+    memcpy(buf + i + size, "\r\n", 3);
+    for (;;) {
+        mustsend(fd, buf);
+        char *line = readline(fd);
+        if (strcmp(line, "OUT_OF_CAPACITY\r\n") == 0)
+            break;
+        assertf(strncmp(line, "INSERTED ", 9) == 0, "got %s", line);
+        n++;
+        assert(n < 20);
+    }
+    assertf(n >= 10, "only %d jobs fit", n);
+
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nmem-limit: 1048576\n");
+
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, buf);
+    ckrespsub(fd, "INSERTED ");
 }
 
 void
-cttest_too_big_priority()
+cttest_mem_stats()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 4294967296 0 100 1\r\n");
-    mustsend(fd, "a\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
+
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+    mustsend(fd, "stats-tube foo\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nmem: 0\n");
+    mustsend(fd, "put 0 0 100 1000\r\n");
+    char body[1003];
+    memset(body, 'x', 1000);
+    memcpy(body + 1000, "\r\n", 3);
+    mustsend(fd, body);
+    ckresp(fd, "INSERTED 1\r\n");
+
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    char *doc = readline(fd);
+    char *s = strstr(doc, "\nmem-bodies: ");
+    assert(s);
+    assert(atoi(s + 13) >= 1002);
+    assert(strstr(doc, "\nmem-limit: 0\n"));
+    mustsend(fd, "stats-tube foo\r\n");
+    ckrespsub(fd, "OK ");
+    doc = readline(fd);
+    s = strstr(doc, "\nmem: ");
+    assert(s);
+    assert(atoi(s + 6) >= 1002);
+
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "stats-tube foo\r\n");
+    ckrespsub(fd, "OK ");
+    doc = readline(fd);
+    s = strstr(doc, "\nmem: ");
+    assert(s);
+    assertf(atoi(s + 6) < 1000, "mem %d", atoi(s + 6));
 }
 
 void
-cttest_omit_time_left()
+cttest_spill_buried()
 {
+    spill.dir = ctdir();
+
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 5 1\r\n");
-    mustsend(fd, "a\r\n");
+    char body[303];
+    memset(body, 'b', 300);
+    memcpy(body + 300, "\r\n", 3);
+    mustsend(fd, "put 0 0 100 300\r\n");
+    mustsend(fd, body);
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "stats-job 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 300\r\n");
+    ckresp(fd, body);
+    mustsend(fd, "stats\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ntime-left: 0\n");
+    ckrespsub(fd, "\nspill-jobs: 0\n");
+
+    mustsend(fd, "bury 1 0\r\n");
+    ckresp(fd, "BURIED\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    char *doc = readline(fd);
+    assert(strstr(doc, "\nspill-jobs: 1\n"));
+    assert(strstr(doc, "\nspill-bytes: 302\n"));
+    assert(strstr(doc, "\nspill-writes: 1\n"));
+    assert(strstr(doc, "\nmem-bodies: 0\n"));
+
+    mustsend(fd, "peek-buried\r\n");
+    ckresp(fd, "FOUND 1 300\r\n");
+    ckresp(fd, body);
+    mustsend(fd, "kick 1\r\n");
+    ckresp(fd, "KICKED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 300\r\n");
+    ckresp(fd, body);
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    doc = readline(fd);
+    assert(strstr(doc, "\nspill-jobs: 0\n"));
+    assert(strstr(doc, "\nspill-reads: 2\n"));
 }
 
 void
-cttest_small_delay()
+cttest_spill_small_and_soon()
 {
+    spill.dir = ctdir();
+
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 1 1 0\r\n");
-    mustsend(fd, "\r\n");
+    mustsend(fd, "put 0 100 100 4\r\n");
+    mustsend(fd, "tiny\r\n");
     ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 300\r\n");
+    char body[303];
+    memset(body, 'r', 300);
+    memcpy(body + 300, "\r\n", 3);
+    mustsend(fd, body);
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nspill-jobs: 0\n");
 }
 
 void
-cttest_delayed_to_ready()
+cttest_spill_binlog()
 {
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+    spill.dir = ctdir();
+
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 1 1 0\r\n");
-    mustsend(fd, "\r\n");
+    char body[403];
+    memset(body, 'd', 400);
+    memcpy(body + 400, "\r\n", 3);
+    mustsend(fd, "put 0 3600 100 400\r\n");
+    mustsend(fd, body);
     ckresp(fd, "INSERTED 1\r\n");
-
-    mustsend(fd, "stats-tube default\r\n");
+    mustsend(fd, "stats\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-ready: 0\n");
+    ckrespsub(fd, "\nspill-jobs: 1\n");
 
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-delayed: 1\n");
+    kill_srvpid();
 
-    mustsend(fd, "stats-tube default\r\n");
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ntotal-jobs: 1\n");
+    ckrespsub(fd, "\nspill-jobs: 1\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 400\r\n");
+    ckresp(fd, body);
+}
 
-    usleep(1010000); // 1.01 sec
+// zbody fills body with n bytes of a JSON-like document that
+// compresses about as well as real ones do, and "\r\n".
+static void
+zbody(char *body, int n)
+{
+    char rec[32];
+    int i, r;
+    uint32 x = 1;
+
+    for (i = 0; i < n; i += r) {
+        x = x * 1103515245 + 12345;
+        r = snprintf(rec, sizeof rec, "{\"id\":%06u,\"ok\":true},",
+                     (x >> 8) % 1000000);
+        r = min(r, n - i);
+        memcpy(body + i, rec, r);
+    }
+    memcpy(body + n, "\r\n", 3);
+}
 
-    // check that after 1 sec the delayed job is ready again
+void
+cttest_compress_peek()
+{
+    zstat.min = 1000;
 
-    mustsend(fd, "stats-tube default\r\n");
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char body[4003];
+    zbody(body, 4000);
+    mustsend(fd, "put 0 0 100 4000\r\n");
+    mustsend(fd, body);
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 500\r\n");
+    mustsend(fd, body + 3500);
+    ckresp(fd, "INSERTED 2\r\n");
+
+    mustsend(fd, "stats\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-ready: 1\n");
+    char *doc = readline(fd);
+    assert(strstr(doc, "\ncompressed-jobs: 1\n"));
+    assert(strstr(doc, "\ncompressed-raw-bytes: 4002\n"));
+    char *s = strstr(doc, "\ncompressed-bytes: ");
+    assert(s);
+    assertf(atoi(s + 19) < 2000, "compressed-bytes %d", atoi(s + 19));
 
-    mustsend(fd, "stats-tube default\r\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 4000\r\n");
+    ckresp(fd, body);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 4000\r\n");
+    ckresp(fd, body);
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 4000\r\n");
+    ckresp(fd, body);
+    mustsend(fd, "stats\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-delayed: 0\n");
+    doc = readline(fd);
+    assert(strstr(doc, "\ndecompress-cache-misses: 1\n"));
+    assert(strstr(doc, "\ndecompress-cache-hits: 2\n"));
 
-    mustsend(fd, "stats-tube default\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "stats\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ntotal-jobs: 1\n");
+    ckrespsub(fd, "\ncompressed-jobs: 0\n");
 }
 
 void
-cttest_statsjob_ck_format()
+cttest_compress_put_batch()
 {
+    zstat.min = 1000;
+
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "stats-job 111ABC\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
-    mustsend(fd, "stats-job 111 222\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
-    mustsend(fd, "stats-job 111\r\n");
-    ckresp(fd, "NOT_FOUND\r\n");
+    char body[2003], payload[4200];
+    zbody(body, 2000);
+    int n = snprintf(payload, sizeof payload, "0 0 100 2000\r\n%s0 0 100 3\r\nabc\r\n", body);
+    char cmd[64];
+    snprintf(cmd, sizeof cmd, "put-batch 2 %d\r\n", n);
+    mustsend(fd, cmd);
+    mustsend(fd, payload);
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED_BATCH 1 2\r\n");
+    mustsend(fd, "reserve-batch 2\r\n");
+    ckresp(fd, "RESERVED_BATCH 2\r\n");
+    ckresp(fd, "RESERVED 1 2000\r\n");
+    ckresp(fd, body);
+    ckresp(fd, "RESERVED 2 3\r\n");
+    ckresp(fd, "abc\r\n");
 }
 
 void
-cttest_stats_tube()
+cttest_compress_binlog()
 {
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+    zstat.min = 1000;
+
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "use tubea\r\n");
-    ckresp(fd, "USING tubea\r\n");
-    mustsend(fd, "put 0 0 0 1\r\n");
-    mustsend(fd, "x\r\n");
+    char body[3003];
+    zbody(body, 3000);
+    mustsend(fd, "put 0 0 100 3000\r\n");
+    mustsend(fd, body);
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "delete 1\r\n");
-    ckresp(fd, "DELETED\r\n");
 
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nname: \"tubea\"\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-urgent: 0\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-ready: 0\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-reserved: 0\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-delayed: 0\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-buried: 0\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ntotal-jobs: 1\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-using: 1\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-watching: 0\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-waiting: 0\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncmd-delete: 1\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncmd-pause-tube: 0\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\npause: 0\n");
-    mustsend(fd, "stats-tube tubea\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\npause-time-left: 0\n");
+    kill_srvpid();
+    zstat.min = 0;
 
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nname: \"default\"\n");
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-urgent: 0\n");
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-ready: 0\n");
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-reserved: 0\n");
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-delayed: 0\n");
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-jobs-buried: 0\n");
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ntotal-jobs: 0\n");
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-using: 0\n");
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-watching: 1\n");
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncurrent-waiting: 0\n");
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncmd-delete: 0\n");
-    mustsend(fd, "stats-tube default\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ncmd-pause-tube: 0\n");
-    mustsend(fd, "stats-tube default\r\n");
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\npause: 0\n");
-    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "\ncompressed-jobs: 1\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 3000\r\n");
+    ckresp(fd, body);
+}
+
+void
+cttest_compress_spill()
+{
+    spill.dir = ctdir();
+    zstat.min = 1000;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char body[3003];
+    zbody(body, 3000);
+    mustsend(fd, "put 0 0 100 3000\r\n");
+    mustsend(fd, body);
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 3000\r\n");
+    ckresp(fd, body);
+    mustsend(fd, "bury 1 0\r\n");
+    ckresp(fd, "BURIED\r\n");
+    mustsend(fd, "stats\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\npause-time-left: 0\n");
+    ckrespsub(fd, "\nspill-jobs: 1\n");
+    mustsend(fd, "peek-buried\r\n");
+    ckresp(fd, "FOUND 1 3000\r\n");
+    ckresp(fd, body);
 }
 
 void
-cttest_ttrlarge()
+cttest_dedup_put()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 120 1\r\n");
+    mustsend(fd, "put 0 0 100 1 k1\r\n");
     mustsend(fd, "a\r\n");
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "put 0 0 4294 1\r\n");
-    mustsend(fd, "a\r\n");
+    mustsend(fd, "put 0 0 100 1 k1\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1 k2\r\n");
+    mustsend(fd, "c\r\n");
     ckresp(fd, "INSERTED 2\r\n");
-    mustsend(fd, "put 0 0 4295 1\r\n");
-    mustsend(fd, "a\r\n");
+
+    // keys are per tube
+    mustsend(fd, "use other\r\n");
+    ckresp(fd, "USING other\r\n");
+    mustsend(fd, "put 0 0 100 1 k1\r\n");
+    mustsend(fd, "d\r\n");
     ckresp(fd, "INSERTED 3\r\n");
-    mustsend(fd, "put 0 0 4296 1\r\n");
-    mustsend(fd, "a\r\n");
-    ckresp(fd, "INSERTED 4\r\n");
-    mustsend(fd, "put 0 0 4297 1\r\n");
-    mustsend(fd, "a\r\n");
-    ckresp(fd, "INSERTED 5\r\n");
-    mustsend(fd, "put 0 0 5000 1\r\n");
-    mustsend(fd, "a\r\n");
-    ckresp(fd, "INSERTED 6\r\n");
-    mustsend(fd, "put 0 0 21600 1\r\n");
-    mustsend(fd, "a\r\n");
-    ckresp(fd, "INSERTED 7\r\n");
-    mustsend(fd, "stats-job 1\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nttr: 120\n");
-    mustsend(fd, "stats-job 2\r\n");
+
+    mustsend(fd, "stats\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nttr: 4294\n");
-    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "\ndedup-keys: 3\ndedup-hits: 1\n");
+    mustsend(fd, "stats-tube default\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nttr: 4295\n");
-    mustsend(fd, "stats-job 4\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nttr: 4296\n");
-    mustsend(fd, "stats-job 5\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nttr: 4297\n");
-    mustsend(fd, "stats-job 6\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nttr: 5000\n");
-    mustsend(fd, "stats-job 7\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nttr: 21600\n");
+    ckrespsub(fd, "\ntotal-jobs: 2\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 1\r\n");
+    ckresp(fd, "a\r\n");
 }
 
 void
-cttest_ttr_small()
+cttest_dedup_after_delete()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 1\r\n");
+    mustsend(fd, "put 0 0 100 1 k1\r\n");
     mustsend(fd, "a\r\n");
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "stats-job 1\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nttr: 1\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "put 0 0 100 1 k1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "peek-ready\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
 }
 
 void
-cttest_zero_delay()
+cttest_dedup_bad_key()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 1 0\r\n");
-    mustsend(fd, "\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1 \r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put 0 0 100 1 a!b\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put 0 0 100 1 a b\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
 }
 
 void
-cttest_reserve_with_timeout_2conns()
+cttest_dedup_off()
 {
-    int fd0, fd1;
-
-    job_data_size_limit = 10;
+    dedup_window = 0;
 
     int port = SERVER();
-    fd0 = mustdiallocal(port);
-    fd1 = mustdiallocal(port);
-    mustsend(fd0, "watch foo\r\n");
-    ckresp(fd0, "WATCHING 2\r\n");
-    mustsend(fd0, "reserve-with-timeout 1\r\n");
-    mustsend(fd1, "watch foo\r\n");
-    ckresp(fd1, "WATCHING 2\r\n");
-    timeout = 1100000000; // 1.1s
-    ckresp(fd0, "TIMED_OUT\r\n");
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1 k1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1 k1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
 }
 
 void
-cttest_reserve_ttr_deadline_soon()
+cttest_dedup_binlog()
 {
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
     int port = SERVER();
     int fd = mustdiallocal(port);
-
-    mustsend(fd, "put 0 0 1 1\r\n");
+    mustsend(fd, "put 0 0 100 1 k1\r\n");
     mustsend(fd, "a\r\n");
     ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1 k2\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "DELETED\r\n");
 
-    mustsend(fd, "reserve-with-timeout 1\r\n");
-    ckresp(fd, "RESERVED 1 1\r\n");
-    ckresp(fd, "a\r\n");
-
-    // After 0.2s the job should be still reserved.
-    usleep(200000);
-    mustsend(fd, "stats-job 1\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nstate: reserved\n");
-
-    mustsend(fd, "reserve-with-timeout 1\r\n");
-    ckresp(fd, "DEADLINE_SOON\r\n");
-
-    // Job should be reserved; last "reserve" took less than 1s.
-    mustsend(fd, "stats-job 1\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nstate: reserved\n");
+    kill_srvpid();
+    port = SERVER();
+    fd = mustdiallocal(port);
 
-    // We don't want to process the job, so release it and check that it's ready.
-    mustsend(fd, "release 1 0 0\r\n");
-    ckresp(fd, "RELEASED\r\n");
-    mustsend(fd, "stats-job 1\r\n");
+    // both keys, even that of the deleted job
+    mustsend(fd, "put 0 0 100 1 k1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1 k2\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 0 100 1 k3\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "stats\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nstate: ready\n");
+    ckrespsub(fd, "\ndedup-keys: 3\ndedup-hits: 2\n");
 }
 
 void
-cttest_reserve_job_ttr_deadline_soon()
+cttest_job_size_invalid()
 {
+    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
     int port = SERVER();
     int fd = mustdiallocal(port);
-
-    mustsend(fd, "put 0 5 1 1\r\n");
-    mustsend(fd, "a\r\n");
+    mustsend(fd, "put 0 0 0 4294967296\r\n");
+    mustsend(fd, "put 0 0 0 10b\r\n");
+    mustsend(fd, "put 0 0 0 --!@#$%^&&**()0b\r\n");
+    mustsend(fd, "put 0 0 0 1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
     ckresp(fd, "INSERTED 1\r\n");
+}
 
-    mustsend(fd, "stats-job 1\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nstate: delayed\n");
-
-    mustsend(fd, "reserve-job 1\r\n");
-    ckresp(fd, "RESERVED 1 1\r\n");
-    ckresp(fd, "a\r\n");
-
-    // After 0.1s the job should be still reserved.
-    usleep(100000);
-    mustsend(fd, "stats-job 1\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nstate: reserved\n");
-
-    // Reservation made with reserve-job should behave the same way as other
-    // reserve commands, e.g. produce "deadline soon" message, and get released
-    // when ttr ends.
-    mustsend(fd, "reserve-with-timeout 1\r\n");
-    ckresp(fd, "DEADLINE_SOON\r\n");
+void
+cttest_job_size_max_plus_1()
+{
+    /* verify that server reject the job larger than maximum allowed. */
+    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 0 1073741825\r\n");
 
-    // Job should be reserved; last "reserve" took less than 1s.
-    mustsend(fd, "stats-job 1\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nstate: reserved\n");
+    const int len = 1024*1024;
+    char body[len+1];
+    memset(body, 'a', len);
+    body[len] = 0;
 
-    // We are not able to process the job in time. Check that it gets released.
-    // The job was in delayed state. It becomes ready when it gets auto-released.
-    usleep(1000000); // 1.0s
-    // put a dummy job
-    mustsend(fd, "put 0 0 1 1\r\n");
-    mustsend(fd, "B\r\n");
-    ckresp(fd, "INSERTED 2\r\n");
-    // check that ID=1 gets released
-    mustsend(fd, "stats-job 1\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nstate: ready\n");
+    int i;
+    for (i=0; i<JOB_DATA_SIZE_LIMIT_MAX; i+=len) {
+        mustsend(fd, body);
+    }
+    mustsend(fd, "x");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "JOB_TOO_BIG\r\n");
 }
 
 void
-cttest_reserve_job_already_reserved()
+cttest_delete_ready()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-
-    mustsend(fd, "put 0 0 1 1\r\n");
-    mustsend(fd, "A\r\n");
+    mustsend(fd, "put 0 0 0 0\r\n");
+    mustsend(fd, "\r\n");
     ckresp(fd, "INSERTED 1\r\n");
-
-    mustsend(fd, "reserve-job 1\r\n");
-    ckresp(fd, "RESERVED 1 1\r\n");
-    ckresp(fd, "A\r\n");
-
-    // Job should not be reserved twice.
-    mustsend(fd, "reserve-job 1\r\n");
-    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
 }
 
 void
-cttest_reserve_job_ready()
+cttest_delete_reserved_by_other()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-
     mustsend(fd, "put 0 0 1 1\r\n");
-    mustsend(fd, "A\r\n");
+    mustsend(fd, "a\r\n");
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "put 0 0 1 1\r\n");
-    mustsend(fd, "B\r\n");
-    ckresp(fd, "INSERTED 2\r\n");
-
-    mustsend(fd, "reserve-job 2\r\n");
-    ckresp(fd, "RESERVED 2 1\r\n");
-    ckresp(fd, "B\r\n");
 
-    // Non-existing job.
-    mustsend(fd, "reserve-job 3\r\n");
-    ckresp(fd, "NOT_FOUND\r\n");
+    int o = mustdiallocal(port);
+    mustsend(o, "reserve\r\n");
+    ckresp(o, "RESERVED 1 1\r\n");
+    ckresp(o, "a\r\n");
 
-    // id=1 was not reserved.
-    mustsend(fd, "release 1 1 0\r\n");
+    mustsend(fd, "delete 1\r\n");
     ckresp(fd, "NOT_FOUND\r\n");
-
-    mustsend(fd, "release 2 1 0\r\n");
-    ckresp(fd, "RELEASED\r\n");
 }
 
 void
-cttest_reserve_job_delayed()
+cttest_delete_bad_format()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
+    mustsend(fd, "delete 18446744073709551616\r\n"); // UINT64_MAX+1
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete 184467440737095516160000000000000000000000000000\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete foo111\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete 111foo\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
 
-    mustsend(fd, "put 0 100 1 1\r\n");
-    mustsend(fd, "A\r\n");
+void
+cttest_multi_tube()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "use abc\r\n");
+    ckresp(fd, "USING abc\r\n");
+    mustsend(fd, "put 999999 0 0 0\r\n");
+    mustsend(fd, "\r\n");
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "put 0 100 1 1\r\n");
-    mustsend(fd, "B\r\n");
+    mustsend(fd, "use def\r\n");
+    ckresp(fd, "USING def\r\n");
+    mustsend(fd, "put 99 0 0 0\r\n");
+    mustsend(fd, "\r\n");
     ckresp(fd, "INSERTED 2\r\n");
-    mustsend(fd, "put 0 100 1 1\r\n");
-    mustsend(fd, "C\r\n");
-    ckresp(fd, "INSERTED 3\r\n");
-
-    mustsend(fd, "reserve-job 2\r\n");
-    ckresp(fd, "RESERVED 2 1\r\n");
-    ckresp(fd, "B\r\n");
-
-    mustsend(fd, "release 2 1 0\r\n");
-    ckresp(fd, "RELEASED\r\n");
-
-    // verify that job was released in ready state.
-    mustsend(fd, "stats-job 2\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nstate: ready\n");
+    mustsend(fd, "watch abc\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "watch def\r\n");
+    ckresp(fd, "WATCHING 3\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 0\r\n");
 }
 
 void
-cttest_reserve_job_buried()
+cttest_negative_delay()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
+    mustsend(fd, "put 512 -1 100 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
 
-    // put, reserve and bury
-    mustsend(fd, "put 0 0 1 1\r\n");
-    mustsend(fd, "A\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "reserve-job 1\r\n");
-    ckresp(fd, "RESERVED 1 1\r\n");
-    ckresp(fd, "A\r\n");
-    mustsend(fd, "bury 1 1\r\n");
-    ckresp(fd, "BURIED\r\n");
-
-    // put, reserve and bury
-    mustsend(fd, "put 0 0 1 1\r\n");
-    mustsend(fd, "B\r\n");
-    ckresp(fd, "INSERTED 2\r\n");
-    mustsend(fd, "reserve-job 2\r\n");
-    ckresp(fd, "RESERVED 2 1\r\n");
-    ckresp(fd, "B\r\n");
-    mustsend(fd, "bury 2 1\r\n");
-    ckresp(fd, "BURIED\r\n");
-
-    // reserve by ids
-    mustsend(fd, "reserve-job 2\r\n");
-    ckresp(fd, "RESERVED 2 1\r\n");
-    ckresp(fd, "B\r\n");
-    mustsend(fd, "reserve-job 1\r\n");
-    ckresp(fd, "RESERVED 1 1\r\n");
-    ckresp(fd, "A\r\n");
+/* TODO: add more edge cases tests for delay and ttr */
 
-    // release back and check if jobs are ready.
-    mustsend(fd, "release 1 1 0\r\n");
-    ckresp(fd, "RELEASED\r\n");
-    mustsend(fd, "release 2 1 0\r\n");
-    ckresp(fd, "RELEASED\r\n");
-    mustsend(fd, "stats-job 1\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nstate: ready\n");
-    mustsend(fd, "stats-job 2\r\n");
-    ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nstate: ready\n");
+void
+cttest_garbage_priority()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put -1kkdj9djjkd9 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
 
+void
+cttest_negative_priority()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put -1 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
 }
 
 void
-cttest_release_bad_format()
+cttest_max_priority()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
+    mustsend(fd, "put 4294967295 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+}
 
-    // bad id
-    mustsend(fd, "release 18446744073709551616 1 1\r\n"); // UINT64_MAX+1
-    ckresp(fd, "BAD_FORMAT\r\n");
-    mustsend(fd, "release 184467440737095516160000000000000000000000000000 1 1\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
-    mustsend(fd, "release foo111\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
-    mustsend(fd, "release 111foo\r\n");
+void
+cttest_too_big_priority()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 4294967296 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
     ckresp(fd, "BAD_FORMAT\r\n");
+}
 
-    // bad priority
-    mustsend(fd, "release 18446744073709551615 abc 1\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
+void
+cttest_put_batch()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+    mustsend(fd, "put-batch 3 45\r\n");
+    mustsend(fd, "5 0 100 1\r\na\r\n");
+    mustsend(fd, "1 0 100 2\r\nbb\r\n");
+    mustsend(fd, "9 1 100 3\r\nccc\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED_BATCH 1 3\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "d\r\n");
+    ckresp(fd, "INSERTED 4\r\n");
 
-    // bad duration
-    mustsend(fd, "release 18446744073709551615 1 abc\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "stats-tube foo\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 1\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\npri: 9\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-put-batch: 1\n");
+
+    mustsend(fd, "watch foo\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 4 1\r\n");
+    ckresp(fd, "d\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 2\r\n");
+    ckresp(fd, "bb\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
 }
 
 void
-cttest_release_not_found()
+cttest_put_batch_wakes_waiter()
 {
     int port = SERVER();
+    int worker = mustdiallocal(port);
+    mustsend(worker, "reserve\r\n");
+    mustsend(worker, "reserve\r\n");
+
     int fd = mustdiallocal(port);
-    mustsend(fd, "release 1 1 1\r\n");
+    mustsend(fd, "put-batch 2 28\r\n");
+    mustsend(fd, "0 0 100 1\r\na\r\n0 0 100 1\r\nb\r\n\r\n");
+    ckresp(fd, "INSERTED_BATCH 1 2\r\n");
+    ckresp(worker, "RESERVED 1 1\r\n");
+    ckresp(worker, "a\r\n");
+    ckresp(worker, "RESERVED 2 1\r\n");
+    ckresp(worker, "b\r\n");
+}
+
+void
+cttest_put_batch_too_big()
+{
+    job_data_size_limit = 10;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-batch 2 39\r\n");
+    mustsend(fd, "0 0 100 1\r\na\r\n0 0 100 11\r\naaaaaaaaaaa\r\n\r\n");
+    ckresp(fd, "JOB_TOO_BIG\r\n");
+    mustsend(fd, "peek-ready\r\n");
     ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
 }
 
 void
-cttest_close_releases_job()
+cttest_put_batch_bad_format()
 {
     int port = SERVER();
-    int cons = mustdiallocal(port);
-    int prod = mustdiallocal(port);
-    mustsend(cons, "reserve-with-timeout 1\r\n");
+    int fd = mustdiallocal(port);
 
-    mustsend(prod, "put 0 0 100 1\r\n");
-    mustsend(prod, "a\r\n");
-    ckresp(prod, "INSERTED 1\r\n");
+    // count says 2, payload holds 1
+    mustsend(fd, "put-batch 2 14\r\n");
+    mustsend(fd, "0 0 100 1\r\na\r\n\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
 
-    ckresp(cons, "RESERVED 1 1\r\n");
-    ckresp(cons, "a\r\n");
+    // count says 1, payload holds 2
+    mustsend(fd, "put-batch 1 28\r\n");
+    mustsend(fd, "0 0 100 1\r\na\r\n0 0 100 1\r\nb\r\n\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
 
-    mustsend(prod, "stats-job 1\r\n");
-    ckrespsub(prod, "OK ");
-    ckrespsub(prod, "\nstate: reserved\n");
+    // missing CRLF after a body
+    mustsend(fd, "put-batch 1 14\r\n");
+    mustsend(fd, "0 0 100 1\r\naXX\r\n");
+    ckresp(fd, "EXPECTED_CRLF\r\n");
 
-    // Closed consumer connection should make the job ready sooner than ttr=100.
-    close(cons);
+    // zero count; the payload is skipped
+    mustsend(fd, "put-batch 0 14\r\n");
+    mustsend(fd, "0 0 100 1\r\na\r\n\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
 
-    // Job should be released in less than 1s. It is not instantly;
-    // we do not make guarantees about how soon jobs should be released.
-    mustsend(prod, "reserve-with-timeout 1\r\n");
-    ckresp(prod, "RESERVED 1 1\r\n");
-    ckresp(prod, "a\r\n");
+    mustsend(fd, "peek-ready\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
 }
 
 void
-cttest_quit_releases_job()
+cttest_put_batch_in_drain()
 {
-    // This test is similar to the close_releases_job test, except that
-    // connection is not closed, but command quit is sent.
+    enter_drain_mode(SIGUSR1);
     int port = SERVER();
-    int cons = mustdiallocal(port);
-    int prod = mustdiallocal(port);
-    mustsend(cons, "reserve-with-timeout 1\r\n");
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-batch 1 14\r\n");
+    mustsend(fd, "0 0 100 1\r\na\r\n\r\n");
+    ckresp(fd, "DRAINING\r\n");
+}
 
-    mustsend(prod, "put 0 0 100 1\r\n");
-    mustsend(prod, "a\r\n");
-    ckresp(prod, "INSERTED 1\r\n");
+void
+cttest_reserve_batch()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 5 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 1 0 100 2\r\n");
+    mustsend(fd, "bb\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 3 0 200 3\r\n");
+    mustsend(fd, "ccc\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
 
-    ckresp(cons, "RESERVED 1 1\r\n");
-    ckresp(cons, "a\r\n");
+    mustsend(fd, "reserve-batch 2\r\n");
+    ckresp(fd, "RESERVED_BATCH 2\r\n");
+    ckresp(fd, "RESERVED 2 2\r\n");
+    ckresp(fd, "bb\r\n");
+    ckresp(fd, "RESERVED 3 3\r\n");
+    ckresp(fd, "ccc\r\n");
 
-    mustsend(prod, "stats-job 1\r\n");
-    ckrespsub(prod, "OK ");
-    ckrespsub(prod, "\nstate: reserved\n");
+    // fewer ready than asked for
+    mustsend(fd, "reserve-batch 10\r\n");
+    ckresp(fd, "RESERVED_BATCH 1\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
 
-    // Quitting consumer should make the job ready sooner than ttr=100.
-    mustsend(cons, "quit\r\n");
+    // none ready and no timeout
+    mustsend(fd, "reserve-batch 10\r\n");
+    ckresp(fd, "RESERVED_BATCH 0\r\n");
 
-    // Job should be released in less than 1s. It is not instantly;
-    // we do not make guarantees about how soon jobs should be released.
-    mustsend(prod, "reserve-with-timeout 1\r\n");
-    ckresp(prod, "RESERVED 1 1\r\n");
-    ckresp(prod, "a\r\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: reserved\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nttr: 200\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-reserved: 3\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-reserve-batch: 3\n");
+
+    mustsend(fd, "release 3 0 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "DELETED\r\n");
 }
 
 void
-cttest_unpause_tube()
+cttest_reserve_batch_bad_format()
 {
-    int fd0, fd1;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "reserve-batch 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "reserve-batch 1001\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "reserve-batch 2 x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
 
+void
+cttest_reserve_batch_timeout()
+{
     int port = SERVER();
-    fd0 = mustdiallocal(port);
-    fd1 = mustdiallocal(port);
+    int fd = mustdiallocal(port);
+    mustsend(fd, "reserve-batch 5 0\r\n");
+    ckresp(fd, "TIMED_OUT\r\n");
 
-    mustsend(fd0, "put 0 0 0 0\r\n");
-    mustsend(fd0, "\r\n");
-    ckresp(fd0, "INSERTED 1\r\n");
+    // a plain reserve after a timed out batch is not framed as a batch
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+}
 
-    mustsend(fd0, "pause-tube default 86400\r\n");
-    ckresp(fd0, "PAUSED\r\n");
+void
+cttest_reserve_batch_waits()
+{
+    int port = SERVER();
+    int worker = mustdiallocal(port);
+    mustsend(worker, "watch foo\r\n");
+    ckresp(worker, "WATCHING 2\r\n");
+    mustsend(worker, "reserve-batch 5 10\r\n");
 
-    mustsend(fd1, "reserve\r\n");
+    int fd = mustdiallocal(port);
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+    mustsend(fd, "put-batch 2 28\r\n");
+    mustsend(fd, "0 0 100 1\r\na\r\n0 0 100 1\r\nb\r\n\r\n");
+    ckresp(fd, "INSERTED_BATCH 1 2\r\n");
+
+    ckresp(worker, "RESERVED_BATCH 2\r\n");
+    ckresp(worker, "RESERVED 1 1\r\n");
+    ckresp(worker, "a\r\n");
+    ckresp(worker, "RESERVED 2 1\r\n");
+    ckresp(worker, "b\r\n");
+}
 
-    mustsend(fd0, "pause-tube default 0\r\n");
-    ckresp(fd0, "PAUSED\r\n");
+void
+cttest_reserve_batch_skips_paused()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 9 0 100 1\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "use default\r\n");
+    ckresp(fd, "USING default\r\n");
+    mustsend(fd, "put 5 0 100 1\r\n");
+    mustsend(fd, "c\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "watch foo\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "pause-tube foo 60\r\n");
+    ckresp(fd, "PAUSED\r\n");
 
-    // ckresp will time out if this takes too long, so the
-    // test will not pass.
-    ckresp(fd1, "RESERVED 1 0\r\n");
-    ckresp(fd1, "\r\n");
+    mustsend(fd, "reserve-batch 5\r\n");
+    ckresp(fd, "RESERVED_BATCH 1\r\n");
+    ckresp(fd, "RESERVED 3 1\r\n");
+    ckresp(fd, "c\r\n");
 }
 
 void
-cttest_list_tube()
+cttest_delete_many()
 {
     int port = SERVER();
-    int fd0 = mustdiallocal(port);
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "c\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
 
-    mustsend(fd0, "watch w\r\n");
-    ckresp(fd0, "WATCHING 2\r\n");
+    mustsend(fd, "delete-many 7\r\n");
+    mustsend(fd, "1 9 2 1\r\n");
+    ckresp(fd, "OK 60\r\n");
+    ckresp(fd, "---\n- 1: DELETED\n- 9: NOT_FOUND\n- 2: DELETED\n- 1: NOT_FOUND\n\r\n");
 
-    mustsend(fd0, "use u\r\n");
-    ckresp(fd0, "USING u\r\n");
+    mustsend(fd, "peek-ready\r\n");
+    ckresp(fd, "FOUND 3 1\r\n");
+    ckresp(fd, "c\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-delete-many: 1\n");
+}
 
-    mustsend(fd0, "list-tubes\r\n");
-    ckrespsub(fd0, "OK ");
+void
+cttest_release_many()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int fd2 = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "c\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd2, "reserve\r\n");
+    ckresp(fd2, "RESERVED 3 1\r\n");
+    ckresp(fd2, "c\r\n");
+
+    // job 3 is reserved by another connection
+    mustsend(fd, "release-many 7 0 5\r\n");
+    mustsend(fd, "1 2 3\r\n");
+    ckresp(fd, "OK 47\r\n");
+    ckresp(fd, "---\n- 1: RELEASED\n- 2: RELEASED\n- 3: NOT_FOUND\n\r\n");
+
+    mustsend(fd, "stats-job 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: ready\npri: 7\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-release-many: 1\n");
+}
+
+void
+cttest_release_many_wakes_waiter()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int fd2 = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+
+    mustsend(fd2, "reserve\r\n");
+    usleep(10000);
+    mustsend(fd, "release-many 0 0 1\r\n");
+    mustsend(fd, "1\r\n");
+    ckresp(fd, "OK 18\r\n");
+    ckresp(fd, "---\n- 1: RELEASED\n\r\n");
+    ckresp(fd2, "RESERVED 1 1\r\n");
+    ckresp(fd2, "a\r\n");
+}
+
+void
+cttest_bury_many()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+
+    mustsend(fd, "bury-many 4 3\r\n");
+    mustsend(fd, "2 1\r\n");
+    ckresp(fd, "OK 28\r\n");
+    ckresp(fd, "---\n- 2: BURIED\n- 1: BURIED\n\r\n");
+
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: buried\npri: 4\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-bury-many: 1\n");
+}
+
+void
+cttest_reserve_stream()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int fd2 = mustdiallocal(port);
+    mustsend(fd2, "put 0 0 100 1\r\n");
+    mustsend(fd2, "a\r\n");
+    ckresp(fd2, "INSERTED 1\r\n");
+    mustsend(fd2, "put 0 0 100 1\r\n");
+    mustsend(fd2, "b\r\n");
+    ckresp(fd2, "INSERTED 2\r\n");
+    mustsend(fd2, "put 0 0 100 1\r\n");
+    mustsend(fd2, "c\r\n");
+    ckresp(fd2, "INSERTED 3\r\n");
+
+    mustsend(fd, "reserve-stream 2\r\n");
+    ckresp(fd, "STREAMING 2\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+
+    // the window is full until a job is finished
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    ckresp(fd, "RESERVED 3 1\r\n");
+    ckresp(fd, "c\r\n");
+
+    // new jobs are pushed as they arrive
+    mustsend(fd, "release 2 0 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "bury 3 0\r\n");
+    ckresp(fd, "BURIED\r\n");
+    mustsend(fd2, "put 0 0 100 1\r\n");
+    mustsend(fd2, "d\r\n");
+    ckresp(fd2, "INSERTED 4\r\n");
+    ckresp(fd, "RESERVED 4 1\r\n");
+    ckresp(fd, "d\r\n");
+
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-reserve-stream: 1\n");
+}
+
+void
+cttest_reserve_stream_stop()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int fd2 = mustdiallocal(port);
+    mustsend(fd, "reserve-stream 5\r\n");
+    ckresp(fd, "STREAMING 5\r\n");
+    mustsend(fd, "list-tubes-watched\r\n");
+    ckresp(fd, "OK 14\r\n");
+    ckresp(fd, "---\n- default\n\r\n");
+    mustsend(fd, "reserve-stream 0\r\n");
+    ckresp(fd, "STREAMING 0\r\n");
+
+    mustsend(fd2, "put 0 0 100 1\r\n");
+    mustsend(fd2, "a\r\n");
+    ckresp(fd2, "INSERTED 1\r\n");
+    mustsend(fd, "peek-ready\r\n");
+    ckresp(fd, "FOUND 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-waiting: 0\n");
+}
+
+void
+cttest_reserve_stream_not_waiting()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int fd2 = mustdiallocal(port);
+    int fd3 = mustdiallocal(port);
+    mustsend(fd, "reserve-stream 2\r\n");
+    ckresp(fd, "STREAMING 2\r\n");
+
+    // an idle streaming conn is not counted as waiting
+    mustsend(fd2, "stats-tube default\r\n");
+    ckrespsub(fd2, "OK ");
+    ckrespsub(fd2, "\ncurrent-waiting: 0\n");
+
+    // a blocked reserve is, even while a stream waits too
+    mustsend(fd3, "reserve-with-timeout 1\r\n");
+    usleep(10000); // time for the server to see it
+    mustsend(fd2, "stats\r\n");
+    ckrespsub(fd2, "OK ");
+    ckrespsub(fd2, "\ncurrent-waiting: 1\n");
+    ckresp(fd3, "TIMED_OUT\r\n");
+
+    mustsend(fd2, "put 0 0 100 1\r\n");
+    mustsend(fd2, "a\r\n");
+    ckresp(fd2, "INSERTED 1\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd2, "stats-tube default\r\n");
+    ckrespsub(fd2, "OK ");
+    ckrespsub(fd2, "\ncurrent-waiting: 0\n");
+    mustsend(fd2, "stats\r\n");
+    ckrespsub(fd2, "OK ");
+    ckrespsub(fd2, "\ncurrent-waiting: 0\n");
+}
+
+void
+cttest_reserve_stream_ttr()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 1 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve-stream 1\r\n");
+    ckresp(fd, "STREAMING 1\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+
+    // no DEADLINE_SOON; the job times out and comes back
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntimeouts: 1\n");
+}
+
+void
+cttest_list_jobs()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 5 0 100 2\r\nbc\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 100 100 0\r\n\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+
+    mustsend(fd, "list-jobs default ready 0 1\r\n");
+    ckresp(fd, "OK 114\r\n");
+    ckresp(fd, "---\nnext: 1\njobs:\n"
+               "- {id: 1, pri: 0, age: 0, bytes: 1, reserves: 0, timeouts: 0,"
+               " releases: 0, buries: 0, kicks: 0}\n\r\n");
+    mustsend(fd, "list-jobs default ready 1 1\r\n");
+    ckresp(fd, "OK 114\r\n");
+    ckresp(fd, "---\nnext: 0\njobs:\n"
+               "- {id: 2, pri: 5, age: 0, bytes: 2, reserves: 0, timeouts: 0,"
+               " releases: 0, buries: 0, kicks: 0}\n\r\n");
+    mustsend(fd, "list-jobs default delayed 0 10\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\n- {id: 3, pri: 0, age: 0, bytes: 0,");
+    mustsend(fd, "list-jobs default buried 0 10\r\n");
+    ckresp(fd, "OK 21\r\n");
+    ckresp(fd, "---\nnext: 0\njobs: []\n\r\n");
+}
+
+// bury_in_order puts n jobs and buries them in the order of ids.
+static void
+bury_in_order(int fd, int *ids, int n)
+{
+    char buf[50];
+    int i, pri[n];
+
+    for (i = 0; i < n; i++)
+        pri[ids[i] - 1] = i;
+    for (i = 0; i < n; i++) {
+        sprintf(buf, "put %d 0 100 1\r\na\r\n", pri[i]);
+        mustsend(fd, buf);
+        ckrespsub(fd, "INSERTED ");
+    }
+    for (i = 0; i < n; i++) {
+        mustsend(fd, "reserve\r\n");
+        sprintf(buf, "RESERVED %d 1\r\n", ids[i]);
+        ckresp(fd, buf);
+        ckresp(fd, "a\r\n");
+        sprintf(buf, "bury %d 0\r\n", ids[i]);
+        mustsend(fd, buf);
+        ckresp(fd, "BURIED\r\n");
+    }
+}
+
+void
+cttest_list_jobs_buried_cursor()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int ids[] = {3, 2, 1};
+
+    bury_in_order(fd, ids, 3);
+
+    // the cursor counts buries, not ids
+    mustsend(fd, "list-jobs default buried 0 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nnext: 2\njobs:\n- {id: 3,");
+    mustsend(fd, "list-jobs default buried 1 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nnext: 0\njobs:\n- {id: 2,");
+    mustsend(fd, "list-jobs default buried 2 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nnext: 0\njobs:\n- {id: 1,");
+    mustsend(fd, "list-jobs default buried 3 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nnext: 0\njobs: []\n");
+}
+
+// A page goes on after the last job of the previous one, even if
+// that job is no longer buried.
+void
+cttest_list_jobs_buried_cursor_gone()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int ids[] = {5, 6, 1, 2, 3, 4};
+
+    bury_in_order(fd, ids, 6);
+
+    mustsend(fd, "list-jobs default buried 0 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nnext: 2\njobs:\n- {id: 5,");
+    mustsend(fd, "kick-job 6\r\n");
+    ckresp(fd, "KICKED\r\n");
+    mustsend(fd, "list-jobs default buried 2 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nnext: 4\njobs:\n- {id: 1,");
+    mustsend(fd, "delete 3\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "delete 4\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "list-jobs default buried 4 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nnext: 0\njobs: []\n");
+}
+
+// The jobs between the cursor and the next page can span several
+// blocks of marks, all of them gone.
+void
+cttest_list_jobs_buried_cursor_far()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int i, ids[600];
+    char buf[50];
+
+    for (i = 0; i < 600; i++)
+        ids[i] = i + 1;
+    bury_in_order(fd, ids, 600);
+    for (i = 2; i <= 520; i++) {
+        sprintf(buf, "delete %d\r\n", i);
+        mustsend(fd, buf);
+        ckresp(fd, "DELETED\r\n");
+    }
+
+    mustsend(fd, "list-jobs default buried 1 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nnext: 522\njobs:\n- {id: 521,");
+    mustsend(fd, "kick 1\r\n");
+    ckresp(fd, "KICKED 1\r\n");
+    mustsend(fd, "list-jobs default buried 0 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nnext: 521\njobs:\n- {id: 521,");
+}
+
+void
+cttest_list_jobs_bad_format()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "list-jobs default reserved 0 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "list-jobs default ready 0 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "list-jobs default ready 0 1001\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "list-jobs default ready 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "list-jobs default ready 0 1 x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "list-jobs nosuchtube ready 0 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+}
+
+// read_conns reads the lines of a list-conns reply into buf, up to
+// the empty line that ends it, and returns how many there were.
+static int
+read_conns(int fd, char *buf, size_t size)
+{
+    char *line;
+    size_t n = 0;
+    int k = 0;
+
+    ckresp(fd, "CONNS\r\n");
+    while (strcmp(line = readline(fd), "\r\n") != 0) {
+        assert(n + strlen(line) < size);
+        strcpy(buf + n, line);
+        n += strlen(line);
+        k++;
+    }
+    return k;
+}
+
+void
+cttest_list_conns()
+{
+    int port = SERVER();
+    int prod = mustdiallocal(port);
+    int work = mustdiallocal(port);
+    int fd = mustdiallocal(port);
+    char body[4096];
+
+    mustsend(prod, "use foo\r\n");
+    ckresp(prod, "USING foo\r\n");
+    mustsend(prod, "put 0 0 100 1\r\na\r\n");
+    ckresp(prod, "INSERTED 1\r\n");
+    mustsend(work, "watch foo\r\n");
+    ckresp(work, "WATCHING 2\r\n");
+    mustsend(work, "reserve\r\n");
+    ckresp(work, "RESERVED 1 1\r\n");
+    ckresp(work, "a\r\n");
+
+    mustsend(fd, "list-conns\r\n");
+    assert(read_conns(fd, body, sizeof body) == 3);
+    assert(strstr(body, " want-command producer foo 1 0 0 "));
+    assert(strstr(body, " want-command worker default 2 1 9"));
+    assert(strstr(body, " want-command - default 1 0 0 "));
+    assert(strstr(body, " 127.0.0.1:"));
+
+    close(prod);
+    close(work);
+    usleep(10000); // time for the server to see them go
+    mustsend(fd, "list-conns\r\n");
+    assert(read_conns(fd, body, sizeof body) == 1);
+    assert(!strstr(body, " producer "));
+    assert(!strstr(body, " worker "));
+
+    // the connection can go on with other commands
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+}
+
+// A list-conns reply bigger than the stats buffer is sent in pieces.
+void
+cttest_list_conns_many()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    static char body[200 * 200];
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        int c = mustdiallocal(port);
+        mustsend(c, "use tube-with-a-long-name-for-a-long-line\r\n");
+        ckresp(c, "USING tube-with-a-long-name-for-a-long-line\r\n");
+    }
+    mustsend(fd, "list-conns\r\n");
+    assert(read_conns(fd, body, sizeof body) == 201);
+    mustsend(fd, "list-conns\r\n");
+    assert(read_conns(fd, body, sizeof body) == 201);
+}
+
+void
+cttest_stats_conn()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int other = mustdiallocal(port);
+    char buf[50];
+
+    mustsend(other, "stats-conn\r\n");
+    ckrespsub(other, "OK ");
+    char *body = readline(other);
+    char *s = strstr(body, "\nfd: ");
+    assert(s);
+    int ofd = atoi(s + 5);
+    assert(strstr(body, "\nstate: want-command\n"));
+    assert(strstr(body, "\ncmds: 1\n"));
+    assert(strstr(body, "\nreplies: 0\n"));
+
+    mustsend(other, "put 0 0 100 1\r\na\r\n");
+    ckresp(other, "INSERTED 1\r\n");
+    sprintf(buf, "stats-conn %d\r\n", ofd);
+    mustsend(fd, buf);
+    ckrespsub(fd, "OK ");
+    body = readline(fd);
+    assert(strstr(body, "\nproducer: true\n"));
+    assert(strstr(body, "\ncmds: 2\n"));
+    assert(strstr(body, "\nbytes-in: 30\n"));
+
+    mustsend(fd, "stats-conn 9999\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "stats-conn x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "stats-connx\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+// A job whose reservation times out while it is still being sent can
+// be deleted by another conn; the first conn still gets all of it.
+void
+cttest_send_outlives_job()
+{
+    enum { size = 8 << 20 };
+    job_data_size_limit = size;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int fd2 = mustdiallocal(port);
+    char *body = malloc(size + 2), *got = malloc(size + 2);
+    char buf[50];
+    int i;
+
+    for (i = 0; i < size; i++) {
+        body[i] = 'a' + i % 26;
+    }
+    memcpy(body + size, "\r\n", 2);
+    sprintf(buf, "put 0 0 1 %d\r\n", size);
+    mustsend(fd, buf);
+    writefull(fd, body, size + 2);
+    ckresp(fd, "INSERTED 1\r\n");
+
+    // don't read the reply until the job has timed out and is gone
+    mustsend(fd, "reserve\r\n");
+    usleep(1500000);
+    mustsend(fd2, "delete 1\r\n");
+    ckresp(fd2, "DELETED\r\n");
+
+    sprintf(buf, "RESERVED 1 %d\r\n", size);
+    ckresp(fd, buf);
+    readfull(fd, got, size + 2);
+    assert(memcmp(got, body, size + 2) == 0);
+    free(body);
+    free(got);
+}
+
+// Binary protocol op and status codes used below.
+enum {
+    Bput = 1, Bpeek = 2, Breserve = 3, Bdelete = 4, Brelease = 5, Bbury = 6,
+    Bkick = 7, Buse = 11, Bwatch = 12, Bignore = 13, Bstatstube = 17,
+    Breservetimeout = 20, Btouch = 21, Bputbatch = 26,
+};
+enum {
+    Sinserted = 1, Sburied = 2, Sreserved = 3, Sdeleted = 4, Sreleased = 5,
+    Stouched = 6, Susing = 7, Swatching = 8, Sfound = 9, Skicked = 10,
+    Sok = 11, Snotfound = 12, Stimedout = 14, Sjobtoobig = 16,
+    Sbadformat = 20, Sunknown = 21,
+};
+
+void
+cttest_binary_put_reserve_delete()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char *data;
+
+    mustsend(fd, "binary 1\r\n");
+    ckresp(fd, "BINARY 1\r\n");
+
+    sendframe(fd, Bput, 0, 5, 0, 100, "hello");
+    ckframe(fd, Sinserted, 1);
+    sendframe(fd, Bput, 0, 5, 0, 100, "");
+    ckframe(fd, Sinserted, 2);
+    sendframe(fd, Bpeek, 1, 0, 0, 0, "");
+    data = ckframe(fd, Sfound, 1);
+    assertf(strcmp(data, "hello") == 0, "got \"%s\"", data);
+
+    sendframe(fd, Breserve, 0, 0, 0, 0, "");
+    data = ckframe(fd, Sreserved, 1);
+    assertf(strcmp(data, "hello") == 0, "got \"%s\"", data);
+    sendframe(fd, Btouch, 1, 0, 0, 0, "");
+    ckframe(fd, Stouched, 0);
+    sendframe(fd, Bdelete, 1, 0, 0, 0, "");
+    ckframe(fd, Sdeleted, 0);
+    sendframe(fd, Bdelete, 1, 0, 0, 0, "");
+    ckframe(fd, Snotfound, 0);
+
+    sendframe(fd, Breserve, 0, 0, 0, 0, "");
+    data = ckframe(fd, Sreserved, 2);
+    assertf(strcmp(data, "") == 0, "got \"%s\"", data);
+    sendframe(fd, Brelease, 2, 0, 0, 0, "");
+    ckframe(fd, Sreleased, 0);
+    sendframe(fd, Breserve, 0, 0, 0, 0, "");
+    ckframe(fd, Sreserved, 2);
+    sendframe(fd, Bbury, 2, 0, 0, 0, "");
+    ckframe(fd, Sburied, 0);
+    sendframe(fd, Bkick, 0, 10, 0, 0, "");
+    ckframe(fd, Skicked, 1);
+    sendframe(fd, Breservetimeout, 0, 0, 0, 0, "");
+    ckframe(fd, Sreserved, 2);
+    sendframe(fd, Breservetimeout, 0, 0, 0, 0, "");
+    ckframe(fd, Stimedout, 0);
+}
+
+void
+cttest_binary_tubes()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int fd2 = mustdiallocal(port);
+    char *data;
+
+    mustsend(fd, "binary 1\r\n");
+    ckresp(fd, "BINARY 1\r\n");
+    sendframe(fd, Buse, 0, 0, 0, 0, "foo");
+    ckframe(fd, Susing, 0);
+    sendframe(fd, Bwatch, 0, 0, 0, 0, "foo");
+    ckframe(fd, Swatching, 2);
+    sendframe(fd, Bignore, 0, 0, 0, 0, "default");
+    ckframe(fd, Swatching, 1);
+    sendframe(fd, Bput, 0, 0, 0, 100, "x");
+    ckframe(fd, Sinserted, 1);
+    sendframe(fd, Bstatstube, 0, 0, 0, 0, "foo");
+    data = ckframe(fd, Sok, Anynum);
+    assertf(strstr(data, "\ncurrent-jobs-ready: 1\n"), "got \"%s\"", data);
+    assertf(strncmp(data, "---\n", 4) == 0, "got \"%s\"", data);
+    sendframe(fd, Bstatstube, 0, 0, 0, 0, "-bad");
+    ckframe(fd, Sbadformat, 0);
+
+    // text and binary conns share the same jobs
+    mustsend(fd2, "use foo\r\n");
+    ckresp(fd2, "USING foo\r\n");
+    mustsend(fd2, "put 0 0 100 2\r\n");
+    mustsend(fd2, "yz\r\n");
+    ckresp(fd2, "INSERTED 2\r\n");
+    sendframe(fd, Breserve, 0, 0, 0, 0, "");
+    ckframe(fd, Sreserved, 1);
+    sendframe(fd, Breserve, 0, 0, 0, 0, "");
+    data = ckframe(fd, Sreserved, 2);
+    assertf(strcmp(data, "yz") == 0, "got \"%s\"", data);
+}
+
+void
+cttest_binary_errors()
+{
+    job_data_size_limit = 10;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char big[20] = "aaaaaaaaaaaaaaaaaaa";
+
+    mustsend(fd, "binary 2\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "binary 1\r\n");
+    ckresp(fd, "BINARY 1\r\n");
+
+    // the body is skipped and the conn stays in sync
+    sendframe(fd, Bput, 0, 0, 0, 100, big);
+    ckframe(fd, Sjobtoobig, 0);
+    sendframe(fd, Bputbatch, 0, 0, 0, 0, "");
+    ckframe(fd, Sunknown, 0);
+    sendframe(fd, Bput, 0, 0, 0, 100, "ok");
+    ckframe(fd, Sinserted, 1);
+}
+
+void
+cttest_delete_reserve()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+
+    mustsend(fd, "delete-reserve 1\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "delete-reserve 2 0\r\n");
+    ckresp(fd, "TIMED_OUT\r\n");
+    mustsend(fd, "delete-reserve 2 0\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-delete-reserve: 3\n");
+}
+
+void
+cttest_delete_reserve_waits()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int fd2 = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+
+    mustsend(fd, "delete-reserve 1 10\r\n");
+    usleep(10000);
+    mustsend(fd2, "put 0 0 100 1\r\n");
+    mustsend(fd2, "b\r\n");
+    ckresp(fd2, "INSERTED 2\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+}
+
+void
+cttest_release_reserve()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 5 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 5 0 100 1\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+
+    // job 1 goes to the back of the queue, so job 2 comes next
+    mustsend(fd, "release-reserve 1 9 0\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "release-reserve 2 0 60 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "release-reserve 2 0 0 0\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+
+    mustsend(fd, "stats-job 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: delayed\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-release-reserve: 3\n");
+}
+
+void
+cttest_delete_reserve_bad_format()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "delete-reserve\r\n");
+    ckresp(fd, "UNKNOWN_COMMAND\r\n");
+    mustsend(fd, "delete-reserve x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete-reserve 1 x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete-reserve 1 1 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "release-reserve 1 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_id_list_bad_format()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "delete-many x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "release-many 0 5\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete-many 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete-many 3\r\n");
+    mustsend(fd, "1,2\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete-many 3\r\n");
+    mustsend(fd, "1 2xx");
+    ckresp(fd, "EXPECTED_CRLF\r\n");
+
+    // one more id than ID_LIST_MAX
+    char buf[2*ID_LIST_MAX + 3];
+    int i;
+    for (i = 0; i <= ID_LIST_MAX; i++) {
+        buf[2*i] = '1';
+        buf[2*i+1] = ' ';
+    }
+    memcpy(buf + 2*ID_LIST_MAX + 1, "\r\n", 2);
+    mustsend(fd, "delete-many 2001\r\n");
+    writefull(fd, buf, sizeof buf);
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_omit_time_left()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 5 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntime-left: 0\n");
+}
+
+void
+cttest_small_delay()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 1 1 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+}
+
+void
+cttest_delayed_to_ready()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 1 1 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 0\n");
+
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 1\n");
+
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntotal-jobs: 1\n");
+
+    usleep(1010000); // 1.01 sec
+
+    // check that after 1 sec the delayed job is ready again
+
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 1\n");
+
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 0\n");
+
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntotal-jobs: 1\n");
+}
+
+void
+cttest_statsjob_ck_format()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "stats-job 111ABC\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "stats-job 111 222\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "stats-job 111\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+}
+
+void
+cttest_stats_tube()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "use tubea\r\n");
+    ckresp(fd, "USING tubea\r\n");
+    mustsend(fd, "put 0 0 0 1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nname: \"tubea\"\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-urgent: 0\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 0\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-reserved: 0\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 0\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-buried: 0\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntotal-jobs: 1\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-using: 1\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-watching: 0\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-waiting: 0\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-delete: 1\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-pause-tube: 0\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\npause: 0\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\npause-time-left: 0\n");
+
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nname: \"default\"\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-urgent: 0\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 0\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-reserved: 0\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 0\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-buried: 0\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntotal-jobs: 0\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-using: 0\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-watching: 1\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-waiting: 0\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-delete: 0\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-pause-tube: 0\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\npause: 0\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\npause-time-left: 0\n");
+}
+
+void
+cttest_ttrlarge()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 120 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 4294 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 0 4295 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "put 0 0 4296 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 4\r\n");
+    mustsend(fd, "put 0 0 4297 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 5\r\n");
+    mustsend(fd, "put 0 0 5000 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 6\r\n");
+    mustsend(fd, "put 0 0 21600 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 7\r\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nttr: 120\n");
+    mustsend(fd, "stats-job 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nttr: 4294\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nttr: 4295\n");
+    mustsend(fd, "stats-job 4\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nttr: 4296\n");
+    mustsend(fd, "stats-job 5\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nttr: 4297\n");
+    mustsend(fd, "stats-job 6\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nttr: 5000\n");
+    mustsend(fd, "stats-job 7\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nttr: 21600\n");
+}
+
+void
+cttest_ttr_small()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 0 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nttr: 1\n");
+}
+
+void
+cttest_zero_delay()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 1 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+}
+
+void
+cttest_reserve_with_timeout_2conns()
+{
+    int fd0, fd1;
+
+    job_data_size_limit = 10;
+
+    int port = SERVER();
+    fd0 = mustdiallocal(port);
+    fd1 = mustdiallocal(port);
+    mustsend(fd0, "watch foo\r\n");
+    ckresp(fd0, "WATCHING 2\r\n");
+    mustsend(fd0, "reserve-with-timeout 1\r\n");
+    mustsend(fd1, "watch foo\r\n");
+    ckresp(fd1, "WATCHING 2\r\n");
+    timeout = 1100000000; // 1.1s
+    ckresp(fd0, "TIMED_OUT\r\n");
+}
+
+void
+cttest_reserve_ttr_deadline_soon()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    mustsend(fd, "put 0 0 1 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    mustsend(fd, "reserve-with-timeout 1\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+
+    // After 0.2s the job should be still reserved.
+    usleep(200000);
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: reserved\n");
+
+    mustsend(fd, "reserve-with-timeout 1\r\n");
+    ckresp(fd, "DEADLINE_SOON\r\n");
+
+    // Job should be reserved; last "reserve" took less than 1s.
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: reserved\n");
+
+    // We don't want to process the job, so release it and check that it's ready.
+    mustsend(fd, "release 1 0 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: ready\n");
+}
+
+void
+cttest_reserve_job_ttr_deadline_soon()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    mustsend(fd, "put 0 5 1 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: delayed\n");
+
+    mustsend(fd, "reserve-job 1\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+
+    // After 0.1s the job should be still reserved.
+    usleep(100000);
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: reserved\n");
+
+    // Reservation made with reserve-job should behave the same way as other
+    // reserve commands, e.g. produce "deadline soon" message, and get released
+    // when ttr ends.
+    mustsend(fd, "reserve-with-timeout 1\r\n");
+    ckresp(fd, "DEADLINE_SOON\r\n");
+
+    // Job should be reserved; last "reserve" took less than 1s.
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: reserved\n");
+
+    // We are not able to process the job in time. Check that it gets released.
+    // The job was in delayed state. It becomes ready when it gets auto-released.
+    usleep(1000000); // 1.0s
+    // put a dummy job
+    mustsend(fd, "put 0 0 1 1\r\n");
+    mustsend(fd, "B\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    // check that ID=1 gets released
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: ready\n");
+}
+
+void
+cttest_reserve_job_already_reserved()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    mustsend(fd, "put 0 0 1 1\r\n");
+    mustsend(fd, "A\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    mustsend(fd, "reserve-job 1\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "A\r\n");
+
+    // Job should not be reserved twice.
+    mustsend(fd, "reserve-job 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+}
+
+void
+cttest_reserve_job_ready()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    mustsend(fd, "put 0 0 1 1\r\n");
+    mustsend(fd, "A\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 1 1\r\n");
+    mustsend(fd, "B\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+
+    mustsend(fd, "reserve-job 2\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "B\r\n");
+
+    // Non-existing job.
+    mustsend(fd, "reserve-job 3\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+
+    // id=1 was not reserved.
+    mustsend(fd, "release 1 1 0\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+
+    mustsend(fd, "release 2 1 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+}
+
+void
+cttest_reserve_job_delayed()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    mustsend(fd, "put 0 100 1 1\r\n");
+    mustsend(fd, "A\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 100 1 1\r\n");
+    mustsend(fd, "B\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 100 1 1\r\n");
+    mustsend(fd, "C\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+
+    mustsend(fd, "reserve-job 2\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "B\r\n");
+
+    mustsend(fd, "release 2 1 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+
+    // verify that job was released in ready state.
+    mustsend(fd, "stats-job 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: ready\n");
+}
+
+void
+cttest_reserve_job_buried()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    // put, reserve and bury
+    mustsend(fd, "put 0 0 1 1\r\n");
+    mustsend(fd, "A\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve-job 1\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "A\r\n");
+    mustsend(fd, "bury 1 1\r\n");
+    ckresp(fd, "BURIED\r\n");
+
+    // put, reserve and bury
+    mustsend(fd, "put 0 0 1 1\r\n");
+    mustsend(fd, "B\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "reserve-job 2\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "B\r\n");
+    mustsend(fd, "bury 2 1\r\n");
+    ckresp(fd, "BURIED\r\n");
+
+    // reserve by ids
+    mustsend(fd, "reserve-job 2\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "B\r\n");
+    mustsend(fd, "reserve-job 1\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "A\r\n");
+
+    // release back and check if jobs are ready.
+    mustsend(fd, "release 1 1 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "release 2 1 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: ready\n");
+    mustsend(fd, "stats-job 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: ready\n");
+
+}
+
+void
+cttest_release_bad_format()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    // bad id
+    mustsend(fd, "release 18446744073709551616 1 1\r\n"); // UINT64_MAX+1
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "release 184467440737095516160000000000000000000000000000 1 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "release foo111\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "release 111foo\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+
+    // bad priority
+    mustsend(fd, "release 18446744073709551615 abc 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+
+    // bad duration
+    mustsend(fd, "release 18446744073709551615 1 abc\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_release_not_found()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "release 1 1 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+}
+
+void
+cttest_close_releases_job()
+{
+    int port = SERVER();
+    int cons = mustdiallocal(port);
+    int prod = mustdiallocal(port);
+    mustsend(cons, "reserve-with-timeout 1\r\n");
+
+    mustsend(prod, "put 0 0 100 1\r\n");
+    mustsend(prod, "a\r\n");
+    ckresp(prod, "INSERTED 1\r\n");
+
+    ckresp(cons, "RESERVED 1 1\r\n");
+    ckresp(cons, "a\r\n");
+
+    mustsend(prod, "stats-job 1\r\n");
+    ckrespsub(prod, "OK ");
+    ckrespsub(prod, "\nstate: reserved\n");
+
+    // Closed consumer connection should make the job ready sooner than ttr=100.
+    close(cons);
+
+    // Job should be released in less than 1s. It is not instantly;
+    // we do not make guarantees about how soon jobs should be released.
+    mustsend(prod, "reserve-with-timeout 1\r\n");
+    ckresp(prod, "RESERVED 1 1\r\n");
+    ckresp(prod, "a\r\n");
+}
+
+void
+cttest_quit_releases_job()
+{
+    // This test is similar to the close_releases_job test, except that
+    // connection is not closed, but command quit is sent.
+    int port = SERVER();
+    int cons = mustdiallocal(port);
+    int prod = mustdiallocal(port);
+    mustsend(cons, "reserve-with-timeout 1\r\n");
+
+    mustsend(prod, "put 0 0 100 1\r\n");
+    mustsend(prod, "a\r\n");
+    ckresp(prod, "INSERTED 1\r\n");
+
+    ckresp(cons, "RESERVED 1 1\r\n");
+    ckresp(cons, "a\r\n");
+
+    mustsend(prod, "stats-job 1\r\n");
+    ckrespsub(prod, "OK ");
+    ckrespsub(prod, "\nstate: reserved\n");
+
+    // Quitting consumer should make the job ready sooner than ttr=100.
+    mustsend(cons, "quit\r\n");
+
+    // Job should be released in less than 1s. It is not instantly;
+    // we do not make guarantees about how soon jobs should be released.
+    mustsend(prod, "reserve-with-timeout 1\r\n");
+    ckresp(prod, "RESERVED 1 1\r\n");
+    ckresp(prod, "a\r\n");
+}
+
+void
+cttest_unpause_tube()
+{
+    int fd0, fd1;
+
+    int port = SERVER();
+    fd0 = mustdiallocal(port);
+    fd1 = mustdiallocal(port);
+
+    mustsend(fd0, "put 0 0 0 0\r\n");
+    mustsend(fd0, "\r\n");
+    ckresp(fd0, "INSERTED 1\r\n");
+
+    mustsend(fd0, "pause-tube default 86400\r\n");
+    ckresp(fd0, "PAUSED\r\n");
+
+    mustsend(fd1, "reserve\r\n");
+
+    mustsend(fd0, "pause-tube default 0\r\n");
+    ckresp(fd0, "PAUSED\r\n");
+
+    // ckresp will time out if this takes too long, so the
+    // test will not pass.
+    ckresp(fd1, "RESERVED 1 0\r\n");
+    ckresp(fd1, "\r\n");
+}
+
+void
+cttest_list_tube()
+{
+    int port = SERVER();
+    int fd0 = mustdiallocal(port);
+
+    mustsend(fd0, "watch w\r\n");
+    ckresp(fd0, "WATCHING 2\r\n");
+
+    mustsend(fd0, "use u\r\n");
+    ckresp(fd0, "USING u\r\n");
+
+    mustsend(fd0, "list-tubes\r\n");
+    ckrespsub(fd0, "OK ");
     ckresp(fd0,
            "---\n"
            "- default\n"
            "- w\n"
            "- u\n\r\n");
 
-    mustsend(fd0, "list-tube-used\r\n");
-    ckresp(fd0, "USING u\r\n");
+    mustsend(fd0, "list-tube-used\r\n");
+    ckresp(fd0, "USING u\r\n");
+
+    mustsend(fd0, "list-tubes-watched\r\n");
+    ckrespsub(fd0, "OK ");
+    ckresp(fd0,
+           "---\n"
+           "- default\n"
+           "- w\n\r\n");
+
+    mustsend(fd0, "ignore default\r\n");
+    ckresp(fd0, "WATCHING 1\r\n");
+
+    mustsend(fd0, "list-tubes-watched\r\n");
+    ckrespsub(fd0, "OK ");
+    ckresp(fd0,
+           "---\n"
+           "- w\n\r\n");
+
+    mustsend(fd0, "ignore w\r\n");
+    ckresp(fd0, "NOT_IGNORED\r\n");
+}
+
+#define STRING_LEN_200  \
+    "0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789" \
+    "0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789"
+
+void
+cttest_use_tube_long()
+{
+    int port = SERVER();
+    int fd0 = mustdiallocal(port);
+    // 200 chars is okay
+    mustsend(fd0, "use " STRING_LEN_200 "\r\n");
+    ckresp(fd0, "USING " STRING_LEN_200 "\r\n");
+    // 201 chars is too much
+    mustsend(fd0, "use " STRING_LEN_200 "Z\r\n");
+    ckresp(fd0, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_longest_command()
+{
+    int port = SERVER();
+    int fd0 = mustdiallocal(port);
+    mustsend(fd0, "use " STRING_LEN_200 "\r\n");
+    ckresp(fd0, "USING " STRING_LEN_200 "\r\n");
+    mustsend(fd0, "pause-tube " STRING_LEN_200 " 4294967295\r\n");
+    ckresp(fd0, "PAUSED\r\n");
+}
 
-    mustsend(fd0, "list-tubes-watched\r\n");
-    ckrespsub(fd0, "OK ");
-    ckresp(fd0,
-           "---\n"
-           "- default\n"
-           "- w\n\r\n");
+void
+cttest_binlog_empty_exit()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    job_data_size_limit = 10;
 
-    mustsend(fd0, "ignore default\r\n");
-    ckresp(fd0, "WATCHING 1\r\n");
+    int port = SERVER();
+    kill_srvpid();
+
+    port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 0 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+}
+
+void
+cttest_binlog_bury()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    job_data_size_limit = 10;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 0\r\n");
+    ckresp(fd, "\r\n");
+    mustsend(fd, "bury 1 0\r\n");
+    ckresp(fd, "BURIED\r\n");
+}
+
+void
+cttest_binlog_basic()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    job_data_size_limit = 10;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+}
+
+void
+cttest_binlog_size_limit()
+{
+    int i = 0;
+    int gotsize;
+
+    size = 4096;
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = size;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char *b2 = fmtalloc("%s/binlog.2", ctdir());
+    while (!exist(b2)) {
+        char *exp = fmtalloc("INSERTED %d\r\n", ++i);
+        mustsend(fd, "put 0 0 100 50\r\n");
+        mustsend(fd, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n");
+        ckresp(fd, exp);
+        free(exp);
+    }
+
+    char *b1 = fmtalloc("%s/binlog.1", ctdir());
+    gotsize = filesize(b1);
+    assertf(gotsize == size, "binlog.1 %d != %d", gotsize, size);
+    gotsize = filesize(b2);
+    assertf(gotsize == size, "binlog.2 %d != %d", gotsize, size);
+    free(b1);
+    free(b2);
+}
+
+void
+cttest_binlog_allocation()
+{
+    int i = 0;
+
+    size = 601;
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = size;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    for (i = 1; i <= 96; i++) {
+        char *exp = fmtalloc("INSERTED %d\r\n", i);
+        mustsend(fd, "put 0 0 120 22\r\n");
+        mustsend(fd, "job payload xxxxxxxxxx\r\n");
+        ckresp(fd, exp);
+        free(exp);
+    }
+    for (i = 1; i <= 96; i++) {
+        char *exp = fmtalloc("delete %d\r\n", i);
+        mustsend(fd, exp);
+        ckresp(fd, "DELETED\r\n");
+        free(exp);
+    }
+}
+
+void
+cttest_binlog_compact_idle()
+{
+    int i;
+
+    size = 1000;
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = size;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 4\r\n");
+    mustsend(fd, "keep\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    for (i = 2; i < 40; i++) {
+        char *exp = fmtalloc("INSERTED %d\r\n", i);
+        mustsend(fd, "put 0 0 100 50\r\n");
+        mustsend(fd, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n");
+        ckresp(fd, exp);
+        free(exp);
+        exp = fmtalloc("delete %d\r\n", i);
+        mustsend(fd, exp);
+        ckresp(fd, "DELETED\r\n");
+        free(exp);
+    }
+
+    // Compaction runs from the event loop, so binlog.1 must go away
+    // without any further writes from the client.
+    char *b1 = fmtalloc("%s/binlog.1", ctdir());
+    for (i = 0; i < 100 && exist(b1); i++) {
+        usleep(10000);
+    }
+    assertf(!exist(b1), "binlog.1 should be compacted away");
+    free(b1);
+
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    char *line = readline(fd);
+    assertf(!strstr(line, "\nbinlog-records-migrated: 0\n"),
+            "compaction should count migrated records");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 4\r\n");
+    ckresp(fd, "keep\r\n");
+}
+
+// Deduplication keys must not hold a binlog file that compaction
+// has emptied of jobs; they are logged again in a newer file.
+void
+cttest_binlog_compact_keys()
+{
+    int i;
+
+    size = 1000;
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = size;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 4 k1\r\n");
+    mustsend(fd, "keep\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 4 k2\r\n");
+    mustsend(fd, "gone\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "DELETED\r\n");
+    for (i = 3; i < 40; i++) {
+        char *exp = fmtalloc("INSERTED %d\r\n", i);
+        mustsend(fd, "put 0 0 100 50\r\n");
+        mustsend(fd, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n");
+        ckresp(fd, exp);
+        free(exp);
+        exp = fmtalloc("delete %d\r\n", i);
+        mustsend(fd, exp);
+        ckresp(fd, "DELETED\r\n");
+        free(exp);
+    }
+
+    char *b1 = fmtalloc("%s/binlog.1", ctdir());
+    for (i = 0; i < 100 && exist(b1); i++) {
+        usleep(10000);
+    }
+    assertf(!exist(b1), "binlog.1 should be compacted away");
+    free(b1);
+
+    // both keys are still live, before and after a restart
+    mustsend(fd, "put 0 0 100 1 k1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1 k2\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1 k1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1 k2\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndedup-keys: 2\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 4\r\n");
+    ckresp(fd, "keep\r\n");
+}
+
+void
+cttest_binlog_read()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "use test\r\n");
+    ckresp(fd, "USING test\r\n");
+    mustsend(fd, "put 0 0 120 4\r\n");
+    mustsend(fd, "test\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 120 4\r\n");
+    mustsend(fd, "tes1\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "watch test\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 4\r\n");
+    ckresp(fd, "test\r\n");
+    mustsend(fd, "release 1 1 1\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 4\r\n");
+    ckresp(fd, "tes1\r\n");
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "DELETED\r\n");
 
-    mustsend(fd0, "list-tubes-watched\r\n");
-    ckrespsub(fd0, "OK ");
-    ckresp(fd0,
-           "---\n"
-           "- w\n\r\n");
+    kill_srvpid();
 
-    mustsend(fd0, "ignore w\r\n");
-    ckresp(fd0, "NOT_IGNORED\r\n");
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "watch test\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 4\r\n");
+    ckresp(fd, "test\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
 }
 
-#define STRING_LEN_200  \
-    "0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789" \
-    "0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789"
-
+// A delayed job keeps its remaining delay across a restart.
 void
-cttest_use_tube_long()
+cttest_binlog_delay_deadline()
 {
-    int port = SERVER();
-    int fd0 = mustdiallocal(port);
-    // 200 chars is okay
-    mustsend(fd0, "use " STRING_LEN_200 "\r\n");
-    ckresp(fd0, "USING " STRING_LEN_200 "\r\n");
-    // 201 chars is too much
-    mustsend(fd0, "use " STRING_LEN_200 "Z\r\n");
-    ckresp(fd0, "BAD_FORMAT\r\n");
-}
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
 
-void
-cttest_longest_command()
-{
     int port = SERVER();
-    int fd0 = mustdiallocal(port);
-    mustsend(fd0, "use " STRING_LEN_200 "\r\n");
-    ckresp(fd0, "USING " STRING_LEN_200 "\r\n");
-    mustsend(fd0, "pause-tube " STRING_LEN_200 " 4294967295\r\n");
-    ckresp(fd0, "PAUSED\r\n");
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 100 120 4\r\n");
+    mustsend(fd, "test\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    char *body = readline(fd);
+    assert(strstr(body, "\nstate: delayed\n"));
+    char *tl = strstr(body, "\ntime-left: ");
+    assert(tl);
+    int left = atoi(tl + 12);
+    assertf(left >= 98 && left <= 100, "time-left %d", left);
 }
 
 void
-cttest_binlog_empty_exit()
+cttest_binlog_ephemeral_tube()
 {
     srv.wal.dir = ctdir();
     srv.wal.use = 1;
-    job_data_size_limit = 10;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+    ms_append(&ephemeral_prefixes, "tmp-");
 
     int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "use tmp-a\r\n");
+    ckresp(fd, "USING tmp-a\r\n");
+    mustsend(fd, "put 0 0 120 4\r\n");
+    mustsend(fd, "lost\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "use durable\r\n");
+    ckresp(fd, "USING durable\r\n");
+    mustsend(fd, "put 0 0 120 4\r\n");
+    mustsend(fd, "kept\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "stats-tube tmp-a\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndurable: false\n");
+    mustsend(fd, "stats-tube durable\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndurable: true\n");
+
+    // the ephemeral job can be released, buried and kicked
+    // without touching the binlog
+    mustsend(fd, "watch tmp-a\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "ignore default\r\n");
+    ckresp(fd, "WATCHING 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 4\r\n");
+    ckresp(fd, "lost\r\n");
+    mustsend(fd, "release 1 0 1\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "kick-job 1\r\n");
+    ckresp(fd, "KICKED\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 4\r\n");
+    ckresp(fd, "lost\r\n");
+    mustsend(fd, "bury 1 0\r\n");
+    ckresp(fd, "BURIED\r\n");
+
     kill_srvpid();
 
     port = SERVER();
-    int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 0\r\n");
-    mustsend(fd, "\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "FOUND 2 4\r\n");
+    ckresp(fd, "kept\r\n");
 }
 
 void
-cttest_binlog_bury()
+cttest_binlog_put_batch_too_big_for_file()
 {
     srv.wal.dir = ctdir();
     srv.wal.use = 1;
-    job_data_size_limit = 10;
+    srv.wal.filesize = 1024;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
 
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 100 0\r\n");
+    char *body = calloc(601, 1);
+    memset(body, 'x', 600);
+
+    // each job fits in a file on its own, but the pair does not
+    mustsend(fd, "put-batch 2 1230\r\n");
+    mustsend(fd, "0 0 100 600\r\n");
+    mustsend(fd, body);
+    mustsend(fd, "\r\n");
+    mustsend(fd, "0 0 100 600\r\n");
+    mustsend(fd, body);
+    mustsend(fd, "\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "OUT_OF_MEMORY\r\n");
+
+    mustsend(fd, "put 0 0 100 600\r\n");
+    mustsend(fd, body);
     mustsend(fd, "\r\n");
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "reserve\r\n");
-    ckresp(fd, "RESERVED 1 0\r\n");
-    ckresp(fd, "\r\n");
-    mustsend(fd, "bury 1 0\r\n");
-    ckresp(fd, "BURIED\r\n");
+    free(body);
 }
 
 void
-cttest_binlog_basic()
+cttest_binlog_put_batch()
 {
     srv.wal.dir = ctdir();
     srv.wal.use = 1;
-    job_data_size_limit = 10;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
 
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 100 0\r\n");
+    mustsend(fd, "put-batch 3 43\r\n");
+    mustsend(fd, "0 0 100 1\r\na\r\n");
+    mustsend(fd, "1 0 100 1\r\nb\r\n");
+    mustsend(fd, "2 0 100 2\r\ncc\r\n");
     mustsend(fd, "\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
+    ckresp(fd, "INSERTED_BATCH 1 3\r\n");
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "DELETED\r\n");
 
     kill_srvpid();
 
     port = SERVER();
     fd = mustdiallocal(port);
-    mustsend(fd, "delete 1\r\n");
-    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 3 2\r\n");
+    ckresp(fd, "cc\r\n");
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
 }
 
 void
-cttest_binlog_size_limit()
+cttest_binlog_flush_tube()
 {
-    int i = 0;
-    int gotsize;
-
-    size = 4096;
     srv.wal.dir = ctdir();
     srv.wal.use = 1;
-    srv.wal.filesize = size;
     srv.wal.syncrate = 0;
     srv.wal.wantsync = 1;
 
     int port = SERVER();
     int fd = mustdiallocal(port);
-    char *b2 = fmtalloc("%s/binlog.2", ctdir());
-    while (!exist(b2)) {
-        char *exp = fmtalloc("INSERTED %d\r\n", ++i);
-        mustsend(fd, "put 0 0 100 50\r\n");
-        mustsend(fd, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n");
-        ckresp(fd, exp);
-        free(exp);
+    int i;
+    char buf[50];
+
+    // 30 jobs need several tombstones
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+    for (i = 0; i < 30; i++) {
+        mustsend(fd, "put 0 0 100 1\r\na\r\n");
+        ckrespsub(fd, "INSERTED ");
     }
+    mustsend(fd, "use bar\r\n");
+    ckresp(fd, "USING bar\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED 31\r\n");
+    mustsend(fd, "put 0 100 100 1\r\nc\r\n");
+    ckresp(fd, "INSERTED 32\r\n");
+    mustsend(fd, "flush-tube foo\r\n");
+    ckresp(fd, "FLUSHED 30\r\n");
+    mustsend(fd, "kick 1\r\n");
+    ckresp(fd, "KICKED 1\r\n");
 
-    char *b1 = fmtalloc("%s/binlog.1", ctdir());
-    gotsize = filesize(b1);
-    assertf(gotsize == size, "binlog.1 %d != %d", gotsize, size);
-    gotsize = filesize(b2);
-    assertf(gotsize == size, "binlog.2 %d != %d", gotsize, size);
-    free(b1);
-    free(b2);
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    for (i = 1; i <= 30; i++) {
+        sprintf(buf, "peek %d\r\n", i);
+        mustsend(fd, buf);
+        ckresp(fd, "NOT_FOUND\r\n");
+    }
+    mustsend(fd, "peek 31\r\n");
+    ckresp(fd, "FOUND 31 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "stats-job 32\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: ready\n");
+
+    // the log still works after the tombstones
+    mustsend(fd, "delete 31\r\n");
+    ckresp(fd, "DELETED\r\n");
+    kill_srvpid();
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 31\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 32\r\n");
+    ckresp(fd, "FOUND 32 1\r\n");
+    ckresp(fd, "c\r\n");
 }
 
 void
-cttest_binlog_allocation()
+cttest_binlog_id_lists()
 {
-    int i = 0;
-
-    size = 601;
     srv.wal.dir = ctdir();
     srv.wal.use = 1;
-    srv.wal.filesize = size;
     srv.wal.syncrate = 0;
     srv.wal.wantsync = 1;
 
     int port = SERVER();
     int fd = mustdiallocal(port);
-    for (i = 1; i <= 96; i++) {
-        char *exp = fmtalloc("INSERTED %d\r\n", i);
-        mustsend(fd, "put 0 0 120 22\r\n");
-        mustsend(fd, "job payload xxxxxxxxxx\r\n");
-        ckresp(fd, exp);
-        free(exp);
-    }
-    for (i = 1; i <= 96; i++) {
-        char *exp = fmtalloc("delete %d\r\n", i);
-        mustsend(fd, exp);
-        ckresp(fd, "DELETED\r\n");
-        free(exp);
-    }
+    mustsend(fd, "put-batch 4 56\r\n");
+    mustsend(fd, "0 0 100 1\r\na\r\n");
+    mustsend(fd, "0 0 100 1\r\nb\r\n");
+    mustsend(fd, "0 0 100 1\r\nc\r\n");
+    mustsend(fd, "0 0 100 1\r\nd\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED_BATCH 1 4\r\n");
+    mustsend(fd, "delete-many 3\r\n");
+    mustsend(fd, "1 4\r\n");
+    ckresp(fd, "OK 30\r\n");
+    ckresp(fd, "---\n- 1: DELETED\n- 4: DELETED\n\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 3 1\r\n");
+    ckresp(fd, "c\r\n");
+    mustsend(fd, "bury-many 0 1\r\n");
+    mustsend(fd, "2\r\n");
+    ckresp(fd, "OK 16\r\n");
+    ckresp(fd, "---\n- 2: BURIED\n\r\n");
+    mustsend(fd, "release-many 0 60 1\r\n");
+    mustsend(fd, "3\r\n");
+    ckresp(fd, "OK 18\r\n");
+    ckresp(fd, "---\n- 3: RELEASED\n\r\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 4\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "stats-job 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: buried\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: delayed\n");
 }
 
+// A torn write at the end of the last binlog file must not
+// bring back a damaged job; everything before it is kept.
 void
-cttest_binlog_read()
+cttest_binlog_bad_checksum_tail()
 {
     srv.wal.dir = ctdir();
     srv.wal.use = 1;
@@ -1647,40 +3976,49 @@ cttest_binlog_read()
 
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "use test\r\n");
-    ckresp(fd, "USING test\r\n");
     mustsend(fd, "put 0 0 120 4\r\n");
-    mustsend(fd, "test\r\n");
+    mustsend(fd, "keep\r\n");
     ckresp(fd, "INSERTED 1\r\n");
     mustsend(fd, "put 0 0 120 4\r\n");
-    mustsend(fd, "tes1\r\n");
+    mustsend(fd, "torn\r\n");
     ckresp(fd, "INSERTED 2\r\n");
-    mustsend(fd, "watch test\r\n");
-    ckresp(fd, "WATCHING 2\r\n");
-    mustsend(fd, "reserve\r\n");
-    ckresp(fd, "RESERVED 1 4\r\n");
-    ckresp(fd, "test\r\n");
-    mustsend(fd, "release 1 1 1\r\n");
-    ckresp(fd, "RELEASED\r\n");
-    mustsend(fd, "reserve\r\n");
-    ckresp(fd, "RESERVED 2 4\r\n");
-    ckresp(fd, "tes1\r\n");
-    mustsend(fd, "delete 2\r\n");
-    ckresp(fd, "DELETED\r\n");
 
     kill_srvpid();
 
+    // flip one byte of the second job's body
+    char *b1 = fmtalloc("%s/binlog.1", ctdir());
+    int bfd = open(b1, O_RDWR);
+    assert(bfd != -1);
+    char buf[4096];
+    int n = read(bfd, buf, sizeof buf);
+    assert(n > 0);
+    int i;
+    for (i = 0; i + 4 <= n && memcmp(buf+i, "torn", 4); i++);
+    assert(i + 4 <= n);
+    buf[i] = 'T';
+    assert(pwrite(bfd, buf, n, 0) == n);
+    close(bfd);
+
     port = SERVER();
     fd = mustdiallocal(port);
-    mustsend(fd, "watch test\r\n");
-    ckresp(fd, "WATCHING 2\r\n");
-    mustsend(fd, "reserve\r\n");
-    ckresp(fd, "RESERVED 1 4\r\n");
-    ckresp(fd, "test\r\n");
-    mustsend(fd, "delete 1\r\n");
-    ckresp(fd, "DELETED\r\n");
-    mustsend(fd, "delete 2\r\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 4\r\n");
+    ckresp(fd, "keep\r\n");
+    mustsend(fd, "peek 2\r\n");
     ckresp(fd, "NOT_FOUND\r\n");
+
+    // binlog.1 is no longer the last file, so the torn record must
+    // be gone from it before the next restart
+    kill_srvpid();
+    int start = i - sizeof(Jobrec) - strlen("default") - sizeof(int);
+    assert(filesize(b1) == start);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 4\r\n");
+    ckresp(fd, "keep\r\n");
+    free(b1);
 }
 
 void
@@ -1987,6 +4325,88 @@ cttest_binlog_v5()
     ckrespsub(fd, "\nkicks: 0\n");
 }
 
+// ctbench_stats_10k_tubes measures a stats command on a server
+// with 10000 tubes, each holding one delayed job.
+void
+ctbench_stats_10k_tubes(int n)
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char buf[50], body[4096], *p;
+    int i, r, got, size;
+
+    for (i = 0; i < 10000; i++) {
+        sprintf(buf, "use t%d\r\n", i);
+        mustsend(fd, buf);
+        ckrespsub(fd, "USING ");
+        mustsend(fd, "put 0 1000 100 1\r\na\r\n");
+        ckrespsub(fd, "INSERTED ");
+    }
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 10000\n");
+
+    // Read each reply with as few syscalls as possible,
+    // so the time is mostly the server's.
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        mustsend(fd, "stats\r\n");
+        got = 0;
+        size = -1;
+        while (size < 0 || got < size) {
+            r = read(fd, body + got, sizeof(body) - 1 - got);
+            assertf(r > 0, "read: %d", r);
+            got += r;
+            body[got] = '\0';
+            if (size < 0 && (p = strstr(body, "\r\n"))) {
+                size = p + 2 - body + atoi(body + 3) + 2;
+            }
+        }
+    }
+    ctstoptimer();
+}
+
+// bench_peek peeks n times at one job of the given size.
+static void
+bench_peek(int n, int size)
+{
+    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char *body = malloc(size + 2);
+    char buf[50];
+    int i;
+
+    memset(body, 'a', size);
+    memcpy(body + size, "\r\n", 2);
+    sprintf(buf, "put 0 0 100 %d\r\n", size);
+    mustsend(fd, buf);
+    writefull(fd, body, size + 2);
+    ckresp(fd, "INSERTED 1\r\n");
+    sprintf(buf, "FOUND 1 %d\r\n", size);
+    ctsetbytes(size);
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        mustsend(fd, "peek 1\r\n");
+        ckresp(fd, buf);
+        readfull(fd, body, size + 2);
+    }
+    ctstoptimer();
+    free(body);
+}
+
+void
+ctbench_peek_0064(int n)
+{
+    bench_peek(n, 64);
+}
+
+void
+ctbench_peek_1mib(int n)
+{
+    bench_peek(n, 1 << 20);
+}
+
 static void
 bench_put_delete_size(int n, int size, int walsize, int sync, int64 syncrate_ms)
 {
@@ -2092,3 +4512,540 @@ ctbench_put_delete_wal_8192_no_fsync(int n)
 {
     bench_put_delete_size(n, 8192, 512000, 0, 0);
 }
+
+static void
+bench_put_size(int n, int size, int batch)
+{
+    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char hdr[50];
+    int i, k, m, len;
+
+    sprintf(hdr, "0 0 0 %d\r\n", size);
+    len = strlen(hdr) + size + 2;
+    char *buf = malloc(50 + (size_t)len*batch + 2);
+    ctsetbytes(size);
+    ctresettimer();
+    for (i = 0; i < n; i += m) {
+        m = min(batch, n - i);
+        char *p = buf;
+        if (batch == 1) {
+            p += sprintf(p, "put %s", hdr);
+        } else {
+            p += sprintf(p, "put-batch %d %d\r\n", m, len*m);
+        }
+        for (k = 0; k < m; k++) {
+            if (batch > 1) p += sprintf(p, "%s", hdr);
+            memset(p, 'a', size);
+            p += size;
+            *p++ = '\r';
+            *p++ = '\n';
+        }
+        if (batch > 1) {
+            *p++ = '\r';
+            *p++ = '\n';
+        }
+        writefull(fd, buf, p - buf);
+        ckrespsub(fd, "INSERTED");
+    }
+    ctstoptimer();
+    free(buf);
+}
+
+void
+ctbench_put_0064(int n)
+{
+    bench_put_size(n, 64, 1);
+}
+
+void
+ctbench_put_batch_0064_x100(int n)
+{
+    bench_put_size(n, 64, 100);
+}
+
+void
+ctbench_put_batch_1024_x100(int n)
+{
+    bench_put_size(n, 1024, 100);
+}
+
+// Reads from fd until n lines have arrived, without checking them.
+// Unlike readline it reads in bulk, so it does not dominate a benchmark.
+static void
+mustreadlines(int fd, int n)
+{
+    char buf[4096];
+    int i, r;
+
+    while (n > 0) {
+        r = read(fd, buf, sizeof buf);
+        assertf(r > 0, "read %d", r);
+        for (i = 0; i < r; i++) {
+            if (buf[i] == '\n') n--;
+        }
+    }
+}
+
+// Reads a reply of n lines from fd into buf, which has room for size
+// bytes, and NUL-terminates it. The reply must be all there is to read.
+static void
+readreply(int fd, char *buf, int size, int n)
+{
+    int i, r, got = 0;
+
+    while (n > 0) {
+        r = read(fd, buf + got, size - 1 - got);
+        assertf(r > 0, "read %d", r);
+        for (i = got; i < got + r; i++) {
+            if (buf[i] == '\n') n--;
+        }
+        got += r;
+    }
+    buf[got] = '\0';
+}
+
+static void
+bench_reserve(int n, int batch)
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char buf[50];
+    int i, k, m;
+
+    for (i = 0; i < n; i += m) {
+        m = min(100, n - i);
+        sprintf(buf, "put-batch %d %d\r\n", m, 14*m);
+        writefull(fd, buf, strlen(buf));
+        for (k = 0; k < m; k++) {
+            writefull(fd, "0 0 100 1\r\na\r\n", 14);
+        }
+        mustsend(fd, "\r\n");
+        ckrespsub(fd, "INSERTED_BATCH ");
+    }
+    ctresettimer();
+    for (i = 0; i < n; i += m) {
+        m = min(batch, n - i);
+        if (batch == 1) {
+            writefull(fd, "reserve\r\n", 9);
+            mustreadlines(fd, 2);
+        } else {
+            sprintf(buf, "reserve-batch %d\r\n", m);
+            writefull(fd, buf, strlen(buf));
+            mustreadlines(fd, 1 + 2*m);
+        }
+    }
+    ctstoptimer();
+}
+void
+ctbench_reserve(int n)
+{
+    bench_reserve(n, 1);
+}
+
+void
+ctbench_reserve_batch_x100(int n)
+{
+    bench_reserve(n, 100);
+}
+
+
+// bench_worker runs a reserve/delete worker loop over n jobs,
+// either as two commands per job or with delete-reserve.
+static void
+bench_worker(int n, int combined)
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char buf[50];
+    int i, k, m;
+
+    for (i = 0; i < n; i += m) {
+        m = min(100, n - i);
+        sprintf(buf, "put-batch %d %d\r\n", m, 14*m);
+        writefull(fd, buf, strlen(buf));
+        for (k = 0; k < m; k++) {
+            writefull(fd, "0 0 100 1\r\na\r\n", 14);
+        }
+        mustsend(fd, "\r\n");
+        ckrespsub(fd, "INSERTED_BATCH ");
+    }
+    ctresettimer();
+    writefull(fd, "reserve\r\n", 9);
+    mustreadlines(fd, 2);
+    for (i = 1; i <= n; i++) {
+        if (combined) {
+            sprintf(buf, "delete-reserve %d 0\r\n", i);
+            writefull(fd, buf, strlen(buf));
+            mustreadlines(fd, i < n ? 2 : 1);
+        } else {
+            sprintf(buf, "delete %d\r\n", i);
+            writefull(fd, buf, strlen(buf));
+            mustreadlines(fd, 1);
+            if (i < n) {
+                writefull(fd, "reserve\r\n", 9);
+                mustreadlines(fd, 2);
+            }
+        }
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_worker_reserve_delete(int n)
+{
+    bench_worker(n, 0);
+}
+
+void
+ctbench_worker_delete_reserve(int n)
+{
+    bench_worker(n, 1);
+}
+
+// Simulated network round trip for the bench_rtt benchmarks.
+#define BENCH_RTT 1000 /* microseconds */
+
+// bench_rtt runs a worker over n jobs as if the server were BENCH_RTT
+// away: the client sleeps that long whenever it has to wait for the
+// server. With window 0 the worker does reserve then delete for each
+// job; otherwise it streams with that window and deletes each job as it
+// arrives.
+static void
+bench_rtt(int n, int window)
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char buf[4096], line[50], *p, *e;
+    int i, k, m, r, have = 0, body = 0, deleted = 0;
+    fd_set rfd;
+    struct timeval tv;
+
+    for (i = 0; i < n; i += m) {
+        m = min(100, n - i);
+        sprintf(line, "put-batch %d %d\r\n", m, 14*m);
+        writefull(fd, line, strlen(line));
+        for (k = 0; k < m; k++) {
+            writefull(fd, "0 0 100 1\r\na\r\n", 14);
+        }
+        mustsend(fd, "\r\n");
+        ckrespsub(fd, "INSERTED_BATCH ");
+    }
+    ctresettimer();
+    if (!window) {
+        for (i = 1; i <= n; i++) {
+            writefull(fd, "reserve\r\n", 9);
+            usleep(BENCH_RTT);
+            mustreadlines(fd, 2);
+            sprintf(line, "delete %d\r\n", i);
+            writefull(fd, line, strlen(line));
+            usleep(BENCH_RTT);
+            mustreadlines(fd, 1);
+        }
+        ctstoptimer();
+        return;
+    }
+
+    sprintf(line, "reserve-stream %d\r\n", window);
+    writefull(fd, line, strlen(line));
+    while (deleted < n) {
+        FD_ZERO(&rfd);
+        FD_SET(fd, &rfd);
+        tv.tv_sec = tv.tv_usec = 0;
+        if (select(fd+1, &rfd, NULL, NULL, &tv) == 0) {
+            usleep(BENCH_RTT);
+        }
+        r = read(fd, buf + have, sizeof buf - have);
+        assertf(r > 0, "read %d", r);
+        have += r;
+        for (p = buf; (e = memchr(p, '\n', buf + have - p)); p = e + 1) {
+            if (body) {
+                body = 0;
+            } else if (strncmp(p, "RESERVED ", 9) == 0) {
+                body = 1;
+                k = snprintf(line, sizeof line, "delete %d\r\n", atoi(p + 9));
+                writefull(fd, line, k);
+            } else if (strncmp(p, "DELETED", 7) == 0) {
+                deleted++;
+            }
+        }
+        have -= p - buf;
+        memmove(buf, p, have);
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_rtt_reserve_delete(int n)
+{
+    bench_rtt(n, 0);
+}
+
+void
+ctbench_rtt_stream_0010(int n)
+{
+    bench_rtt(n, 10);
+}
+
+void
+ctbench_rtt_stream_0100(int n)
+{
+    bench_rtt(n, 100);
+}
+
+// bench_proto puts and then deletes n jobs in pipelined runs of 100,
+// over the text or the binary protocol, to compare the cost of parsing
+// requests and formatting replies.
+static void
+bench_proto(int n, int binary)
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char buf[100 * (BIN_REQ_SIZE + 32)], *p;
+    int i, k, m, op;
+
+    if (binary) {
+        mustsend(fd, "binary 1\r\n");
+        ckresp(fd, "BINARY 1\r\n");
+    }
+    ctresettimer();
+    for (op = 0; op < 2; op++) {
+        for (i = 0; i < n; i += m) {
+            m = min(100, n - i);
+            p = buf;
+            for (k = 1; k <= m; k++) {
+                if (binary && op == 0) {
+                    p += mkframe(p, Bput, 0, 0, 0, 100, "a", 1);
+                } else if (binary) {
+                    p += mkframe(p, Bdelete, i + k, 0, 0, 0, "", 0);
+                } else if (op == 0) {
+                    p += sprintf(p, "put 0 0 100 1\r\na\r\n");
+                } else {
+                    p += sprintf(p, "delete %d\r\n", i + k);
+                }
+            }
+            writefull(fd, buf, p - buf);
+            if (binary) {
+                readfull(fd, buf, 16 * m);
+            } else {
+                mustreadlines(fd, m);
+            }
+        }
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_proto_text(int n)
+{
+    bench_proto(n, 0);
+}
+
+void
+ctbench_proto_binary(int n)
+{
+    bench_proto(n, 1);
+}
+
+// bench_round_trip runs n put, reserve, delete round trips spread over
+// nconn connections, each with one command in flight, so the server
+// has nconn clients to serve at once. With wal set, the jobs are also
+// written to the binlog, without fsync.
+static void
+bench_round_trip(int n, int nconn, int wal)
+{
+    if (wal) {
+        srv.wal.dir = ctdir();
+        srv.wal.use = 1;
+        srv.wal.wantsync = 0;
+    }
+
+    int port = SERVER();
+    int fd[256];
+    char buf[100];
+    int i, k, m;
+
+    for (k = 0; k < nconn; k++) {
+        fd[k] = mustdiallocal(port);
+    }
+    ctresettimer();
+    for (i = 0; i < n; i += m) {
+        m = min(nconn, n - i);
+        for (k = 0; k < m; k++) {
+            writefull(fd[k], "put 0 0 100 1\r\na\r\n", 18);
+        }
+        for (k = 0; k < m; k++) {
+            mustreadlines(fd[k], 1);
+            writefull(fd[k], "reserve\r\n", 9);
+        }
+        for (k = 0; k < m; k++) {
+            readreply(fd[k], buf, sizeof buf, 2);
+            assertf(strncmp(buf, "RESERVED ", 9) == 0, "got %s", buf);
+            writefull(fd[k], buf, sprintf(buf, "delete %d\r\n", atoi(buf + 9)));
+        }
+        for (k = 0; k < m; k++) {
+            mustreadlines(fd[k], 1);
+        }
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_round_trip_0001(int n)
+{
+    bench_round_trip(n, 1, 0);
+}
+
+void
+ctbench_round_trip_0016(int n)
+{
+    bench_round_trip(n, 16, 0);
+}
+
+void
+ctbench_round_trip_0256(int n)
+{
+    bench_round_trip(n, 256, 0);
+}
+
+void
+ctbench_round_trip_0001_wal(int n)
+{
+    bench_round_trip(n, 1, 1);
+}
+
+void
+ctbench_round_trip_0016_wal(int n)
+{
+    bench_round_trip(n, 16, 1);
+}
+
+void
+ctbench_round_trip_0256_wal(int n)
+{
+    bench_round_trip(n, 256, 1);
+}
+
+// bench_put_pipelined sends puts in runs of depth without waiting
+// for the replies in between.
+static void
+bench_put_pipelined(int n, int depth, int wal)
+{
+    if (wal) {
+        srv.wal.dir = ctdir();
+        srv.wal.use = 1;
+        srv.wal.wantsync = 0;
+    }
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char *buf = malloc(18 * depth);
+    int i, k, m;
+
+    for (k = 0; k < depth; k++) {
+        memcpy(buf + 18*k, "put 0 0 100 1\r\na\r\n", 18);
+    }
+    ctresettimer();
+    for (i = 0; i < n; i += m) {
+        m = min(depth, n - i);
+        writefull(fd, buf, 18 * m);
+        mustreadlines(fd, m);
+    }
+    ctstoptimer();
+    free(buf);
+}
+
+void
+ctbench_put_pipelined_x100(int n)
+{
+    bench_put_pipelined(n, 100, 0);
+}
+
+void
+ctbench_put_pipelined_x100_wal(int n)
+{
+    bench_put_pipelined(n, 100, 1);
+}
+
+// bench_fan_in has a worker watching ntubes tubes reserve and delete
+// n jobs put round-robin into all of them, so every reserve picks
+// among that many tubes.
+static void
+bench_fan_in(int n, int ntubes)
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int wfd = mustdiallocal(port);
+    char buf[100 * 40], *p;
+    int i, k, m;
+
+    for (i = 0; i < n; i += m) {
+        m = min(100, n - i);
+        p = buf;
+        for (k = i; k < i + m; k++) {
+            p += sprintf(p, "use t%d\r\nput 0 0 100 1\r\na\r\n", k % ntubes);
+        }
+        writefull(fd, buf, p - buf);
+        mustreadlines(fd, 2 * m);
+    }
+    for (i = 0; i < ntubes; i += m) {
+        m = min(100, ntubes - i);
+        p = buf;
+        for (k = i; k < i + m; k++) {
+            p += sprintf(p, "watch t%d\r\n", k);
+        }
+        writefull(wfd, buf, p - buf);
+        mustreadlines(wfd, m);
+    }
+    mustsend(wfd, "ignore default\r\n");
+    ckrespsub(wfd, "WATCHING ");
+
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        writefull(wfd, "reserve\r\n", 9);
+        readreply(wfd, buf, sizeof buf, 2);
+        assertf(strncmp(buf, "RESERVED ", 9) == 0, "got %s", buf);
+        writefull(wfd, buf, sprintf(buf, "delete %d\r\n", atoi(buf + 9)));
+        mustreadlines(wfd, 1);
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_fan_in_1000_tubes(int n)
+{
+    bench_fan_in(n, 1000);
+}
+
+// ctbench_replay measures reading back a binlog of n jobs at startup.
+void
+ctbench_replay(int n)
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.wantsync = 0;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char buf[50];
+    int i, k, m;
+
+    for (i = 0; i < n; i += m) {
+        m = min(100, n - i);
+        sprintf(buf, "put-batch %d %d\r\n", m, 14*m);
+        writefull(fd, buf, strlen(buf));
+        for (k = 0; k < m; k++) {
+            writefull(fd, "0 0 100 1\r\na\r\n", 14);
+        }
+        mustsend(fd, "\r\n");
+        ckrespsub(fd, "INSERTED_BATCH ");
+    }
+    kill_srvpid();
+
+    prot_init();
+    ctresettimer();
+    srv_acquire_wal(&srv);
+    ctstoptimer();
+    assert(job_find(n));
+}
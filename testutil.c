@@ -117,6 +117,22 @@ cttest_optz_more_than_max()
     assert(job_data_size_limit == 1073741824);
 }
 
+void
+cttest_optZ()
+{
+    char *args[] = {
+        "-Z",
+        "100",
+        "-Z200",
+        "-V",
+        NULL,
+    };
+
+    optparse(&srv, args);
+    assert(zstat.min == 200);
+    assert(verbose == 1);
+}
+
 void
 cttest_opts()
 {
@@ -180,6 +196,22 @@ cttest_optb()
     assert(srv.wal.use == 1);
 }
 
+void
+cttest_opte()
+{
+    char *args[] = {
+        "-ecache.",
+        "-e",
+        "tmp-",
+        NULL,
+    };
+
+    optparse(&srv, args);
+    assert(ephemeral_prefixes.len == 2);
+    assert(strcmp(ephemeral_prefixes.items[0], "cache.") == 0);
+    assert(strcmp(ephemeral_prefixes.items[1], "tmp-") == 0);
+}
+
 void
 cttest_optV()
 {
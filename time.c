@@ -1,16 +1,81 @@
 #include "dat.h"
 #include <stdint.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <time.h>
 
+// Deadlines, timeouts and durations are measured on a monotonic clock,
+// so a step of the system clock can neither fire them early nor hold
+// them back. The wall clock is only used for job creation times and
+// what is reported from them; see walltime and clockoffset.
+
+// coarseclock is set by -C; see monoclock.
+int coarseclock = 0;
+
+// now is the monotonic time at the last clockupdate, or 0 before it.
+static int64 now;
+
+static int64
+readclock(clockid_t id)
+{
+    struct timespec ts;
+
+    if (clock_gettime(id, &ts) != 0)
+        return warn("clock_gettime"), -1; // can't happen
+
+    return ((int64)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+// monoclock returns the monotonic clock to read: the coarse one if
+// asked for and available. It is cheaper but only ticks every few
+// milliseconds, which is also how precise deadlines become.
+static clockid_t
+monoclock(void)
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+    if (coarseclock)
+        return CLOCK_MONOTONIC_COARSE;
+#endif
+    return CLOCK_MONOTONIC;
+}
+
+// nanoseconds reads the precise monotonic clock. It is what
+// measurements and time budgets use, whatever -C says.
 int64
 nanoseconds(void)
 {
-    int r;
-    struct timeval tv;
+    return readclock(CLOCK_MONOTONIC);
+}
 
-    r = gettimeofday(&tv, 0);
-    if (r != 0) return warnx("gettimeofday"), -1; // can't happen
+// walltime reads the wall clock, in nanoseconds since the epoch.
+int64
+walltime(void)
+{
+    return readclock(CLOCK_REALTIME);
+}
+
+// clockoffset returns what to add to a monotonic time
+// to get the wall clock time of the same moment.
+int64
+clockoffset(void)
+{
+    return walltime() - nanoseconds();
+}
 
-    return ((int64)tv.tv_sec)*1000000000 + ((int64)tv.tv_usec)*1000;
+// clockupdate reads the monotonic clock for curtime, the coarse one
+// with -C, and returns it. The event loop calls it once per iteration.
+int64
+clockupdate(void)
+{
+    return now = readclock(monoclock());
+}
+
+// curtime returns the monotonic time as of the last clockupdate. It
+// is what the hot paths use: everything done in one iteration of the
+// event loop sees the same time, and reading it costs nothing.
+int64
+curtime(void)
+{
+    if (!now)
+        clockupdate();
+    return now;
 }
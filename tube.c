@@ -5,12 +5,16 @@
 
 struct Ms tubes;
 
+// Tubes whose names start with one of these strings are ephemeral.
+struct Ms ephemeral_prefixes;
+
 Tube *
 make_tube(const char *name)
 {
     Tube *t = new(Tube);
     if (!t)
         return NULL;
+    mem_used[Memtube] += sizeof(Tube);
 
     strncpy(t->name, name, MAX_TUBE_NAME_LEN);
     if (t->name[MAX_TUBE_NAME_LEN - 1] != '\0') {
@@ -28,6 +32,15 @@ make_tube(const char *name)
     t->buried.prev = t->buried.next = &t->buried;
     ms_init(&t->waiting_conns, NULL, NULL);
 
+    size_t i;
+    for (i = 0; i < ephemeral_prefixes.len; i++) {
+        char *p = ephemeral_prefixes.items[i];
+        if (strncmp(t->name, p, strlen(p)) == 0) {
+            t->ephemeral = 1;
+            break;
+        }
+    }
+
     return t;
 }
 
@@ -37,8 +50,17 @@ tube_free(Tube *t)
     ms_remove(&tubes, t);
     free(t->ready.data);
     free(t->delay.data);
+    mem_used[Memheap] -= sizeof(void*) * (t->ready.cap + t->delay.cap);
     ms_clear(&t->waiting_conns);
+    free(t->keys);
+    mem_used[Memkey] -= sizeof(Dkey*) * t->keycap;
+    if (t->proclat)
+        mem_used[Memtube] -= sizeof(Hist);
+    free(t->proclat);
+    free(t->marks);
+    mem_used[Memtube] -= sizeof(Job*) * t->markcap;
     free(t);
+    mem_used[Memtube] -= sizeof(Tube);
 }
 
 void
@@ -86,6 +86,31 @@ zalloc(int n)
 }
 
 
+uint64 mem_used[Memcats];
+
+// mem_limit is set by -m. 0 means no limit.
+uint64 mem_limit = 0;
+
+// mem_total returns the bytes counted in all categories of mem_used.
+uint64
+mem_total()
+{
+    uint64 n = 0;
+    int i;
+
+    for (i = 0; i < Memcats; i++)
+        n += mem_used[i];
+    return n;
+}
+
+// mem_over returns 1 if using n more bytes would go over mem_limit.
+int
+mem_over(uint64 n)
+{
+    return mem_limit && mem_total() + n > mem_limit;
+}
+
+
 static void
 warn_systemd_ignored_option(char *opt, char *arg)
 {
@@ -105,24 +130,38 @@ usage(int code)
             "\n"
             "Options:\n"
             " -b DIR   write-ahead log directory\n"
+            " -e PFX   do not log jobs in tubes whose names start with PFX;\n"
+            "          may be given more than once\n"
             " -f MS    fsync at most once every MS milliseconds (default is %dms);\n"
             "          use -f0 for \"always fsync\"\n"
             " -F       never fsync\n"
             " -l ADDR  listen on address (default is 0.0.0.0)\n"
             " -p PORT  listen on port (default is " Portdef ")\n"
             " -u USER  become user and group\n"
+            " -m BYTES refuse new jobs when memory use would go over BYTES\n"
             " -z BYTES set the maximum job size in bytes (default is %d);\n"
             "          max allowed is %d bytes\n"
+            " -Z BYTES compress job bodies of BYTES bytes or more\n"
+            " -k SECS  keep put deduplication keys for SECS seconds\n"
+            "          (default is %ds); use -k0 to ignore keys\n"
             " -s BYTES set the size of each write-ahead log file (default is %d);\n"
             "          will be rounded up to a multiple of 4096 bytes\n"
+            " -t DIR   keep the bodies of buried, long delayed and far back\n"
+            "          ready jobs on disk in DIR instead of in memory\n"
             " -v       show version information\n"
             " -V       increase verbosity\n"
+            " -S MS    log event loop work taking MS milliseconds or more\n"
+            "          (default is %dms); use -S0 to turn it off\n"
+            " -C       use a coarse monotonic clock: cheaper to read, but\n"
+            "          deadlines are only precise to a few milliseconds\n"
             " -h       show this help\n",
             progname,
             DEFAULT_FSYNC_MS,
             JOB_DATA_SIZE_LIMIT_DEFAULT,
             JOB_DATA_SIZE_LIMIT_MAX,
-            Filesizedef);
+            DEFAULT_DEDUP_SECS,
+            Filesizedef,
+            DEFAULT_SLOW_MS);
     exit(code);
 }
 
@@ -177,9 +216,21 @@ optparse(Server *s, char **argv)
                         job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
                     }
                     break;
+                case 'Z': {
+                    // min evaluates its arguments twice
+                    size_t z = parse_size_t(EARGF(flagusage("-Z")));
+                    zstat.min = min(z, (size_t)JOB_DATA_SIZE_LIMIT_MAX);
+                    break;
+                }
+                case 'k':
+                    dedup_window = (int64)parse_size_t(EARGF(flagusage("-k"))) * 1000000000;
+                    break;
                 case 's':
                     s->wal.filesize = parse_size_t(EARGF(flagusage("-s")));
                     break;
+                case 'm':
+                    mem_limit = parse_size_t(EARGF(flagusage("-m")));
+                    break;
                 case 'c':
                     warnx("-c flag was removed. binlog is always compacted.");
                     break;
@@ -197,10 +248,19 @@ optparse(Server *s, char **argv)
                 case 'u':
                     s->user = EARGF(flagusage("-u"));
                     break;
+                case 't':
+                    spill.dir = EARGF(flagusage("-t"));
+                    break;
                 case 'b':
                     s->wal.dir = EARGF(flagusage("-b"));
                     s->wal.use = 1;
                     break;
+                case 'e':
+                    if (!ms_append(&ephemeral_prefixes, EARGF(flagusage("-e")))) {
+                        twarnx("OOM");
+                        exit(1);
+                    }
+                    break;
                 case 'h':
                     usage(0);
                 case 'v':
@@ -209,6 +269,13 @@ optparse(Server *s, char **argv)
                 case 'V':
                     verbose++;
                     break;
+                case 'C':
+                    coarseclock = 1;
+                    break;
+                case 'S':
+                    ms = (int64)parse_size_t(EARGF(flagusage("-S")));
+                    s->slowop = ms * 1000000;
+                    break;
                 default:
                     warnx("unknown flag: %s", arg-2);
                     usage(5);
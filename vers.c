@@ -0,0 +1 @@
+const char version[] = "unknown";
@@ -12,6 +12,8 @@
 #include <limits.h>
 
 static int reserve(Wal *w, int n);
+static int writerec(Wal *w, Job *j);
+static int writekey(Wal *w, Dkey *k);
 
 
 // Reads w->dir for files matching binlog.NNN,
@@ -100,6 +102,18 @@ ratio(Wal *w)
 }
 
 
+// Walskip returns 1 if j must not be written to the log: it was
+// put into an ephemeral tube and so has never been logged. A job
+// that is already in the log (e.g. it was put before the tube's
+// name matched a -e prefix) is logged as usual, so that its delete
+// record is not lost.
+static int
+walskip(Job *j)
+{
+    return j->tube->ephemeral && !j->file;
+}
+
+
 // Returns the number of bytes reserved or 0 on error.
 static int
 walresvmigrate(Wal *w, Job *j)
@@ -111,48 +125,108 @@ walresvmigrate(Wal *w, Job *j)
     z += sizeof(int);
     z += strlen(j->tube->name);
     z += sizeof(Jobrec);
-    z += j->r.body_size;
+    z += job_stored_size(j) + job_keylen(j);
 
     return reserve(w, z);
 }
 
 
-static void
+// Movekey writes a key record for a deduplication key of the head
+// file, which holds no more jobs, to the current file. It returns the
+// number of bytes reserved for the record, or 0 if no key was moved.
+static int
+movekey(Wal *w)
+{
+    Dkey *k = w->head->keys;
+    int z;
+
+    if (!k) return 0;
+
+    z = reserve(w, sizeof(int) + sizeof(Keyrec) +
+                   strlen(k->tube->name) + k->len);
+    if (z) {
+        w->nmig++;
+        writekey(w, k);
+    }
+    return z;
+}
+
+
+// Moveone migrates the oldest live job in the head file to the
+// current file, or once there are none, one of the deduplication
+// keys that still hold the file (see movekey). It returns the number
+// of bytes reserved for the migrated record, or 0 if nothing could be
+// moved.
+static int
 moveone(Wal *w)
 {
     Job *j;
+    Body *b = NULL;
+    int z;
 
     if (w->head == w->cur || w->head->next == w->cur) {
         // no point in moving a job
-        return;
+        return 0;
     }
 
     j = w->head->jlist.fnext;
     if (!j || j == &w->head->jlist) {
-        // head holds no jlist; can't happen
-        twarnx("head holds no jlist");
-        return;
+        return movekey(w);
+    }
+
+    // A full record holds the body, so a spilled one is read back
+    // for as long as it takes to write it.
+    if (j->spill) {
+        b = spillread(j);
+        if (!b)
+            return 0;
+        j->bodybuf = b;
+        j->body = b->data;
     }
 
-    if (!walresvmigrate(w, j)) {
-        // it will not fit, so we'll try again later
-        return;
+    z = walresvmigrate(w, j);
+    if (z) {
+        filermjob(w->head, j);
+        w->nmig++;
+        writerec(w, j);
     }
+    // otherwise it will not fit, so we'll try again later
 
-    filermjob(w->head, j);
-    w->nmig++;
-    walwrite(w, j);
+    if (b) {
+        j->bodybuf = NULL;
+        j->body = NULL;
+        body_unref(b);
+    }
+    return z;
 }
 
 
-static void
+// Walcompact migrates live records out of the head file, doing at
+// most one slice of work per call. The amount of work is paced by
+// the disk headroom: the more of the log is garbage relative to live
+// data (see ratio), the bigger the slice.
+// It returns 1 if there is more compaction to do, otherwise 0.
+int
 walcompact(Wal *w)
 {
-    int r;
-
-    for (r=ratio(w); r>=2; r--) {
-        moveone(w);
+    int r, n;
+    int64 budget, deadline;
+
+    if (!w->use) return 0;
+
+    r = ratio(w);
+    if (r < 2) return 0;
+
+    budget = (int64)min(r, Compactmaxratio) * Compactstep;
+    deadline = nanoseconds() + Compactslice;
+    while (budget > 0) {
+        n = moveone(w);
+        if (!n) return 0;
+        budget -= n;
+        if (ratio(w) < 2) return 0;
+        if (nanoseconds() >= deadline) break;
     }
+    return 1;
 }
 
 
@@ -167,6 +241,7 @@ walsync(Wal *w)
         if (fsync(w->cur->fd) == -1) {
             twarn("fsync");
         }
+        hist_record(&w->synclat, nanoseconds() - now);
     }
 }
 
@@ -174,19 +249,47 @@ walsync(Wal *w)
 // Walwrite writes j to the log w (if w is enabled).
 // On failure, walwrite disables w and returns 0; on success, it returns 1.
 // Unlke walresv*, walwrite should never fail because of a full disk.
-// If w is disabled, then walwrite takes no action and returns 1.
+// If w is disabled, or j is not logged (see walskip), then walwrite
+// takes no action and returns 1.
 int
 walwrite(Wal *w, Job *j)
+{
+    if (!w->use) return 1;
+    if (walskip(j)) return 1;
+    return writerec(w, j);
+}
+
+
+static int
+writerec(Wal *w, Job *j)
 {
     int r = 0;
+    int64 t;
 
-    if (!w->use) return 1;
     if (w->cur->resv > 0 || usenext(w)) {
-        if (j->file) {
-            r = filewrjobshort(w->cur, j);
-        } else {
-            r = filewrjobfull(w->cur, j);
-        }
+        t = nanoseconds();
+        r = filewrjobs(w->cur, &j, 1);
+        hist_record(&w->writelat, nanoseconds() - t);
+    }
+    if (!r) {
+        filewclose(w->cur);
+        w->use = 0;
+    }
+    w->nrec++;
+    return r;
+}
+
+
+static int
+writekey(Wal *w, Dkey *k)
+{
+    int r = 0;
+    int64 t;
+
+    if (w->cur->resv > 0 || usenext(w)) {
+        t = nanoseconds();
+        r = filewrkey(w->cur, k);
+        hist_record(&w->writelat, nanoseconds() - t);
     }
     if (!r) {
         filewclose(w->cur);
@@ -197,11 +300,129 @@ walwrite(Wal *w, Job *j)
 }
 
 
+static int
+recsize(Job *j)
+{
+    int z = sizeof(int) + sizeof(Jobrec);
+
+    if (!j->file) {
+        z += strlen(j->tube->name);
+        z += job_stored_size(j) + job_keylen(j);
+    }
+    return z;
+}
+
+
+// Walwritebatch is like walwrite for each of the n jobs in js, but
+// gathers their records into as few writes as possible: one per
+// file the reserved space for the records is spread over.
+int
+walwritebatch(Wal *w, Job **js, int n)
+{
+    int i, k, r = 1;
+    int64 avail, t;
+
+    if (!w->use) return 1;
+    for (i = 0; r && i < n; i = k) {
+        while (i < n && walskip(js[i])) i++;
+        if (i == n) break;
+
+        r = 0;
+        if (!(w->cur->resv > 0 || usenext(w))) break;
+        avail = w->cur->resv;
+        for (k = i; k < n && !walskip(js[k]); k++) {
+            int z = recsize(js[k]);
+            if (k > i && z > avail) break;
+            avail -= z;
+        }
+        t = nanoseconds();
+        r = filewrjobs(w->cur, js+i, k-i);
+        hist_record(&w->writelat, nanoseconds() - t);
+        w->nrec += k-i;
+    }
+    if (!r) {
+        filewclose(w->cur);
+        w->use = 0;
+    }
+    return r;
+}
+
+
+// Walresvdrop gives back n bytes of reserved space that no record
+// will use, taking it from the current file first. n must be a
+// multiple of the size of a delete record, so every file keeps the
+// invariants described at balance.
+static void
+walresvdrop(Wal *w, int n)
+{
+    static const int z = sizeof(int) + sizeof(Jobrec);
+    File *f;
+    int d;
+
+    for (f = w->cur; f && n > 0; f = f->next) {
+        d = min(n, f->resv - f->resv % z);
+        f->resv -= d;
+        f->free += d;
+        w->resv -= d;
+        n -= d;
+    }
+}
+
+
+// Walwritetomb logs the deletion of the n jobs in js with tombstone
+// records rather than a delete record per job. Each tombstone uses the
+// space reserved for one delete and names up to Tombmax jobs; the
+// space reserved for the other deletes is given back. The jobs are
+// taken out of their files, so the caller must free them next.
+// On failure, walwritetomb disables w and returns 0; on success,
+// it returns 1.
+int
+walwritetomb(Wal *w, Job **js, int n)
+{
+    static const int z = sizeof(int) + sizeof(Jobrec);
+    uint64 ids[n];
+    int i, k, m = 0, ntomb = 0, r = 1;
+    int64 t;
+
+    if (!w->use) return 1;
+    for (i = 0; i < n; i++) {
+        if (js[i]->file) ids[m++] = js[i]->r.id;
+    }
+    for (i = 0; r && i < m; i += k) {
+        while (w->cur->resv < z) {
+            if (!usenext(w)) {
+                r = 0;
+                break;
+            }
+        }
+        if (!r) break;
+        k = min(m - i, w->cur->resv / z * Tombmax);
+        t = nanoseconds();
+        r = filewrtomb(w->cur, ids + i, k);
+        hist_record(&w->writelat, nanoseconds() - t);
+        ntomb += (k + Tombmax - 1) / Tombmax;
+        w->nrec += (k + Tombmax - 1) / Tombmax;
+    }
+    if (!r) {
+        filewclose(w->cur);
+        w->use = 0;
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        filermjob(js[i]->file, js[i]);
+    }
+    walresvdrop(w, (m - ntomb) * z);
+    return 1;
+}
+
+
+// Walmaint does the bookkeeping due after a write. Compaction is
+// not part of it; see walcompact.
 void
 walmaint(Wal *w)
 {
     if (w->use) {
-        walcompact(w);
         walsync(w);
     }
 }
@@ -368,11 +589,14 @@ walresvput(Wal *w, Job *j)
 {
     int z = 0;
 
+    // return value must be nonzero but is otherwise ignored
+    if (walskip(j)) return 1;
+
     // reserve space for the initial job record
     z += sizeof(int);
     z += strlen(j->tube->name);
     z += sizeof(Jobrec);
-    z += j->r.body_size;
+    z += job_stored_size(j) + job_keylen(j);
 
     // plus space for a delete to come later
     z += sizeof(int);
@@ -382,17 +606,106 @@ walresvput(Wal *w, Job *j)
 }
 
 
+// Filespace is the room for records in a fresh file, after the
+// version and clock offset header. A batch is reserved in one piece,
+// so it must fit in that.
+static int64
+filespace(Wal *w)
+{
+    return w->filesize - (int64)(sizeof(int) + sizeof(int64));
+}
+
+
+// Walbatchfits reports whether n new jobs put into t, with nbody bytes
+// of bodies in all, can be logged as one batch; see walresvputbatch.
+// Compression only makes the records smaller.
+int
+walbatchfits(Wal *w, Tube *t, int n, int64 nbody)
+{
+    int64 z;
+
+    if (!w->use || t->ephemeral) return 1;
+    z = sizeof(int) + strlen(t->name) + sizeof(Jobrec);
+    z += sizeof(int) + sizeof(Jobrec);
+    return (int64)n * z + nbody <= min(filespace(w), INT_MAX);
+}
+
+
+// Walresvputbatch reserves space for the initial records of the n
+// new jobs in js, plus their deletes, in a single reservation, and
+// sets each job's walresv.
+// Returns the number of bytes reserved or 0 on error.
+int
+walresvputbatch(Wal *w, Job **js, int n)
+{
+    int i, z[n];
+    int64 total = 0;
+
+    for (i = 0; i < n; i++) {
+        z[i] = 0;
+        if (walskip(js[i])) continue;
+        z[i] += sizeof(int);
+        z[i] += strlen(js[i]->tube->name);
+        z[i] += sizeof(Jobrec);
+        z[i] += job_stored_size(js[i]) + job_keylen(js[i]);
+        z[i] += sizeof(int);
+        z[i] += sizeof(Jobrec);
+        total += z[i];
+    }
+    if (total > INT_MAX) return 0;
+    if (w->use && total > filespace(w)) return 0;
+
+    // return value must be nonzero but is otherwise ignored
+    if (!total) total = 1;
+    else if (!reserve(w, total)) return 0;
+
+    for (i = 0; i < n; i++) {
+        js[i]->walresv = z[i] ? z[i] : 1;
+    }
+    return total;
+}
+
+
 // Returns the number of bytes reserved or 0 on error.
 int
-walresvupdate(Wal *w)
+walresvupdate(Wal *w, Job *j)
 {
     int z = 0;
+
+    // return value must be nonzero but is otherwise ignored
+    if (walskip(j)) return 1;
+
     z +=sizeof(int);
     z +=sizeof(Jobrec);
     return reserve(w, z);
 }
 
 
+// Walresvupdatebatch reserves space for an update record for each of
+// the n jobs in js in a single reservation, and adds it to each
+// job's walresv.
+// Returns the number of bytes reserved or 0 on error.
+int
+walresvupdatebatch(Wal *w, Job **js, int n)
+{
+    static const int z = sizeof(int) + sizeof(Jobrec);
+    int i, m = 0;
+
+    for (i = 0; i < n; i++) {
+        if (!walskip(js[i])) m++;
+    }
+
+    // return value must be nonzero but is otherwise ignored
+    if (!m) return 1;
+    if (!reserve(w, m * z)) return 0;
+
+    for (i = 0; i < n; i++) {
+        if (!walskip(js[i])) js[i]->walresv += z;
+    }
+    return m * z;
+}
+
+
 // Returns the number of locks acquired: either 0 or 1.
 int
 waldirlock(Wal *w)